@@ -1,13 +1,53 @@
 #ifndef FILE_IO_H
 #define FILE_IO_H
 
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
 #include "task.h"
+#include "task_log.h"
 
-#define DATA_FILE "data/tasks.dat"
+#define DATA_DIR "data"
+#define DATA_FILE "data/tasks.dat"     // Snapshot, its log is data/tasks.log
+
+#define TASK_FILE_MAGIC 0x52474D54u     // "TMGR" in a little-endian file
+#define TASK_FILE_VERSION 2
+
+// Header at the start of the task file, followed by one section per field (see file_io.c)
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t header_size;       // Offset of the first section
+    uint32_t time_size;         // sizeof(time_t) of the build that wrote the file
+    uint64_t count;             // Tasks in use
+    uint64_t capacity;          // Tasks the field sections have room for
+    uint64_t lsn;               // Sequence number of the last log record folded into the file
+    uint64_t next_id;           // Id the next new task gets
+    uint64_t strings_size;      // Bytes of names and descriptions in use
+    uint64_t strings_capacity;  // Bytes the strings section has room for
+} TaskFileHeader;
+
+// A loaded task file: the snapshot mapped copy-on-write and the log its changes go to
+struct TaskStore {
+    unsigned char *map;         // NULL once the tasks outgrow the snapshot and move to the heap
+    size_t map_size;
+    char *path;
+    char *tmp_path;             // New snapshots are written here and renamed over path
+    char *dir;
+    TaskLog *log;
+    pid_t compactor;            // Child writing a new snapshot, 0 if none
+    uint64_t compact_offset;    // Log size when the compactor started
+    uint64_t compact_lsn;       // Last record the new snapshot holds
+    uint64_t compact_at;        // Log size that starts the next compaction
+};
 
 // Function declarations
 int save_tasks_to_file(TaskList *list, const char *filename);
 TaskList* load_tasks_from_file(const char *filename);
 void initialize_data_file(void);
+int task_store_detach(TaskList *list);
+void task_store_unmap(TaskList *list);
+void task_store_log(TaskList *list, TaskLogType type, const Task *task);
+void task_store_close(TaskList *list);
 
 #endif
@@ -2,10 +2,17 @@
 #define TASK_H
 
 #include <time.h>
+#include <stdint.h>
+#include "task_index.h"
+#include "task_strings.h"
+#include "task_sort.h"
+#include "task_trigrams.h"
 
 #define MAX_TASK_NAME 100
 #define MAX_TASK_DESC 500
 #define MAX_TASKS 1000
+#define TASK_COMPACT_MIN_HOLES 64       // Fewer holes than this in the display order are never compacted
+#define TASK_SEARCH_SCAN_SHARE 8        // A search scans every task once the index leaves more than 1/8 of them
 
 typedef enum {
     LOW = 1,
@@ -13,19 +20,50 @@ typedef enum {
     HIGH = 3
 } Priority;
 
+typedef enum {
+    SORT_BY_PRIORITY,   // HIGH first
+    SORT_BY_DATE        // Earliest due date first
+} TaskSortKey;
+
+// One task's fields gathered from the list (task_get), the strings point into the list's arena
 typedef struct {
     int id;
-    char name[MAX_TASK_NAME];
-    char description[MAX_TASK_DESC];
+    const char *name;
+    const char *description;
     time_t due_date;
     Priority priority;
     int completed;
 } Task;
 
+// Backing file of a list loaded with load_tasks_from_file (see file_io.h)
+typedef struct TaskStore TaskStore;
+
+// Tasks are stored by field, one array per field indexed by slot, so a pass over one field only
+// reads that field. Names and descriptions are offsets into the strings arena.
 typedef struct {
-    Task *tasks;
-    int count;
-    int capacity;
+    int *ids;                   // 0 for a free slot
+    time_t *due_dates;
+    unsigned char *priorities;
+    unsigned char *completed;
+    uint32_t *names;
+    uint32_t *descriptions;
+    TaskStrings strings;
+    int count;          // Tasks in the list
+    int capacity;       // Slots allocated
+    int slots;          // Slots handed out so far, free ones included
+    TaskStore *store;   // NULL for a list that only lives in memory
+    int next_id;        // Id the next task_add hands out, ids are never reused
+    TaskIndex index;    // Id -> slot, built by the first lookup
+    int indexed;
+    int *free_slots;    // Stack of free slots, task_add reuses them before taking new ones
+    int free_count;
+    int free_capacity;
+    int *order;         // Slots in display order, -1 where a deleted task was (NULL: slots 0 to slots - 1)
+    int *positions;     // Place of each slot in order
+    int order_count;
+    int order_capacity;
+    TaskView views[2];  // Slots by TaskSortKey, built by the first task_list_view and kept up to date after
+    TaskTrigramIndex trigrams;  // Keyword search index, built by the first task_search
 } TaskList;
 
 // Function declarations
@@ -36,8 +74,23 @@ void task_list_display(TaskList *list);
 void task_mark_complete(TaskList *list, int id);
 void task_mark_incomplete(TaskList *list, int id);
 void task_delete(TaskList *list, int id);
+void task_delete_completed(TaskList *list);
 void task_search(TaskList *list, const char *keyword);
-void task_list_sort_by_priority(TaskList *list);
-void task_list_sort_by_date(TaskList *list);
+void task_search_ignore_case(TaskList *list, const char *keyword);
+int task_list_sort_by_priority(TaskList *list);
+int task_list_sort_by_date(TaskList *list);
+void task_list_display_sorted(TaskList *list, TaskSortKey key);
+
+Task task_get(const TaskList *list, int slot);
+int task_list_compact(TaskList *list);
+int task_list_order_length(const TaskList *list);
+int task_list_order_slot(const TaskList *list, int position);
+int task_list_view(TaskList *list, TaskSortKey key, const TaskViewEntry **entries);
+
+// Changes without messages or logging, used to replay the task log
+int task_find(TaskList *list, int id);
+int task_insert(TaskList *list, int id, const char *name, const char *desc, time_t due_date, Priority priority);
+int task_remove(TaskList *list, int slot);
+int task_sort(TaskList *list, TaskSortKey key);
 
 #endif
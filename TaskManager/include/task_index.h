@@ -0,0 +1,28 @@
+#ifndef TASK_INDEX_H
+#define TASK_INDEX_H
+
+#define TASK_INDEX_MIN_CAPACITY 64
+
+// One slot of the index, id 0 marks an empty slot (task ids start at 1)
+typedef struct {
+    int id;
+    int slot;       // Position of the task in the list's tasks array
+} TaskIndexEntry;
+
+// Open-addressing hash table from task id to slot, kept at most half full
+typedef struct {
+    TaskIndexEntry *entries;
+    int capacity;   // Power of two, 0 until the first insert
+    int count;
+    int shift;      // 32 - log2(capacity), for the multiplicative hash
+} TaskIndex;
+
+// Function declarations
+int task_index_find(const TaskIndex *index, int id);
+int task_index_put(TaskIndex *index, int id, int slot);
+void task_index_remove(TaskIndex *index, int id);
+int task_index_reserve(TaskIndex *index, int count);
+void task_index_clear(TaskIndex *index);
+void task_index_free(TaskIndex *index);
+
+#endif
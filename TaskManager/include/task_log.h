@@ -0,0 +1,56 @@
+#ifndef TASK_LOG_H
+#define TASK_LOG_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "task.h"
+
+#define TASK_LOG_MAGIC 0x474F4C54u      // "TLOG" in a little-endian file
+#define TASK_LOG_VERSION 1
+#define TASK_LOG_HEADER_SIZE 16
+#define TASK_LOG_COMMIT_MS 5            // How long the flusher waits for more records to share one fsync
+#define TASK_LOG_BUFFER_SIZE 65536      // Pending bytes that start a commit without waiting
+#define TASK_LOG_COMPACT_SIZE (4 * 1024 * 1024)     // Log size that starts a compaction
+
+// Log record types, one per change to the list
+typedef enum {
+    LOG_ADD = 1,
+    LOG_DELETE = 2,
+    LOG_COMPLETE = 3,
+    LOG_INCOMPLETE = 4,
+    LOG_SORT_PRIORITY = 5,
+    LOG_SORT_DATE = 6
+} TaskLogType;
+
+// An open task log, records are buffered and committed by a flusher thread
+typedef struct {
+    int fd;
+    char *path;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;        // Signals the flusher
+    pthread_cond_t synced;      // Signals threads waiting in task_log_sync
+    pthread_t flusher;
+    unsigned char *buffer;      // Records appended since the last commit
+    size_t used;
+    size_t buffer_size;
+    unsigned char *spare;       // Buffer being written by the flusher
+    size_t spare_size;
+    uint64_t size;              // Bytes of the file once everything appended is written
+    uint64_t durable;           // Bytes of the file known to be on disk
+    uint64_t lsn;               // Sequence number of the last record appended
+    int flushing;
+    int urgent;                 // Commit without waiting for more records
+    int stop;
+    int failed;
+} TaskLog;
+
+// Function declarations
+int task_log_replay(TaskList *list, const char *path, uint64_t snapshot_lsn, uint64_t *lsn);
+TaskLog* task_log_open(const char *path, uint64_t lsn);
+uint64_t task_log_append(TaskLog *log, TaskLogType type, const Task *task);
+int task_log_sync(TaskLog *log);
+int task_log_rewrite(TaskLog *log, uint64_t offset, uint64_t base_lsn);
+void task_log_close(TaskLog *log);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef TASK_SCAN_H
+#define TASK_SCAN_H
+
+#include <stdint.h>
+#include "task_strings.h"
+
+#define TASK_SCAN_CHUNK_MIN (1 << 20)  // Bytes of the arena each scan thread gets at least
+#define TASK_SCAN_MAX_THREADS 16
+
+// Function declarations
+int task_scan_strings(const TaskStrings *strings, const char *keyword, int ignore_case, uint32_t **offsets);
+int task_scan_strings_split(const TaskStrings *strings, const char *keyword, int ignore_case, int threads,
+        uint32_t **offsets);
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef TASK_SORT_H
+#define TASK_SORT_H
+
+#include <stdint.h>
+
+// A sort key and the slot it belongs to, tasks are sorted as arrays of these instead of moving tasks
+typedef struct {
+    uint64_t key;
+    int slot;
+} TaskSortItem;
+
+// One entry of a sorted view, it is out of date once the slot no longer holds this id
+typedef struct {
+    int slot;
+    int id;
+} TaskViewEntry;
+
+// Slots sorted by one key and then by id, kept up to date by task_add (see task_list_view)
+typedef struct {
+    TaskViewEntry *entries;     // Sorted entries first, then the ones added since the last refresh
+    int count;
+    int sorted;                 // Entries [0, sorted) are in order
+    int capacity;
+    int built;                  // 0 until the first task_list_view, and again after the slots move
+} TaskView;
+
+// Function declarations
+int task_sort_items(TaskSortItem *items, int count);
+void task_view_reset(TaskView *view);
+void task_view_free(TaskView *view);
+
+#endif
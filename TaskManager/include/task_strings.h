@@ -0,0 +1,32 @@
+#ifndef TASK_STRINGS_H
+#define TASK_STRINGS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TASK_STRINGS_NONE UINT32_MAX        // Offset returned when a string could not be added
+#define TASK_STRINGS_MIN_CAPACITY 4096
+
+// Arena of the task names and descriptions, each stored once and referenced by its offset
+typedef struct {
+    char *data;                 // NUL-terminated strings back to back
+    size_t size;
+    size_t capacity;
+    uint32_t *table;            // Intern table: offset + 1 of a string per bucket, 0 for an empty bucket
+    size_t table_capacity;      // Power of two, 0 until the first task_strings_intern builds it
+    size_t table_count;
+} TaskStrings;
+
+// Function declarations
+int task_strings_init(TaskStrings *strings, size_t capacity);
+uint32_t task_strings_intern(TaskStrings *strings, const char *text, size_t length);
+int task_strings_fits(const TaskStrings *strings, size_t length);
+void task_strings_forget(TaskStrings *strings);
+void task_strings_free(TaskStrings *strings);
+
+// The string at an offset (an offset past the arena, from a damaged task file, reads as an empty string)
+static inline const char *task_strings_get(const TaskStrings *strings, uint32_t offset) {
+    return offset < strings->size ? strings->data + offset : "";
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef TASK_TRIGRAMS_H
+#define TASK_TRIGRAMS_H
+
+#include <stdint.h>
+
+#define TASK_TRIGRAMS_MIN_CAPACITY 1024
+
+// Ids of the tasks whose name or description contains one trigram, ascending unless sorted is 0
+typedef struct {
+    uint32_t trigram;   // The three bytes, 0 for an empty bucket
+    int sorted;
+    int *ids;
+    int count;
+    int capacity;
+} TaskPosting;
+
+// Inverted index from every three-byte sequence of the task strings to the tasks that contain it
+typedef struct {
+    TaskPosting *postings;  // Open-addressing table, kept at most half full
+    int capacity;           // Power of two, 0 until the first add
+    int count;
+    int shift;              // 32 - log2(capacity), for the multiplicative hash
+    int removed;            // Tasks deleted since the index was built, their ids are still in the postings
+    int built;
+} TaskTrigramIndex;
+
+// Function declarations
+int task_trigrams_add(TaskTrigramIndex *index, int id, const char *name, const char *desc);
+int task_trigrams_query(TaskTrigramIndex *index, const char *keyword, int **ids);
+void task_trigrams_free(TaskTrigramIndex *index);
+
+#endif
@@ -1,7 +1,525 @@
+/*
+This is the file that keeps the task list on disk.
+A task file (the snapshot) is a versioned header followed by the task list's own arrays, and every change
+made after it was written is in its write-ahead log (task_log.c):
+    - Each field of the tasks has a section of capacity entries (due dates, ids, name offsets,
+      description offsets, priorities, completed flags), followed by the strings section that holds
+      the names and descriptions
+    - Loading maps the snapshot copy-on-write and points the task list's arrays straight at the
+      sections, only the header is checked and nothing is copied, so it takes the same time for any
+      number of tasks (offsets and ids are checked where they are read, see task_strings_get and the
+      id index)
+    - The log is replayed over the snapshot, then each change appends one record to it
+    - Once the log passes TASK_LOG_COMPACT_SIZE a child process writes a new snapshot from its copy of
+      the list, and the log is cut down to the records that came after it
+    - Snapshots hold the tasks in display order and have room to grow, new tasks go into the mapping
+      until it is full
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include "../include/file_io.h"
 
-// TODO: Implement save_tasks_to_file()
-// TODO: Implement load_tasks_from_file()
-// TODO: Implement initialize_data_file()
+#define SNAPSHOT_BATCH 512      // Entries per write when a section is gathered in display order
+
+// Offsets of the sections of a task file, in the order they follow the header
+typedef struct {
+    size_t due_dates;
+    size_t ids;
+    size_t names;
+    size_t descriptions;
+    size_t priorities;
+    size_t completed;
+    size_t strings;
+    size_t size;                // Bytes of the whole file
+} TaskFileLayout;
+
+// Helper function for where the sections of a task file with room for capacity tasks go
+// The widest fields come first so every section is aligned for its type
+static void task_file_layout(TaskFileLayout *layout, uint64_t capacity, uint64_t strings_capacity) {
+    size_t slots = (size_t) capacity;
+    layout->due_dates = sizeof(TaskFileHeader);
+    layout->ids = layout->due_dates + slots * sizeof(time_t);
+    layout->names = layout->ids + slots * sizeof(int);
+    layout->descriptions = layout->names + slots * sizeof(uint32_t);
+    layout->priorities = layout->descriptions + slots * sizeof(uint32_t);
+    layout->completed = layout->priorities + slots;
+    layout->strings = layout->completed + slots;
+    layout->size = layout->strings + (size_t) strings_capacity;
+}
+
+// Helper function to fill in a header for this build's layout
+static void header_init(TaskFileHeader *header, uint64_t count, uint64_t capacity, uint64_t lsn,
+        uint64_t next_id, uint64_t strings_size, uint64_t strings_capacity) {
+    memset(header, 0, sizeof(TaskFileHeader));
+    header->magic = TASK_FILE_MAGIC;
+    header->version = TASK_FILE_VERSION;
+    header->header_size = sizeof(TaskFileHeader);
+    header->time_size = sizeof(time_t);
+    header->count = count;
+    header->capacity = capacity;
+    header->lsn = lsn;
+    header->next_id = next_id;
+    header->strings_size = strings_size;
+    header->strings_capacity = strings_capacity;
+}
+
+// Helper function to write a whole buffer at offset (returns 0 on success, -1 on failure)
+static int write_all(int fd, const void *data, size_t size, size_t offset) {
+    const unsigned char *bytes = (const unsigned char*) data;
+    while (size > 0) {
+        ssize_t written = pwrite(fd, bytes, size, (off_t) offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += written;
+        size -= (size_t) written;
+        offset += (size_t) written;
+    }
+    return 0;
+}
+
+// Helper function for a copy of path with its extension replaced (or added)
+static char *path_with_extension(const char *path, const char *extension) {
+    const char *dot = strrchr(path, '.');
+    const char *slash = strrchr(path, '/');
+    size_t base = dot != NULL && (slash == NULL || dot > slash) ? (size_t) (dot - path) : strlen(path);
+    char *result = (char*) malloc(base + strlen(extension) + 1);
+    if (result != NULL) {
+        memcpy(result, path, base);
+        strcpy(result + base, extension);
+    }
+    return result;
+}
+
+// Helper function for a copy of the directory part of path
+static char *path_directory(const char *path) {
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL) {
+        return strdup(".");
+    }
+    size_t length = slash == path ? 1 : (size_t) (slash - path);
+    char *result = (char*) malloc(length + 1);
+    if (result != NULL) {
+        memcpy(result, path, length);
+        result[length] = '\0';
+    }
+    return result;
+}
+
+// Helper function to write one field array at offset in display order, with the free slots left out
+static int write_section(int fd, const TaskList *list, const void *field, size_t width, size_t offset) {
+    const unsigned char *bytes = (const unsigned char*) field;
+    // Without an explicit order the slots are already in display order with no free ones among them
+    if (list->order == NULL) {
+        return write_all(fd, bytes, width * (size_t) list->slots, offset);
+    }
+    // Otherwise the entries are gathered into batches on the stack
+    unsigned char batch[SNAPSHOT_BATCH * sizeof(time_t)];
+    size_t batched = 0;
+    int length = task_list_order_length(list);
+    for (int p = 0; p < length; p++) {
+        int slot = task_list_order_slot(list, p);
+        if (slot >= 0) {
+            memcpy(batch + batched * width, bytes + (size_t) slot * width, width);
+            batched++;
+        }
+        if (batched == SNAPSHOT_BATCH || (p == length - 1 && batched > 0)) {
+            if (write_all(fd, batch, batched * width, offset) != 0) {
+                return -1;
+            }
+            offset += batched * width;
+            batched = 0;
+        }
+    }
+    return 0;
+}
+
+// Helper function to write the list as a snapshot holding log records up to lsn
+// A stale_log that belongs to the file being replaced is removed just before the rename (NULL for none)
+// Only system calls are used so a forked child can run it (returns 0 on success, -1 on failure)
+static int write_snapshot(const TaskList *list, const char *path, const char *tmp_path, const char *dir,
+        uint64_t lsn, const char *stale_log) {
+    // Leave room to grow so new tasks go into the mapping without copying it
+    uint64_t count = (uint64_t) list->count;
+    uint64_t capacity = count < MAX_TASKS ? MAX_TASKS : count * 2;
+    uint64_t strings_size = (uint64_t) list->strings.size;
+    uint64_t strings_capacity = strings_size < TASK_STRINGS_MIN_CAPACITY ? TASK_STRINGS_MIN_CAPACITY : strings_size * 2;
+    if (strings_capacity > UINT32_MAX) {
+        strings_capacity = UINT32_MAX;
+    }
+    TaskFileHeader header;
+    header_init(&header, count, capacity, lsn, (uint64_t) list->next_id, strings_size, strings_capacity);
+    TaskFileLayout layout;
+    task_file_layout(&layout, capacity, strings_capacity);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    // Strings are written as they are, the name and description offsets stay valid
+    int result = -1;
+    if (write_all(fd, &header, sizeof(header), 0) == 0 &&
+            write_section(fd, list, list->due_dates, sizeof(time_t), layout.due_dates) == 0 &&
+            write_section(fd, list, list->ids, sizeof(int), layout.ids) == 0 &&
+            write_section(fd, list, list->names, sizeof(uint32_t), layout.names) == 0 &&
+            write_section(fd, list, list->descriptions, sizeof(uint32_t), layout.descriptions) == 0 &&
+            write_section(fd, list, list->priorities, 1, layout.priorities) == 0 &&
+            write_section(fd, list, list->completed, 1, layout.completed) == 0 &&
+            write_all(fd, list->strings.data, list->strings.size, layout.strings) == 0 &&
+            ftruncate(fd, (off_t) layout.size) == 0 && fsync(fd) == 0) {
+        result = 0;
+    }
+    if (close(fd) != 0) {
+        result = -1;
+    }
+    if (result == 0 && stale_log != NULL && unlink(stale_log) != 0 && errno != ENOENT) {
+        result = -1;
+    }
+    if (result == 0 && rename(tmp_path, path) != 0) {
+        result = -1;
+    }
+    if (result != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    // The rename has to reach the disk before the log is cut down to match it
+    int dir_fd = open(dir, O_RDONLY);
+    if (dir_fd < 0) {
+        return -1;
+    }
+    result = fsync(dir_fd);
+    close(dir_fd);
+    return result == 0 ? 0 : -1;
+}
+
+// Helper function to finish a compaction when its child is done (blocks until then if wait is set)
+static void compaction_finish(TaskList *list, int wait) {
+    TaskStore *store = list->store;
+    int status;
+    pid_t done = waitpid(store->compactor, &status, wait ? 0 : WNOHANG);
+    if (done == 0) {
+        return;
+    }
+    store->compactor = 0;
+    if (done < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "Error, could not write a new snapshot of %s\n", store->path);
+        // Try again once the log has grown by another threshold
+        store->compact_at = store->log->size + TASK_LOG_COMPACT_SIZE;
+        return;
+    }
+    // The snapshot holds every record up to compact_lsn, keep only the ones after it
+    if (task_log_rewrite(store->log, store->compact_offset, store->compact_lsn) != 0) {
+        // Try again once the log has grown by another threshold, not on the very next change
+        store->compact_at = store->log->size + TASK_LOG_COMPACT_SIZE;
+        return;
+    }
+    store->compact_at = TASK_LOG_COMPACT_SIZE;
+}
+
+// Helper function to start a compaction once the log is big enough, or finish a running one
+static void compaction_check(TaskList *list) {
+    TaskStore *store = list->store;
+    if (store->compactor != 0) {
+        compaction_finish(list, 0);
+        return;
+    }
+    if (store->log->size < store->compact_at) {
+        return;
+    }
+    // The log has to hold everything the snapshot will, a crash must never leave it behind the snapshot
+    if (task_log_sync(store->log) != 0) {
+        return;
+    }
+    store->compact_offset = store->log->size;
+    store->compact_lsn = store->log->lsn;
+    // The child writes from its own copy of the list while this process carries on appending to the log
+    pid_t pid = fork();
+    if (pid < 0) {
+        fprintf(stderr, "Error, could not start a compaction of %s\n", store->path);
+        store->compact_at = store->log->size + TASK_LOG_COMPACT_SIZE;
+        return;
+    }
+    if (pid == 0) {
+        _exit(write_snapshot(list, store->path, store->tmp_path, store->dir, store->compact_lsn, NULL) == 0 ? 0 : 1);
+    }
+    store->compactor = pid;
+}
+
+// Function to append a change to the list's log
+void task_store_log(TaskList *list, TaskLogType type, const Task *task) {
+    if (list == NULL || list->store == NULL) {
+        fprintf(stderr, "Error, list is not backed by a file\n");
+        return;
+    }
+    task_log_append(list->store->log, type, task);
+    compaction_check(list);
+}
+
+// Function to copy the list's arrays and strings out of the snapshot mapping to the heap, for when they
+// have to grow past the room the snapshot left (returns 0 on success, -1 on failure)
+int task_store_detach(TaskList *list) {
+    if (list == NULL || list->store == NULL) {
+        fprintf(stderr, "Error, list is not backed by a file\n");
+        return -1;
+    }
+    if (list->store->map == NULL) {
+        return 0;
+    }
+    // Its changes never went to the file anyway
+    size_t capacity = (size_t) list->capacity;
+    size_t slots = (size_t) list->slots;
+    int *ids = (int*) malloc(sizeof(int) * capacity);
+    time_t *due_dates = (time_t*) malloc(sizeof(time_t) * capacity);
+    unsigned char *priorities = (unsigned char*) malloc(capacity);
+    unsigned char *completed = (unsigned char*) malloc(capacity);
+    uint32_t *names = (uint32_t*) malloc(sizeof(uint32_t) * capacity);
+    uint32_t *descriptions = (uint32_t*) malloc(sizeof(uint32_t) * capacity);
+    char *strings = (char*) malloc(list->strings.capacity);
+    if (ids == NULL || due_dates == NULL || priorities == NULL || completed == NULL || names == NULL ||
+            descriptions == NULL || strings == NULL) {
+        fprintf(stderr, "Error, invalid tasks\n");
+        free(ids);
+        free(due_dates);
+        free(priorities);
+        free(completed);
+        free(names);
+        free(descriptions);
+        free(strings);
+        return -1;
+    }
+    memcpy(ids, list->ids, sizeof(int) * slots);
+    memcpy(due_dates, list->due_dates, sizeof(time_t) * slots);
+    memcpy(priorities, list->priorities, slots);
+    memcpy(completed, list->completed, slots);
+    memcpy(names, list->names, sizeof(uint32_t) * slots);
+    memcpy(descriptions, list->descriptions, sizeof(uint32_t) * slots);
+    memcpy(strings, list->strings.data, list->strings.size);
+    task_store_unmap(list);
+    list->ids = ids;
+    list->due_dates = due_dates;
+    list->priorities = priorities;
+    list->completed = completed;
+    list->names = names;
+    list->descriptions = descriptions;
+    list->strings.data = strings;
+    return 0;
+}
+
+// Function to release the snapshot mapping once nothing in the list points into it
+void task_store_unmap(TaskList *list) {
+    TaskStore *store = list->store;
+    if (store != NULL && store->map != NULL) {
+        munmap(store->map, store->map_size);
+        store->map = NULL;
+    }
+}
+
+// Helper function to free a store whose list is gone
+static void store_free(TaskStore *store) {
+    if (store->map != NULL) {
+        munmap(store->map, store->map_size);
+    }
+    free(store->path);
+    free(store->tmp_path);
+    free(store->dir);
+    free(store);
+}
+
+// Function to commit the log, wait for a running compaction and release the store
+void task_store_close(TaskList *list) {
+    TaskStore *store = list->store;
+    if (store == NULL) {
+        return;
+    }
+    if (store->compactor != 0) {
+        compaction_finish(list, 1);
+    }
+    task_log_close(store->log);
+    store_free(store);
+    list->store = NULL;
+}
+
+// Function to save the task list to a file (returns 0 on success, -1 on failure)
+int save_tasks_to_file(TaskList *list, const char *filename) {
+    // Input guard
+    if (list == NULL || list->ids == NULL) {
+        fprintf(stderr, "Error, list is empty\n");
+        return -1;
+    }
+    if (filename == NULL) {
+        fprintf(stderr, "Error, no file name\n");
+        return -1;
+    }
+    // The list already lives in this file, fold the whole log into a new snapshot now
+    if (list->store != NULL && strcmp(list->store->path, filename) == 0) {
+        TaskStore *store = list->store;
+        if (store->compactor != 0) {
+            compaction_finish(list, 1);
+        }
+        if (task_log_sync(store->log) != 0 ||
+                write_snapshot(list, store->path, store->tmp_path, store->dir, store->log->lsn, NULL) != 0) {
+            fprintf(stderr, "Error, could not write %s\n", filename);
+            return -1;
+        }
+        return task_log_rewrite(store->log, store->log->size, store->log->lsn);
+    }
+    // Otherwise write a new task file with an empty log, a log left by a file of the same name would
+    // otherwise be replayed over it
+    char *tmp_path = path_with_extension(filename, ".tmp");
+    char *log_path = path_with_extension(filename, ".log");
+    char *dir = path_directory(filename);
+    int result = -1;
+    if (tmp_path != NULL && log_path != NULL && dir != NULL) {
+        result = write_snapshot(list, filename, tmp_path, dir, 0, log_path);
+    }
+    if (result != 0) {
+        fprintf(stderr, "Error, could not write %s\n", filename);
+    }
+    free(tmp_path);
+    free(log_path);
+    free(dir);
+    return result;
+}
+
+// Function to map a task file, replay its log and return a list that works on it (returns NULL on failure)
+TaskList* load_tasks_from_file(const char *filename) {
+    // Input guard
+    if (filename == NULL) {
+        fprintf(stderr, "Error, no file name\n");
+        return NULL;
+    }
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error, could not open %s\n", filename);
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(TaskFileHeader)) {
+        fprintf(stderr, "Error, %s is not a task file\n", filename);
+        close(fd);
+        return NULL;
+    }
+    // Changes stay in this process's copy of the pages, the file only changes when a snapshot replaces it
+    size_t size = (size_t) info.st_size;
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error, could not map %s\n", filename);
+        return NULL;
+    }
+    TaskFileHeader *header = (TaskFileHeader*) map;
+    // Only the header is checked, it says where the sections are and how much of them is in use
+    // The arena has to end with a NUL so an offset inside it never reads past it
+    TaskFileLayout layout;
+    task_file_layout(&layout, header->capacity, header->strings_capacity);
+    const char *problem = NULL;
+    if (header->magic != TASK_FILE_MAGIC) {
+        problem = "is not a task file";
+    } else if (header->version != TASK_FILE_VERSION || header->header_size != sizeof(TaskFileHeader) ||
+            header->time_size != sizeof(time_t)) {
+        problem = "was written by an incompatible version";
+    } else if (header->count > header->capacity || header->capacity > INT_MAX || header->next_id == 0 ||
+            header->next_id > INT_MAX || header->strings_size > header->strings_capacity ||
+            header->strings_capacity > UINT32_MAX || layout.size > size ||
+            (header->strings_size > 0 && ((char*) map)[layout.strings + header->strings_size - 1] != '\0')) {
+        problem = "is damaged";
+    }
+    TaskList *list = NULL;
+    TaskStore *store = NULL;
+    char *log_path = NULL;
+    if (problem == NULL) {
+        list = (TaskList*) calloc(1, sizeof(TaskList));
+        store = (TaskStore*) calloc(1, sizeof(TaskStore));
+        log_path = path_with_extension(filename, ".log");
+        if (store != NULL) {
+            store->path = strdup(filename);
+            store->tmp_path = path_with_extension(filename, ".tmp");
+            store->dir = path_directory(filename);
+        }
+        if (list == NULL || store == NULL || log_path == NULL || store->path == NULL || store->tmp_path == NULL ||
+                store->dir == NULL) {
+            problem = "could not be loaded, memory allocation failed";
+        }
+    }
+    if (problem != NULL) {
+        fprintf(stderr, "Error, %s %s\n", filename, problem);
+        free(list);
+        if (store != NULL) {
+            free(store->path);
+            free(store->tmp_path);
+            free(store->dir);
+            free(store);
+        }
+        free(log_path);
+        munmap(map, size);
+        return NULL;
+    }
+    store->map = (unsigned char*) map;
+    store->map_size = size;
+    store->compact_at = TASK_LOG_COMPACT_SIZE;
+    list->due_dates = (time_t*) (store->map + layout.due_dates);
+    list->ids = (int*) (store->map + layout.ids);
+    list->names = (uint32_t*) (store->map + layout.names);
+    list->descriptions = (uint32_t*) (store->map + layout.descriptions);
+    list->priorities = store->map + layout.priorities;
+    list->completed = store->map + layout.completed;
+    list->strings.data = (char*) (store->map + layout.strings);
+    list->strings.size = (size_t) header->strings_size;
+    list->strings.capacity = (size_t) header->strings_capacity;
+    list->count = (int) header->count;
+    list->slots = list->count;
+    list->capacity = (int) header->capacity;
+    list->store = store;
+    list->next_id = (int) header->next_id;
+
+    // Bring the list up to date with the changes made since the snapshot
+    uint64_t lsn;
+    if (task_log_replay(list, log_path, header->lsn, &lsn) == 0) {
+        store->log = task_log_open(log_path, lsn);
+    }
+    free(log_path);
+    if (store->log == NULL) {
+        task_list_destroy(list);
+        return NULL;
+    }
+    compaction_check(list);
+    return list;
+}
+
+// Function to create the data directory and an empty task file if they do not exist yet
+void initialize_data_file(void) {
+    if (mkdir(DATA_DIR, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "Error, could not create the %s directory\n", DATA_DIR);
+        return;
+    }
+    int fd = open(DATA_FILE, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        if (errno != EEXIST) {
+            fprintf(stderr, "Error, could not create %s\n", DATA_FILE);
+        }
+        return;
+    }
+    // A new file has room for MAX_TASKS tasks, they take no disk space until they are written
+    TaskFileHeader header;
+    header_init(&header, 0, MAX_TASKS, 0, 1, 0, TASK_STRINGS_MIN_CAPACITY);
+    TaskFileLayout layout;
+    task_file_layout(&layout, MAX_TASKS, TASK_STRINGS_MIN_CAPACITY);
+    if (ftruncate(fd, (off_t) layout.size) != 0 ||
+            pwrite(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) || fsync(fd) != 0) {
+        fprintf(stderr, "Error, could not write %s\n", DATA_FILE);
+    }
+    close(fd);
+}
@@ -5,10 +5,20 @@
 #include "../include/ui.h"
 
 int main(void) {
-    // TODO: Initialize data directory
-    // TODO: Load existing tasks from file
-    // TODO: Start the UI loop
-    // TODO: Save tasks before exiting
-    
+    // Create the data directory and an empty task file on the first run
+    initialize_data_file();
+    // Map the task file and replay its log, a list that only lives in memory keeps the program usable if that fails
+    TaskList *list = load_tasks_from_file(DATA_FILE);
+    if (list == NULL) {
+        fprintf(stderr, "Error, changes will not be saved this session\n");
+        list = task_list_create();
+        if (list == NULL) {
+            return 1;
+        }
+    }
+    // Start the UI loop
+    run_ui(list);
+    // Every change is already in the task log, this commits the last records
+    task_list_destroy(list);
     return 0;
 }
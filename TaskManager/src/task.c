@@ -7,45 +7,466 @@ Some of the functions of this program are listed below
     - Display all the tasks
     - Mark the tasks as complete or incomplete
     - Delete a specified tasks
-    - Search for a specific task
-    - Sort the tasks by priority
+    - Search for a specific task, with or without matching case
+    - Sort the tasks by priority or due date, and display them through sorted views
+
+Tasks live in slots that never move while the task exists. Deleting a task frees its slot for the next
+task_add, and the display order is a separate array of slots with holes where deleted tasks were. Once
+the holes outnumber the tasks, the list is compacted back into one run of slots in display order.
+
+Each field is its own array indexed by slot, names and descriptions are offsets into the string arena
+(task_strings.c) and task_get gathers one task's fields.
 */
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include "../include/task.h"
+#include "../include/file_io.h"
+#include "../include/task_scan.h"
+
+// Helper function to append a change to the task log when the list lives in a task file
+static void task_list_persist(TaskList *list, TaskLogType type, const Task *task) {
+    if (list->store != NULL) {
+        task_store_log(list, type, task);
+    }
+}
+
+// Helper function for whether the fields still point into a mapped task file
+static int task_list_mapped(const TaskList *list) {
+    return list->store != NULL && list->store->map != NULL;
+}
+
+// Helper function to allocate the field arrays of capacity slots (returns -1 on failure)
+static int task_fields_alloc(TaskList *list, int capacity) {
+    size_t slots = (size_t) (capacity > 0 ? capacity : 1);
+    list->ids = (int*) malloc(sizeof(int) * slots);
+    list->due_dates = (time_t*) malloc(sizeof(time_t) * slots);
+    list->priorities = (unsigned char*) malloc(slots);
+    list->completed = (unsigned char*) malloc(slots);
+    list->names = (uint32_t*) malloc(sizeof(uint32_t) * slots);
+    list->descriptions = (uint32_t*) malloc(sizeof(uint32_t) * slots);
+    if (list->ids == NULL || list->due_dates == NULL || list->priorities == NULL || list->completed == NULL ||
+            list->names == NULL || list->descriptions == NULL) {
+        fprintf(stderr, "Error, task array allocation failed\n");
+        free(list->ids);
+        free(list->due_dates);
+        free(list->priorities);
+        free(list->completed);
+        free(list->names);
+        free(list->descriptions);
+        return -1;
+    }
+    return 0;
+}
+
+// Helper function to release the field arrays and the string arena
+static void task_list_free_fields(TaskList *list) {
+    if (task_list_mapped(list)) {
+        task_store_unmap(list);
+    } else {
+        free(list->ids);
+        free(list->due_dates);
+        free(list->priorities);
+        free(list->completed);
+        free(list->names);
+        free(list->descriptions);
+        free(list->strings.data);
+    }
+    task_strings_forget(&list->strings);
+    list->ids = NULL;
+    list->due_dates = NULL;
+    list->priorities = NULL;
+    list->completed = NULL;
+    list->names = NULL;
+    list->descriptions = NULL;
+    list->strings.data = NULL;
+}
 
 // Function to initialize the task list
 TaskList* task_list_create(void) {
     // Initialize heap
-    TaskList *task = (TaskList*) malloc(sizeof(TaskList));
+    TaskList *task = (TaskList*) calloc(1, sizeof(TaskList));
     // Safety check for memory allocation
     if (task == NULL) {
         fprintf(stderr, "Error, memory allocation failed\n");
         return NULL;
     }
     // Initialize ptr and variables in TaskList
-    task->tasks = (Task*) malloc(sizeof(Task) * MAX_TASKS);
-    if (task->tasks == NULL) {
-        fprintf(stderr, "Error, task array allocation failed\n");
+    if (task_fields_alloc(task, MAX_TASKS) != 0) {
+        free(task);
+        return NULL;
+    }
+    if (task_strings_init(&task->strings, TASK_STRINGS_MIN_CAPACITY) != 0) {
+        task_list_free_fields(task);
         free(task);
         return NULL;
     }
     task->count = 0;
     task->capacity = MAX_TASKS;
+    task->slots = 0;
+    task->store = NULL;
+    task->next_id = 1;
+    memset(&task->index, 0, sizeof(TaskIndex));
+    task->indexed = 0;
+    task->free_slots = NULL;
+    task->free_count = 0;
+    task->free_capacity = 0;
+    task->order = NULL;
+    task->positions = NULL;
+    task->order_count = 0;
+    task->order_capacity = 0;
 
     return task;
 }
 
 // Function to clean up the task list
 void task_list_destroy(TaskList *list) {
-    free(list->tasks);
-    list->tasks = NULL;
+    // A loaded list may point into its task file instead of owning the arrays
+    task_list_free_fields(list);
+    if (list->store != NULL) {
+        task_store_close(list);
+    }
+    task_index_free(&list->index);
+    task_view_free(&list->views[SORT_BY_PRIORITY]);
+    task_view_free(&list->views[SORT_BY_DATE]);
+    task_trigrams_free(&list->trigrams);
+    free(list->free_slots);
+    free(list->order);
+    free(list->positions);
     free(list);
     list = NULL;
 }
 
+// Function to gather the fields of the task in a slot
+Task task_get(const TaskList *list, int slot) {
+    Task task;
+    task.id = list->ids[slot];
+    task.name = task_strings_get(&list->strings, list->names[slot]);
+    task.description = task_strings_get(&list->strings, list->descriptions[slot]);
+    task.due_date = list->due_dates[slot];
+    task.priority = (Priority) list->priorities[slot];
+    task.completed = list->completed[slot];
+    return task;
+}
+
+// Helper function to forget the id index, the next lookup builds it again
+static void task_list_unindex(TaskList *list) {
+    task_index_clear(&list->index);
+    list->indexed = 0;
+}
+
+// Helper function to build the id index the first time it is needed (returns -1 if it could not be built)
+static int task_list_index(TaskList *list) {
+    if (list->indexed) {
+        return 0;
+    }
+    if (task_index_reserve(&list->index, list->count) != 0) {
+        return -1;
+    }
+    // Walk backwards so an id that appears twice (a damaged file) finds the first one. The ids of a loaded
+    // file are only checked here, so one at or past next_id moves next_id on instead of being handed out again
+    for (int i = list->slots - 1; i >= 0; i--) {
+        int id = list->ids[i];
+        if (id > 0) {
+            task_index_put(&list->index, id, i);
+            if (id >= list->next_id && id < INT_MAX) {
+                list->next_id = id + 1;
+            }
+        }
+    }
+    list->indexed = 1;
+    return 0;
+}
+
+// Function to find the slot of a task by ID (returns -1 if there is none)
+int task_find(TaskList *list, int id) {
+    if (task_list_index(list) == 0) {
+        return task_index_find(&list->index, id);
+    }
+    // Without memory for the index, fall back to a scan
+    for (int i = 0; i < list->slots; i++) {
+        if (id == list->ids[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Function for the number of places in the display order, holes included
+int task_list_order_length(const TaskList *list) {
+    return list->order != NULL ? list->order_count : list->slots;
+}
+
+// Function for the slot at a place in the display order (returns -1 for the hole of a deleted task)
+int task_list_order_slot(const TaskList *list, int position) {
+    return list->order != NULL ? list->order[position] : position;
+}
+
+// Helper function to give the list an explicit display order (returns -1 on failure)
+// Until the first delete or sort it is simply slots 0 to slots - 1, so a loaded list does not build one
+static int task_list_order(TaskList *list) {
+    if (list->order != NULL) {
+        return 0;
+    }
+    int capacity = list->capacity > 0 ? list->capacity : 1;
+    int *order = (int*) malloc(sizeof(int) * (size_t) capacity);
+    int *positions = (int*) malloc(sizeof(int) * (size_t) capacity);
+    if (order == NULL || positions == NULL) {
+        fprintf(stderr, "Error, order allocation failed\n");
+        free(order);
+        free(positions);
+        return -1;
+    }
+    for (int i = 0; i < list->slots; i++) {
+        order[i] = i;
+        positions[i] = i;
+    }
+    list->order = order;
+    list->positions = positions;
+    list->order_count = list->slots;
+    list->order_capacity = capacity;
+    return 0;
+}
+
+// Function to move the tasks into one run of slots in display order, dropping free slots and holes
+// Strings of deleted tasks are dropped as well (returns 0 on success, -1 on failure)
+int task_list_compact(TaskList *list) {
+    if (list->order == NULL) {
+        return 0;
+    }
+    TaskList fresh;
+    memset(&fresh, 0, sizeof(TaskList));
+    if (task_fields_alloc(&fresh, list->capacity) != 0) {
+        return -1;
+    }
+    if (task_strings_init(&fresh.strings, list->strings.size) != 0) {
+        task_list_free_fields(&fresh);
+        return -1;
+    }
+    int count = 0;
+    for (int p = 0; p < list->order_count; p++) {
+        int slot = list->order[p];
+        if (slot < 0) {
+            continue;
+        }
+        const char *name = task_strings_get(&list->strings, list->names[slot]);
+        const char *desc = task_strings_get(&list->strings, list->descriptions[slot]);
+        fresh.names[count] = task_strings_intern(&fresh.strings, name, strlen(name));
+        fresh.descriptions[count] = task_strings_intern(&fresh.strings, desc, strlen(desc));
+        if (fresh.names[count] == TASK_STRINGS_NONE || fresh.descriptions[count] == TASK_STRINGS_NONE) {
+            task_list_free_fields(&fresh);
+            return -1;
+        }
+        fresh.ids[count] = list->ids[slot];
+        fresh.due_dates[count] = list->due_dates[slot];
+        fresh.priorities[count] = list->priorities[slot];
+        fresh.completed[count] = list->completed[slot];
+        count++;
+    }
+    task_list_free_fields(list);
+    list->ids = fresh.ids;
+    list->due_dates = fresh.due_dates;
+    list->priorities = fresh.priorities;
+    list->completed = fresh.completed;
+    list->names = fresh.names;
+    list->descriptions = fresh.descriptions;
+    list->strings = fresh.strings;
+    free(list->order);
+    free(list->positions);
+    list->order = NULL;
+    list->positions = NULL;
+    list->order_count = 0;
+    list->order_capacity = 0;
+    list->free_count = 0;
+    list->slots = count;
+    // Every task may have moved, the index and views are rebuilt by the next lookup
+    task_list_unindex(list);
+    task_view_reset(&list->views[SORT_BY_PRIORITY]);
+    task_view_reset(&list->views[SORT_BY_DATE]);
+    return 0;
+}
+
+// Helper function to resize one field array (returns -1 on failure)
+static int grow_field(void **field, size_t width, int capacity) {
+    void *grown = realloc(*field, width * (size_t) capacity);
+    if (grown == NULL) {
+        fprintf(stderr, "Error, invalid tasks\n");
+        return -1;
+    }
+    *field = grown;
+    return 0;
+}
+
+// Helper function to grow the slots to new_capacity (returns -1 on failure)
+static int task_list_grow(TaskList *list, int new_capacity) {
+    // A full snapshot moves the list to the heap (its changes never went to the file anyway)
+    if (list->store != NULL && task_store_detach(list) != 0) {
+        return -1;
+    }
+    if (grow_field((void**) &list->ids, sizeof(int), new_capacity) != 0 ||
+            grow_field((void**) &list->due_dates, sizeof(time_t), new_capacity) != 0 ||
+            grow_field((void**) &list->priorities, 1, new_capacity) != 0 ||
+            grow_field((void**) &list->completed, 1, new_capacity) != 0 ||
+            grow_field((void**) &list->names, sizeof(uint32_t), new_capacity) != 0 ||
+            grow_field((void**) &list->descriptions, sizeof(uint32_t), new_capacity) != 0) {
+        return -1;
+    }
+    // Update capacity
+    list->capacity = new_capacity;
+    if (list->positions != NULL) {
+        int *positions = (int*) realloc(list->positions, sizeof(int) * (size_t) new_capacity);
+        if (positions == NULL) {
+            fprintf(stderr, "Error, order allocation failed\n");
+            return -1;
+        }
+        list->positions = positions;
+    }
+    return 0;
+}
+
+// Helper function to make room for one more entry in an int array (returns -1 on failure)
+static int grow_ints(int **items, int *capacity, int count) {
+    if (count < *capacity) {
+        return 0;
+    }
+    int new_capacity = *capacity > 0 ? *capacity * 2 : 64;
+    int *grown = (int*) realloc(*items, sizeof(int) * (size_t) new_capacity);
+    if (grown == NULL) {
+        fprintf(stderr, "Error, memory allocation failed\n");
+        return -1;
+    }
+    *items = grown;
+    *capacity = new_capacity;
+    return 0;
+}
+
+// Helper function for the length of text cut to at most max bytes
+static size_t text_length(const char *text, size_t max) {
+    size_t length = 0;
+    while (length < max && text[length] != '\0') {
+        length++;
+    }
+    return length;
+}
+
+// Helper function to queue a new task for a sorted view, it is sorted in by the next task_list_view
+static void task_view_add(TaskView *view, int id, int slot) {
+    if (!view->built) {
+        return;
+    }
+    if (view->count == view->capacity) {
+        int capacity = view->capacity > 0 ? view->capacity * 2 : 64;
+        TaskViewEntry *entries = (TaskViewEntry*) realloc(view->entries, sizeof(TaskViewEntry) * (size_t) capacity);
+        if (entries == NULL) {
+            // Without room for it the view is built again from scratch
+            task_view_reset(view);
+            return;
+        }
+        view->entries = entries;
+        view->capacity = capacity;
+    }
+    view->entries[view->count].slot = slot;
+    view->entries[view->count].id = id;
+    view->count++;
+}
+
+// Function to add a task with a given ID at the end of the display order, without messages or logging
+// (returns its slot, -1 on failure)
+int task_insert(TaskList *list, int id, const char *name, const char *desc, time_t due_date, Priority priority) {
+    if (list->order != NULL && grow_ints(&list->order, &list->order_capacity, list->order_count) != 0) {
+        return -1;
+    }
+    size_t name_length = text_length(name, MAX_TASK_NAME - 1);
+    size_t desc_length = text_length(desc, MAX_TASK_DESC - 1);
+    // The strings of a loaded list are in the mapping until they outgrow the room the snapshot left
+    if (task_list_mapped(list) && !task_strings_fits(&list->strings, name_length + desc_length + 1) &&
+            task_store_detach(list) != 0) {
+        return -1;
+    }
+    uint32_t name_offset = task_strings_intern(&list->strings, name, name_length);
+    uint32_t desc_offset = task_strings_intern(&list->strings, desc, desc_length);
+    if (name_offset == TASK_STRINGS_NONE || desc_offset == TASK_STRINGS_NONE) {
+        return -1;
+    }
+    // Reuse a free slot, or take the next one
+    int slot;
+    if (list->free_count > 0) {
+        slot = list->free_slots[--list->free_count];
+    } else {
+        // Conditional for capacity
+        if (list->slots >= list->capacity &&
+                task_list_grow(list, list->capacity > 0 ? list->capacity * 2 : MAX_TASKS) != 0) {
+            return -1;
+        }
+        slot = list->slots++;
+    }
+    // Write new tasks in
+    list->ids[slot] = id;
+    list->due_dates[slot] = due_date;
+    list->priorities[slot] = (unsigned char) priority;
+    list->completed[slot] = 0;
+    list->names[slot] = name_offset;
+    list->descriptions[slot] = desc_offset;
+    // increment count
+    list->count++;
+    if (list->order != NULL) {
+        list->positions[slot] = list->order_count;
+        list->order[list->order_count++] = slot;
+    }
+    if (id >= list->next_id) {
+        list->next_id = id + 1;
+    }
+    if (list->indexed && task_index_put(&list->index, id, slot) != 0) {
+        task_list_unindex(list);
+    }
+    task_view_add(&list->views[SORT_BY_PRIORITY], id, slot);
+    task_view_add(&list->views[SORT_BY_DATE], id, slot);
+    if (list->trigrams.built) {
+        Task task = task_get(list, slot);
+        if (task_trigrams_add(&list->trigrams, id, task.name, task.description) != 0) {
+            // The next search builds the index again
+            task_trigrams_free(&list->trigrams);
+        }
+    }
+    return slot;
+}
+
+// Helper function to free the slot of a task (returns -1 on failure)
+static int task_release(TaskList *list, int slot) {
+    if (task_list_order(list) != 0 ||
+            grow_ints(&list->free_slots, &list->free_capacity, list->free_count) != 0) {
+        return -1;
+    }
+    if (list->indexed) {
+        task_index_remove(&list->index, list->ids[slot]);
+    }
+    list->ids[slot] = 0;
+    list->order[list->positions[slot]] = -1;
+    list->trigrams.removed++;
+    list->free_slots[list->free_count++] = slot;
+    list->count--;
+    return 0;
+}
+
+// Helper function to compact the list once the holes in the display order outnumber the tasks
+static void task_list_compact_if_sparse(TaskList *list) {
+    int holes = list->order_count - list->count;
+    if (list->order != NULL && holes > list->count && holes >= TASK_COMPACT_MIN_HOLES) {
+        task_list_compact(list);
+    }
+}
+
+// Function to remove the task in a slot, without messages or logging (returns 0 on success, -1 on failure)
+int task_remove(TaskList *list, int slot) {
+    if (task_release(list, slot) != 0) {
+        return -1;
+    }
+    task_list_compact_if_sparse(list);
+    return 0;
+}
+
 // Function to add a task
 void task_add(TaskList *list, const char *name, const char *desc, time_t due_date, Priority priority) {
     // input guard
@@ -61,34 +482,19 @@ void task_add(TaskList *list, const char *name, const char *desc, time_t due_dat
         fprintf(stderr, "Error, list is empty\n");
         return;
     }
-    if (list->tasks == NULL) {
+    if (list->ids == NULL) {
         fprintf(stderr, "Error, there are no task\n");
         return;
     }
-    // Conditional for capacity
-    if (list->count >= list->capacity) {
-        int new_capacity = list->capacity * 2;
-        Task* temp_task = (Task*) realloc(list->tasks, sizeof(Task) * new_capacity);
-        if (temp_task == NULL) {
-            fprintf(stderr, "Error, invalid tasks\n");
-            return;
-        }
-        // Update tasks and capacity
-        list->tasks = temp_task;
-        list->capacity = new_capacity;
-    }
+    // The index checks the ids of a loaded list against next_id, so build it before handing out the next id
+    task_list_index(list);
     // Write new tasks in
-    Task* new_task = &list->tasks[list->count];
-    new_task->id = list->count + 1;
-    new_task->due_date = due_date;
-    new_task->priority = priority;
-    new_task->completed = 0;
-    strncpy(new_task->name, name, MAX_TASK_NAME - 1);
-    new_task->name[MAX_TASK_NAME - 1] = '\0';
-    strncpy(new_task->description, desc, MAX_TASK_DESC - 1);
-    new_task->description[MAX_TASK_DESC - 1] = '\0';
-    // increment count
-    list->count++;
+    int slot = task_insert(list, list->next_id, name, desc, due_date, priority);
+    if (slot < 0) {
+        return;
+    }
+    Task new_task = task_get(list, slot);
+    task_list_persist(list, LOG_ADD, &new_task);
 }
 
 // Helper function to convert Priority enum to string
@@ -105,6 +511,16 @@ const char* priority_to_string(Priority p) {
     }
 }
 
+// Helper function to print the task in a slot as a row of the task table
+static void task_print(const TaskList *list, int slot) {
+    Task task = task_get(list, slot);
+    printf("%d | ", task.id);
+    printf("%s | ", task.name);
+    printf("%s | ", priority_to_string(task.priority));
+    printf("%s | ", task.completed ? "Complete" : "Pending");
+    printf("%s", ctime(&task.due_date));
+}
+
 // Function to display list
 void task_list_display(TaskList *list) {
     // Conditional for input
@@ -117,18 +533,48 @@ void task_list_display(TaskList *list) {
         fprintf(stderr, "Error, No tasks to display\n");
         return;
     }
-    if (list->tasks == NULL) {
+    if (list->ids == NULL) {
+        fprintf(stderr, "Error, there are no task\n");
+        return;
+    }
+    // Print task
+    printf("ID | Name | Priority | Status | Due Date\n");
+    int length = task_list_order_length(list);
+    for (int p = 0; p < length; p++) {
+        int i = task_list_order_slot(list, p);
+        if (i < 0) {
+            continue;
+        }
+        task_print(list, i);
+    }
+}
+
+// Function to display the tasks sorted by a key without changing their order in the list
+// Uses the list's sorted views, so only tasks added since the last call have to be sorted
+void task_list_display_sorted(TaskList *list, TaskSortKey key) {
+    // Conditional for input
+    if (list == NULL) {
+        fprintf(stderr, "Error, list is empty\n");
+        return;
+    }
+    // Check if empty
+    if (list->count == 0) {
+        fprintf(stderr, "Error, No tasks to display\n");
+        return;
+    }
+    if (list->ids == NULL) {
         fprintf(stderr, "Error, there are no task\n");
         return;
     }
+    const TaskViewEntry *entries;
+    int count = task_list_view(list, key, &entries);
+    if (count < 0) {
+        return;
+    }
     // Print task
     printf("ID | Name | Priority | Status | Due Date\n");
-    for (int i = 0; i < list->count; i++) {
-        printf("%d | ", list->tasks[i].id);
-        printf("%s | ", list->tasks[i].name);
-        printf("%s | ", priority_to_string(list->tasks[i].priority));
-        printf("%s | ", list->tasks[i].completed ? "Complete" : "Pending");
-        printf("%s", ctime(&list->tasks[i].due_date));
+    for (int i = 0; i < count; i++) {
+        task_print(list, entries[i].slot);
     }
 }
 
@@ -140,7 +586,7 @@ void task_mark_complete(TaskList *list, int id) {
         return;
     }
     // Conditional check for tasks 
-    if (list->tasks == NULL) {
+    if (list->ids == NULL) {
         fprintf(stderr, "Error, there are no task\n");
         return;
     }
@@ -154,21 +600,20 @@ void task_mark_complete(TaskList *list, int id) {
         fprintf(stderr, "Invalid id number\n");
         return;
     }
-    // Loop through the id
-    for (int i = 0; i < list->count; i++) {
-        if (id == list->tasks[i].id) {
-            if (list->tasks[i].completed == 1) {
-                printf("Task already completed\n");
-                return;
-            } else {
-                list->tasks[i].completed = 1;
-                printf("Task has been marked as complete!\n");
-                return;
-            }
-        }
+    // Look up the id
+    int i = task_find(list, id);
+    if (i < 0) {
+        fprintf(stderr, "Error, Task was not found!\n");
+        return;
     }
-    fprintf(stderr, "Error, Task was not found!\n");
-    return;
+    if (list->completed[i] == 1) {
+        printf("Task already completed\n");
+        return;
+    }
+    list->completed[i] = 1;
+    Task task = task_get(list, i);
+    task_list_persist(list, LOG_COMPLETE, &task);
+    printf("Task has been marked as complete!\n");
 }
 
 // Function to mark task incomplete
@@ -179,7 +624,7 @@ void task_mark_incomplete(TaskList *list, int id) {
         return;
     }
     // Conditional check for tasks 
-    if (list->tasks == NULL) {
+    if (list->ids == NULL) {
         fprintf(stderr, "Error, there are no task\n");
         return;
     }
@@ -193,19 +638,20 @@ void task_mark_incomplete(TaskList *list, int id) {
         fprintf(stderr, "Invalid id number\n");
         return;
     }
-    // Loop throught the id
-    for (int i = 0; i < list->count; i++) {
-        if (id == list->tasks[i].id && list->tasks[i].completed == 1) {
-            printf("Task has been marked as incomplete\n");
-            list->tasks[i].completed = 0;
-            return;
-        } else if (id == list->tasks[i].id && list->tasks[i].completed != 1) {
-            printf("Task has already been marked as incomplete\n");
-            return;
-        }
+    // Look up the id
+    int i = task_find(list, id);
+    if (i < 0) {
+        fprintf(stderr, "Error, Task was not found!\n");
+        return;
+    }
+    if (list->completed[i] != 1) {
+        printf("Task has already been marked as incomplete\n");
+        return;
     }
-    fprintf(stderr, "Error, Task was not found!\n");
-    return;
+    printf("Task has been marked as incomplete\n");
+    list->completed[i] = 0;
+    Task task = task_get(list, i);
+    task_list_persist(list, LOG_INCOMPLETE, &task);
 }
 
 // Function to delete a task
@@ -216,7 +662,7 @@ void task_delete(TaskList *list, int id) {
         return;
     }
     // Conditional check for tasks 
-    if (list->tasks == NULL) {
+    if (list->ids == NULL) {
         fprintf(stderr, "Error, There are no task\n");
         return;
     }
@@ -230,31 +676,31 @@ void task_delete(TaskList *list, int id) {
         fprintf(stderr, "Error, Invalid id number\n");
         return;
     }
-    // Loop through to find ID
-    for (int i = 0; i < list->count; i++) {
-        if (id == list->tasks[i].id) {
-            // Loop through from ID -> tail shifting elements
-            for (int j = i; j < list->count - 1; j++) {
-                list->tasks[j] = list->tasks[j + 1];
-            }
-            // Update array size
-            list->count--;
-            return;
-        } 
+    // Look up the id
+    int i = task_find(list, id);
+    if (i < 0) {
+        fprintf(stderr, "Error, Task not found\n");
+        return;
     }
-    fprintf(stderr, "Error, Task not found\n");
-    return;
+    // The change is applied before it is logged, a compaction started by the append must see it
+    // (the record only holds the id, the strings may be gone once the list is compacted)
+    Task task = task_get(list, i);
+    if (task_remove(list, i) != 0) {
+        fprintf(stderr, "Error, Task could not be deleted\n");
+        return;
+    }
+    task_list_persist(list, LOG_DELETE, &task);
 }
 
-// Function to serach for a task
-void task_search(TaskList *list, const char *keyword) {
+// Function to delete every completed task in one pass
+void task_delete_completed(TaskList *list) {
     // Check input
     if (list == NULL) {
         fprintf(stderr, "Error, List is empty\n");
         return;
     }
     // Conditional check for tasks 
-    if (list->tasks == NULL) {
+    if (list->ids == NULL) {
         fprintf(stderr, "Error, There are no task\n");
         return;
     }
@@ -263,41 +709,161 @@ void task_search(TaskList *list, const char *keyword) {
         fprintf(stderr, "Error, No tasks\n");
         return;
     }
-    // Conditional to check keyword
-    if (keyword == NULL) {
-        fprintf(stderr, "Error, No keyword\n");
-        return;
+    // Each delete only frees a slot, the list is compacted once at the end
+    int deleted = 0;
+    int length = task_list_order_length(list);
+    for (int p = 0; p < length; p++) {
+        int i = task_list_order_slot(list, p);
+        if (i < 0 || !list->completed[i]) {
+            continue;
+        }
+        Task task = task_get(list, i);
+        if (task_release(list, i) != 0) {
+            break;
+        }
+        task_list_persist(list, LOG_DELETE, &task);
+        deleted++;
+    }
+    task_list_compact_if_sparse(list);
+    printf("%d completed tasks deleted\n", deleted);
+}
+
+// Helper function to build the keyword index the first time it is needed, and again once deleted tasks
+// outnumber the rest (returns -1 if it could not be built)
+static int task_list_trigrams(TaskList *list) {
+    TaskTrigramIndex *index = &list->trigrams;
+    if (index->built && index->removed > list->count) {
+        task_trigrams_free(index);
+    }
+    if (index->built) {
+        return 0;
     }
-    int found = 0;
-    // Loop through list to find name
-    for (int i = 0; i < list->count; i++) {
-        // Find the keyword within the name or description
-        if (strstr(list->tasks[i].name, keyword) || 
-        strstr(list->tasks[i].description, keyword)) {
-            printf("ID | Name | Priority | Status | Due Date\n");
-            printf("%d | ", list->tasks[i].id);
-            printf("%s | ", list->tasks[i].name);
-            printf("%s | ", priority_to_string(list->tasks[i].priority));
-            printf("%s | ", list->tasks[i].completed ? "Complete" : "Pending");
-            printf("%s", ctime(&list->tasks[i].due_date));
-            found = 1;
+    int length = task_list_order_length(list);
+    for (int p = 0; p < length; p++) {
+        int slot = task_list_order_slot(list, p);
+        if (slot < 0) {
+            continue;
+        }
+        Task task = task_get(list, slot);
+        if (task_trigrams_add(index, task.id, task.name, task.description) != 0) {
+            task_trigrams_free(index);
+            return -1;
         }
     }
-    if (found == 0) {
-        printf("No tasks matched\n");
+    index->removed = 0;
+    index->built = 1;
+    // Candidates are looked up by id, build that index now rather than in the middle of a search
+    task_list_index(list);
+    return 0;
+}
+
+// Helper function for whether the task in a slot has keyword in its name or description
+static int task_matches(const TaskList *list, int slot, const char *keyword) {
+    return strstr(task_strings_get(&list->strings, list->names[slot]), keyword) != NULL ||
+        strstr(task_strings_get(&list->strings, list->descriptions[slot]), keyword) != NULL;
+}
+
+// Helper function to scan every task for keyword, filling slots in display order (returns the count, -1 on failure)
+// The string arena is scanned once (task_scan.c), then each task checks its two strings against the matches
+static int task_list_scan(TaskList *list, const char *keyword, int ignore_case, int *slots) {
+    uint32_t *offsets;
+    int matched = task_scan_strings(&list->strings, keyword, ignore_case, &offsets);
+    if (matched < 0) {
+        return -1;
     }
-    return;
+    unsigned char *marks = (unsigned char*) calloc(list->strings.size / 8 + 1, 1);
+    if (marks == NULL) {
+        fprintf(stderr, "Error, search allocation failed\n");
+        free(offsets);
+        return -1;
+    }
+    for (int i = 0; i < matched; i++) {
+        marks[offsets[i] / 8] |= (unsigned char) (1 << (offsets[i] % 8));
+    }
+    free(offsets);
+    int count = 0;
+    int length = task_list_order_length(list);
+    for (int p = 0; p < length; p++) {
+        int slot = task_list_order_slot(list, p);
+        if (slot < 0) {
+            continue;
+        }
+        uint32_t name = list->names[slot];
+        uint32_t desc = list->descriptions[slot];
+        // Offsets past the arena (a damaged file) have no bit and match nothing
+        if ((name < list->strings.size && (marks[name / 8] & (1 << (name % 8)))) ||
+                (desc < list->strings.size && (marks[desc / 8] & (1 << (desc % 8))))) {
+            slots[count++] = slot;
+        }
+    }
+    free(marks);
+    return count;
 }
 
-// Function to sort the list by priority (Using bubble sort)
-void task_list_sort_by_priority(TaskList *list) {
+// Helper function for the slots of the tasks that have keyword in their name or description, in display
+// order. A case-sensitive search only checks the tasks the keyword index leaves, any other search scans
+// every task. Sets *slots to an array the caller frees (returns the number of slots, -1 on failure)
+static int task_list_matches(TaskList *list, const char *keyword, int ignore_case, int **slots) {
+    int *ids = NULL;
+    int candidates = -1;
+    if (!ignore_case && task_list_trigrams(list) == 0) {
+        candidates = task_trigrams_query(&list->trigrams, keyword, &ids);
+    }
+    // Looking up and reordering a large share of the list costs more than scanning it
+    if (candidates > list->count / TASK_SEARCH_SCAN_SHARE) {
+        free(ids);
+        ids = NULL;
+        candidates = -1;
+    }
+    int capacity = candidates >= 0 ? candidates : list->count;
+    *slots = (int*) malloc(sizeof(int) * (size_t) (capacity > 0 ? capacity : 1));
+    if (*slots == NULL) {
+        fprintf(stderr, "Error, search allocation failed\n");
+        free(ids);
+        return -1;
+    }
+    if (candidates < 0) {
+        int count = task_list_scan(list, keyword, ignore_case, *slots);
+        if (count < 0) {
+            free(*slots);
+        }
+        return count;
+    }
+    TaskSortItem *items = (TaskSortItem*) malloc(sizeof(TaskSortItem) * (size_t) (capacity > 0 ? capacity : 1));
+    if (items == NULL) {
+        fprintf(stderr, "Error, search allocation failed\n");
+        free(ids);
+        free(*slots);
+        return -1;
+    }
+    // Ids come out of the index in id order, put the matches in display order
+    int count = 0;
+    for (int i = 0; i < candidates; i++) {
+        int slot = task_find(list, ids[i]);
+        if (slot >= 0 && task_matches(list, slot, keyword)) {
+            items[count].key = (uint64_t) (list->order != NULL ? list->positions[slot] : slot);
+            items[count].slot = slot;
+            count++;
+        }
+    }
+    task_sort_items(items, count);
+    for (int i = 0; i < count; i++) {
+        (*slots)[i] = items[i].slot;
+    }
+    free(ids);
+    free(items);
+    return count;
+}
+
+// Helper function to print the tasks that have keyword in their name or description
+static void task_list_search(TaskList *list, const char *keyword, int ignore_case) {
     // Check input
     if (list == NULL) {
         fprintf(stderr, "Error, List is empty\n");
         return;
     }
     // Conditional check for tasks 
-    if (list->tasks == NULL) {
+    if (list->ids == NULL) {
         fprintf(stderr, "Error, There are no task\n");
         return;
     }
@@ -306,55 +872,277 @@ void task_list_sort_by_priority(TaskList *list) {
         fprintf(stderr, "Error, No tasks\n");
         return;
     }
-    // Implement bubble sort
-    for (int i = 0; i < list->count - 1; i++) {
-        int swapped = 0;
-        for (int j = 0; j < list->count - i - 1; j++) {
-            if (list->tasks[j].priority < list->tasks[j+1].priority) {
-                Task temp_task = list->tasks[j];
-                list->tasks[j] = list->tasks[j+1];
-                list->tasks[j+1] = temp_task;
-                swapped = 1;
+    // Conditional to check keyword
+    if (keyword == NULL) {
+        fprintf(stderr, "Error, No keyword\n");
+        return;
+    }
+    // Find the keyword within the names and descriptions
+    int *slots;
+    int found = task_list_matches(list, keyword, ignore_case, &slots);
+    if (found < 0) {
+        return;
+    }
+    for (int i = 0; i < found; i++) {
+        printf("ID | Name | Priority | Status | Due Date\n");
+        task_print(list, slots[i]);
+    }
+    free(slots);
+    if (found == 0) {
+        printf("No tasks matched\n");
+    }
+}
+
+// Function to serach for a task
+void task_search(TaskList *list, const char *keyword) {
+    task_list_search(list, keyword, 0);
+}
+
+// Function to search for a task, with ASCII letters matching in either case
+void task_search_ignore_case(TaskList *list, const char *keyword) {
+    task_list_search(list, keyword, 1);
+}
+
+// Helper function for the sort key of a slot, smaller keys come first
+static uint64_t task_sort_key(const TaskList *list, int slot, TaskSortKey key) {
+    if (key == SORT_BY_PRIORITY) {
+        return (uint64_t) (HIGH - list->priorities[slot]);
+    }
+    // Flipping the sign bit orders negative dates before positive ones
+    return (uint64_t) (int64_t) list->due_dates[slot] ^ ((uint64_t) 1 << 63);
+}
+
+// Function to sort the display order, without messages or logging (returns 0 on success, -1 on failure)
+// Tasks with equal keys keep their order, and only the order changes, tasks stay in their slots
+int task_sort(TaskList *list, TaskSortKey key) {
+    if (task_list_order(list) != 0) {
+        return -1;
+    }
+    TaskSortItem *items = (TaskSortItem*) malloc(sizeof(TaskSortItem) * (size_t) (list->count > 0 ? list->count : 1));
+    if (items == NULL) {
+        fprintf(stderr, "Error, sort allocation failed\n");
+        return -1;
+    }
+    // Close up the holes while the keys are gathered
+    int count = 0;
+    for (int p = 0; p < list->order_count; p++) {
+        int slot = list->order[p];
+        if (slot >= 0) {
+            items[count].key = task_sort_key(list, slot, key);
+            items[count].slot = slot;
+            count++;
+        }
+    }
+    if (task_sort_items(items, count) != 0) {
+        free(items);
+        return -1;
+    }
+    for (int p = 0; p < count; p++) {
+        list->order[p] = items[p].slot;
+        list->positions[items[p].slot] = p;
+    }
+    list->order_count = count;
+    free(items);
+    return 0;
+}
+
+// Helper function to sort items by key and then by the id of their slot
+static int task_sort_items_by_id(const TaskList *list, TaskSortItem *items, int count, TaskSortKey key) {
+    for (int i = 0; i < count; i++) {
+        items[i].key = (uint64_t) (unsigned int) list->ids[items[i].slot];
+    }
+    if (task_sort_items(items, count) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        items[i].key = task_sort_key(list, items[i].slot, key);
+    }
+    return task_sort_items(items, count);
+}
+
+// Helper function for whether a view entry comes before a sorted item
+static int task_view_before(const TaskList *list, TaskViewEntry entry, const TaskSortItem *item, TaskSortKey key) {
+    uint64_t entry_key = task_sort_key(list, entry.slot, key);
+    return entry_key < item->key || (entry_key == item->key && entry.id < list->ids[item->slot]);
+}
+
+// Helper function to put sorted items into a view whose sorted entries are all still there
+// Works from the back in place, so the entries before the first new one are not touched
+static void task_view_insert(const TaskList *list, TaskView *view, const TaskSortItem *items, int count,
+        TaskSortKey key) {
+    TaskViewEntry *entries = view->entries;
+    int end = view->sorted;
+    int write = view->sorted + count;
+    for (int b = count - 1; b >= 0; b--) {
+        // First of the remaining entries that has to come after this item
+        int low = 0;
+        int high = end;
+        while (low < high) {
+            int middle = low + (high - low) / 2;
+            if (task_view_before(list, entries[middle], &items[b], key)) {
+                low = middle + 1;
+            } else {
+                high = middle;
             }
         }
-        if (swapped == 0) {
-            break;
+        write -= end - low;
+        memmove(&entries[write], &entries[low], sizeof(TaskViewEntry) * (size_t) (end - low));
+        end = low;
+        write--;
+        entries[write].slot = items[b].slot;
+        entries[write].id = list->ids[items[b].slot];
+    }
+    view->count = view->sorted + count;
+    view->sorted = view->count;
+}
+
+// Helper function to merge sorted items with the entries of a view, dropping entries of deleted tasks
+// An entry is gone once its slot holds another id, ids are never reused (returns -1 on failure)
+static int task_view_merge(const TaskList *list, TaskView *view, const TaskSortItem *items, int count,
+        TaskSortKey key) {
+    int capacity = list->count > 0 ? list->count : 1;
+    TaskViewEntry *merged = (TaskViewEntry*) malloc(sizeof(TaskViewEntry) * (size_t) capacity);
+    if (merged == NULL) {
+        fprintf(stderr, "Error, view allocation failed\n");
+        return -1;
+    }
+    int total = 0;
+    int a = 0;
+    int b = 0;
+    while (a < view->sorted || b < count) {
+        if (a < view->sorted && list->ids[view->entries[a].slot] != view->entries[a].id) {
+            a++;
+            continue;
         }
+        if (a == view->sorted || (b < count && !task_view_before(list, view->entries[a], &items[b], key))) {
+            merged[total].slot = items[b].slot;
+            merged[total].id = list->ids[items[b].slot];
+            b++;
+        } else {
+            merged[total] = view->entries[a];
+            a++;
+        }
+        total++;
     }
+    free(view->entries);
+    view->entries = merged;
+    view->capacity = capacity;
+    view->count = total;
+    view->sorted = total;
+    return 0;
+}
+
+// Function for the tasks sorted by a key and then by id, through a view that is kept between calls
+// Only tasks added since the last call are sorted, then merged with the rest (entries of deleted tasks
+// are dropped on the way). Returns the number of entries, -1 on failure.
+int task_list_view(TaskList *list, TaskSortKey key, const TaskViewEntry **entries) {
+    TaskView *view = &list->views[key];
+    if (!view->built) {
+        // The first call sorts every task
+        TaskViewEntry *all = (TaskViewEntry*) malloc(sizeof(TaskViewEntry) * (size_t) (list->count > 0 ? list->count : 1));
+        if (all == NULL) {
+            fprintf(stderr, "Error, view allocation failed\n");
+            return -1;
+        }
+        int count = 0;
+        int length = task_list_order_length(list);
+        for (int p = 0; p < length; p++) {
+            int slot = task_list_order_slot(list, p);
+            if (slot >= 0) {
+                all[count].slot = slot;
+                all[count].id = list->ids[slot];
+                count++;
+            }
+        }
+        free(view->entries);
+        view->entries = all;
+        view->capacity = list->count > 0 ? list->count : 1;
+        view->count = count;
+        view->sorted = 0;
+        view->built = 1;
+    }
+    // Nothing was added or deleted since the last call
+    if (view->sorted == view->count && view->count == list->count) {
+        *entries = view->entries;
+        return view->count;
+    }
+    // Sort the entries added since the last call, leaving out the ones deleted already
+    int added = view->count - view->sorted;
+    TaskSortItem *items = (TaskSortItem*) malloc(sizeof(TaskSortItem) * (size_t) (added > 0 ? added : 1));
+    if (items == NULL) {
+        fprintf(stderr, "Error, view allocation failed\n");
+        return -1;
+    }
+    int fresh = 0;
+    for (int i = view->sorted; i < view->count; i++) {
+        if (list->ids[view->entries[i].slot] == view->entries[i].id) {
+            items[fresh++].slot = view->entries[i].slot;
+        }
+    }
+    if (task_sort_items_by_id(list, items, fresh, key) != 0) {
+        free(items);
+        return -1;
+    }
+    if (view->sorted + fresh == list->count) {
+        // No sorted entry was deleted, each added one is placed by a binary search
+        task_view_insert(list, view, items, fresh, key);
+    } else if (task_view_merge(list, view, items, fresh, key) != 0) {
+        free(items);
+        return -1;
+    }
+    free(items);
+    *entries = view->entries;
+    return view->count;
+}
+
+// Function to sort the list by priority (returns 0 on success, -1 on failure)
+int task_list_sort_by_priority(TaskList *list) {
+    // Check input
+    if (list == NULL) {
+        fprintf(stderr, "Error, List is empty\n");
+        return -1;
+    }
+    // Conditional check for tasks 
+    if (list->ids == NULL) {
+        fprintf(stderr, "Error, There are no task\n");
+        return -1;
+    }
+    // Conditional check for tasks count
+    if (list->count == 0) {
+        fprintf(stderr, "Error, No tasks\n");
+        return -1;
+    }
+    // Nothing is logged for a sort that did not happen
+    if (task_sort(list, SORT_BY_PRIORITY) != 0) {
+        return -1;
+    }
+    task_list_persist(list, LOG_SORT_PRIORITY, NULL);
     printf("List successfully sorted!\n");
+    return 0;
 }
 
-// Function to sort the list by date
-void task_list_sort_by_date(TaskList *list) {
+// Function to sort the list by date (returns 0 on success, -1 on failure)
+int task_list_sort_by_date(TaskList *list) {
     // Check input
     if (list == NULL) {
         fprintf(stderr, "Error, List is empty\n");
-        return;
+        return -1;
     }
     // Conditional check for tasks 
-    if (list->tasks == NULL) {
+    if (list->ids == NULL) {
         fprintf(stderr, "Error, There are no task\n");
-        return;
+        return -1;
     }
     // Conditional check for tasks count
     if (list->count == 0) {
         fprintf(stderr, "Error, No tasks\n");
-        return;
+        return -1;
     }
-    // Implement bubble sort
-    for (int i = 0; i < list->count - 1; i++) {
-        int swapped = 0;
-        for (int j = 0; j < list->count - i - 1; j++) {
-            if (list->tasks[j].due_date > list->tasks[j+1].due_date) {
-                Task temp_task = list->tasks[j];
-                list->tasks[j] = list->tasks[j+1];
-                list->tasks[j+1] = temp_task;
-                swapped = 1;
-            }
-        }
-        if (swapped == 0) {
-            break;
-        }
+    // Nothing is logged for a sort that did not happen
+    if (task_sort(list, SORT_BY_DATE) != 0) {
+        return -1;
     }
+    task_list_persist(list, LOG_SORT_DATE, NULL);
     printf("List successfully sorted\n");    
+    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,137 @@
+/*
+This is the file that maps task ids to their position in the task list.
+The index is an open-addressing hash table with linear probing:
+    - Ids are spread with a multiplicative (Fibonacci) hash, which keeps sequential ids apart
+    - The table is kept at most half full, so a lookup touches one or two entries on average
+    - Removing an id shifts the entries after it back instead of leaving a tombstone, so lookups
+      never slow down after many deletions
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "../include/task_index.h"
+
+// Helper function for the home bucket of an id
+static int index_bucket(const TaskIndex *index, int id) {
+    return (int) (((uint32_t) id * 2654435769u) >> index->shift);
+}
+
+// Helper function to move the entries to a new table of capacity buckets
+static int index_resize(TaskIndex *index, int capacity) {
+    TaskIndexEntry *entries = (TaskIndexEntry*) calloc((size_t) capacity, sizeof(TaskIndexEntry));
+    if (entries == NULL) {
+        fprintf(stderr, "Error, index allocation failed\n");
+        return -1;
+    }
+    TaskIndexEntry *old_entries = index->entries;
+    int old_capacity = index->capacity;
+    int shift = 32;
+    for (int size = capacity; size > 1; size >>= 1) {
+        shift--;
+    }
+    index->entries = entries;
+    index->capacity = capacity;
+    index->shift = shift;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_entries[i].id != 0) {
+            int bucket = index_bucket(index, old_entries[i].id);
+            while (entries[bucket].id != 0) {
+                bucket = (bucket + 1) & (capacity - 1);
+            }
+            entries[bucket] = old_entries[i];
+        }
+    }
+    free(old_entries);
+    return 0;
+}
+
+// Function to find the slot of an id (returns -1 if it is not in the index)
+int task_index_find(const TaskIndex *index, int id) {
+    if (index->count == 0 || id <= 0) {
+        return -1;
+    }
+    int bucket = index_bucket(index, id);
+    while (index->entries[bucket].id != 0) {
+        if (index->entries[bucket].id == id) {
+            return index->entries[bucket].slot;
+        }
+        bucket = (bucket + 1) & (index->capacity - 1);
+    }
+    return -1;
+}
+
+// Function to make room for count ids without resizing (returns 0 on success, -1 on failure)
+int task_index_reserve(TaskIndex *index, int count) {
+    int capacity = index->capacity > 0 ? index->capacity : TASK_INDEX_MIN_CAPACITY;
+    while (capacity / 2 < count) {
+        capacity *= 2;
+    }
+    if (capacity == index->capacity) {
+        return 0;
+    }
+    return index_resize(index, capacity);
+}
+
+// Function to add an id or move it to a new slot (returns 0 on success, -1 on failure)
+int task_index_put(TaskIndex *index, int id, int slot) {
+    if (task_index_reserve(index, index->count + 1) != 0) {
+        return -1;
+    }
+    int bucket = index_bucket(index, id);
+    while (index->entries[bucket].id != 0) {
+        if (index->entries[bucket].id == id) {
+            index->entries[bucket].slot = slot;
+            return 0;
+        }
+        bucket = (bucket + 1) & (index->capacity - 1);
+    }
+    index->entries[bucket].id = id;
+    index->entries[bucket].slot = slot;
+    index->count++;
+    return 0;
+}
+
+// Function to remove an id from the index
+void task_index_remove(TaskIndex *index, int id) {
+    if (index->count == 0 || id <= 0) {
+        return;
+    }
+    int mask = index->capacity - 1;
+    int bucket = index_bucket(index, id);
+    while (index->entries[bucket].id != id) {
+        if (index->entries[bucket].id == 0) {
+            return;
+        }
+        bucket = (bucket + 1) & mask;
+    }
+    // Shift back every entry of the run that would no longer be reachable across the gap
+    int next = (bucket + 1) & mask;
+    while (index->entries[next].id != 0) {
+        int home = index_bucket(index, index->entries[next].id);
+        if (((next - home) & mask) >= ((next - bucket) & mask)) {
+            index->entries[bucket] = index->entries[next];
+            bucket = next;
+        }
+        next = (next + 1) & mask;
+    }
+    index->entries[bucket].id = 0;
+    index->count--;
+}
+
+// Function to empty the index, keeping its table
+void task_index_clear(TaskIndex *index) {
+    if (index->entries != NULL) {
+        memset(index->entries, 0, sizeof(TaskIndexEntry) * (size_t) index->capacity);
+    }
+    index->count = 0;
+}
+
+// Function to release the index's table
+void task_index_free(TaskIndex *index) {
+    free(index->entries);
+    index->entries = NULL;
+    index->capacity = 0;
+    index->count = 0;
+}
@@ -0,0 +1,463 @@
+/*
+This is the file that keeps the write-ahead log of changes to a loaded task list.
+Every add, delete, mark and sort is appended as one small record instead of rewriting the task file:
+    - Records are buffered and a flusher thread commits them, everything appended within
+      TASK_LOG_COMMIT_MS shares one write and one fsync (group commit)
+    - Each record carries a checksum, so a record torn by a crash is dropped on replay
+    - Records are numbered (the log sequence number, LSN) from the base LSN in the log header, and
+      replay skips the ones the snapshot already holds
+    - After a compaction the log is rewritten to hold only the records the new snapshot does not
+
+A log file is a 16-byte header (magic "TLOG", version, base LSN) followed by records:
+    4 bytes FNV-1a checksum of the rest of the record
+    2 bytes payload length
+    1 byte  record type (TaskLogType)
+    payload: add      - id, due date, priority, name length, description length, name, description
+             delete   - id
+             mark     - id
+             sort     - nothing
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/task_log.h"
+
+#define RECORD_HEADER_SIZE 7
+#define ADD_PAYLOAD_SIZE 16
+
+// Helper function for the checksum of a record
+static uint32_t record_checksum(const unsigned char *data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Helper function to write a whole buffer (returns 0 on success, -1 on failure)
+static int write_all(int fd, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char*) data;
+    while (size > 0) {
+        ssize_t written = write(fd, bytes, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += written;
+        size -= (size_t) written;
+    }
+    return 0;
+}
+
+// Helper function to write a log header and make it durable
+static int write_header(int fd, uint64_t base_lsn) {
+    unsigned char header[TASK_LOG_HEADER_SIZE];
+    uint32_t magic = TASK_LOG_MAGIC;
+    uint32_t version = TASK_LOG_VERSION;
+    memcpy(header, &magic, 4);
+    memcpy(header + 4, &version, 4);
+    memcpy(header + 8, &base_lsn, 8);
+    if (write_all(fd, header, sizeof(header)) != 0 || fsync(fd) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Helper function to apply one record to the list (returns -1 if it does not fit the list)
+static int apply_record(TaskList *list, int type, const unsigned char *payload, size_t length) {
+    int32_t id;
+    if (type == LOG_SORT_PRIORITY || type == LOG_SORT_DATE) {
+        return task_sort(list, type == LOG_SORT_PRIORITY ? SORT_BY_PRIORITY : SORT_BY_DATE);
+    }
+    if (length < 4) {
+        return -1;
+    }
+    memcpy(&id, payload, 4);
+    if (type == LOG_ADD) {
+        int64_t due_date;
+        uint16_t desc_length;
+        char name[MAX_TASK_NAME];
+        char desc[MAX_TASK_DESC];
+        if (length < ADD_PAYLOAD_SIZE) {
+            return -1;
+        }
+        memcpy(&due_date, payload + 4, 8);
+        memcpy(&desc_length, payload + 14, 2);
+        size_t name_length = payload[13];
+        if (name_length >= MAX_TASK_NAME || desc_length >= MAX_TASK_DESC ||
+                length != ADD_PAYLOAD_SIZE + name_length + desc_length) {
+            return -1;
+        }
+        memcpy(name, payload + ADD_PAYLOAD_SIZE, name_length);
+        name[name_length] = '\0';
+        memcpy(desc, payload + ADD_PAYLOAD_SIZE + name_length, desc_length);
+        desc[desc_length] = '\0';
+        return task_insert(list, id, name, desc, (time_t) due_date, (Priority) payload[12]) >= 0 ? 0 : -1;
+    }
+    int index = task_find(list, id);
+    if (index < 0) {
+        return -1;
+    }
+    switch (type) {
+        case LOG_DELETE:
+            return task_remove(list, index);
+        case LOG_COMPLETE:
+            list->completed[index] = 1;
+            return 0;
+        case LOG_INCOMPLETE:
+            list->completed[index] = 0;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+// Function to apply the records of a log that come after the snapshot (returns 0 on success, -1 on failure)
+// lsn is set to the last record the list now holds, a missing log is an empty one
+int task_log_replay(TaskList *list, const char *path, uint64_t snapshot_lsn, uint64_t *lsn) {
+    *lsn = snapshot_lsn;
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        if (errno == ENOENT) {
+            return 0;
+        }
+        fprintf(stderr, "Error, could not open %s\n", path);
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        fprintf(stderr, "Error, could not read %s\n", path);
+        close(fd);
+        return -1;
+    }
+    size_t size = (size_t) info.st_size;
+    // A crash while the log was created can leave it without a whole header
+    if (size < TASK_LOG_HEADER_SIZE) {
+        int result = ftruncate(fd, 0);
+        close(fd);
+        return result == 0 ? 0 : -1;
+    }
+    unsigned char *data = (unsigned char*) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error, could not map %s\n", path);
+        close(fd);
+        return -1;
+    }
+    uint32_t magic;
+    uint32_t version;
+    uint64_t current;
+    memcpy(&magic, data, 4);
+    memcpy(&version, data + 4, 4);
+    memcpy(&current, data + 8, 8);
+    const char *problem = NULL;
+    if (magic != TASK_LOG_MAGIC || version != TASK_LOG_VERSION) {
+        problem = "is not a task log";
+    } else if (current > snapshot_lsn) {
+        problem = "does not follow the task file";
+    }
+    size_t offset = TASK_LOG_HEADER_SIZE;
+    while (problem == NULL && offset + RECORD_HEADER_SIZE <= size) {
+        uint32_t checksum;
+        uint16_t length;
+        memcpy(&checksum, data + offset, 4);
+        memcpy(&length, data + offset + 4, 2);
+        // A record cut short or garbled by a crash ends the log
+        if (offset + RECORD_HEADER_SIZE + length > size ||
+                record_checksum(data + offset + 4, RECORD_HEADER_SIZE - 4 + length) != checksum) {
+            break;
+        }
+        current++;
+        if (current > snapshot_lsn &&
+                apply_record(list, data[offset + 6], data + offset + RECORD_HEADER_SIZE, length) != 0) {
+            problem = "does not match the task file";
+        }
+        offset += RECORD_HEADER_SIZE + length;
+    }
+    munmap(data, size);
+    if (problem != NULL) {
+        fprintf(stderr, "Error, %s %s\n", path, problem);
+        close(fd);
+        return -1;
+    }
+    int result = 0;
+    if (current <= snapshot_lsn) {
+        // Everything in the log is in the snapshot already, task_log_open starts a new one
+        result = ftruncate(fd, 0);
+    } else if (offset < size) {
+        // Drop the torn record so new records are not appended after it
+        result = ftruncate(fd, (off_t) offset);
+        *lsn = current;
+    } else {
+        *lsn = current;
+    }
+    close(fd);
+    if (result != 0) {
+        fprintf(stderr, "Error, could not write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Helper function for the time the commit window ends
+static void commit_deadline(struct timespec *deadline) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_nsec += TASK_LOG_COMMIT_MS * 1000000L;
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+}
+
+// Flusher thread: commits buffered records with one write and one fsync per batch
+static void *log_flusher(void *arg) {
+    TaskLog *log = (TaskLog*) arg;
+    pthread_mutex_lock(&log->lock);
+    while (!log->stop || log->used > 0) {
+        if (log->used == 0) {
+            pthread_cond_wait(&log->wake, &log->lock);
+            continue;
+        }
+        // Group commit: records appended within the commit window join this batch
+        struct timespec deadline;
+        commit_deadline(&deadline);
+        while (!log->stop && !log->urgent && log->used < TASK_LOG_BUFFER_SIZE) {
+            if (pthread_cond_timedwait(&log->wake, &log->lock, &deadline) == ETIMEDOUT) {
+                break;
+            }
+        }
+        // Swap buffers so appends carry on while the batch is written
+        unsigned char *batch = log->buffer;
+        size_t batch_size = log->used;
+        size_t buffer_size = log->buffer_size;
+        log->buffer = log->spare;
+        log->buffer_size = log->spare_size;
+        log->spare = batch;
+        log->spare_size = buffer_size;
+        log->used = 0;
+        log->urgent = 0;
+        // After a failed write the file may end in a partial record, nothing can follow it
+        if (log->failed) {
+            continue;
+        }
+        log->flushing = 1;
+        pthread_mutex_unlock(&log->lock);
+        int result = write_all(log->fd, batch, batch_size) == 0 && fsync(log->fd) == 0 ? 0 : -1;
+        pthread_mutex_lock(&log->lock);
+        log->flushing = 0;
+        if (result == 0) {
+            log->durable += batch_size;
+        } else {
+            log->failed = 1;
+            fprintf(stderr, "Error, could not write %s, changes are no longer saved\n", log->path);
+        }
+        pthread_cond_broadcast(&log->synced);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+// Function to open a log for appending after task_log_replay, lsn is the last record the list holds
+// (returns NULL on failure)
+TaskLog* task_log_open(const char *path, uint64_t lsn) {
+    int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error, could not open %s\n", path);
+        return NULL;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        fprintf(stderr, "Error, could not read %s\n", path);
+        close(fd);
+        return NULL;
+    }
+    uint64_t size = (uint64_t) info.st_size;
+    if (size == 0) {
+        if (write_header(fd, lsn) != 0) {
+            fprintf(stderr, "Error, could not write %s\n", path);
+            close(fd);
+            return NULL;
+        }
+        size = TASK_LOG_HEADER_SIZE;
+    }
+    TaskLog *log = (TaskLog*) calloc(1, sizeof(TaskLog));
+    if (log == NULL) {
+        fprintf(stderr, "Error, memory allocation failed\n");
+        close(fd);
+        return NULL;
+    }
+    log->fd = fd;
+    log->path = strdup(path);
+    log->buffer = (unsigned char*) malloc(TASK_LOG_BUFFER_SIZE);
+    log->spare = (unsigned char*) malloc(TASK_LOG_BUFFER_SIZE);
+    log->buffer_size = TASK_LOG_BUFFER_SIZE;
+    log->spare_size = TASK_LOG_BUFFER_SIZE;
+    log->size = size;
+    log->durable = size;
+    log->lsn = lsn;
+    if (log->path == NULL || log->buffer == NULL || log->spare == NULL) {
+        fprintf(stderr, "Error, memory allocation failed\n");
+        free(log->path);
+        free(log->buffer);
+        free(log->spare);
+        free(log);
+        close(fd);
+        return NULL;
+    }
+    pthread_mutex_init(&log->lock, NULL);
+    pthread_cond_init(&log->wake, NULL);
+    pthread_cond_init(&log->synced, NULL);
+    if (pthread_create(&log->flusher, NULL, log_flusher, log) != 0) {
+        fprintf(stderr, "Error, could not start the log flusher\n");
+        pthread_mutex_destroy(&log->lock);
+        pthread_cond_destroy(&log->wake);
+        pthread_cond_destroy(&log->synced);
+        free(log->path);
+        free(log->buffer);
+        free(log->spare);
+        free(log);
+        close(fd);
+        return NULL;
+    }
+    return log;
+}
+
+// Function to append a record for a change, it is on disk within TASK_LOG_COMMIT_MS
+// (returns the record's sequence number, 0 on failure)
+uint64_t task_log_append(TaskLog *log, TaskLogType type, const Task *task) {
+    unsigned char payload[ADD_PAYLOAD_SIZE + MAX_TASK_NAME + MAX_TASK_DESC];
+    size_t length = 0;
+    if (type == LOG_ADD) {
+        int32_t id = task->id;
+        int64_t due_date = (int64_t) task->due_date;
+        size_t name_length = strlen(task->name);
+        uint16_t desc_length = (uint16_t) strlen(task->description);
+        memcpy(payload, &id, 4);
+        memcpy(payload + 4, &due_date, 8);
+        payload[12] = (unsigned char) task->priority;
+        payload[13] = (unsigned char) name_length;
+        memcpy(payload + 14, &desc_length, 2);
+        memcpy(payload + ADD_PAYLOAD_SIZE, task->name, name_length);
+        memcpy(payload + ADD_PAYLOAD_SIZE + name_length, task->description, desc_length);
+        length = ADD_PAYLOAD_SIZE + name_length + desc_length;
+    } else if (type != LOG_SORT_PRIORITY && type != LOG_SORT_DATE) {
+        int32_t id = task->id;
+        memcpy(payload, &id, 4);
+        length = 4;
+    }
+
+    pthread_mutex_lock(&log->lock);
+    size_t needed = log->used + RECORD_HEADER_SIZE + length;
+    if (needed > log->buffer_size) {
+        // Appends outran the flusher, the batch just gets bigger
+        unsigned char *buffer = (unsigned char*) realloc(log->buffer, needed * 2);
+        if (buffer == NULL) {
+            pthread_mutex_unlock(&log->lock);
+            fprintf(stderr, "Error, memory allocation failed\n");
+            return 0;
+        }
+        log->buffer = buffer;
+        log->buffer_size = needed * 2;
+    }
+    unsigned char *record = log->buffer + log->used;
+    uint16_t record_length = (uint16_t) length;
+    memcpy(record + 4, &record_length, 2);
+    record[6] = (unsigned char) type;
+    memcpy(record + RECORD_HEADER_SIZE, payload, length);
+    uint32_t checksum = record_checksum(record + 4, RECORD_HEADER_SIZE - 4 + length);
+    memcpy(record, &checksum, 4);
+    log->used = needed;
+    log->size += RECORD_HEADER_SIZE + length;
+    uint64_t lsn = ++log->lsn;
+    pthread_cond_signal(&log->wake);
+    pthread_mutex_unlock(&log->lock);
+    return lsn;
+}
+
+// Function to wait until every record appended so far is on disk (returns 0 on success, -1 on failure)
+int task_log_sync(TaskLog *log) {
+    pthread_mutex_lock(&log->lock);
+    uint64_t target = log->size;
+    if (log->durable < target) {
+        log->urgent = 1;
+        pthread_cond_signal(&log->wake);
+    }
+    while (log->durable < target && !log->failed) {
+        pthread_cond_wait(&log->synced, &log->lock);
+    }
+    int result = log->failed ? -1 : 0;
+    pthread_mutex_unlock(&log->lock);
+    return result;
+}
+
+// Function to replace the log with the records from offset on, numbered from base_lsn
+// Only the thread that appends may call it (returns 0 on success, -1 on failure)
+int task_log_rewrite(TaskLog *log, uint64_t offset, uint64_t base_lsn) {
+    if (task_log_sync(log) != 0) {
+        return -1;
+    }
+    // Nothing is pending and the flusher is idle until the next append
+    pthread_mutex_lock(&log->lock);
+    size_t tail = (size_t) (log->size - offset);
+    size_t path_length = strlen(log->path);
+    unsigned char *data = (unsigned char*) malloc(tail > 0 ? tail : 1);
+    char *tmp_path = (char*) malloc(path_length + 5);
+    int fd = -1;
+    int result = -1;
+    if (data != NULL && tmp_path != NULL) {
+        memcpy(tmp_path, log->path, path_length);
+        memcpy(tmp_path + path_length, ".tmp", 5);
+        fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    }
+    if (fd >= 0 && pread(log->fd, data, tail, (off_t) offset) == (ssize_t) tail &&
+            write_header(fd, base_lsn) == 0 && write_all(fd, data, tail) == 0 && fsync(fd) == 0 &&
+            rename(tmp_path, log->path) == 0) {
+        close(log->fd);
+        log->fd = fd;
+        log->size = TASK_LOG_HEADER_SIZE + tail;
+        log->durable = log->size;
+        result = 0;
+    } else {
+        // The old log stays, replay skips whatever the new snapshot already holds
+        fprintf(stderr, "Error, could not rewrite %s\n", log->path);
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmp_path);
+        }
+    }
+    pthread_mutex_unlock(&log->lock);
+    free(data);
+    free(tmp_path);
+    return result;
+}
+
+// Function to commit what is left, stop the flusher and close the log
+void task_log_close(TaskLog *log) {
+    if (log == NULL) {
+        return;
+    }
+    task_log_sync(log);
+    pthread_mutex_lock(&log->lock);
+    log->stop = 1;
+    pthread_cond_signal(&log->wake);
+    pthread_mutex_unlock(&log->lock);
+    pthread_join(log->flusher, NULL);
+    pthread_mutex_destroy(&log->lock);
+    pthread_cond_destroy(&log->wake);
+    pthread_cond_destroy(&log->synced);
+    close(log->fd);
+    free(log->path);
+    free(log->buffer);
+    free(log->spare);
+    free(log);
+}
@@ -0,0 +1,343 @@
+/*
+This is the file that scans the task strings for a keyword when the search index cannot answer.
+The scan runs over the string arena instead of task by task, so a string that several tasks share is
+only read once:
+    - Candidate places are found 16 (SSE2) or 32 (AVX2) bytes at a time by comparing the keyword's first
+      and last bytes with two loads offset by the keyword's length, only places where both match are
+      compared in full
+    - Ignoring case folds ASCII letters with an OR of 0x20 before the compare, other bytes still have to
+      match exactly
+    - A keyword never holds a NUL, so a match never crosses from one string into the next; after a match
+      the scan skips to the next string
+    - Large arenas are split into chunks scanned by one thread each, and the matches are put back in
+      arena order
+The plain loops are used when the CPU has no SSE2.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "../include/task_scan.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TASK_SCAN_SIMD 1
+#include <immintrin.h>
+#endif
+
+#define NOT_FOUND ((size_t) -1)
+
+// The keyword as the scan compares it
+typedef struct {
+    const unsigned char *text;  // Lowercase when case is ignored
+    size_t length;
+    unsigned char first_fold;   // 0x20 if the first byte is a letter and case is ignored, else 0
+    unsigned char last_fold;
+    int ignore_case;
+} Needle;
+
+// Function that finds the first match starting in [from, end) of an arena of size bytes
+typedef size_t (*FindFunction)(const unsigned char *data, size_t from, size_t end, size_t size, const Needle *needle);
+
+// One thread's part of the arena and the strings it found
+typedef struct {
+    const unsigned char *data;
+    size_t begin;
+    size_t end;
+    size_t size;
+    const Needle *needle;
+    FindFunction find;
+    uint32_t *offsets;
+    int count;
+    int capacity;
+    int failed;
+} ScanChunk;
+
+// Helper function for a byte folded to lowercase when it is an ASCII letter
+static unsigned char fold(unsigned char byte) {
+    return byte >= 'A' && byte <= 'Z' ? (unsigned char) (byte | 0x20) : byte;
+}
+
+// Helper function for the fold mask of a keyword byte
+static unsigned char fold_mask(unsigned char byte, int ignore_case) {
+    return ignore_case && byte >= 'a' && byte <= 'z' ? 0x20 : 0;
+}
+
+// Helper function to compare the keyword with the text at a place whose first and last bytes match
+static int needle_matches(const unsigned char *text, const Needle *needle) {
+    if (needle->ignore_case) {
+        for (size_t i = 1; i + 1 < needle->length; i++) {
+            if (fold(text[i]) != needle->text[i]) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    return needle->length < 3 || memcmp(text + 1, needle->text + 1, needle->length - 2) == 0;
+}
+
+// Helper function to find a match one place at a time
+static size_t find_scalar(const unsigned char *data, size_t from, size_t end, size_t size, const Needle *needle) {
+    size_t length = needle->length;
+    unsigned char first = needle->text[0];
+    unsigned char last = needle->text[length - 1];
+    for (size_t i = from; i < end && i + length <= size; i++) {
+        if ((data[i] | needle->first_fold) == first && (data[i + length - 1] | needle->last_fold) == last &&
+                needle_matches(data + i, needle)) {
+            return i;
+        }
+    }
+    return NOT_FOUND;
+}
+
+#ifdef TASK_SCAN_SIMD
+
+// Helper function to find a match 16 places at a time
+__attribute__((target("sse2")))
+static size_t find_sse2(const unsigned char *data, size_t from, size_t end, size_t size, const Needle *needle) {
+    size_t length = needle->length;
+    const __m128i first = _mm_set1_epi8((char) needle->text[0]);
+    const __m128i last = _mm_set1_epi8((char) needle->text[length - 1]);
+    const __m128i first_fold = _mm_set1_epi8((char) needle->first_fold);
+    const __m128i last_fold = _mm_set1_epi8((char) needle->last_fold);
+    size_t i = from;
+    // Both loads have to stay inside the arena
+    while (i < end && i + length - 1 + 16 <= size) {
+        __m128i block_first = _mm_or_si128(_mm_loadu_si128((const __m128i*) (data + i)), first_fold);
+        __m128i block_last = _mm_or_si128(_mm_loadu_si128((const __m128i*) (data + i + length - 1)), last_fold);
+        unsigned int mask = (unsigned int) _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(block_first, first), _mm_cmpeq_epi8(block_last, last)));
+        while (mask != 0) {
+            size_t place = i + (size_t) __builtin_ctz(mask);
+            if (place >= end) {
+                return NOT_FOUND;
+            }
+            if (needle_matches(data + place, needle)) {
+                return place;
+            }
+            mask &= mask - 1;
+        }
+        i += 16;
+    }
+    return find_scalar(data, i, end, size, needle);
+}
+
+// Helper function to find a match 32 places at a time
+__attribute__((target("avx2")))
+static size_t find_avx2(const unsigned char *data, size_t from, size_t end, size_t size, const Needle *needle) {
+    size_t length = needle->length;
+    const __m256i first = _mm256_set1_epi8((char) needle->text[0]);
+    const __m256i last = _mm256_set1_epi8((char) needle->text[length - 1]);
+    const __m256i first_fold = _mm256_set1_epi8((char) needle->first_fold);
+    const __m256i last_fold = _mm256_set1_epi8((char) needle->last_fold);
+    size_t i = from;
+    // Both loads have to stay inside the arena
+    while (i < end && i + length - 1 + 32 <= size) {
+        __m256i block_first = _mm256_or_si256(_mm256_loadu_si256((const __m256i*) (data + i)), first_fold);
+        __m256i block_last = _mm256_or_si256(_mm256_loadu_si256((const __m256i*) (data + i + length - 1)), last_fold);
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(block_first, first), _mm256_cmpeq_epi8(block_last, last)));
+        while (mask != 0) {
+            size_t place = i + (size_t) __builtin_ctz(mask);
+            if (place >= end) {
+                return NOT_FOUND;
+            }
+            if (needle_matches(data + place, needle)) {
+                return place;
+            }
+            mask &= mask - 1;
+        }
+        i += 32;
+    }
+    return find_sse2(data, i, end, size, needle);
+}
+
+#endif
+
+// Pick the widest compare the CPU supports
+static FindFunction find_function(void) {
+#ifdef TASK_SCAN_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        return find_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return find_sse2;
+    }
+#endif
+    return find_scalar;
+}
+
+// Helper function to record the start of a string with a match (returns -1 on failure)
+static int chunk_add(ScanChunk *chunk, uint32_t offset) {
+    if (chunk->count == chunk->capacity) {
+        int capacity = chunk->capacity > 0 ? chunk->capacity * 2 : 64;
+        uint32_t *offsets = (uint32_t*) realloc(chunk->offsets, sizeof(uint32_t) * (size_t) capacity);
+        if (offsets == NULL) {
+            return -1;
+        }
+        chunk->offsets = offsets;
+        chunk->capacity = capacity;
+    }
+    chunk->offsets[chunk->count++] = offset;
+    return 0;
+}
+
+// Helper function to scan one chunk, run by a thread of its own or by the caller
+static void *scan_chunk(void *argument) {
+    ScanChunk *chunk = (ScanChunk*) argument;
+    const unsigned char *data = chunk->data;
+    size_t place = chunk->begin;
+    while (place < chunk->end) {
+        size_t match = chunk->find(data, place, chunk->end, chunk->size, chunk->needle);
+        if (match == NOT_FOUND) {
+            break;
+        }
+        // The string that holds the match starts after the NUL before it
+        size_t start = match;
+        while (start > 0 && data[start - 1] != '\0') {
+            start--;
+        }
+        if (chunk_add(chunk, (uint32_t) start) != 0) {
+            chunk->failed = 1;
+            break;
+        }
+        // One match is enough, go on with the next string
+        const unsigned char *nul = (const unsigned char*) memchr(data + match, '\0', chunk->size - match);
+        if (nul == NULL) {
+            break;
+        }
+        place = (size_t) (nul - data) + 1;
+    }
+    return NULL;
+}
+
+// Helper function for the number of threads to scan size bytes with
+static int scan_threads(size_t size) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    long threads = (long) (size / TASK_SCAN_CHUNK_MIN);
+    if (threads > cores) {
+        threads = cores;
+    }
+    if (threads > TASK_SCAN_MAX_THREADS) {
+        threads = TASK_SCAN_MAX_THREADS;
+    }
+    return threads > 1 ? (int) threads : 1;
+}
+
+// Helper function to scan the arena in threads chunks (returns the number of offsets, -1 on failure)
+static int scan_strings(const TaskStrings *strings, const Needle *needle, int threads, uint32_t **offsets) {
+    ScanChunk chunks[TASK_SCAN_MAX_THREADS];
+    pthread_t workers[TASK_SCAN_MAX_THREADS];
+    int started[TASK_SCAN_MAX_THREADS];
+    size_t size = strings->size;
+    FindFunction find = find_function();
+    for (int t = 0; t < threads; t++) {
+        memset(&chunks[t], 0, sizeof(ScanChunk));
+        chunks[t].data = (const unsigned char*) strings->data;
+        chunks[t].begin = size / (size_t) threads * (size_t) t;
+        chunks[t].end = t == threads - 1 ? size : size / (size_t) threads * (size_t) (t + 1);
+        chunks[t].size = size;
+        chunks[t].needle = needle;
+        chunks[t].find = find;
+    }
+    // The caller scans the first chunk itself, a chunk whose thread cannot start is scanned by the caller too
+    for (int t = 1; t < threads; t++) {
+        started[t] = pthread_create(&workers[t], NULL, scan_chunk, &chunks[t]) == 0;
+    }
+    scan_chunk(&chunks[0]);
+    for (int t = 1; t < threads; t++) {
+        if (started[t]) {
+            pthread_join(workers[t], NULL);
+        } else {
+            scan_chunk(&chunks[t]);
+        }
+    }
+    // Put the chunks together in arena order, a string that spans two chunks may be in both
+    int total = 0;
+    int failed = 0;
+    for (int t = 0; t < threads; t++) {
+        total += chunks[t].count;
+        failed |= chunks[t].failed;
+    }
+    uint32_t *merged = failed ? NULL : (uint32_t*) malloc(sizeof(uint32_t) * (size_t) (total > 0 ? total : 1));
+    int count = 0;
+    if (merged != NULL) {
+        for (int t = 0; t < threads; t++) {
+            for (int i = 0; i < chunks[t].count; i++) {
+                if (count == 0 || merged[count - 1] != chunks[t].offsets[i]) {
+                    merged[count++] = chunks[t].offsets[i];
+                }
+            }
+        }
+    }
+    for (int t = 0; t < threads; t++) {
+        free(chunks[t].offsets);
+    }
+    if (merged == NULL) {
+        fprintf(stderr, "Error, scan allocation failed\n");
+        return -1;
+    }
+    *offsets = merged;
+    return count;
+}
+
+// Function for the offsets of the strings in the arena that contain keyword, in ascending order
+// Matches what strstr finds, or with ignore_case what it finds once ASCII letters are folded to lowercase.
+// Sets *offsets to an array the caller frees (returns how many there are, -1 on failure)
+int task_scan_strings(const TaskStrings *strings, const char *keyword, int ignore_case, uint32_t **offsets) {
+    return task_scan_strings_split(strings, keyword, ignore_case, scan_threads(strings->size), offsets);
+}
+
+// Function to scan like task_scan_strings with the arena split into a given number of chunks (1 to
+// TASK_SCAN_MAX_THREADS) whatever its size, so the joins between chunks can be tested on small arenas
+int task_scan_strings_split(const TaskStrings *strings, const char *keyword, int ignore_case, int threads,
+        uint32_t **offsets) {
+    if (threads < 1) {
+        threads = 1;
+    } else if (threads > TASK_SCAN_MAX_THREADS) {
+        threads = TASK_SCAN_MAX_THREADS;
+    }
+    size_t length = strlen(keyword);
+    // Every string contains the empty keyword
+    if (length == 0) {
+        uint32_t *all = NULL;
+        int count = 0;
+        int capacity = 0;
+        for (size_t offset = 0; offset < strings->size; offset += strlen(strings->data + offset) + 1) {
+            if (count == capacity) {
+                capacity = capacity > 0 ? capacity * 2 : 64;
+                uint32_t *grown = (uint32_t*) realloc(all, sizeof(uint32_t) * (size_t) capacity);
+                if (grown == NULL) {
+                    fprintf(stderr, "Error, scan allocation failed\n");
+                    free(all);
+                    return -1;
+                }
+                all = grown;
+            }
+            all[count++] = (uint32_t) offset;
+        }
+        *offsets = all;
+        return count;
+    }
+    unsigned char *text = (unsigned char*) malloc(length);
+    if (text == NULL) {
+        fprintf(stderr, "Error, scan allocation failed\n");
+        return -1;
+    }
+    for (size_t i = 0; i < length; i++) {
+        text[i] = ignore_case ? fold((unsigned char) keyword[i]) : (unsigned char) keyword[i];
+    }
+    Needle needle;
+    needle.text = text;
+    needle.length = length;
+    needle.first_fold = fold_mask(text[0], ignore_case);
+    needle.last_fold = fold_mask(text[length - 1], ignore_case);
+    needle.ignore_case = ignore_case;
+    int count = scan_strings(strings, &needle, threads, offsets);
+    free(text);
+    return count;
+}
@@ -0,0 +1,98 @@
+/*
+This is the file that sorts tasks by their keys.
+Sorting works on compact (key, slot) items rather than on the tasks themselves:
+    - Items are sorted with a least-significant-digit radix sort on 8-bit digits, which is stable and
+      takes a fixed number of passes over the items whatever their order
+    - Digits that are the same in all keys are skipped and the rest are counted in one pass, so
+      priorities take a single counting pass and dates only the passes for the bytes that vary
+    - Keys that are in order already are left as they are
+    - Because the sort is stable, sorting by one key and then another orders by the second key first
+      and by the first within it
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/task_sort.h"
+
+#define DIGIT_BITS 8
+#define DIGITS (64 / DIGIT_BITS)
+#define BUCKETS (1 << DIGIT_BITS)
+
+// Function to sort items by key, keeping items with equal keys in their order
+// (returns 0 on success, -1 on failure)
+int task_sort_items(TaskSortItem *items, int count) {
+    if (count < 2) {
+        return 0;
+    }
+    // Find the digits that differ between keys, nothing moves if the keys are in order already
+    uint64_t differ = 0;
+    int ordered = 1;
+    for (int i = 1; i < count; i++) {
+        differ |= items[i].key ^ items[0].key;
+        ordered &= items[i - 1].key <= items[i].key;
+    }
+    if (ordered) {
+        return 0;
+    }
+    // Count those digits of every key in one pass
+    size_t counts[DIGITS][BUCKETS];
+    memset(counts, 0, sizeof(counts));
+    int digits[DIGITS];
+    int used = 0;
+    for (int d = 0; d < DIGITS; d++) {
+        if (((differ >> (d * DIGIT_BITS)) & (BUCKETS - 1)) != 0) {
+            digits[used++] = d;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        uint64_t key = items[i].key;
+        for (int u = 0; u < used; u++) {
+            counts[digits[u]][(key >> (digits[u] * DIGIT_BITS)) & (BUCKETS - 1)]++;
+        }
+    }
+    TaskSortItem *buffer = (TaskSortItem*) malloc(sizeof(TaskSortItem) * (size_t) count);
+    if (buffer == NULL) {
+        fprintf(stderr, "Error, sort allocation failed\n");
+        return -1;
+    }
+    TaskSortItem *from = items;
+    TaskSortItem *to = buffer;
+    for (int u = 0; u < used; u++) {
+        int d = digits[u];
+        int shift = d * DIGIT_BITS;
+        // Turn the counts into the first place of each digit, then deal the items out in order
+        size_t place = 0;
+        for (int b = 0; b < BUCKETS; b++) {
+            size_t digit_count = counts[d][b];
+            counts[d][b] = place;
+            place += digit_count;
+        }
+        for (int i = 0; i < count; i++) {
+            to[counts[d][(from[i].key >> shift) & (BUCKETS - 1)]++] = from[i];
+        }
+        TaskSortItem *swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != items) {
+        memcpy(items, from, sizeof(TaskSortItem) * (size_t) count);
+    }
+    free(buffer);
+    return 0;
+}
+
+// Function to empty a view, the next task_list_view builds it again
+void task_view_reset(TaskView *view) {
+    view->count = 0;
+    view->sorted = 0;
+    view->built = 0;
+}
+
+// Function to release a view's entries
+void task_view_free(TaskView *view) {
+    free(view->entries);
+    view->entries = NULL;
+    view->capacity = 0;
+    task_view_reset(view);
+}
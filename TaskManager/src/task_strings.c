@@ -0,0 +1,149 @@
+/*
+This is the file that stores the names and descriptions of the tasks.
+Strings are kept back to back in one arena and tasks refer to them by offset:
+    - A string is only stored once, adding one that is already there returns the existing offset
+      (an intern table hashes the strings with FNV-1a and probes linearly)
+    - The intern table is built by the first add rather than when the arena is loaded, so a mapped
+      arena costs nothing until it changes
+    - Strings of deleted tasks stay until task_list_compact copies the live ones to a new arena
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/task_strings.h"
+
+#define TABLE_MIN_CAPACITY 1024
+
+// Helper function for the hash of a string
+static uint32_t string_hash(const char *text, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char) text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Helper function to put an offset in the first free bucket of its probe sequence
+static void table_insert(uint32_t *table, size_t capacity, const char *data, uint32_t offset) {
+    const char *text = data + offset;
+    size_t bucket = string_hash(text, strlen(text)) & (capacity - 1);
+    while (table[bucket] != 0) {
+        bucket = (bucket + 1) & (capacity - 1);
+    }
+    table[bucket] = offset + 1;
+}
+
+// Helper function to give the intern table room for count more strings, building it from the strings
+// already in the arena the first time (returns -1 on failure)
+static int table_reserve(TaskStrings *strings, size_t count) {
+    size_t entries = strings->table_count;
+    if (strings->table == NULL) {
+        for (size_t offset = 0; offset < strings->size; offset += strlen(strings->data + offset) + 1) {
+            entries++;
+        }
+    }
+    size_t capacity = strings->table_capacity > 0 ? strings->table_capacity : TABLE_MIN_CAPACITY;
+    while (capacity / 2 < entries + count) {
+        capacity *= 2;
+    }
+    if (capacity == strings->table_capacity) {
+        return 0;
+    }
+    uint32_t *table = (uint32_t*) calloc(capacity, sizeof(uint32_t));
+    if (table == NULL) {
+        fprintf(stderr, "Error, string table allocation failed\n");
+        return -1;
+    }
+    if (strings->table != NULL) {
+        for (size_t i = 0; i < strings->table_capacity; i++) {
+            if (strings->table[i] != 0) {
+                table_insert(table, capacity, strings->data, strings->table[i] - 1);
+            }
+        }
+        free(strings->table);
+    } else {
+        for (size_t offset = 0; offset < strings->size; offset += strlen(strings->data + offset) + 1) {
+            table_insert(table, capacity, strings->data, (uint32_t) offset);
+        }
+    }
+    strings->table = table;
+    strings->table_capacity = capacity;
+    strings->table_count = entries;
+    return 0;
+}
+
+// Function to set up an empty arena with room for capacity bytes (returns 0 on success, -1 on failure)
+int task_strings_init(TaskStrings *strings, size_t capacity) {
+    memset(strings, 0, sizeof(TaskStrings));
+    strings->capacity = capacity > 0 ? capacity : TASK_STRINGS_MIN_CAPACITY;
+    strings->data = (char*) malloc(strings->capacity);
+    if (strings->data == NULL) {
+        fprintf(stderr, "Error, string arena allocation failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Function to check whether a string of length bytes is sure to fit without growing the arena
+int task_strings_fits(const TaskStrings *strings, size_t length) {
+    return strings->size + length + 1 <= strings->capacity;
+}
+
+// Function to add a string, or find it if it is already there (returns its offset, TASK_STRINGS_NONE on failure)
+// Growing the arena reallocates data, it has to be owned by the heap
+uint32_t task_strings_intern(TaskStrings *strings, const char *text, size_t length) {
+    if (table_reserve(strings, 1) != 0) {
+        return TASK_STRINGS_NONE;
+    }
+    size_t mask = strings->table_capacity - 1;
+    size_t bucket = string_hash(text, length) & mask;
+    while (strings->table[bucket] != 0) {
+        const char *candidate = strings->data + strings->table[bucket] - 1;
+        if (strncmp(candidate, text, length) == 0 && candidate[length] == '\0') {
+            return strings->table[bucket] - 1;
+        }
+        bucket = (bucket + 1) & mask;
+    }
+    if (strings->size + length + 1 > UINT32_MAX) {
+        fprintf(stderr, "Error, string arena is full\n");
+        return TASK_STRINGS_NONE;
+    }
+    if (!task_strings_fits(strings, length)) {
+        size_t capacity = strings->capacity > 0 ? strings->capacity * 2 : TASK_STRINGS_MIN_CAPACITY;
+        while (strings->size + length + 1 > capacity) {
+            capacity *= 2;
+        }
+        char *data = (char*) realloc(strings->data, capacity);
+        if (data == NULL) {
+            fprintf(stderr, "Error, string arena allocation failed\n");
+            return TASK_STRINGS_NONE;
+        }
+        strings->data = data;
+        strings->capacity = capacity;
+    }
+    uint32_t offset = (uint32_t) strings->size;
+    memcpy(strings->data + offset, text, length);
+    strings->data[offset + length] = '\0';
+    strings->size += length + 1;
+    strings->table[bucket] = offset + 1;
+    strings->table_count++;
+    return offset;
+}
+
+// Function to drop the intern table, for when the arena's data is replaced under it
+void task_strings_forget(TaskStrings *strings) {
+    free(strings->table);
+    strings->table = NULL;
+    strings->table_capacity = 0;
+    strings->table_count = 0;
+}
+
+// Function to release the arena's data and intern table
+void task_strings_free(TaskStrings *strings) {
+    task_strings_forget(strings);
+    free(strings->data);
+    strings->data = NULL;
+    strings->size = 0;
+    strings->capacity = 0;
+}
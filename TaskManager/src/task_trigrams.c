@@ -0,0 +1,253 @@
+/*
+This is the file that indexes the task strings for keyword search.
+Every three-byte sequence (trigram) of a task's name and description has a posting list of the ids of
+the tasks that contain it:
+    - A keyword of three bytes or more can only be in tasks that contain all of its trigrams, so a search
+      intersects their posting lists and checks the few tasks left with strstr
+    - New ids are larger than every id before them, so adding a task appends to its postings and they
+      stay sorted; the intersection gallops through the longer lists with exponential search
+    - Deleting a task leaves its id in the postings, a search skips ids that are no longer in the list
+      and the index is rebuilt once deleted ids outnumber the tasks
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/task_trigrams.h"
+
+// Helper function for the trigram at the start of text (which must have three bytes left)
+static uint32_t trigram_at(const char *text) {
+    return ((uint32_t) (unsigned char) text[0] << 16) | ((uint32_t) (unsigned char) text[1] << 8) |
+        (uint32_t) (unsigned char) text[2];
+}
+
+// Helper function for the home bucket of a trigram
+static int trigram_bucket(const TaskTrigramIndex *index, uint32_t trigram) {
+    return (int) ((trigram * 2654435769u) >> index->shift);
+}
+
+// Helper function for the posting list of a trigram (returns NULL if no task contains it)
+static TaskPosting *posting_find(TaskTrigramIndex *index, uint32_t trigram) {
+    if (index->count == 0) {
+        return NULL;
+    }
+    int bucket = trigram_bucket(index, trigram);
+    while (index->postings[bucket].trigram != 0) {
+        if (index->postings[bucket].trigram == trigram) {
+            return &index->postings[bucket];
+        }
+        bucket = (bucket + 1) & (index->capacity - 1);
+    }
+    return NULL;
+}
+
+// Helper function to move the postings to a table of capacity buckets (returns -1 on failure)
+static int index_resize(TaskTrigramIndex *index, int capacity) {
+    TaskPosting *postings = (TaskPosting*) calloc((size_t) capacity, sizeof(TaskPosting));
+    if (postings == NULL) {
+        fprintf(stderr, "Error, search index allocation failed\n");
+        return -1;
+    }
+    TaskPosting *old_postings = index->postings;
+    int old_capacity = index->capacity;
+    int shift = 32;
+    for (int size = capacity; size > 1; size >>= 1) {
+        shift--;
+    }
+    index->postings = postings;
+    index->capacity = capacity;
+    index->shift = shift;
+    for (int i = 0; i < old_capacity; i++) {
+        if (old_postings[i].trigram != 0) {
+            int bucket = trigram_bucket(index, old_postings[i].trigram);
+            while (postings[bucket].trigram != 0) {
+                bucket = (bucket + 1) & (capacity - 1);
+            }
+            postings[bucket] = old_postings[i];
+        }
+    }
+    free(old_postings);
+    return 0;
+}
+
+// Helper function for the posting list of a trigram, added if it is new (returns NULL on failure)
+static TaskPosting *posting_get(TaskTrigramIndex *index, uint32_t trigram) {
+    TaskPosting *posting = posting_find(index, trigram);
+    if (posting != NULL) {
+        return posting;
+    }
+    if ((index->count + 1) * 2 > index->capacity &&
+            index_resize(index, index->capacity > 0 ? index->capacity * 2 : TASK_TRIGRAMS_MIN_CAPACITY) != 0) {
+        return NULL;
+    }
+    int bucket = trigram_bucket(index, trigram);
+    while (index->postings[bucket].trigram != 0) {
+        bucket = (bucket + 1) & (index->capacity - 1);
+    }
+    posting = &index->postings[bucket];
+    posting->trigram = trigram;
+    posting->sorted = 1;
+    index->count++;
+    return posting;
+}
+
+// Helper function to add the trigrams of one string of a task (returns -1 on failure)
+static int index_text(TaskTrigramIndex *index, int id, const char *text) {
+    size_t length = strlen(text);
+    for (size_t i = 0; i + 3 <= length; i++) {
+        TaskPosting *posting = posting_get(index, trigram_at(text + i));
+        if (posting == NULL) {
+            return -1;
+        }
+        // A trigram the task has already added ends its posting list
+        if (posting->count > 0 && posting->ids[posting->count - 1] == id) {
+            continue;
+        }
+        if (posting->count == posting->capacity) {
+            int capacity = posting->capacity > 0 ? posting->capacity * 2 : 4;
+            int *ids = (int*) realloc(posting->ids, sizeof(int) * (size_t) capacity);
+            if (ids == NULL) {
+                fprintf(stderr, "Error, search index allocation failed\n");
+                return -1;
+            }
+            posting->ids = ids;
+            posting->capacity = capacity;
+        }
+        if (posting->count > 0 && posting->ids[posting->count - 1] > id) {
+            posting->sorted = 0;
+        }
+        posting->ids[posting->count++] = id;
+    }
+    return 0;
+}
+
+// Function to add a task's name and description to the index (returns 0 on success, -1 on failure)
+int task_trigrams_add(TaskTrigramIndex *index, int id, const char *name, const char *desc) {
+    if (index_text(index, id, name) != 0 || index_text(index, id, desc) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+// Helper function to compare ids for qsort
+static int compare_ids(const void *a, const void *b) {
+    int x = *(const int*) a;
+    int y = *(const int*) b;
+    return (x > y) - (x < y);
+}
+
+// Helper function to sort a posting list whose ids were not added in order, dropping repeats
+static void posting_sort(TaskPosting *posting) {
+    qsort(posting->ids, (size_t) posting->count, sizeof(int), compare_ids);
+    int count = 0;
+    for (int i = 0; i < posting->count; i++) {
+        if (count == 0 || posting->ids[count - 1] != posting->ids[i]) {
+            posting->ids[count++] = posting->ids[i];
+        }
+    }
+    posting->count = count;
+    posting->sorted = 1;
+}
+
+// Helper function for the first place at or after from that holds an id of at least target
+static int first_at_least(const int *ids, int count, int from, int target) {
+    // Double the step until it passes target, then binary search the last step
+    int bound = 1;
+    while (from + bound < count && ids[from + bound] < target) {
+        bound *= 2;
+    }
+    int low = from + bound / 2;
+    int high = from + bound < count ? from + bound : count;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (ids[middle] < target) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Function for the ids of the tasks that may contain keyword, in ascending order
+// Every task that does contain it is among them, the caller checks each one. Sets *ids to an array
+// the caller frees and returns how many there are, or returns -1 if the index cannot answer (keywords
+// shorter than a trigram, or no memory) and the tasks have to be scanned.
+int task_trigrams_query(TaskTrigramIndex *index, const char *keyword, int **ids) {
+    size_t length = strlen(keyword);
+    if (length < 3) {
+        return -1;
+    }
+    // Gather the keyword's posting lists, shortest first
+    size_t trigram_count = length - 2;
+    TaskPosting **postings = (TaskPosting**) malloc(sizeof(TaskPosting*) * trigram_count);
+    if (postings == NULL) {
+        fprintf(stderr, "Error, search allocation failed\n");
+        return -1;
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < trigram_count; i++) {
+        TaskPosting *posting = posting_find(index, trigram_at(keyword + i));
+        if (posting == NULL || posting->count == 0) {
+            // No task has this trigram, so none has the keyword
+            free(postings);
+            *ids = NULL;
+            return 0;
+        }
+        size_t place = used;
+        int repeated = 0;
+        for (size_t j = 0; j < used; j++) {
+            if (postings[j] == posting) {
+                repeated = 1;
+                break;
+            }
+        }
+        if (repeated) {
+            continue;
+        }
+        while (place > 0 && postings[place - 1]->count > posting->count) {
+            postings[place] = postings[place - 1];
+            place--;
+        }
+        postings[place] = posting;
+        used++;
+    }
+    for (size_t i = 0; i < used; i++) {
+        if (!postings[i]->sorted) {
+            posting_sort(postings[i]);
+        }
+    }
+    // Start from the shortest list and keep the ids every other list has as well
+    int count = postings[0]->count;
+    int *candidates = (int*) malloc(sizeof(int) * (size_t) count);
+    if (candidates == NULL) {
+        fprintf(stderr, "Error, search allocation failed\n");
+        free(postings);
+        return -1;
+    }
+    memcpy(candidates, postings[0]->ids, sizeof(int) * (size_t) count);
+    for (size_t i = 1; i < used && count > 0; i++) {
+        const TaskPosting *posting = postings[i];
+        int kept = 0;
+        int place = 0;
+        for (int c = 0; c < count && place < posting->count; c++) {
+            place = first_at_least(posting->ids, posting->count, place, candidates[c]);
+            if (place < posting->count && posting->ids[place] == candidates[c]) {
+                candidates[kept++] = candidates[c];
+            }
+        }
+        count = kept;
+    }
+    free(postings);
+    *ids = candidates;
+    return count;
+}
+
+// Function to release the index
+void task_trigrams_free(TaskTrigramIndex *index) {
+    for (int i = 0; i < index->capacity; i++) {
+        free(index->postings[i].ids);
+    }
+    free(index->postings);
+    memset(index, 0, sizeof(TaskTrigramIndex));
+}
@@ -37,7 +37,11 @@ void display_menu(void) {
     printf("6. Search for a task\n");
     printf("7. Sort tasks by priority\n");
     printf("8. Sort tasks by due date\n");
-    printf("9. Exit\n\n");
+    printf("9. Exit\n");
+    printf("10. Delete all completed tasks\n");
+    printf("11. Display tasks by priority\n");
+    printf("12. Display tasks by due date\n");
+    printf("13. Search for a task ignoring case\n\n");
 }
 // Function to run the UI loop
 void run_ui(TaskList *list) {
@@ -58,8 +62,8 @@ void run_ui(TaskList *list) {
             continue;
         }
         clear_input_buffer();
-        if (choice < 1 || choice > 9) {
-            fprintf(stderr, "Invalid option. Please enter a number between 1 and 9.\n");
+        if (choice < 1 || choice > 13) {
+            fprintf(stderr, "Invalid option. Please enter a number between 1 and 13.\n");
             continue;
         }
         // Handle user input
@@ -151,8 +155,9 @@ void run_ui(TaskList *list) {
             case 5:
                 task_list_display(list);
                 break;
-            // Case for searching for a task
-            case 6: {
+            // Case for searching for a task, with or without matching case
+            case 6:
+            case 13: {
                 char keyword[MAX_TASK_NAME];
                 printf("Enter keyword to search for: ");
                 if (fgets(keyword, sizeof(keyword), stdin) == NULL) {
@@ -164,23 +169,41 @@ void run_ui(TaskList *list) {
                     fprintf(stderr, "Keyword cannot be empty\n");
                     break;
                 }
-                task_search(list, keyword);
+                if (choice == 13) {
+                    task_search_ignore_case(list, keyword);
+                } else {
+                    task_search(list, keyword);
+                }
                 break;
             }
             // Case for sorting tasks by priority
             case 7:
-                task_list_sort_by_priority(list);
-                printf("Tasks sorted by priority\n");
+                if (task_list_sort_by_priority(list) == 0) {
+                    printf("Tasks sorted by priority\n");
+                }
                 break;
             // Case for sorting tasks by due date
             case 8:
-                task_list_sort_by_date(list);
-                printf("Tasks sorted by due date\n");
+                if (task_list_sort_by_date(list) == 0) {
+                    printf("Tasks sorted by due date\n");
+                }
                 break;
             // Case for exiting the program
             case 9:
                 printf("Exiting Task Manager. Goodbye!\n");
                 return;
+            // Case for deleting every completed task
+            case 10:
+                task_delete_completed(list);
+                break;
+            // Case for displaying the tasks by priority, the list keeps its order
+            case 11:
+                task_list_display_sorted(list, SORT_BY_PRIORITY);
+                break;
+            // Case for displaying the tasks by due date, the list keeps its order
+            case 12:
+                task_list_display_sorted(list, SORT_BY_DATE);
+                break;
         }
     }
 }
\ No newline at end of file
@@ -0,0 +1,210 @@
+/*
+Regression tests for the task file and its write-ahead log.
+Each test works in a fresh directory under /tmp and prints one line, the exit status is the number of
+failed tests.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "../include/task.h"
+#include "../include/file_io.h"
+
+// Helper function to make an empty task file in a new directory (returns the file's path, NULL on failure)
+static char *test_task_file(char *dir) {
+    if (mkdtemp(dir) == NULL) {
+        return NULL;
+    }
+    char *path = (char*) malloc(strlen(dir) + sizeof("/t.dat"));
+    if (path == NULL) {
+        return NULL;
+    }
+    sprintf(path, "%s/t.dat", dir);
+    TaskList *empty = task_list_create();
+    if (empty == NULL || save_tasks_to_file(empty, path) != 0) {
+        free(path);
+        path = NULL;
+    }
+    if (empty != NULL) {
+        task_list_destroy(empty);
+    }
+    return path;
+}
+
+// Helper function to remove the files of a test directory
+static void test_cleanup(const char *dir, const char *path) {
+    char other[256];
+    unlink(path);
+    snprintf(other, sizeof(other), "%s/t.log", dir);
+    unlink(other);
+    snprintf(other, sizeof(other), "%s/t.tmp", dir);
+    unlink(other);
+    rmdir(dir);
+}
+
+// A delete whose log record starts a compaction has to stay deleted after a reload
+static int test_delete_starts_compaction(void) {
+    char dir[] = "/tmp/task_test_XXXXXX";
+    char *path = test_task_file(dir);
+    TaskList *list = path != NULL ? load_tasks_from_file(path) : NULL;
+    if (list == NULL) {
+        free(path);
+        return 1;
+    }
+    char desc[MAX_TASK_DESC];
+    memset(desc, 'd', sizeof(desc) - 1);
+    desc[sizeof(desc) - 1] = '\0';
+    // Fill the log with adds until it is close to the threshold
+    TaskLog *log = list->store->log;
+    while (log->size + 2 * sizeof(desc) < list->store->compact_at) {
+        task_add(list, "task", desc, 0, MEDIUM);
+    }
+    // Then with marks, whose records are the size of a delete's, until one more would start the compaction
+    uint64_t before = log->size;
+    task_mark_complete(list, 2);
+    uint64_t record = log->size - before;
+    while (log->size + record < list->store->compact_at) {
+        if (list->completed[task_find(list, 2)]) {
+            task_mark_incomplete(list, 2);
+        } else {
+            task_mark_complete(list, 2);
+        }
+    }
+    task_delete(list, 1);
+    int started = list->store->compactor != 0;
+    int count = list->count;
+    int gone = task_find(list, 1) < 0;
+    task_list_destroy(list);
+
+    list = load_tasks_from_file(path);
+    int failed = !started || !gone || list == NULL || list->count != count || task_find(list, 1) >= 0;
+    if (list != NULL) {
+        task_list_destroy(list);
+    }
+    test_cleanup(dir, path);
+    free(path);
+    return failed;
+}
+
+// Saving another list over a task file has to leave out the changes logged against the old one
+static int test_save_over_logged_file(void) {
+    char dir[] = "/tmp/task_test_XXXXXX";
+    char *path = test_task_file(dir);
+    TaskList *list = path != NULL ? load_tasks_from_file(path) : NULL;
+    if (list == NULL) {
+        free(path);
+        return 1;
+    }
+    task_add(list, "old", "logged", 0, LOW);
+    task_list_destroy(list);
+    list = task_list_create();
+    task_add(list, "new", "saved", 0, HIGH);
+    int failed = save_tasks_to_file(list, path) != 0;
+    task_list_destroy(list);
+
+    list = load_tasks_from_file(path);
+    failed = failed || list == NULL || list->count != 1 || strcmp(task_get(list, 0).name, "new") != 0;
+    if (list != NULL) {
+        task_list_destroy(list);
+    }
+    test_cleanup(dir, path);
+    free(path);
+    return failed;
+}
+
+// Helper function to overwrite the first id (or with names set, the first name offset) of a task file
+static int test_damage(const char *path, int names, uint32_t value) {
+    TaskFileHeader header;
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = -1;
+    if (pread(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header)) {
+        // Due dates come first, then the ids, then the names
+        off_t offset = (off_t) (sizeof(header) + header.capacity * sizeof(time_t));
+        if (names) {
+            offset += (off_t) (header.capacity * sizeof(int));
+        }
+        if (pwrite(fd, &value, sizeof(value), offset) == (ssize_t) sizeof(value)) {
+            result = 0;
+        }
+    }
+    close(fd);
+    return result;
+}
+
+// A task file whose name offset points past the string arena still loads, and the name reads as empty
+static int test_damaged_offset(void) {
+    char dir[] = "/tmp/task_test_XXXXXX";
+    char *path = test_task_file(dir);
+    if (path == NULL) {
+        return 1;
+    }
+    TaskList *list = task_list_create();
+    task_add(list, "name", "description", 0, LOW);
+    save_tasks_to_file(list, path);
+    task_list_destroy(list);
+    int failed = 1;
+    if (test_damage(path, 1, 1u << 20) == 0) {
+        list = load_tasks_from_file(path);
+        if (list != NULL) {
+            failed = strcmp(task_get(list, 0).name, "") != 0 ||
+                strcmp(task_get(list, 0).description, "description") != 0;
+            task_search(list, "na");
+            task_list_destroy(list);
+        }
+    }
+    test_cleanup(dir, path);
+    free(path);
+    return failed;
+}
+
+// A task file with an id past next_id still loads, and the next new task gets an id of its own
+static int test_damaged_id(void) {
+    char dir[] = "/tmp/task_test_XXXXXX";
+    char *path = test_task_file(dir);
+    if (path == NULL) {
+        return 1;
+    }
+    TaskList *list = task_list_create();
+    task_add(list, "first", "description", 0, LOW);
+    task_add(list, "second", "description", 0, LOW);
+    save_tasks_to_file(list, path);
+    task_list_destroy(list);
+    int failed = 1;
+    if (test_damage(path, 0, 1000) == 0) {
+        list = load_tasks_from_file(path);
+        if (list != NULL) {
+            int damaged = list->ids[0];
+            task_add(list, "third", "description", 0, LOW);
+            int added = list->ids[task_list_order_slot(list, task_list_order_length(list) - 1)];
+            failed = added == damaged || added == list->ids[1] || task_find(list, damaged) != 0;
+            task_list_destroy(list);
+        }
+    }
+    test_cleanup(dir, path);
+    free(path);
+    return failed;
+}
+
+int main(void) {
+    int failures = 0;
+    int failed = test_delete_starts_compaction();
+    printf("%s: delete that starts a compaction stays deleted\n", failed ? "FAIL" : "ok");
+    failures += failed;
+    failed = test_save_over_logged_file();
+    printf("%s: saving another list over a task file drops the old file's log\n", failed ? "FAIL" : "ok");
+    failures += failed;
+    failed = test_damaged_offset();
+    printf("%s: task file with a name offset past the strings reads it as empty\n", failed ? "FAIL" : "ok");
+    failures += failed;
+    failed = test_damaged_id();
+    printf("%s: task file with an id past next_id does not get it handed out again\n", failed ? "FAIL" : "ok");
+    failures += failed;
+    return failures;
+}
@@ -0,0 +1,290 @@
+/*
+Equivalence tests for the search and sort paths that replace a plain loop.
+Each test checks a fast path against the simplest code that gives the same answer (strstr over every
+string, a comparison sort) on generated tasks and prints one line, the exit status is the number of
+failed tests.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/task.h"
+#include "../include/task_scan.h"
+
+#define TEST_STRINGS 120000     // Strings in the scan arena, about 2.5 MB so it takes several chunks
+#define TEST_TASKS 3000
+
+static uint32_t test_state = 12345;
+
+// Helper function for the next pseudo-random number (xorshift, the same sequence on every platform)
+static uint32_t test_random(void) {
+    test_state ^= test_state << 13;
+    test_state ^= test_state >> 17;
+    test_state ^= test_state << 5;
+    return test_state;
+}
+
+// Helper function to fill text with up to max - 1 bytes from a small alphabet, so keywords match often
+static void test_text(char *text, size_t max) {
+    static const char alphabet[] = "abcAB -";
+    size_t length = test_random() % max;
+    for (size_t i = 0; i < length; i++) {
+        text[i] = alphabet[test_random() % (sizeof(alphabet) - 1)];
+    }
+    text[length] = '\0';
+}
+
+// Helper function for strstr with ASCII letters folded to lowercase in both strings
+static int test_contains(const char *text, const char *keyword, int ignore_case) {
+    if (!ignore_case) {
+        return strstr(text, keyword) != NULL;
+    }
+    char folded_text[MAX_TASK_DESC];
+    char folded_keyword[MAX_TASK_DESC];
+    size_t i;
+    for (i = 0; text[i] != '\0'; i++) {
+        folded_text[i] = text[i] >= 'A' && text[i] <= 'Z' ? (char) (text[i] + 32) : text[i];
+    }
+    folded_text[i] = '\0';
+    for (i = 0; keyword[i] != '\0'; i++) {
+        folded_keyword[i] = keyword[i] >= 'A' && keyword[i] <= 'Z' ? (char) (keyword[i] + 32) : keyword[i];
+    }
+    folded_keyword[i] = '\0';
+    return strstr(folded_text, folded_keyword) != NULL;
+}
+
+// The arena scan finds the same strings as strstr on each of them, however the arena is split
+static int test_scan_matches_strstr(void) {
+    static const char *keywords[] = { "", "a", "A", "ab", "aB", "b-", " a", "abc", "cab", "Abca", "aaaa",
+        "abcabc", "- -", "zz" };
+    TaskStrings strings;
+    if (task_strings_init(&strings, 0) != 0) {
+        return 1;
+    }
+    char text[MAX_TASK_NAME];
+    for (int i = 0; i < TEST_STRINGS; i++) {
+        test_text(text, 40);
+        if (task_strings_intern(&strings, text, strlen(text)) == TASK_STRINGS_NONE) {
+            task_strings_free(&strings);
+            return 1;
+        }
+    }
+    uint32_t *expected = (uint32_t*) malloc(sizeof(uint32_t) * (strings.size + 1));
+    int failed = expected == NULL;
+    static const int splits[] = { 0, 1, 2, 3, 7, TASK_SCAN_MAX_THREADS };
+    for (size_t k = 0; !failed && k < sizeof(keywords) / sizeof(keywords[0]); k++) {
+        for (int ignore_case = 0; !failed && ignore_case <= 1; ignore_case++) {
+            int count = 0;
+            for (size_t offset = 0; offset < strings.size; offset += strlen(strings.data + offset) + 1) {
+                if (test_contains(strings.data + offset, keywords[k], ignore_case)) {
+                    expected[count++] = (uint32_t) offset;
+                }
+            }
+            // Split 0 is the split task_scan_strings picks for this machine
+            for (size_t s = 0; !failed && s < sizeof(splits) / sizeof(splits[0]); s++) {
+                uint32_t *offsets = NULL;
+                int found = splits[s] == 0 ?
+                    task_scan_strings(&strings, keywords[k], ignore_case, &offsets) :
+                    task_scan_strings_split(&strings, keywords[k], ignore_case, splits[s], &offsets);
+                failed = found != count || (count > 0 && memcmp(offsets, expected, sizeof(uint32_t) * (size_t) count) != 0);
+                if (failed) {
+                    fprintf(stderr, "scan of \"%s\" (ignore case %d, split %d) found %d, strstr %d\n",
+                        keywords[k], ignore_case, splits[s], found, count);
+                }
+                free(offsets);
+            }
+        }
+    }
+    free(expected);
+    task_strings_free(&strings);
+    return failed;
+}
+
+// Helper function for a list of generated tasks with many equal keys, some of them deleted
+static TaskList *test_task_list(int count) {
+    TaskList *list = task_list_create();
+    if (list == NULL) {
+        return NULL;
+    }
+    char name[MAX_TASK_NAME];
+    char desc[MAX_TASK_NAME];
+    for (int i = 0; i < count; i++) {
+        test_text(name, 20);
+        test_text(desc, 30);
+        // Dates on both sides of the epoch, so the sign of the key matters
+        time_t due_date = (time_t) ((int) (test_random() % 11) - 5) * 86400;
+        Priority priority = (Priority) (LOW + (int) (test_random() % 3));
+        if (task_insert(list, list->next_id, name, desc, due_date, priority) < 0) {
+            task_list_destroy(list);
+            return NULL;
+        }
+    }
+    for (int i = 0; i < count / 5; i++) {
+        int slot = (int) (test_random() % (uint32_t) list->slots);
+        if (list->ids[slot] != 0) {
+            task_remove(list, slot);
+        }
+    }
+    return list;
+}
+
+// Helper function for the sort key the way a comparison sort sees it (smaller first)
+static long long test_key(const TaskList *list, int slot, TaskSortKey key) {
+    return key == SORT_BY_PRIORITY ? (long long) (HIGH - list->priorities[slot]) : (long long) list->due_dates[slot];
+}
+
+// Reference sort: insertion sort by key, stable, then by id when by_id is set
+static void test_sort_slots(const TaskList *list, int *slots, int count, TaskSortKey key, int by_id) {
+    for (int i = 1; i < count; i++) {
+        int slot = slots[i];
+        int j = i;
+        while (j > 0 && (test_key(list, slots[j - 1], key) > test_key(list, slot, key) ||
+                (by_id && test_key(list, slots[j - 1], key) == test_key(list, slot, key) &&
+                list->ids[slots[j - 1]] > list->ids[slot]))) {
+            slots[j] = slots[j - 1];
+            j--;
+        }
+        slots[j] = slot;
+    }
+}
+
+// Helper function for the slots of the list in display order, holes left out (returns the count)
+static int test_display_order(const TaskList *list, int *slots) {
+    int count = 0;
+    int length = task_list_order_length(list);
+    for (int p = 0; p < length; p++) {
+        int slot = task_list_order_slot(list, p);
+        if (slot >= 0) {
+            slots[count++] = slot;
+        }
+    }
+    return count;
+}
+
+// Sorting the display order gives what a stable comparison sort of it gives
+static int test_sort_matches_stable_sort(void) {
+    TaskList *list = test_task_list(TEST_TASKS);
+    if (list == NULL) {
+        return 1;
+    }
+    int *expected = (int*) malloc(sizeof(int) * TEST_TASKS);
+    int *order = (int*) malloc(sizeof(int) * TEST_TASKS);
+    int failed = expected == NULL || order == NULL;
+    // Each sort starts from the order the one before it left, ties keep that order
+    static const TaskSortKey keys[] = { SORT_BY_DATE, SORT_BY_PRIORITY, SORT_BY_DATE };
+    for (size_t k = 0; !failed && k < sizeof(keys) / sizeof(keys[0]); k++) {
+        int count = test_display_order(list, expected);
+        test_sort_slots(list, expected, count, keys[k], 0);
+        failed = task_sort(list, keys[k]) != 0 || test_display_order(list, order) != count ||
+            memcmp(order, expected, sizeof(int) * (size_t) count) != 0;
+    }
+    free(expected);
+    free(order);
+    task_list_destroy(list);
+    return failed;
+}
+
+// Helper function to compare a view with a comparison sort of the tasks by key and then by id
+static int test_view_check(TaskList *list, TaskSortKey key, int *expected) {
+    const TaskViewEntry *entries;
+    int count = test_display_order(list, expected);
+    test_sort_slots(list, expected, count, key, 1);
+    if (task_list_view(list, key, &entries) != count) {
+        return 1;
+    }
+    for (int i = 0; i < count; i++) {
+        if (entries[i].slot != expected[i] || entries[i].id != list->ids[expected[i]]) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// The sorted views stay equal to a full sort while tasks are added and deleted between calls
+static int test_views_match_full_sort(void) {
+    TaskList *list = test_task_list(TEST_TASKS);
+    if (list == NULL) {
+        return 1;
+    }
+    int *expected = (int*) malloc(sizeof(int) * TEST_TASKS * 2);
+    int failed = expected == NULL;
+    char name[MAX_TASK_NAME];
+    for (int round = 0; !failed && round < 6; round++) {
+        failed = test_view_check(list, SORT_BY_PRIORITY, expected) || test_view_check(list, SORT_BY_DATE, expected);
+        for (int i = 0; !failed && i < 200; i++) {
+            test_text(name, 20);
+            time_t due_date = (time_t) ((int) (test_random() % 11) - 5) * 86400;
+            failed = task_insert(list, list->next_id, name, "added", due_date,
+                (Priority) (LOW + (int) (test_random() % 3))) < 0;
+        }
+        // Enough deletes in some rounds that the list compacts and the views start over
+        for (int i = 0; !failed && i < 150 * round; i++) {
+            int slot = (int) (test_random() % (uint32_t) list->slots);
+            if (list->ids[slot] != 0) {
+                failed = task_remove(list, slot) != 0;
+            }
+        }
+    }
+    free(expected);
+    task_list_destroy(list);
+    return failed;
+}
+
+// The trigram index leaves out no task that strstr finds, so checking its candidates finds them all
+static int test_trigrams_match_strstr(void) {
+    static char names[TEST_TASKS][MAX_TASK_NAME];
+    static char descs[TEST_TASKS][MAX_TASK_NAME];
+    static const char *keywords[] = { "abc", "aaa", "cab", "b-a", "- -", "AB ", "abcab", "cccc", "zzz" };
+    TaskTrigramIndex index;
+    memset(&index, 0, sizeof(TaskTrigramIndex));
+    int failed = 0;
+    // Ids start at 1 like the list's
+    for (int i = 0; !failed && i < TEST_TASKS; i++) {
+        test_text(names[i], 20);
+        test_text(descs[i], 40);
+        failed = task_trigrams_add(&index, i + 1, names[i], descs[i]) != 0;
+    }
+    for (size_t k = 0; !failed && k < sizeof(keywords) / sizeof(keywords[0]); k++) {
+        int *ids = NULL;
+        int candidates = task_trigrams_query(&index, keywords[k], &ids);
+        if (candidates < 0) {
+            failed = 1;
+            break;
+        }
+        // Walk the candidates and every task side by side, both are in id order
+        int c = 0;
+        for (int i = 0; !failed && i < TEST_TASKS; i++) {
+            int id = i + 1;
+            int contains = strstr(names[i], keywords[k]) != NULL || strstr(descs[i], keywords[k]) != NULL;
+            int candidate = c < candidates && ids[c] == id;
+            if (candidate) {
+                c++;
+            }
+            failed = contains && !candidate;
+        }
+        failed = failed || c != candidates;
+        if (failed) {
+            fprintf(stderr, "trigram search for \"%s\" does not match strstr\n", keywords[k]);
+        }
+        free(ids);
+    }
+    task_trigrams_free(&index);
+    return failed;
+}
+
+int main(void) {
+    int failures = 0;
+    int failed = test_scan_matches_strstr();
+    printf("%s: arena scan finds what strstr finds, case-sensitive and ignoring case\n", failed ? "FAIL" : "ok");
+    failures += failed;
+    failed = test_sort_matches_stable_sort();
+    printf("%s: radix sort of the display order matches a stable sort\n", failed ? "FAIL" : "ok");
+    failures += failed;
+    failed = test_views_match_full_sort();
+    printf("%s: sorted views stay equal to a full sort across adds and deletes\n", failed ? "FAIL" : "ok");
+    failures += failed;
+    failed = test_trigrams_match_strstr();
+    printf("%s: trigram candidates hold every task strstr finds\n", failed ? "FAIL" : "ok");
+    failures += failed;
+    return failures;
+}
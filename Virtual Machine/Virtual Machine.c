@@ -14,10 +14,24 @@ The instruction set includes:
 - PUSH: Push a value onto the stack
 - POP: Pop a value from the stack
 - PRINT: Print the value of a register
+- CALL: Call a subroutine (the return address goes on a separate call stack)
+- RET: Return from a subroutine
+- PUSHM: Push a set of registers onto the stack in one go
+- POPM: Pop a set of registers pushed by PUSHM
+- LDB / STB: Load or store one byte of data memory, addressed by a register
+- VADD / VSUB / VMUL: Add, subtract or multiply a range of data memory by another range
+- MSET / MCPY: Fill or copy a range of data memory
+- VSUM / VCMP: Sum a range into a register, or compare two ranges
+- CALLN: Call a host C function registered with vm_register_native
 
 The virtual machine uses a simple memory model with a fixed-size memory array and a set of registers.
+The register width (vm_word) and memory size are chosen when the VM is compiled, see Virtual_Machine.h.
+Code memory is shared and read-only, each VM has its own data memory for the load/store and bulk
+instructions (the bulk ones run on the SIMD kernels in vm_vector.c).
 
-To compile: gcc -o Virtual_Machine.exe "Virtual Machine.c"
+The example program and main() live in main.c, and the other execution engines in the vm_*.c files.
+
+To compile: make
 To run: .\Virtual_Machine.exe
 To run with stdout and stderr: .\Virtual_Machine.exe 2>&1
 
@@ -30,277 +44,703 @@ Author: Zane Francis
 #include <stdint.h>
 #include "Virtual_Machine.h"
 
-// Initialize the virtual machine (zero out memory and registers)
+// Initialize the virtual machine (zero out registers and stack, no program loaded)
 void vm_init(VirtualMachine *vm) {
-    memset(vm->memory, 0, MEMORY_SIZE);
-    memset(vm->registers, 0, NUM_REGISTERS);
-    memset(vm->stack, 0, MEMORY_SIZE);
+    memset(vm->registers, 0, sizeof(vm->registers));
+    memset(vm->stack, 0, sizeof(vm->stack));
     vm->pc = 0;
     vm->sp = MEMORY_SIZE - 1;
+    vm->stack_low = vm->sp;
+    vm->call_depth = 0;
+    memset(vm->data, 0, VM_DATA_SIZE);
+    memset(vm->data_written, 0, sizeof(vm->data_written));
     vm->running = 0;
+    vm->halted = 0;
+    vm->fusion = 1;
+    vm->sink = NULL;
+#ifdef VM_PROFILE
+    vm->profile = NULL;
+#endif
+    memset(vm->natives, 0, sizeof(vm->natives));
+    // Every VM starts on the shared all-zero image, so nothing needs decoding here
+    vm->image = &vm_empty_image;
+    vm->memory = vm_empty_image.memory;
 }
 
-// Function to load the program into the virtual machine
-void vm_load_program(VirtualMachine *vm, uint8_t *program, size_t size) {
+// Function to load the program into the virtual machine (returns 0 on success, -1 if rejected)
+int vm_load_program(VirtualMachine *vm, uint8_t *program, size_t size) {
     
     // Safety check so program doesn't exceed memory size
     if (size > MEMORY_SIZE) {
         fprintf(stderr, "Error, Program size (%zu bytes) exceeds the memory siz (%d bytes)\n", 
             size, MEMORY_SIZE);
+        return -1;
+    }
+    // Build a private code image (decoded and verified once), use vm_attach_image to share one instead
+    VmImage *image = vm_image_create(program, size, vm->fusion);
+    if (image == NULL) {
+        vm->running = 0;
+        return -1;
+    }
+    // Attaching sets the running flag, then drop our own reference so the VM holds the only one
+    vm_attach_image(vm, image);
+    vm_image_release(image);
+    return 0;
+}
+
+// Send a PRINT value to the attached output sink (stderr if none)
+void vm_print_value(VirtualMachine *vm, vm_word value) {
+    if (vm->sink != NULL) {
+        vm_sink_write(vm->sink, value);
         return;
     }
-    // Copy bytes to memory (can use memcpy, but wanted to hard code it)
-    for (int i = 0; i < size; i++){
-        vm->memory[i] = program[i];
+    fprintf(stderr, "Register value: %" PRIu64 "\n", (uint64_t) value);
+}
+
+// Make host function fn reachable as OP_CALLN index (NULL clears the slot), returns 0 or -1 for a bad index
+int vm_register_native(VirtualMachine *vm, uint8_t index, VmNativeFn fn, void *ctx) {
+    if (index >= VM_MAX_NATIVES) {
+        fprintf(stderr, "Error, native function index %d is out of range (max %d)\n", index, VM_MAX_NATIVES - 1);
+        return -1;
     }
-    // set running flag
-    vm->running = 1;
+    vm->natives[index].fn = fn;
+    vm->natives[index].ctx = ctx;
+    return 0;
 }
 
-// Execution function for the virtual machine
-void vm_execute(VirtualMachine *vm) {
-    while (vm->running) {
-        // Fetch Opcode
-        uint8_t opcode = vm->memory[vm->pc++];
+/*
+Run OP_CALLN on the VM's own registers and data memory (shared by every engine, which store pc and sp
+first). Returns 0, or -1 after reporting the error and stopping the VM.
+*/
+int vm_call_native(VirtualMachine *vm, uint8_t index) {
+    if (index >= VM_MAX_NATIVES || vm->natives[index].fn == NULL) {
+        fprintf(stderr, "Error, no native function registered at index %d\n", index);
+        vm->running = 0;
+        return -1;
+    }
+    // The host function can write anywhere in data memory, so every page counts as written
+    memset(vm->data_written, 1, sizeof(vm->data_written));
+    if (vm->natives[index].fn(vm, vm->registers, vm->data, vm->natives[index].ctx) != 0) {
+        fprintf(stderr, "Error, native function %d failed\n", index);
+        vm->running = 0;
+        return -1;
+    }
+    return 0;
+}
 
-        switch (opcode) {
-            // Case for ending the virtual machine
-            case OP_HALT:
+// Execute a single instruction at pc (shared by vm_execute and vm_step)
+static inline void vm_dispatch(VirtualMachine *vm) {
+    // Fetch Opcode
+    uint8_t opcode = vm->memory[vm->pc++];
+
+    switch (opcode) {
+        // Case for ending the virtual machine
+        case OP_HALT:
+            vm->running = 0;
+            vm->halted = 1;
+            break;
+
+        //Case for loading the registers and values
+        case OP_LOAD: {
+            // Fetch register number and value
+            uint8_t reg = vm->memory[vm->pc++];
+            uint8_t value = vm->memory[vm->pc++];
+            // Saftey check for operand
+            if (reg >= NUM_REGISTERS) {
+                fprintf(stderr, "Error, Invalid register %d\n", reg);
                 vm->running = 0;
                 break;
+            }
+            // Add register value to register
+            vm->registers[reg] = value;
+            break;
+        }
 
-            //Case for loading the registers and values
-            case OP_LOAD: {
-                // Fetch register number and value
-                uint8_t reg = vm->memory[vm->pc++];
-                uint8_t value = vm->memory[vm->pc++];
-                // Saftey check for operand
-                if (reg >= NUM_REGISTERS) {
-                    fprintf(stderr, "Error, Invalid register %d\n", reg);
-                    vm->running = 0;
-                    break;
-                }
-                // Add register value to register
-                vm->registers[reg] = value;
+        // Case for printing
+        case OP_PRINT: {
+            // Fetch register number
+            uint8_t reg = vm->memory[vm->pc++];
+            // Saftey check for operand
+            if (reg >= NUM_REGISTERS) {
+                fprintf(stderr, "Error, Invalid register %d\n", reg);
+                vm->running = 0;
                 break;
             }
+            // Print value in register
+            vm_print_value(vm, vm->registers[reg]);
+            break;
+        }
 
-            // Case for printing
-            case OP_PRINT: {
-                // Fetch register number
-                uint8_t reg = vm->memory[vm->pc++];
-                // Saftey check for operand
-                if (reg >= NUM_REGISTERS) {
-                    fprintf(stderr, "Error, Invalid register %d\n", reg);
-                    vm->running = 0;
-                    break;
-                }
-                // Print value in register
-                fprintf(stderr, "Register value: %d\n", vm->registers[reg]);                
+        // Case for addition
+        case OP_ADD: {
+            // Fetch registers
+            uint8_t fir_reg = vm->memory[vm->pc++];
+            uint8_t sec_reg = vm->memory[vm->pc++];
+            uint8_t des_reg = vm->memory[vm->pc++];
+            // Saftey check for operands
+            if (fir_reg >= NUM_REGISTERS || sec_reg >= NUM_REGISTERS || des_reg >= NUM_REGISTERS) {
+                fprintf(stderr, "Error, Invalid register %d or %d or %d\n",
+                    fir_reg, sec_reg, des_reg);
+                vm->running = 0;
                 break;
             }
+            // Add first and second reg and store in destintaion reg 
+            vm->registers[des_reg] = vm->registers[fir_reg] + vm->registers[sec_reg];
+            break;
+        }
 
-            // Case for addition
-            case OP_ADD: {
-                // Fetch registers
-                uint8_t fir_reg = vm->memory[vm->pc++];
-                uint8_t sec_reg = vm->memory[vm->pc++];
-                uint8_t des_reg = vm->memory[vm->pc++];
-                // Saftey check for operands
-                if (fir_reg >= NUM_REGISTERS || sec_reg >= NUM_REGISTERS || des_reg >= NUM_REGISTERS) {
-                    fprintf(stderr, "Error, Invalid register %d or %d or %d\n",
-                        fir_reg, sec_reg, des_reg);
-                    vm->running = 0;
-                    break;
-                }
-                // Add first and second reg and store in destintaion reg 
-                vm->registers[des_reg] = vm->registers[fir_reg] + vm->registers[sec_reg];
+        // Case for subtraction
+        case OP_SUB: {
+            // Fetch registers
+            uint8_t fir_reg = vm->memory[vm->pc++];
+            uint8_t sec_reg = vm->memory[vm->pc++];
+            uint8_t des_reg = vm->memory[vm->pc++];
+            // Safety check for operands
+            if (fir_reg >= NUM_REGISTERS || sec_reg >= NUM_REGISTERS || des_reg >= NUM_REGISTERS) {
+                fprintf(stderr, "Error, Invalid register %d or %d or %d\n", 
+                    fir_reg, sec_reg, des_reg);
+                vm->running = 0;
+                break;
+            }
+            // Substract second from first reg and store in destination reg
+            vm->registers[des_reg] = vm->registers[fir_reg] - vm->registers[sec_reg];
+            break;
+        }
+
+        // Case for multiplication
+        case OP_MUL: {
+            // Fetch registers
+            uint8_t fir_reg = vm->memory[vm->pc++];
+            uint8_t sec_reg = vm->memory[vm->pc++];
+            uint8_t des_reg = vm->memory[vm->pc++];
+            // Safety check for operands
+            if (fir_reg >= NUM_REGISTERS || sec_reg >= NUM_REGISTERS || des_reg >= NUM_REGISTERS) {
+                fprintf(stderr, "Error, invalid register %d or %d or %d\n", 
+                    fir_reg, sec_reg, des_reg);
+                vm->running = 0;
+                break;
+            }
+            // Multiply first and second reg and store in destination reg
+            vm->registers[des_reg] = vm_word_mul(vm->registers[fir_reg], vm->registers[sec_reg]);
+            break;
+        }
+        
+        // Case for division
+        case OP_DIV: {
+            // Fetch registers
+            uint8_t fir_reg = vm->memory[vm->pc++];
+            uint8_t sec_reg = vm->memory[vm->pc++];
+            uint8_t des_reg = vm->memory[vm->pc++];
+            // Safety check for operand
+            if (fir_reg >= NUM_REGISTERS || sec_reg >= NUM_REGISTERS || des_reg >= NUM_REGISTERS) {
+                fprintf(stderr, "Error, Invalid register %d or %d or %d\n", 
+                    fir_reg, sec_reg, des_reg);
+                vm->running = 0;
                 break;
             }
+            if (vm->registers[sec_reg] == 0) {
+                fprintf(stderr, "Error, can not divide when register %d is 0.\n", sec_reg);
+                vm->running = 0;
+                break;
+            }
+            // Divide the second reg from the first and store in destination reg
+            vm->registers[des_reg] = vm->registers[fir_reg] / vm->registers[sec_reg];
+            break;
+        }
 
-            // Case for subtraction
-            case OP_SUB: {
-                // Fetch registers
-                uint8_t fir_reg = vm->memory[vm->pc++];
-                uint8_t sec_reg = vm->memory[vm->pc++];
-                uint8_t des_reg = vm->memory[vm->pc++];
-                // Safety check for operands
-                if (fir_reg >= NUM_REGISTERS || sec_reg >= NUM_REGISTERS || des_reg >= NUM_REGISTERS) {
-                    fprintf(stderr, "Error, Invalid register %d or %d or %d\n", 
-                        fir_reg, sec_reg, des_reg);
+        // Case for jumping to register
+        case OP_JMP: {
+            // Fetch two-byte address for larger programs
+            uint8_t high_byte = vm->memory[vm->pc++];
+            uint8_t low_byte = vm->memory[vm->pc++];
+            uint16_t address = (high_byte << 8) | low_byte;
+            // Safety check address is in bounds
+            if (address >= MEMORY_SIZE) {
+                fprintf(stderr, "Error invalid address %d\n", address);
+                vm->running = 0;
+                break;
+            }
+            // Jump to register
+            vm->pc = address;
+            break;
+        }
+
+        // Case for jumping to zero
+        case OP_JZ: {
+            // Fetch two-byte address
+            uint8_t reg_index = vm->memory[vm->pc++];
+            uint8_t high_byte = vm->memory[vm->pc++];
+            uint8_t low_byte = vm->memory[vm->pc++];
+            uint16_t address = (high_byte << 8) | low_byte;
+            // Safety check index
+            if (reg_index >= NUM_REGISTERS) {
+                fprintf(stderr, "Error invalid address %d\n", address);
+                vm->running = 0;
+                break;
+            }
+            // Safety check for address
+            if (address >= MEMORY_SIZE) {
+                fprintf(stderr, "Error, invalid address %d\n", address);
+                vm->running = 0;
+                break;
+            }
+            // Condition to jump
+            if (vm->registers[reg_index] == 0) {
+                vm->pc = address;
+                break;
+            }
+            break;
+        }
+
+        // Case for pushing a into a stack
+        case OP_PUSH: {
+            // Fetch regiser operand
+            uint8_t reg_op = vm->memory[vm->pc++];
+            // Safety check for operand
+            if (reg_op >= NUM_REGISTERS) {
+                fprintf(stderr, "Error, invalid regiser %d\n", reg_op);
+                vm->running = 0;
+                break;
+            }
+            // Check for stack underflow
+            if (vm->sp <= 0) {
+                fprintf(stderr, "Error, stack underflow\n");
+                vm->running = 0;
+                break;
+            }
+            // Perform stack push and decrement stack pointer
+            vm->stack[vm->sp] = vm->registers[reg_op];
+            vm->sp--;
+            break;
+        }
+
+        // Case for popping out of a stack
+        case OP_POP: {
+            // Fetch register operand
+            uint8_t reg_op = vm->memory[vm->pc++];
+            // Safety check for operand
+            if (reg_op >= NUM_REGISTERS) {
+                fprintf(stderr, "Error, invalid register %d\n", reg_op);
+                vm->running = 0;
+                break;
+            }
+            // Check for stack overflow
+            if (vm->sp >= MEMORY_SIZE - 1) {
+                fprintf(stderr, "Error, stack overflow\n");
+                vm->running = 0;
+                break;
+            }
+            // Remember how deep the stack got before it shrinks (see vm_restore)
+            if (vm->sp < vm->stack_low) {
+                vm->stack_low = vm->sp;
+            }
+            // Increment stack pointer and perform stack pop
+            vm->sp++;
+            vm->registers[reg_op] = vm->stack[vm->sp];
+            break;
+        }
+
+        // Case for calling a subroutine
+        case OP_CALL: {
+            // Fetch two-byte address
+            uint8_t high_byte = vm->memory[vm->pc++];
+            uint8_t low_byte = vm->memory[vm->pc++];
+            uint16_t address = (high_byte << 8) | low_byte;
+            // Safety check address is in bounds
+            if (address >= MEMORY_SIZE) {
+                fprintf(stderr, "Error, invalid address %d\n", address);
+                vm->running = 0;
+                break;
+            }
+            // Check for call stack overflow
+            if (vm->call_depth >= VM_CALL_DEPTH) {
+                fprintf(stderr, "Error, call stack overflow\n");
+                vm->running = 0;
+                break;
+            }
+            // Save the address of the next instruction and jump
+            vm->call_stack[vm->call_depth++] = vm->pc;
+            vm->pc = address;
+            break;
+        }
+
+        // Case for returning from a subroutine
+        case OP_RET:
+            // Check for a return without a call
+            if (vm->call_depth == 0) {
+                fprintf(stderr, "Error, return with an empty call stack\n");
+                vm->running = 0;
+                break;
+            }
+            vm->pc = vm->call_stack[--vm->call_depth];
+            break;
+
+        // Case for pushing a set of registers
+        case OP_PUSHM: {
+            // Fetch register mask
+            uint8_t mask = vm->memory[vm->pc++];
+            // Safety check for operand
+            if (mask >> NUM_REGISTERS) {
+                fprintf(stderr, "Error, invalid register mask %d\n", mask);
+                vm->running = 0;
+                break;
+            }
+            // Check there is room for every register
+            if (vm->sp < vm_mask_count(mask)) {
+                fprintf(stderr, "Error, stack underflow\n");
+                vm->running = 0;
+                break;
+            }
+            vm->sp = vm_push_mask(vm->stack, vm->sp, vm->registers, mask);
+            break;
+        }
+
+        // Case for popping a set of registers
+        case OP_POPM: {
+            // Fetch register mask
+            uint8_t mask = vm->memory[vm->pc++];
+            // Safety check for operand
+            if (mask >> NUM_REGISTERS) {
+                fprintf(stderr, "Error, invalid register mask %d\n", mask);
+                vm->running = 0;
+                break;
+            }
+            // Check the stack holds every register
+            if (vm->sp + vm_mask_count(mask) > MEMORY_SIZE - 1) {
+                fprintf(stderr, "Error, stack overflow\n");
+                vm->running = 0;
+                break;
+            }
+            if (vm->sp < vm->stack_low) {
+                vm->stack_low = vm->sp;
+            }
+            vm->sp = vm_pop_mask(vm->stack, vm->sp, vm->registers, mask);
+            break;
+        }
+
+        // Case for loading a byte of data memory
+        case OP_LDB: {
+            // Fetch registers
+            uint8_t des_reg = vm->memory[vm->pc++];
+            uint8_t adr_reg = vm->memory[vm->pc++];
+            // Safety check for operands
+            if (des_reg >= NUM_REGISTERS || adr_reg >= NUM_REGISTERS) {
+                fprintf(stderr, "Error, invalid register %d or %d\n", des_reg, adr_reg);
+                vm->running = 0;
+                break;
+            }
+            if (!vm_data_address(vm->registers[adr_reg])) {
+                fprintf(stderr, "Error, invalid data address %" PRIu64 "\n", (uint64_t) vm->registers[adr_reg]);
+                vm->running = 0;
+                break;
+            }
+            vm->registers[des_reg] = vm->data[vm->registers[adr_reg]];
+            break;
+        }
+
+        // Case for storing a byte of data memory
+        case OP_STB: {
+            // Fetch registers
+            uint8_t adr_reg = vm->memory[vm->pc++];
+            uint8_t src_reg = vm->memory[vm->pc++];
+            // Safety check for operands
+            if (adr_reg >= NUM_REGISTERS || src_reg >= NUM_REGISTERS) {
+                fprintf(stderr, "Error, invalid register %d or %d\n", adr_reg, src_reg);
+                vm->running = 0;
+                break;
+            }
+            if (!vm_data_address(vm->registers[adr_reg])) {
+                fprintf(stderr, "Error, invalid data address %" PRIu64 "\n", (uint64_t) vm->registers[adr_reg]);
+                vm->running = 0;
+                break;
+            }
+            vm->data[vm->registers[adr_reg]] = (uint8_t) vm->registers[src_reg];
+            vm_data_mark(vm, vm->registers[adr_reg]);
+            break;
+        }
+
+        // Case for the bulk operations over ranges of data memory
+        case OP_VADD:
+        case OP_VSUB:
+        case OP_VMUL:
+        case OP_MSET:
+        case OP_MCPY:
+        case OP_VSUM:
+        case OP_VCMP: {
+            // Fetch registers
+            const uint8_t *operand = &vm->memory[vm->pc];
+            int count = vm_instruction_length(opcode) - 1;
+            vm->pc += count;
+            // Safety check for operands
+            for (int i = 0; i < count; i++) {
+                if (operand[i] >= NUM_REGISTERS) {
+                    fprintf(stderr, "Error, invalid register %d\n", operand[i]);
                     vm->running = 0;
                     break;
                 }
-                // Substract second from first reg and store in destination reg
-                vm->registers[des_reg] = vm->registers[fir_reg] - vm->registers[sec_reg];
+            }
+            if (!vm->running) {
+                break;
+            }
+            VmBulkOperands reg = vm_bulk_operands(opcode, operand);
+            vm_word length = vm->registers[reg.length];
+            int result = vm_data_bulk(vm, opcode, vm->registers[reg.x], vm->registers[reg.y], length);
+            // Ranges depend on runtime values so they are always checked
+            if (result < 0) {
+                fprintf(stderr, "Error, data range of %" PRIu64 " bytes is out of bounds\n", (uint64_t) length);
+                vm->running = 0;
                 break;
             }
+            if (reg.result < NUM_REGISTERS) {
+                vm->registers[reg.result] = (vm_word) result;
+            }
+            break;
+        }
 
-            // Case for multiplication
-            case OP_MUL: {
-                // Fetch registers
-                uint8_t fir_reg = vm->memory[vm->pc++];
-                uint8_t sec_reg = vm->memory[vm->pc++];
-                uint8_t des_reg = vm->memory[vm->pc++];
-                // Safety check for operands
-                if (fir_reg >= NUM_REGISTERS || sec_reg >= NUM_REGISTERS || des_reg >= NUM_REGISTERS) {
-                    fprintf(stderr, "Error, invalid register %d or %d or %d\n", 
-                        fir_reg, sec_reg, des_reg);
-                    vm->running = 0;
+        // Case for calling a host function
+        case OP_CALLN: {
+            // Fetch the function index, the call sees pc past the instruction
+            uint8_t index = vm->memory[vm->pc++];
+            vm_call_native(vm, index);
+            break;
+        }
+
+        // Default case
+        default:
+            fprintf(stderr, "Error, invalid opcode %d\n", opcode);
+            vm->running = 0;
+            break;
+    }
+}
+
+// Execution loop for verified programs (operands and jump targets were checked at load time)
+static void vm_execute_verified(VirtualMachine *vm, const int check_stack) {
+    const uint8_t *mem = vm->memory;
+    vm_word *regs = vm->registers;
+
+    while (vm->running) {
+        VM_PROFILE_START(vm);
+        uint8_t opcode = mem[vm->pc];
+        const uint8_t *operand = &mem[vm->pc + 1];
+
+        switch (opcode) {
+            case OP_HALT:
+                vm->pc++;
+                vm->running = 0;
+                vm->halted = 1;
+                break;
+            case OP_LOAD:
+                regs[operand[0]] = operand[1];
+                vm->pc += 3;
+                break;
+            case OP_PRINT:
+                vm_print_value(vm, regs[operand[0]]);
+                vm->pc += 2;
+                break;
+            case OP_ADD:
+                regs[operand[2]] = regs[operand[0]] + regs[operand[1]];
+                vm->pc += 4;
+                break;
+            case OP_SUB:
+                regs[operand[2]] = regs[operand[0]] - regs[operand[1]];
+                vm->pc += 4;
+                break;
+            case OP_MUL:
+                regs[operand[2]] = vm_word_mul(regs[operand[0]], regs[operand[1]]);
+                vm->pc += 4;
+                break;
+            case OP_DIV:
+                // Division by zero depends on runtime values so it is always checked
+                if (regs[operand[1]] == 0) {
+                    vm_dispatch(vm);
                     break;
                 }
-                // Multiply first and second reg and store in destination reg
-                vm->registers[des_reg] = vm->registers[fir_reg] * vm->registers[sec_reg];
-                break;
-            }
-            
-            // Case for division
-            case OP_DIV: {
-                // Fetch registers
-                uint8_t fir_reg = vm->memory[vm->pc++];
-                uint8_t sec_reg = vm->memory[vm->pc++];
-                uint8_t des_reg = vm->memory[vm->pc++];
-                // Safety check for operand
-                if (fir_reg >= NUM_REGISTERS || sec_reg >= NUM_REGISTERS || des_reg >= NUM_REGISTERS) {
-                    fprintf(stderr, "Error, Invalid register %d or %d or %d\n", 
-                        fir_reg, sec_reg, des_reg);
-                    vm->running = 0;
-                    break;
+                regs[operand[2]] = regs[operand[0]] / regs[operand[1]];
+                vm->pc += 4;
+                break;
+            case OP_JMP:
+                vm->pc = (uint16_t) ((operand[0] << 8) | operand[1]);
+                break;
+            case OP_JZ:
+                if (regs[operand[0]] == 0) {
+                    vm->pc = (uint16_t) ((operand[1] << 8) | operand[2]);
+                } else {
+                    vm->pc += 4;
                 }
-                if (vm->registers[sec_reg] == 0) {
-                    fprintf(stderr, "Error, can not divide when register %d is 0.\n", sec_reg);
-                    vm->running = 0;
+                break;
+            case OP_PUSH:
+                if (check_stack && vm->sp <= 0) {
+                    vm_dispatch(vm);
                     break;
                 }
-                // Divide the second reg from the first and store in destination reg
-                vm->registers[des_reg] = vm->registers[fir_reg] / vm->registers[sec_reg];
+                vm->stack[vm->sp] = regs[operand[0]];
+                vm->sp--;
+                vm->pc += 2;
                 break;
-            }
-
-            // Case for jumping to register
-            case OP_JMP: {
-                // Fetch two-byte address for larger programs
-                uint8_t high_byte = vm->memory[vm->pc++];
-                uint8_t low_byte = vm->memory[vm->pc++];
-                uint16_t address = (high_byte << 8) | low_byte;
-                // Safety check address is in bounds
-                if (address >= MEMORY_SIZE) {
-                    fprintf(stderr, "Error invalid address %d\n", address);
-                    vm->running = 0;
+            case OP_POP:
+                if (check_stack && vm->sp >= MEMORY_SIZE - 1) {
+                    vm_dispatch(vm);
                     break;
                 }
-                // Jump to register
-                vm->pc = address;
+                if (vm->sp < vm->stack_low) {
+                    vm->stack_low = vm->sp;
+                }
+                vm->sp++;
+                regs[operand[0]] = vm->stack[vm->sp];
+                vm->pc += 2;
                 break;
-            }
-
-            // Case for jumping to zero
-            case OP_JZ: {
-                // Fetch two-byte address
-                uint8_t reg_index = vm->memory[vm->pc++];
-                uint8_t high_byte = vm->memory[vm->pc++];
-                uint8_t low_byte = vm->memory[vm->pc++];
-                uint16_t address = (high_byte << 8) | low_byte;
-                // Safety check index
-                if (reg_index >= NUM_REGISTERS) {
-                    fprintf(stderr, "Error invalid address %d\n", address);
-                    vm->running = 0;
+            case OP_CALL:
+                // The call stack has no static bound (recursion), so it is always checked
+                if (vm->call_depth >= VM_CALL_DEPTH) {
+                    vm_dispatch(vm);
                     break;
                 }
-                // Safety check for address
-                if (address >= MEMORY_SIZE) {
-                    fprintf(stderr, "Error, invalid address %d\n", address);
-                    vm->running = 0;
+                vm->call_stack[vm->call_depth++] = (uint16_t) (vm->pc + 3);
+                vm->pc = (uint16_t) ((operand[0] << 8) | operand[1]);
+                break;
+            case OP_RET:
+                if (vm->call_depth == 0) {
+                    vm_dispatch(vm);
                     break;
                 }
-                // Condition to jump
-                if (vm->registers[reg_index] == 0) {
-                    vm->pc = address;
+                vm->pc = vm->call_stack[--vm->call_depth];
+                break;
+            case OP_PUSHM:
+                if (check_stack && vm->sp < vm_mask_count(operand[0])) {
+                    vm_dispatch(vm);
                     break;
                 }
+                vm->sp = vm_push_mask(vm->stack, vm->sp, regs, operand[0]);
+                vm->pc += 2;
                 break;
-            }
-
-            // Case for pushing a into a stack
-            case OP_PUSH: {
-                // Fetch regiser operand
-                uint8_t reg_op = vm->memory[vm->pc++];
-                // Safety check for operand
-                if (reg_op >= NUM_REGISTERS) {
-                    fprintf(stderr, "Error, invalid regiser %d\n", reg_op);
-                    vm->running = 0;
+            case OP_POPM:
+                if (check_stack && vm->sp + vm_mask_count(operand[0]) > MEMORY_SIZE - 1) {
+                    vm_dispatch(vm);
                     break;
                 }
-                // Check for stack underflow
-                if (vm->sp <= 0) {
-                    fprintf(stderr, "Error, stack underflow\n");
-                    vm->running = 0;
+                if (vm->sp < vm->stack_low) {
+                    vm->stack_low = vm->sp;
+                }
+                vm->sp = vm_pop_mask(vm->stack, vm->sp, regs, operand[0]);
+                vm->pc += 2;
+                break;
+            case OP_LDB:
+                // Compiles away when every register value is a data address
+                if (!vm_data_address(regs[operand[1]])) {
+                    vm_dispatch(vm);
                     break;
                 }
-                // Perform stack push and decrement stack pointer
-                vm->stack[vm->sp] = vm->registers[reg_op];
-                vm->sp--;
+                regs[operand[0]] = vm->data[regs[operand[1]]];
+                vm->pc += 3;
                 break;
-            }
-
-            // Case for popping out of a stack
-            case OP_POP: {
-                // Fetch register operand
-                uint8_t reg_op = vm->memory[vm->pc++];
-                // Safety check for operand
-                if (reg_op >= NUM_REGISTERS) {
-                    fprintf(stderr, "Error, invalid register %d\n", reg_op);
-                    vm->running = 0;
+            case OP_STB:
+                if (!vm_data_address(regs[operand[0]])) {
+                    vm_dispatch(vm);
                     break;
                 }
-                // Check for stack overflow
-                if (vm->sp >= MEMORY_SIZE - 1) {
-                    fprintf(stderr, "Error, stack overflow\n");
-                    vm->running = 0;
+                vm->data[regs[operand[0]]] = (uint8_t) regs[operand[1]];
+                vm_data_mark(vm, regs[operand[0]]);
+                vm->pc += 3;
+                break;
+            case OP_VADD:
+            case OP_VSUB:
+            case OP_VMUL:
+            case OP_MSET:
+            case OP_MCPY:
+            case OP_VSUM:
+            case OP_VCMP: {
+                VmBulkOperands reg = vm_bulk_operands(opcode, operand);
+                int result = vm_data_bulk(vm, opcode, regs[reg.x], regs[reg.y], regs[reg.length]);
+                // Out of range, let the checked path report it
+                if (result < 0) {
+                    vm_dispatch(vm);
                     break;
                 }
-                // Increment stack pointer and perform stack pop
-                vm->sp++;
-                vm->registers[reg_op] = vm->stack[vm->sp];
+                if (reg.result < NUM_REGISTERS) {
+                    regs[reg.result] = (vm_word) result;
+                }
+                vm->pc += opcode == OP_VCMP ? 5 : 4;
                 break;
             }
-            // Default case
+            case OP_CALLN:
+                // Slots are filled at runtime, vm_call_native reports an empty one or a failed call
+                vm->pc += 2;
+                vm_call_native(vm, operand[0]);
+                break;
             default:
-                fprintf(stderr, "Error, invalid opcode %d\n", opcode);
-                vm->running = 0;
+                // Unreachable for verified programs, but report it the usual way
+                vm_dispatch(vm);
                 break;
         }
+        VM_PROFILE_STOP(vm);
+    }
+}
+
+// Execution function for the virtual machine
+void vm_execute(VirtualMachine *vm) {
+    int stack_safe;
+
+    // Programs that passed the load-time verifier skip the per-instruction checks
+    if (vm->running && vm_verified_entry(vm, &stack_safe)) {
+        if (stack_safe) {
+            vm_execute_verified(vm, 0);
+        } else {
+            vm_execute_verified(vm, 1);
+        }
+    } else {
+        while (vm->running) {
+            VM_PROFILE_START(vm);
+            vm_dispatch(vm);
+            VM_PROFILE_STOP(vm);
+        }
     }
+    VM_PROFILE_HALT(vm);
 }
 
-// Reset function to clear memory and variables
+// Execute exactly one instruction (used by engines that hand unusual cases back)
+void vm_step(VirtualMachine *vm) {
+    vm_dispatch(vm);
+}
+
+// Run the loaded program on the selected execution engine
+void vm_run(VirtualMachine *vm, VmEngine engine) {
+    switch (engine) {
+        case VM_ENGINE_THREADED:
+            vm_execute_threaded(vm);
+            break;
+        case VM_ENGINE_JIT:
+            vm_execute_jit(vm);
+            break;
+        case VM_ENGINE_SWITCH:
+        default:
+            vm_execute(vm);
+            break;
+    }
+}
+
+// Reset function to clear memory and variables (the sink and native functions stay registered)
 void vm_reset(VirtualMachine *vm) {
-    memset(vm->memory, 0, MEMORY_SIZE);
-    memset(vm->registers, 0, NUM_REGISTERS);
-    memset(vm->stack, 0, MEMORY_SIZE);
+    uint16_t low = vm->sp < vm->stack_low ? vm->sp : vm->stack_low;
+
+    vm_unload(vm);
+    memset(vm->registers, 0, sizeof(vm->registers));
+    // Only the part of the stack that was ever written needs clearing
+    if (low + 1 < MEMORY_SIZE) {
+        memset(&vm->stack[low + 1], 0, sizeof(vm_word) * (MEMORY_SIZE - 1 - low));
+    }
     vm->pc = 0;
     vm->sp = 0;
+    vm->stack_low = MEMORY_SIZE - 1;
+    vm->call_depth = 0;
+    // Likewise only the pages of data memory that were written
+    for (int page = 0; page < VM_DATA_PAGES; page++) {
+        if (vm->data_written[page]) {
+            size_t start = (size_t) page << VM_DATA_PAGE_SHIFT;
+            size_t end = start + ((size_t) 1 << VM_DATA_PAGE_SHIFT);
+            memset(&vm->data[start], 0, (end < VM_DATA_SIZE ? end : VM_DATA_SIZE) - start);
+            vm->data_written[page] = 0;
+        }
+    }
     vm->running = 0;
+    vm->halted = 0;
 }
-
-// Main function
-int main() {
-    VirtualMachine vm;
-    // Initialize Virtual Machine
-    vm_init(&vm);
-    // Simple test program (Change this to whatever you want your program to do)
-    uint8_t program[] = {
-        OP_LOAD, 0, 5,
-        OP_LOAD, 1, 3,
-        OP_ADD, 0, 1, 2,
-        OP_PRINT, 2,
-        OP_HALT
-    };
-    // Load and execute the program
-    vm_load_program(&vm, program, sizeof(program));
-    vm_execute(&vm);
-    printf("\nProgram Completed!");
-
-    return 0;
-
-}
\ No newline at end of file
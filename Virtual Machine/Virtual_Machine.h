@@ -12,9 +12,59 @@ Author: Zane Francis
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <inttypes.h>
 
-#define MEMORY_SIZE 256
+/*
+Build-time configuration. Every engine is compiled for one register width and memory size, so
+registers are a plain C integer type and nothing checks the width at runtime. Pick a variant with
+make rebuild WORD_BITS=32 MEMORY_SIZE=16384 (or -DVM_WORD_BITS=... -DVM_MEMORY_SIZE=...).
+The bytecode is the same for every variant: LOAD still takes a one-byte value and addresses are
+still two bytes. Program memory is 256 to 65535 bytes, one byte short of 64 KiB, because the 16-bit
+pc also has to hold the address just past the end. Data memory can be the full 64 KiB.
+*/
+#ifndef VM_WORD_BITS
+#define VM_WORD_BITS 8      // Register width: 8, 16, 32 or 64 bits
+#endif
+#ifndef VM_MEMORY_SIZE
+#define VM_MEMORY_SIZE 256  // Bytes of program memory and slots of stack
+#endif
+#ifndef VM_DATA_SIZE
+#define VM_DATA_SIZE 256    // Bytes of data memory
+#endif
+
+#if VM_WORD_BITS == 8
+typedef uint8_t vm_word;
+#elif VM_WORD_BITS == 16
+typedef uint16_t vm_word;
+#elif VM_WORD_BITS == 32
+typedef uint32_t vm_word;
+#elif VM_WORD_BITS == 64
+typedef uint64_t vm_word;
+#else
+#error "VM_WORD_BITS must be 8, 16, 32 or 64"
+#endif
+
+// pc and jump addresses are 16 bits, and the address just past the end has to fit too
+#if VM_MEMORY_SIZE < 256 || VM_MEMORY_SIZE > 65535
+#error "VM_MEMORY_SIZE must be between 256 and 65535"
+#endif
+#if VM_DATA_SIZE < 1 || VM_DATA_SIZE > 65536
+#error "VM_DATA_SIZE must be between 1 and 65536"
+#endif
+
+// Data addresses only need checking when a register can hold a value past the end of data memory
+#if (VM_WORD_BITS == 8 && VM_DATA_SIZE >= 256) || (VM_WORD_BITS == 16 && VM_DATA_SIZE >= 65536)
+#define VM_DATA_CHECKED 0
+#else
+#define VM_DATA_CHECKED 1
+#endif
+
+#define MEMORY_SIZE VM_MEMORY_SIZE
+#define VM_DATA_PAGE_SHIFT 6    // Data memory is tracked for snapshots in pages of 64 bytes
+#define VM_DATA_PAGES ((VM_DATA_SIZE + (1 << VM_DATA_PAGE_SHIFT) - 1) >> VM_DATA_PAGE_SHIFT)
 #define NUM_REGISTERS 8
+#define VM_CALL_DEPTH 32    // Return addresses the call stack can hold
+#define VM_MAX_NATIVES 32   // Host function slots OP_CALLN can reach
 
 // Define the instruction set
 typedef enum{
@@ -29,22 +79,428 @@ typedef enum{
     OP_JZ,
     OP_PUSH,
     OP_POP,
+    OP_CALL,    // Push the return address onto the call stack and jump
+    OP_RET,     // Jump to the address on top of the call stack
+    OP_PUSHM,   // Push every register in a bitmask (highest first)
+    OP_POPM,    // Pop every register in a bitmask (lowest first), undoing OP_PUSHM
+    OP_LDB,     // rd, ra: load the data byte at address ra (zero-extended)
+    OP_STB,     // ra, rs: store the low byte of rs at data address ra
+    OP_VADD,    // rdst, rsrc, rlen: add rlen source bytes into the destination bytes
+    OP_VSUB,    // rdst, rsrc, rlen: subtract rlen source bytes from the destination bytes
+    OP_VMUL,    // rdst, rsrc, rlen: multiply rlen destination bytes by the source bytes
+    OP_MSET,    // rdst, rval, rlen: fill rlen bytes with rval
+    OP_MCPY,    // rdst, rsrc, rlen: copy rlen bytes (the ranges may overlap)
+    OP_VSUM,    // rd, rsrc, rlen: rd = sum of rlen bytes (wrapping at the register width)
+    OP_VCMP,    // rd, ra, rb, rlen: rd = 0 if the ranges are equal, else 1 + index of the first difference
+    OP_CALLN,   // n: call host function n (registered with vm_register_native)
 }Opcode;
 
-// Define the structure of the virtual machine
+// Internal opcodes used only in the pre-decoded instruction stream
+#define VM_OP_LOAD_ADD 0xF0 // Superinstructions built by the fusion pass
+#define VM_OP_LOAD_SUB 0xF1
+#define VM_OP_SUB_JZ 0xF2
+#define VM_OP_PUSH_POP 0xF3
+#define VM_OP_TRAP 0xFE     // Undecodable instruction, handed back to vm_step
+#define VM_OP_FALLOFF 0xFF  // Program counter ran past the end of memory
+
+// Pre-decoded instruction (one per memory address, built by vm_decode_program)
+typedef struct {
+    uint8_t op;       // Opcode or one of the internal VM_OP_* values
+    uint8_t a;        // First operand (register or value)
+    uint8_t b;        // Second operand
+    uint8_t c;        // Third operand
+    uint8_t x;        // Operands of the second instruction of a superinstruction
+    uint8_t y;
+    uint8_t z;
+    uint16_t cost;    // Instructions charged to the budget when this backward branch is taken (0 otherwise)
+    uint16_t target;  // Jump target for OP_JMP / OP_JZ / OP_CALL
+    uint16_t next;    // Address of the following instruction
+}VmInstr;
+
+// Per-address flags recorded by the verifier
+#define VM_ADDR_START 0x01    // First byte of a reachable instruction
+#define VM_ADDR_OPERAND 0x02  // Operand byte of a reachable instruction
+#define VM_ADDR_TARGET 0x04   // Target of a jump
+
+// Results of the load-time verifier (vm_verify.c)
+typedef struct {
+    uint8_t verified;               // Program passed vm_verify_program
+    uint8_t stack_checked;          // Every instruction has one known stack depth
+    uint16_t max_stack_depth;       // Deepest stack any path can reach
+    uint8_t flags[MEMORY_SIZE];     // VM_ADDR_* flags for each address
+    uint16_t depth[MEMORY_SIZE];    // Stack depth on entry to each instruction
+}VmVerifyInfo;
+
+// Result of a budgeted run (vm_execute_for)
+typedef enum{
+    VM_STATUS_HALTED = 0,   // Program reached OP_HALT
+    VM_STATUS_YIELDED,      // Budget ran out, call again to continue
+    VM_STATUS_ERROR,        // Program stopped on a runtime error
+}VmStatus;
+
+// Available execution engines
+typedef enum{
+    VM_ENGINE_SWITCH = 0,   // Byte-at-a-time switch interpreter (vm_execute)
+    VM_ENGINE_THREADED,     // Pre-decoded stream with threaded dispatch
+    VM_ENGINE_JIT,          // Native x86-64 code (falls back to threaded elsewhere)
+}VmEngine;
+
+#ifdef VM_PROFILE
+// Guest profile collected by vm_execute when built with -DVM_PROFILE (vm_profile.c)
+typedef struct {
+    uint64_t instructions;              // Instructions executed
+    uint64_t cycles;                    // Host cycles (rdtsc) or nanoseconds spent in them
+    uint64_t op_count[256];             // Executions per opcode
+    uint64_t op_cycles[256];            // Host time per opcode
+    uint64_t pc_hits[MEMORY_SIZE];      // Executions per address
+    uint64_t jz_taken[MEMORY_SIZE];     // OP_JZ branches taken per address
+    uint64_t jz_not_taken[MEMORY_SIZE]; // OP_JZ branches not taken per address
+    FILE *report;                       // Where the report goes on OP_HALT (stderr if NULL)
+}VmProfile;
+#endif
+
+// Output hook for OP_PRINT (ctx is the pointer passed alongside it)
+typedef void (*VmPrintFn)(void *ctx, vm_word value);
+
+// Kinds of output sink for OP_PRINT (vm_sink.c)
+typedef enum{
+    VM_SINK_STDERR = 0,     // "Register value: N" lines straight to stderr (the default)
+    VM_SINK_DISCARD,        // Count values and drop them
+    VM_SINK_RING,           // Keep the most recent values in a caller-supplied ring buffer
+    VM_SINK_TEXT,           // "Register value: N" lines, buffered and written to a FILE in batches
+    VM_SINK_BINARY,         // Raw value bytes, buffered and written to a FILE in batches
+    VM_SINK_CALLBACK,       // Hand each value to a VmPrintFn
+}VmSinkKind;
+
+// Where OP_PRINT values go (one sink can be shared by VMs on the same thread)
+typedef struct {
+    VmSinkKind kind;
+    uint64_t total;         // Values written since the sink was set up
+    uint8_t *buffer;        // Pending bytes for the file sinks
+    vm_word *ring;          // Ring storage
+    size_t capacity;
+    size_t count;           // Bytes pending (file sinks) or values held (ring)
+    size_t head;            // Next ring slot to write
+    uint8_t owns_buffer;    // Buffer was allocated by the sink
+    FILE *file;
+    VmPrintFn fn;
+    void *ctx;
+}VmSink;
+
+/*
+Host function called by OP_CALLN. registers and data point straight at the calling VM's registers and
+data memory, nothing is copied: arguments and results go through the registers, and buffers are
+passed as data addresses and lengths. Return 0 to carry on, anything else stops the VM with an error.
+ctx is the pointer given to vm_register_native.
+*/
+struct VirtualMachine;
+typedef int (*VmNativeFn)(struct VirtualMachine *vm, vm_word *registers, uint8_t *data, void *ctx);
+
+typedef struct {
+    VmNativeFn fn;          // NULL if the slot is empty
+    void *ctx;
+}VmNative;
+
+// Native code for an image (vm_jit.c)
+typedef struct VmJit VmJit;
+
+// Immutable code image (program bytes, decoded stream and verifier results) shared by every VM running it
 typedef struct {
     uint8_t memory[MEMORY_SIZE];
-    uint8_t registers[NUM_REGISTERS];
+    VmInstr decoded[MEMORY_SIZE + 1];
+    VmVerifyInfo verify;
+    size_t size;                // Program bytes, the rest of memory is zero
+    uint8_t fusion;             // Decoded with superinstructions
+    uint32_t refs;              // VMs and snapshots holding it (0 for the built-in empty image)
+    VmJit *jit;                 // Compiled by the first vm_execute_jit, freed with the image
+}VmImage;
+
+// Define the structure of the virtual machine
+typedef struct VirtualMachine {
+    const uint8_t *memory;      // Code, points into image
+    vm_word registers[NUM_REGISTERS];
     uint16_t pc;
-    uint8_t stack[MEMORY_SIZE];
+    vm_word stack[MEMORY_SIZE];
     uint16_t sp;
+    uint16_t stack_low;         // Lowest sp since vm_init (updated on POP), no slot below it was ever written
+    uint16_t call_stack[VM_CALL_DEPTH]; // Return addresses pushed by OP_CALL
+    uint8_t call_depth;         // Entries in use on the call stack
+    uint8_t data[VM_DATA_SIZE]; // Data memory for OP_LDB/OP_STB and the bulk instructions
+    uint8_t data_written[VM_DATA_PAGES];    // Pages of data written since vm_init, the others are all zero
     uint8_t running;
+    uint8_t halted;             // Stopped by OP_HALT rather than an error
+    VmSink *sink;               // NULL prints to stderr
+#ifdef VM_PROFILE
+    VmProfile *profile;         // NULL disables profiling
+#endif
+    VmNative natives[VM_MAX_NATIVES];   // Host functions for OP_CALLN
+    VmImage *image;             // Loaded program (copying the struct borrows the reference)
+    uint8_t fusion;             // Build superinstructions when loading
 }VirtualMachine;
 
+// Checkpoint of a VM's execution state (vm_image.c)
+typedef struct {
+    VmImage *image;
+    vm_word registers[NUM_REGISTERS];
+    uint16_t pc;
+    uint16_t sp;
+    uint16_t stack_low;
+    uint8_t call_depth;
+    uint8_t running;
+    uint8_t halted;
+    uint16_t call_stack[VM_CALL_DEPTH];
+    vm_word stack[MEMORY_SIZE];         // Only the slots above stack_low are filled in
+    uint8_t data[VM_DATA_SIZE];         // Only the pages marked in data_written are filled in
+    uint8_t data_written[VM_DATA_PAGES];
+}VmSnapshot;
+
 // Function properties
 void vm_init(VirtualMachine *vm);
-void vm_load_program(VirtualMachine *vm, uint8_t *program, size_t size);
+int vm_load_program(VirtualMachine *vm, uint8_t *program, size_t size);
 void vm_execute(VirtualMachine *vm);
+void vm_step(VirtualMachine *vm);
+void vm_run(VirtualMachine *vm, VmEngine engine);
 void vm_reset(VirtualMachine *vm);
+void vm_print_value(VirtualMachine *vm, vm_word value);
+int vm_register_native(VirtualMachine *vm, uint8_t index, VmNativeFn fn, void *ctx);
+int vm_call_native(VirtualMachine *vm, uint8_t index);
+
+// Word multiply (1u keeps 16-bit words from being promoted to int, where the product can overflow)
+static inline vm_word vm_word_mul(vm_word a, vm_word b) {
+    return (vm_word) (1u * a * b);
+}
+
+// Whether a register value is a data memory address (always, for 8-bit registers and 256 bytes of data)
+static inline int vm_data_address(vm_word address) {
+#if VM_DATA_CHECKED
+    return address < VM_DATA_SIZE;
+#else
+    (void) address;
+    return 1;
+#endif
+}
+
+// Record a store to data memory, vm_snapshot and vm_reset only touch the pages that were written
+static inline void vm_data_mark(VirtualMachine *vm, vm_word address) {
+    vm->data_written[address >> VM_DATA_PAGE_SHIFT] = 1;
+}
+
+/*
+Bulk register save/restore for OP_PUSHM / OP_POPM, shared by the engines and the code vm_aot writes.
+Pushing the highest register first leaves the saved registers in ascending order in memory, so a
+contiguous mask (r3-r5, or all of them) is one memcpy instead of a push per register. The caller
+checks that the stack has room for vm_mask_count(mask) values.
+*/
+static inline int vm_mask_count(uint8_t mask) {
+#if defined(__GNUC__)
+    return __builtin_popcount(mask);
+#else
+    int count = 0;
+    for (; mask != 0; mask &= (uint8_t) (mask - 1)) {
+        count++;
+    }
+    return count;
+#endif
+}
+
+static inline uint16_t vm_push_mask(vm_word *stack, uint16_t sp, const vm_word *regs, uint8_t mask) {
+    int count = vm_mask_count(mask);
+    vm_word *dst = &stack[sp - count + 1];
+
+    if (count == 0) {
+        return sp;
+    }
+    int low = 0;
+    while (!(mask & (1u << low))) {
+        low++;
+    }
+    if ((unsigned) (mask >> low) == (1u << count) - 1) {
+        memcpy(dst, &regs[low], sizeof(vm_word) * (size_t) count);
+    } else {
+        for (int r = low; r < NUM_REGISTERS; r++) {
+            if (mask & (1u << r)) {
+                *dst++ = regs[r];
+            }
+        }
+    }
+    return (uint16_t) (sp - count);
+}
+
+static inline uint16_t vm_pop_mask(const vm_word *stack, uint16_t sp, vm_word *regs, uint8_t mask) {
+    int count = vm_mask_count(mask);
+    const vm_word *src = &stack[sp + 1];
+
+    if (count == 0) {
+        return sp;
+    }
+    int low = 0;
+    while (!(mask & (1u << low))) {
+        low++;
+    }
+    if ((unsigned) (mask >> low) == (1u << count) - 1) {
+        memcpy(&regs[low], src, sizeof(vm_word) * (size_t) count);
+    } else {
+        for (int r = low; r < NUM_REGISTERS; r++) {
+            if (mask & (1u << r)) {
+                regs[r] = *src++;
+            }
+        }
+    }
+    return (uint16_t) (sp + count);
+}
+
+// Shared code images and snapshots (vm_image.c)
+VmImage *vm_image_create(const uint8_t *program, size_t size, int fusion);
+void vm_image_retain(VmImage *image);
+void vm_image_release(VmImage *image);
+void vm_attach_image(VirtualMachine *vm, VmImage *image);
+void vm_unload(VirtualMachine *vm);
+void vm_snapshot(const VirtualMachine *vm, VmSnapshot *snap);
+void vm_restore(VirtualMachine *vm, const VmSnapshot *snap);
+void vm_snapshot_free(VmSnapshot *snap);
+extern VmImage vm_empty_image;
+
+// Binary program image files written by the assembler (vm_imgfile.c)
+#define VM_IMAGE_FILE_VERSION 1
+int vm_image_save(const VmImage *image, const char *path);
+VmImage *vm_image_load(const char *path, int fusion);
+
+// Output sinks for OP_PRINT (vm_sink.c)
+void vm_set_sink(VirtualMachine *vm, VmSink *sink);
+void vm_sink_init_stderr(VmSink *sink);
+void vm_sink_init_discard(VmSink *sink);
+void vm_sink_init_ring(VmSink *sink, vm_word *buffer, size_t capacity);
+int vm_sink_init_text(VmSink *sink, FILE *file, size_t buffer_size);
+int vm_sink_init_binary(VmSink *sink, FILE *file, size_t buffer_size);
+void vm_sink_init_callback(VmSink *sink, VmPrintFn fn, void *ctx);
+void vm_sink_write(VmSink *sink, vm_word value);
+size_t vm_sink_ring_read(const VmSink *sink, vm_word *out, size_t max);
+void vm_sink_flush(VmSink *sink);
+void vm_sink_free(VmSink *sink);
+
+// Threaded engine (vm_threaded.c)
+int vm_instruction_length(uint8_t opcode);
+void vm_decode_program(VmImage *image);
+void vm_decode_verified(VmImage *image);
+void vm_execute_threaded(VirtualMachine *vm);
+void vm_set_fusion(VirtualMachine *vm, int enabled);
+VmStatus vm_execute_for(VirtualMachine *vm, uint64_t max_instructions);
+
+// Load-time verifier (vm_verify.c)
+int vm_verify_program(VmImage *image);
+int vm_verify_metadata(VmImage *image);
+int vm_verified_entry(const VirtualMachine *vm, int *stack_safe);
+
+// x86-64 JIT compiler (vm_jit.c)
+VmJit *vm_jit_compile(const VirtualMachine *vm);
+void vm_jit_execute(VmJit *jit, VirtualMachine *vm);
+void vm_jit_free(VmJit *jit);
+void vm_execute_jit(VirtualMachine *vm);
+
+// Guest profiler (vm_profile.c), compiled out entirely unless VM_PROFILE is defined
+#ifdef VM_PROFILE
+uint64_t vm_profile_clock(void);
+void vm_profile_record(VmProfile *profile, const uint8_t *memory, uint16_t pc, uint16_t next_pc, uint64_t elapsed);
+void vm_profile_report(const VmProfile *profile, FILE *out);
+#define VM_PROFILE_START(vm) \
+    uint16_t prof_pc = (vm)->pc; \
+    uint64_t prof_start = (vm)->profile ? vm_profile_clock() : 0
+#define VM_PROFILE_STOP(vm) \
+    if ((vm)->profile) \
+        vm_profile_record((vm)->profile, (vm)->memory, prof_pc, (vm)->pc, vm_profile_clock() - prof_start)
+#define VM_PROFILE_HALT(vm) \
+    if ((vm)->profile && (vm)->halted) \
+        vm_profile_report((vm)->profile, (vm)->profile->report ? (vm)->profile->report : stderr)
+#else
+#define VM_PROFILE_START(vm) ((void) 0)
+#define VM_PROFILE_STOP(vm) ((void) 0)
+#define VM_PROFILE_HALT(vm) ((void) 0)
+#endif
+
+// Batch executor (vm_batch.c)
+typedef enum{
+    VM_JOB_HALTED = 0,      // Program reached OP_HALT
+    VM_JOB_ERROR,           // Program stopped on a runtime error
+    VM_JOB_REJECTED,        // Program failed to load
+}VmJobStatus;
+
+// One independent program run (zero the struct before the first batch)
+typedef struct {
+    const uint8_t *program;             // Bytecode, not copied
+    size_t size;
+    vm_word registers[NUM_REGISTERS];   // Initial registers in, final registers out
+    VmJobStatus status;
+    vm_word *output;                    // Values printed by OP_PRINT
+    size_t output_count;
+    size_t output_capacity;
+}VmJob;
+
+int vm_batch_run(VmJob *jobs, size_t count, int num_threads, VmEngine engine);
+void vm_batch_free_output(VmJob *jobs, size_t count);
+void vm_job_capture_print(void *ctx, vm_word value);
+
+// Round-robin scheduler for many VMs on one thread (vm_sched.c)
+typedef struct {
+    VirtualMachine *vm;
+    VmStatus status;
+    void *user;                         // Caller's pointer, untouched by the scheduler
+}VmTask;
+
+typedef struct {
+    VmTask *tasks;                      // Every task added, in order
+    size_t count;
+    size_t capacity;
+    size_t *ready;                      // Indexes of the tasks that are still running
+    size_t ready_count;
+    uint64_t quantum;                   // Instruction budget per turn
+    uint64_t rounds;                    // Completed passes over the ready list
+}VmScheduler;
+
+int vm_scheduler_init(VmScheduler *sched, uint64_t quantum);
+int vm_scheduler_add(VmScheduler *sched, VirtualMachine *vm, void *user);
+size_t vm_scheduler_run(VmScheduler *sched, uint64_t max_rounds);
+void vm_scheduler_free(VmScheduler *sched);
+
+// Lockstep SIMD execution of one program over many jobs (vm_simd.c)
+#define VM_LANES 32
+int vm_lockstep_run(const uint8_t *program, size_t size, const VmNative *natives, VmJob *jobs, size_t count);
+
+// Bulk data-memory instructions and the SIMD kernels behind them (vm_vector.c)
+typedef struct {
+    uint8_t x;          // Register holding vm_data_bulk's x (destination or only address)
+    uint8_t y;          // Register holding its y (source address or fill value, unused by OP_VSUM)
+    uint8_t length;     // Register holding the byte count
+    uint8_t result;     // Register that receives the result, NUM_REGISTERS if there is none
+}VmBulkOperands;
+
+// Where the register operands of a bulk instruction are (OP_VSUM/OP_VCMP name their result register first)
+static inline VmBulkOperands vm_bulk_operands(uint8_t opcode, const uint8_t *operand) {
+    VmBulkOperands regs;
+
+    if (opcode == OP_VSUM) {
+        regs.result = operand[0];
+        regs.x = operand[1];
+        regs.y = operand[1];
+        regs.length = operand[2];
+    } else if (opcode == OP_VCMP) {
+        regs.result = operand[0];
+        regs.x = operand[1];
+        regs.y = operand[2];
+        regs.length = operand[3];
+    } else {
+        regs.result = NUM_REGISTERS;
+        regs.x = operand[0];
+        regs.y = operand[1];
+        regs.length = operand[2];
+    }
+    return regs;
+}
+
+void vm_vec_add(uint8_t *dst, const uint8_t *src, size_t count);
+void vm_vec_sub(uint8_t *dst, const uint8_t *src, size_t count);
+void vm_vec_mul(uint8_t *dst, const uint8_t *src, size_t count);
+uint32_t vm_vec_sum(const uint8_t *src, size_t count);
+size_t vm_vec_mismatch(const uint8_t *a, const uint8_t *b, size_t count);
+int vm_data_bulk(VirtualMachine *vm, uint8_t opcode, vm_word x, vm_word y, vm_word count);
 
 #endif
\ No newline at end of file
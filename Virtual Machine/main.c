@@ -0,0 +1,38 @@
+/*
+This is the entry point for the simple virtual machine. It loads a small example program and runs it
+with vm_execute. The virtual machine itself lives in "Virtual Machine.c" and the vm_*.c files.
+
+To compile: make
+To run: .\Virtual_Machine.exe
+To run with stdout and stderr: .\Virtual_Machine.exe 2>&1
+
+Author: Zane Francis
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "Virtual_Machine.h"
+
+// Main function
+int main() {
+    VirtualMachine vm;
+    // Initialize Virtual Machine
+    vm_init(&vm);
+    // Simple test program (Change this to whatever you want your program to do)
+    uint8_t program[] = {
+        OP_LOAD, 0, 5,
+        OP_LOAD, 1, 3,
+        OP_ADD, 0, 1, 2,
+        OP_PRINT, 2,
+        OP_HALT
+    };
+    // Load and execute the program
+    vm_load_program(&vm, program, sizeof(program));
+    vm_execute(&vm);
+    vm_unload(&vm);
+    printf("\nProgram Completed!");
+
+    return 0;
+
+}
\ No newline at end of file
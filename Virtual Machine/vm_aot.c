@@ -0,0 +1,373 @@
+/*
+This is the ahead-of-time translator for the virtual machine (vm_aot).
+
+It reads a raw bytecode file or an assembled .vmi image, runs it through the load-time verifier, and
+writes a standalone C file with one function that has the same semantics as vm_execute for that
+program. Every reachable instruction becomes a labelled block of straight-line C, jumps become gotos,
+and the registers live in locals, so gcc -O2 can keep them in host registers and optimize across
+instructions. The generated file also holds a copy of the bytecode (NAME_program / NAME_size) to load
+into the VM first.
+
+The generated function only needs the VM library as its runtime (vm_print_value for PRINT,
+vm_call_native for CALLN, and vm_execute as a fallback), and takes a VirtualMachine just like
+vm_execute, so the two can be swapped freely. If the VM does not hold the translated program, or is
+stopped somewhere that is not the start of a verified instruction, it simply calls vm_execute instead.
+
+Usage: ./vm_aot program.bin|program.vmi output.c [function_name]
+
+Author: Zane Francis
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include "Virtual_Machine.h"
+
+#define AOT_DEFAULT_NAME "vm_aot_program"
+
+// Read a raw bytecode file (returns the number of bytes, -2 for a .vmi image, -1 on failure)
+static long aot_read_program(const char *path, uint8_t *program) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Error, could not open %s\n", path);
+        return -1;
+    }
+    size_t size = fread(program, 1, MEMORY_SIZE, file);
+    if (size >= 4 && memcmp(program, "ZVMI", 4) == 0) {
+        fclose(file);
+        return -2;
+    }
+    // Anything past MEMORY_SIZE would not fit in the VM
+    if (fgetc(file) != EOF) {
+        fprintf(stderr, "Error, %s is larger than the memory size (%d bytes)\n", path, MEMORY_SIZE);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    return (long) size;
+}
+
+// Write the code for the instruction at addr
+static void aot_emit_instruction(FILE *out, const uint8_t *mem, const uint8_t *flags, int addr) {
+    const uint8_t *operand = &mem[addr + 1];
+    int next = addr + vm_instruction_length(mem[addr]);
+
+    fprintf(out, "L_%d:\n", addr);
+    switch (mem[addr]) {
+        case OP_HALT:
+            fprintf(out, "    /* HALT */\n");
+            fprintf(out, "    vm->halted = 1;\n");
+            fprintf(out, "    pc = %d;\n    goto stop;\n", next);
+            break;
+        case OP_LOAD:
+            fprintf(out, "    /* LOAD r%d, %d */\n", operand[0], operand[1]);
+            fprintf(out, "    r%d = %d;\n", operand[0], operand[1]);
+            break;
+        case OP_PRINT:
+            fprintf(out, "    /* PRINT r%d */\n", operand[0]);
+            fprintf(out, "    vm_print_value(vm, r%d);\n", operand[0]);
+            break;
+        case OP_ADD:
+        case OP_SUB:
+            fprintf(out, "    /* %s r%d, r%d, r%d */\n", mem[addr] == OP_ADD ? "ADD" : "SUB",
+                operand[0], operand[1], operand[2]);
+            fprintf(out, "    r%d = (vm_word) (r%d %c r%d);\n", operand[2], operand[0],
+                mem[addr] == OP_ADD ? '+' : '-', operand[1]);
+            break;
+        case OP_MUL:
+            fprintf(out, "    /* MUL r%d, r%d, r%d */\n", operand[0], operand[1], operand[2]);
+            fprintf(out, "    r%d = vm_word_mul(r%d, r%d);\n", operand[2], operand[0], operand[1]);
+            break;
+        case OP_DIV:
+            // Division by zero depends on runtime values so it is always checked
+            fprintf(out, "    /* DIV r%d, r%d, r%d */\n", operand[0], operand[1], operand[2]);
+            fprintf(out, "    if (r%d == 0) {\n", operand[1]);
+            fprintf(out, "        fprintf(stderr, \"Error, can not divide when register %d is 0.\\n\");\n", operand[1]);
+            fprintf(out, "        pc = %d;\n        goto stop;\n    }\n", next);
+            fprintf(out, "    r%d = (vm_word) (r%d / r%d);\n", operand[2], operand[0], operand[1]);
+            break;
+        case OP_JMP: {
+            int target = (operand[0] << 8) | operand[1];
+            fprintf(out, "    /* JMP %d */\n", target);
+            fprintf(out, "    goto L_%d;\n", target);
+            break;
+        }
+        case OP_JZ: {
+            int target = (operand[1] << 8) | operand[2];
+            fprintf(out, "    /* JZ r%d, %d */\n", operand[0], target);
+            fprintf(out, "    if (r%d == 0) {\n        goto L_%d;\n    }\n", operand[0], target);
+            break;
+        }
+        case OP_PUSH:
+            fprintf(out, "    /* PUSH r%d */\n", operand[0]);
+            fprintf(out, "    if (check_stack && sp <= 0) {\n");
+            fprintf(out, "        fprintf(stderr, \"Error, stack underflow\\n\");\n");
+            fprintf(out, "        pc = %d;\n        goto stop;\n    }\n", next);
+            fprintf(out, "    vm->stack[sp--] = r%d;\n", operand[0]);
+            break;
+        case OP_POP:
+            fprintf(out, "    /* POP r%d */\n", operand[0]);
+            fprintf(out, "    if (check_stack && sp >= MEMORY_SIZE - 1) {\n");
+            fprintf(out, "        fprintf(stderr, \"Error, stack overflow\\n\");\n");
+            fprintf(out, "        pc = %d;\n        goto stop;\n    }\n", next);
+            fprintf(out, "    if (sp < vm->stack_low) {\n        vm->stack_low = sp;\n    }\n");
+            fprintf(out, "    r%d = vm->stack[++sp];\n", operand[0]);
+            break;
+        case OP_CALL: {
+            int target = (operand[0] << 8) | operand[1];
+            fprintf(out, "    /* CALL %d */\n", target);
+            fprintf(out, "    if (vm->call_depth >= VM_CALL_DEPTH) {\n");
+            fprintf(out, "        fprintf(stderr, \"Error, call stack overflow\\n\");\n");
+            fprintf(out, "        pc = %d;\n        goto stop;\n    }\n", next);
+            fprintf(out, "    vm->call_stack[vm->call_depth++] = %d;\n", next);
+            fprintf(out, "    goto L_%d;\n", target);
+            break;
+        }
+        case OP_RET:
+            // Returns can only land just after a call, so a switch over the call sites covers them all
+            fprintf(out, "    /* RET */\n");
+            fprintf(out, "    if (vm->call_depth == 0) {\n");
+            fprintf(out, "        fprintf(stderr, \"Error, return with an empty call stack\\n\");\n");
+            fprintf(out, "        pc = %d;\n        goto stop;\n    }\n", next);
+            fprintf(out, "    switch (vm->call_stack[--vm->call_depth]) {\n");
+            for (int site = 0; site + 3 < MEMORY_SIZE; site++) {
+                if ((flags[site] & VM_ADDR_START) && mem[site] == OP_CALL) {
+                    fprintf(out, "        case %d: goto L_%d;\n", site + 3, site + 3);
+                }
+            }
+            fprintf(out, "    }\n");
+            // Anything else was not pushed by this program, let the interpreter carry on from there
+            fprintf(out, "    pc = vm->call_stack[vm->call_depth];\n    goto resume;\n");
+            break;
+        case OP_PUSHM:
+        case OP_POPM: {
+            int count = vm_mask_count(operand[0]);
+            int push = mem[addr] == OP_PUSHM;
+            fprintf(out, "    /* %s 0x%02X */\n", push ? "PUSHM" : "POPM", operand[0]);
+            if (push) {
+                fprintf(out, "    if (check_stack && sp < %d) {\n", count);
+                fprintf(out, "        fprintf(stderr, \"Error, stack underflow\\n\");\n");
+            } else {
+                fprintf(out, "    if (check_stack && sp + %d > MEMORY_SIZE - 1) {\n", count);
+                fprintf(out, "        fprintf(stderr, \"Error, stack overflow\\n\");\n");
+            }
+            fprintf(out, "        pc = %d;\n        goto stop;\n    }\n", next);
+            if (!push) {
+                fprintf(out, "    if (sp < vm->stack_low) {\n        vm->stack_low = sp;\n    }\n");
+            }
+            // Registers live in locals, so write the moves out (highest first for a push, lowest first for a pop)
+            for (int i = 0; i < NUM_REGISTERS; i++) {
+                int reg = push ? NUM_REGISTERS - 1 - i : i;
+                if (!(operand[0] & (1u << reg))) {
+                    continue;
+                }
+                if (push) {
+                    fprintf(out, "    vm->stack[sp--] = r%d;\n", reg);
+                } else {
+                    fprintf(out, "    r%d = vm->stack[++sp];\n", reg);
+                }
+            }
+            break;
+        }
+        case OP_LDB:
+        case OP_STB: {
+            int load = mem[addr] == OP_LDB;
+            int address = operand[load ? 1 : 0];
+            fprintf(out, "    /* %s r%d, r%d */\n", load ? "LDB" : "STB", operand[0], operand[1]);
+            // Only wide registers can hold a value past the end of data memory
+            if (VM_DATA_CHECKED) {
+                fprintf(out, "    if (!vm_data_address(r%d)) {\n", address);
+                fprintf(out, "        fprintf(stderr, \"Error, invalid data address %%\" PRIu64 \"\\n\", (uint64_t) r%d);\n",
+                    address);
+                fprintf(out, "        pc = %d;\n        goto stop;\n    }\n", next);
+            }
+            if (load) {
+                fprintf(out, "    r%d = vm->data[r%d];\n", operand[0], operand[1]);
+            } else {
+                fprintf(out, "    vm->data[r%d] = (uint8_t) r%d;\n", operand[0], operand[1]);
+                fprintf(out, "    vm_data_mark(vm, r%d);\n", operand[0]);
+            }
+            break;
+        }
+        case OP_VADD:
+        case OP_VSUB:
+        case OP_VMUL:
+        case OP_MSET:
+        case OP_MCPY:
+        case OP_VSUM:
+        case OP_VCMP: {
+            static const char *names[] = { "VADD", "VSUB", "VMUL", "MSET", "MCPY", "VSUM", "VCMP" };
+            VmBulkOperands reg = vm_bulk_operands(mem[addr], operand);
+            fprintf(out, "    /* %s", names[mem[addr] - OP_VADD]);
+            for (int i = 0; i < next - addr - 1; i++) {
+                fprintf(out, "%s r%d", i ? "," : "", operand[i]);
+            }
+            fprintf(out, " */\n");
+            // Ranges depend on runtime values so they are always checked
+            fprintf(out, "    {\n        int result = vm_data_bulk(vm, OP_%s, r%d, r%d, r%d);\n",
+                names[mem[addr] - OP_VADD], reg.x, reg.y, reg.length);
+            fprintf(out, "        if (result < 0) {\n");
+            fprintf(out, "            fprintf(stderr, \"Error, data range of %%\" PRIu64 \" bytes is out of bounds\\n\", (uint64_t) r%d);\n",
+                reg.length);
+            fprintf(out, "            pc = %d;\n            goto stop;\n        }\n", next);
+            if (reg.result < NUM_REGISTERS) {
+                fprintf(out, "        r%d = (vm_word) result;\n", reg.result);
+            } else {
+                fprintf(out, "        (void) result;\n");
+            }
+            fprintf(out, "    }\n");
+            break;
+        }
+        case OP_CALLN:
+            // The host function works on vm->registers, so the locals go through the VM around the call
+            fprintf(out, "    /* CALLN %d */\n", operand[0]);
+            fprintf(out, "    {\n");
+            for (int r = 0; r < NUM_REGISTERS; r++) {
+                fprintf(out, "        vm->registers[%d] = r%d;\n", r, r);
+            }
+            fprintf(out, "        vm->pc = %d;\n        vm->sp = sp;\n", next);
+            fprintf(out, "        int failed = vm_call_native(vm, %d);\n", operand[0]);
+            for (int r = 0; r < NUM_REGISTERS; r++) {
+                fprintf(out, "        r%d = vm->registers[%d];\n", r, r);
+            }
+            fprintf(out, "        if (failed) {\n            pc = %d;\n            goto stop;\n        }\n", next);
+            fprintf(out, "    }\n");
+            break;
+    }
+}
+
+// Write the C translation of the verified program held by vm
+static void aot_emit(FILE *out, const VirtualMachine *vm, size_t size, const char *name, const char *source) {
+    const uint8_t *mem = vm->memory;
+    const uint8_t *flags = vm->image->verify.flags;
+
+    fprintf(out, "/*\nGenerated by vm_aot from %s. Do not edit.\n\n", source);
+    fprintf(out, "%s(vm) runs the program below with the same results as vm_execute(vm).\n*/\n\n", name);
+    fprintf(out, "#include <stdio.h>\n#include <string.h>\n#include <stdint.h>\n#include <inttypes.h>\n");
+    fprintf(out, "#include \"Virtual_Machine.h\"\n\n");
+
+    // The translation is only valid for the VM variant it was made with
+    fprintf(out, "#if MEMORY_SIZE != %d || VM_WORD_BITS != %d || VM_DATA_SIZE != %d\n", MEMORY_SIZE, VM_WORD_BITS,
+        VM_DATA_SIZE);
+    fprintf(out, "#error \"%s was translated for MEMORY_SIZE %d, VM_WORD_BITS %d and VM_DATA_SIZE %d\"\n#endif\n\n",
+        name, MEMORY_SIZE, VM_WORD_BITS, VM_DATA_SIZE);
+
+    // Copy of the bytecode (zero padded to the full memory), to load into the VM before calling the function
+    fprintf(out, "const size_t %s_size = %zu;\n", name, size);
+    fprintf(out, "const uint8_t %s_program[MEMORY_SIZE] = {", name);
+    for (size_t i = 0; i < size; i++) {
+        fprintf(out, "%s%d,", i % 16 == 0 ? "\n    " : " ", mem[i]);
+    }
+    fprintf(out, "\n};\n\n");
+
+    fprintf(out, "void %s(VirtualMachine *vm) {\n", name);
+    fprintf(out, "    int stack_safe;\n\n");
+    fprintf(out, "    if (!vm->running) {\n        return;\n    }\n");
+    fprintf(out, "    // Anything other than this program at a verified instruction goes to the interpreter. Memory past\n");
+    fprintf(out, "    // an image's size is zero, so the same size and bytes up to it mean the same program\n");
+    fprintf(out, "    if (vm->image == NULL || vm->image->size != %s_size ||\n", name);
+    fprintf(out, "            memcmp(vm->memory, %s_program, %s_size) != 0 || !vm_verified_entry(vm, &stack_safe)) {\n",
+        name, name);
+    fprintf(out, "        vm_execute(vm);\n        return;\n    }\n");
+    fprintf(out, "    const int check_stack = !stack_safe;\n");
+    fprintf(out, "    uint16_t sp = vm->sp;\n    uint16_t pc;\n");
+    for (int r = 0; r < NUM_REGISTERS; r++) {
+        fprintf(out, "    vm_word r%d = vm->registers[%d];\n", r, r);
+    }
+    fprintf(out, "    (void) check_stack;\n\n");
+
+    // Enter at the current pc
+    fprintf(out, "    switch (vm->pc) {\n");
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (flags[addr] & VM_ADDR_START) {
+            fprintf(out, "        case %d: goto L_%d;\n", addr, addr);
+        }
+    }
+    fprintf(out, "        default: vm_execute(vm); return;\n    }\n\n");
+
+    // One block per reachable instruction, in address order so fall-through is free
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (flags[addr] & VM_ADDR_START) {
+            aot_emit_instruction(out, mem, flags, addr);
+        }
+    }
+
+    // Every path that ends at HALT or an error lands here (programs that loop forever never do), and
+    // a return to an address this program never called from resumes in the interpreter
+    fprintf(out, "\nstop: __attribute__((unused));\n");
+    fprintf(out, "    vm->running = 0;\n");
+    fprintf(out, "resume: __attribute__((unused));\n");
+    fprintf(out, "    vm->pc = pc;\n    vm->sp = sp;\n");
+    for (int r = 0; r < NUM_REGISTERS; r++) {
+        fprintf(out, "    vm->registers[%d] = r%d;\n", r, r);
+    }
+    fprintf(out, "    if (vm->running) {\n        vm_execute(vm);\n    }\n");
+    fprintf(out, "}\n");
+}
+
+// Function names end up in C source, so only allow identifiers
+static int aot_valid_name(const char *name) {
+    if (!isalpha((unsigned char) name[0]) && name[0] != '_') {
+        return 0;
+    }
+    for (const char *c = name; *c; c++) {
+        if (!isalnum((unsigned char) *c) && *c != '_') {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s program.bin|program.vmi output.c [function_name]\n", argv[0]);
+        return 1;
+    }
+    const char *name = argc > 3 ? argv[3] : AOT_DEFAULT_NAME;
+    if (!aot_valid_name(name)) {
+        fprintf(stderr, "Error, %s is not a valid C function name\n", name);
+        return 1;
+    }
+
+    uint8_t program[MEMORY_SIZE];
+    long size = aot_read_program(argv[1], program);
+    if (size == -1) {
+        return 1;
+    }
+    // Only verified programs are translated, the verifier also tells us where every instruction starts
+    VirtualMachine *vm = (VirtualMachine*) malloc(sizeof(VirtualMachine));
+    if (vm == NULL) {
+        fprintf(stderr, "Error, allocation failed\n");
+        return 1;
+    }
+    vm_init(vm);
+    if (size == -2) {
+        // Assembled .vmi images carry their own verifier results
+        VmImage *image = vm_image_load(argv[1], 1);
+        if (image == NULL) {
+            free(vm);
+            return 1;
+        }
+        vm_attach_image(vm, image);
+        vm_image_release(image);
+        size = (long) image->size;
+    } else if (vm_load_program(vm, program, (size_t) size) != 0) {
+        fprintf(stderr, "Error, %s failed verification\n", argv[1]);
+        free(vm);
+        return 1;
+    }
+
+    FILE *out = fopen(argv[2], "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error, could not open %s\n", argv[2]);
+        free(vm);
+        return 1;
+    }
+    aot_emit(out, vm, (size_t) size, name, argv[1]);
+    fclose(out);
+    vm_unload(vm);
+    free(vm);
+    return 0;
+}
@@ -0,0 +1,405 @@
+/*
+This is the text assembler for the virtual machine (vm_asm).
+
+It turns mnemonic source into a verified .vmi program image (see vm_imgfile.c), or into raw bytecode
+with -raw. The syntax is one instruction per line:
+
+    ; Count down from 5, printing each value
+            LOAD R0, 5
+            LOAD R1, 1
+    loop:   PRINT R0
+            SUB R0, R1, R0
+            JZ R0, done
+            JMP loop
+    done:   HALT
+
+Mnemonics and register names are case-insensitive, values can be decimal or 0x hex (negative values
+wrap to a byte), comments start with ';' or '#', and JMP/JZ/CALL take either a label or an address.
+PUSHM and POPM take a list of registers (PUSHM R3, R4, R6) that becomes their bitmask, and CALLN
+takes the slot number its host function is registered under.
+Labels are resolved in a second pass, so they can be used before they are defined.
+
+Usage: ./vm_asm [-raw] input.asm output.vmi
+
+Author: Zane Francis
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include "Virtual_Machine.h"
+
+#define ASM_MAX_LINE 256
+#define ASM_MAX_LABELS MEMORY_SIZE
+#define ASM_MAX_LABEL_LENGTH 32
+#define ASM_MAX_OPERANDS NUM_REGISTERS
+#define ASM_REGISTER_LIST -1   // Operand count of instructions that take a register list
+
+// Kinds of operand an instruction takes
+typedef enum {
+    ASM_REG,
+    ASM_VALUE,
+    ASM_ADDRESS,
+    ASM_NATIVE,     // Native function slot (0 to VM_MAX_NATIVES - 1)
+} AsmOperand;
+
+// Mnemonic table
+typedef struct {
+    const char *name;
+    uint8_t opcode;
+    int count;
+    AsmOperand operands[4];
+} AsmMnemonic;
+
+static const AsmMnemonic mnemonics[] = {
+    { "HALT", OP_HALT, 0, { ASM_REG, ASM_REG, ASM_REG } },
+    { "LOAD", OP_LOAD, 2, { ASM_REG, ASM_VALUE, ASM_REG } },
+    { "PRINT", OP_PRINT, 1, { ASM_REG, ASM_REG, ASM_REG } },
+    { "ADD", OP_ADD, 3, { ASM_REG, ASM_REG, ASM_REG } },
+    { "SUB", OP_SUB, 3, { ASM_REG, ASM_REG, ASM_REG } },
+    { "MUL", OP_MUL, 3, { ASM_REG, ASM_REG, ASM_REG } },
+    { "DIV", OP_DIV, 3, { ASM_REG, ASM_REG, ASM_REG } },
+    { "JMP", OP_JMP, 1, { ASM_ADDRESS, ASM_REG, ASM_REG } },
+    { "JZ", OP_JZ, 2, { ASM_REG, ASM_ADDRESS, ASM_REG } },
+    { "PUSH", OP_PUSH, 1, { ASM_REG, ASM_REG, ASM_REG } },
+    { "POP", OP_POP, 1, { ASM_REG, ASM_REG, ASM_REG } },
+    { "CALL", OP_CALL, 1, { ASM_ADDRESS, ASM_REG, ASM_REG } },
+    { "RET", OP_RET, 0, { ASM_REG, ASM_REG, ASM_REG } },
+    { "PUSHM", OP_PUSHM, ASM_REGISTER_LIST, { ASM_REG, ASM_REG, ASM_REG } },
+    { "POPM", OP_POPM, ASM_REGISTER_LIST, { ASM_REG, ASM_REG, ASM_REG } },
+    { "LDB", OP_LDB, 2, { ASM_REG, ASM_REG, ASM_REG } },
+    { "STB", OP_STB, 2, { ASM_REG, ASM_REG, ASM_REG } },
+    { "VADD", OP_VADD, 3, { ASM_REG, ASM_REG, ASM_REG } },
+    { "VSUB", OP_VSUB, 3, { ASM_REG, ASM_REG, ASM_REG } },
+    { "VMUL", OP_VMUL, 3, { ASM_REG, ASM_REG, ASM_REG } },
+    { "MSET", OP_MSET, 3, { ASM_REG, ASM_REG, ASM_REG } },
+    { "MCPY", OP_MCPY, 3, { ASM_REG, ASM_REG, ASM_REG } },
+    { "VSUM", OP_VSUM, 3, { ASM_REG, ASM_REG, ASM_REG } },
+    { "VCMP", OP_VCMP, 4, { ASM_REG, ASM_REG, ASM_REG, ASM_REG } },
+    { "CALLN", OP_CALLN, 1, { ASM_NATIVE, ASM_REG, ASM_REG } },
+};
+
+// Label and the address it marks
+typedef struct {
+    char name[ASM_MAX_LABEL_LENGTH + 1];
+    int address;
+} AsmLabel;
+
+// Address operand that still needs its label resolved
+typedef struct {
+    char name[ASM_MAX_LABEL_LENGTH + 1];
+    int at;         // Offset of the 2-byte address in the output
+    int line;
+} AsmFixup;
+
+// Assembler state
+typedef struct {
+    const char *path;
+    int line;
+    uint8_t code[MEMORY_SIZE];
+    int size;
+    AsmLabel labels[ASM_MAX_LABELS];
+    int label_count;
+    AsmFixup fixups[MEMORY_SIZE];
+    int fixup_count;
+    int errors;
+} Assembler;
+
+static void asm_error(Assembler *as, const char *message, const char *detail) {
+    fprintf(stderr, "Error, %s:%d: %s%s%s\n", as->path, as->line, message, detail ? " " : "", detail ? detail : "");
+    as->errors++;
+}
+
+// Skip spaces and tabs
+static char *skip_space(char *text) {
+    while (*text == ' ' || *text == '\t') {
+        text++;
+    }
+    return text;
+}
+
+// Case-insensitive compare of an identifier with a name from a table
+static int same_name(const char *a, const char *b) {
+    while (*a && *b) {
+        if (toupper((unsigned char) *a) != toupper((unsigned char) *b)) {
+            return 0;
+        }
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+static int find_label(const Assembler *as, const char *name) {
+    for (int i = 0; i < as->label_count; i++) {
+        if (strcmp(as->labels[i].name, name) == 0) {
+            return as->labels[i].address;
+        }
+    }
+    return -1;
+}
+
+// Parse a number (decimal or 0x hex, optionally negative), returns 0 if text is not a number
+static int parse_number(const char *text, long *value) {
+    char *end;
+    const char *digits = text + (*text == '-' || *text == '+');
+    if (*text == '\0') {
+        return 0;
+    }
+    // Base 10 unless there is a 0x prefix, so a leading zero is not read as octal
+    int hex = digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X');
+    *value = strtol(text, &end, hex ? 16 : 10);
+    return *end == '\0';
+}
+
+static void emit(Assembler *as, uint8_t byte) {
+    if (as->size >= MEMORY_SIZE) {
+        if (as->size == MEMORY_SIZE) {
+            asm_error(as, "program does not fit in memory", NULL);
+        }
+        as->size = MEMORY_SIZE + 1;
+        return;
+    }
+    as->code[as->size++] = byte;
+}
+
+// Parse a register name, returns -1 if text is not one
+static int parse_register(const char *text) {
+    long value;
+    if ((text[0] != 'R' && text[0] != 'r') || !parse_number(text + 1, &value) ||
+            value < 0 || value >= NUM_REGISTERS) {
+        return -1;
+    }
+    return (int) value;
+}
+
+// Assemble one operand
+static void assemble_operand(Assembler *as, AsmOperand kind, char *text) {
+    long value;
+
+    switch (kind) {
+        case ASM_REG:
+            value = parse_register(text);
+            if (value < 0) {
+                asm_error(as, "invalid register", text);
+                return;
+            }
+            emit(as, (uint8_t) value);
+            break;
+        case ASM_VALUE:
+            if (!parse_number(text, &value) || value < -128 || value > 255) {
+                asm_error(as, "invalid value", text);
+                return;
+            }
+            emit(as, (uint8_t) value);
+            break;
+        case ASM_NATIVE:
+            if (!parse_number(text, &value) || value < 0 || value >= VM_MAX_NATIVES) {
+                asm_error(as, "invalid native function", text);
+                return;
+            }
+            emit(as, (uint8_t) value);
+            break;
+        case ASM_ADDRESS:
+            if (parse_number(text, &value)) {
+                if (value < 0 || value >= MEMORY_SIZE) {
+                    asm_error(as, "address out of range", text);
+                    return;
+                }
+            } else {
+                // Labels are resolved once the whole file has been read
+                if (strlen(text) > ASM_MAX_LABEL_LENGTH) {
+                    asm_error(as, "label too long", text);
+                    return;
+                }
+                if (as->fixup_count >= MEMORY_SIZE) {
+                    asm_error(as, "too many label references", NULL);
+                    return;
+                }
+                AsmFixup *fixup = &as->fixups[as->fixup_count++];
+                strcpy(fixup->name, text);
+                fixup->at = as->size;
+                fixup->line = as->line;
+                value = 0;
+            }
+            emit(as, (uint8_t) (value >> 8));
+            emit(as, (uint8_t) value);
+            break;
+    }
+}
+
+// Assemble one line of source
+static void assemble_line(Assembler *as, char *line) {
+    // Strip comments and the trailing newline
+    line[strcspn(line, ";#\r\n")] = '\0';
+    line = skip_space(line);
+
+    // Leading "label:"
+    char *colon = strchr(line, ':');
+    if (colon != NULL) {
+        *colon = '\0';
+        char *end = colon;
+        while (end > line && (end[-1] == ' ' || end[-1] == '\t')) {
+            *--end = '\0';
+        }
+        if (*line == '\0' || strlen(line) > ASM_MAX_LABEL_LENGTH || isdigit((unsigned char) *line)) {
+            asm_error(as, "invalid label", line);
+        } else if (find_label(as, line) >= 0) {
+            asm_error(as, "duplicate label", line);
+        } else if (as->label_count < ASM_MAX_LABELS) {
+            strcpy(as->labels[as->label_count].name, line);
+            as->labels[as->label_count++].address = as->size;
+        }
+        line = skip_space(colon + 1);
+    }
+    if (*line == '\0') {
+        return;
+    }
+
+    // Mnemonic
+    char *name = line;
+    while (*line && *line != ' ' && *line != '\t') {
+        line++;
+    }
+    if (*line) {
+        *line++ = '\0';
+    }
+    const AsmMnemonic *mnemonic = NULL;
+    for (size_t i = 0; i < sizeof(mnemonics) / sizeof(mnemonics[0]); i++) {
+        if (same_name(name, mnemonics[i].name)) {
+            mnemonic = &mnemonics[i];
+            break;
+        }
+    }
+    if (mnemonic == NULL) {
+        asm_error(as, "unknown instruction", name);
+        return;
+    }
+
+    // Comma separated operands
+    char *operands[ASM_MAX_OPERANDS + 1];
+    int count = 0;
+    line = skip_space(line);
+    while (*line && count <= ASM_MAX_OPERANDS) {
+        char *end = strchr(line, ',');
+        if (end != NULL) {
+            *end = '\0';
+        }
+        // Trim the operand
+        char *stop = line + strlen(line);
+        while (stop > line && (stop[-1] == ' ' || stop[-1] == '\t')) {
+            *--stop = '\0';
+        }
+        operands[count++] = line;
+        if (end == NULL) {
+            break;
+        }
+        line = skip_space(end + 1);
+    }
+    // Register lists become a single mask byte
+    if (mnemonic->count == ASM_REGISTER_LIST) {
+        uint8_t mask = 0;
+        if (count == 0 || count > ASM_MAX_OPERANDS) {
+            asm_error(as, "wrong number of operands for", mnemonic->name);
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            int reg = parse_register(operands[i]);
+            if (reg < 0) {
+                asm_error(as, "invalid register", operands[i]);
+                return;
+            }
+            mask |= (uint8_t) (1u << reg);
+        }
+        emit(as, mnemonic->opcode);
+        emit(as, mask);
+        return;
+    }
+    if (count != mnemonic->count) {
+        asm_error(as, "wrong number of operands for", mnemonic->name);
+        return;
+    }
+
+    emit(as, mnemonic->opcode);
+    for (int i = 0; i < count; i++) {
+        assemble_operand(as, mnemonic->operands[i], operands[i]);
+    }
+}
+
+// Fill in the label addresses now that every label is known
+static void resolve_labels(Assembler *as) {
+    for (int i = 0; i < as->fixup_count; i++) {
+        AsmFixup *fixup = &as->fixups[i];
+        int address = find_label(as, fixup->name);
+        as->line = fixup->line;
+        if (address < 0) {
+            asm_error(as, "undefined label", fixup->name);
+            continue;
+        }
+        if (fixup->at + 1 < MEMORY_SIZE) {
+            as->code[fixup->at] = (uint8_t) (address >> 8);
+            as->code[fixup->at + 1] = (uint8_t) address;
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    int raw = argc > 1 && strcmp(argv[1], "-raw") == 0;
+    if (argc != 3 + raw) {
+        fprintf(stderr, "Usage: %s [-raw] input.asm output.vmi\n", argv[0]);
+        return 1;
+    }
+    const char *input = argv[1 + raw];
+    const char *output = argv[2 + raw];
+
+    Assembler *as = (Assembler*) calloc(1, sizeof(Assembler));
+    if (as == NULL) {
+        fprintf(stderr, "Error, allocation failed\n");
+        return 1;
+    }
+    as->path = input;
+    FILE *file = fopen(input, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Error, could not open %s\n", input);
+        free(as);
+        return 1;
+    }
+    char line[ASM_MAX_LINE];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        as->line++;
+        assemble_line(as, line);
+    }
+    fclose(file);
+    resolve_labels(as);
+    if (as->errors > 0) {
+        fprintf(stderr, "%d error(s), nothing written\n", as->errors);
+        free(as);
+        return 1;
+    }
+
+    // Run the program through the verifier so only loadable programs are written
+    VmImage *image = vm_image_create(as->code, (size_t) as->size, 1);
+    if (image == NULL) {
+        fprintf(stderr, "Error, %s failed verification, nothing written\n", input);
+        free(as);
+        return 1;
+    }
+    int result;
+    if (raw) {
+        FILE *out = fopen(output, "wb");
+        result = out != NULL && fwrite(as->code, 1, (size_t) as->size, out) == (size_t) as->size ? 0 : -1;
+        if (out != NULL && fclose(out) != 0) {
+            result = -1;
+        }
+        if (result != 0) {
+            fprintf(stderr, "Error, could not write %s\n", output);
+        }
+    } else {
+        result = vm_image_save(image, output);
+    }
+    vm_image_release(image);
+    free(as);
+    return result == 0 ? 0 : 1;
+}
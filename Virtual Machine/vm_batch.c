@@ -0,0 +1,198 @@
+/*
+This file implements the multi-core batch executor for the virtual machine.
+
+vm_batch_run takes an array of independent jobs (program + initial registers) and spreads them over
+a pool of pthreads. Every worker owns its own cache-aligned VirtualMachine and starts with an even
+slice of the job array. Jobs are claimed one at a time with an atomic increment on the slice's
+cursor, and a worker that runs out steals from the other slices the same way, so uneven job lengths
+still keep every core busy.
+
+A worker keeps the image of the last program it loaded, so a run of jobs with the same program pointer
+decodes and verifies it once per worker, and with VM_ENGINE_JIT compiles it once per worker.
+
+Each job has its own output buffer that the worker's callback sink appends to, and a job only ever runs on one
+worker, so results are collected without any locks.
+
+Author: Zane Francis
+*/
+
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "Virtual_Machine.h"
+
+#define CACHE_LINE 64
+
+// Per-thread state, aligned so workers never share a cache line
+typedef struct {
+    size_t next;                // Next unclaimed job in this worker's slice (atomic)
+    size_t end;                 // End of this worker's slice
+    char pad[CACHE_LINE - 2 * sizeof(size_t)];  // Thieves touch the cursor, keep it off the VM's lines
+    VmSink sink;                // Callback sink pointed at the current job's output
+    VmImage *image;             // Image of the last job's program, reused while the jobs share it
+    const uint8_t *program;
+    size_t size;
+    VirtualMachine vm;
+} __attribute__((aligned(CACHE_LINE))) VmWorker;
+
+// Shared, read-only state for one batch
+typedef struct {
+    VmJob *jobs;
+    VmWorker *workers;
+    int num_workers;
+    VmEngine engine;
+} VmBatch;
+
+// Arguments for one worker thread
+typedef struct {
+    VmBatch *batch;
+    int index;
+} VmWorkerArgs;
+
+// PRINT callback: append to the job's own output buffer (ctx is the VmJob)
+void vm_job_capture_print(void *ctx, vm_word value) {
+    VmJob *job = (VmJob*) ctx;
+
+    if (job->output_count >= job->output_capacity) {
+        size_t new_capacity = job->output_capacity ? job->output_capacity * 2 : 16;
+        vm_word *temp = (vm_word*) realloc(job->output, sizeof(vm_word) * new_capacity);
+        if (temp == NULL) {
+            fprintf(stderr, "Error, job output allocation failed\n");
+            return;
+        }
+        job->output = temp;
+        job->output_capacity = new_capacity;
+    }
+    job->output[job->output_count++] = value;
+}
+
+// Run one job on a worker's virtual machine
+static void batch_run_job(VmWorker *worker, VmJob *job, VmEngine engine) {
+    VirtualMachine *vm = &worker->vm;
+
+    vm_init(vm);
+    vm_sink_init_callback(&worker->sink, vm_job_capture_print, job);
+    vm_set_sink(vm, &worker->sink);
+    job->output_count = 0;
+    // Jobs next to each other usually run the same program, so they share one image (and its native code)
+    if (worker->image == NULL || worker->program != job->program || worker->size != job->size) {
+        vm_image_release(worker->image);
+        worker->image = vm_image_create(job->program, job->size, vm->fusion);
+        worker->program = job->program;
+        worker->size = job->size;
+    }
+    if (worker->image == NULL) {
+        job->status = VM_JOB_REJECTED;
+        return;
+    }
+    vm_attach_image(vm, worker->image);
+    memcpy(vm->registers, job->registers, sizeof(vm->registers));
+    vm_run(vm, engine);
+    memcpy(job->registers, vm->registers, sizeof(vm->registers));
+    job->status = vm->halted ? VM_JOB_HALTED : VM_JOB_ERROR;
+    vm_unload(vm);
+}
+
+// Claim the next job from a worker's slice (returns 0 once the slice is empty)
+static int batch_claim(VmWorker *worker, size_t *index) {
+    if (__atomic_load_n(&worker->next, __ATOMIC_RELAXED) >= worker->end) {
+        return 0;
+    }
+    *index = __atomic_fetch_add(&worker->next, 1, __ATOMIC_RELAXED);
+    return *index < worker->end;
+}
+
+// Worker thread: drain our own slice, then steal from the others
+static void *batch_worker(void *arg) {
+    VmWorkerArgs *args = (VmWorkerArgs*) arg;
+    VmBatch *batch = args->batch;
+    VmWorker *self = &batch->workers[args->index];
+    size_t index;
+
+    while (batch_claim(self, &index)) {
+        batch_run_job(self, &batch->jobs[index], batch->engine);
+    }
+    for (int i = 1; i < batch->num_workers; i++) {
+        VmWorker *victim = &batch->workers[(args->index + i) % batch->num_workers];
+        while (batch_claim(victim, &index)) {
+            batch_run_job(self, &batch->jobs[index], batch->engine);
+        }
+    }
+    return NULL;
+}
+
+// Run every job on a pool of threads (num_threads <= 0 uses one per online CPU)
+int vm_batch_run(VmJob *jobs, size_t count, int num_threads, VmEngine engine) {
+    if (jobs == NULL) {
+        fprintf(stderr, "Error, no jobs\n");
+        return -1;
+    }
+    if (num_threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? (int) cpus : 1;
+    }
+    if ((size_t) num_threads > count) {
+        num_threads = count > 0 ? (int) count : 1;
+    }
+
+    VmWorker *workers = NULL;
+    if (posix_memalign((void**) &workers, CACHE_LINE, sizeof(VmWorker) * num_threads) != 0) {
+        fprintf(stderr, "Error, worker allocation failed\n");
+        return -1;
+    }
+    pthread_t *threads = (pthread_t*) malloc(sizeof(pthread_t) * num_threads);
+    VmWorkerArgs *args = (VmWorkerArgs*) malloc(sizeof(VmWorkerArgs) * num_threads);
+    if (threads == NULL || args == NULL) {
+        fprintf(stderr, "Error, thread allocation failed\n");
+        free(workers);
+        free(threads);
+        free(args);
+        return -1;
+    }
+
+    // Give every worker an even slice of the jobs to start with
+    VmBatch batch = { jobs, workers, num_threads, engine };
+    for (int i = 0; i < num_threads; i++) {
+        workers[i].next = count * i / num_threads;
+        workers[i].end = count * (i + 1) / num_threads;
+        workers[i].image = NULL;
+        args[i].batch = &batch;
+        args[i].index = i;
+    }
+
+    // The calling thread works as worker 0 (and steals the slice of any thread that failed to start)
+    int started = 1;
+    for (int i = 1; i < num_threads; i++) {
+        if (pthread_create(&threads[i], NULL, batch_worker, &args[i]) != 0) {
+            fprintf(stderr, "Error, could not start worker %d\n", i);
+            break;
+        }
+        started++;
+    }
+    batch_worker(&args[0]);
+    for (int i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    for (int i = 0; i < num_threads; i++) {
+        vm_image_release(workers[i].image);
+    }
+
+    free(workers);
+    free(threads);
+    free(args);
+    return 0;
+}
+
+// Release the output buffers of a finished batch
+void vm_batch_free_output(VmJob *jobs, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(jobs[i].output);
+        jobs[i].output = NULL;
+        jobs[i].output_count = 0;
+        jobs[i].output_capacity = 0;
+    }
+}
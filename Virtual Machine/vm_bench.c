@@ -0,0 +1,368 @@
+/*
+This is the benchmark harness for the virtual machine (make bench).
+
+It builds a small corpus of representative programs (countdown loops, nested loops with extra JZ
+branches, push/pop heavy code, mul/div chains, subroutine calls that save registers, bulk
+operations over 96-byte ranges of data memory and host function calls), runs each one on every
+execution engine and reports guest instructions per second and nanoseconds per instruction. On
+Linux it also reads the hardware counters through perf_event_open (host cycles, host instructions,
+IPC and branch misses); if the counters are not available those columns are left empty.
+
+Results are appended to a CSV file (bench_results.csv by default) with a fixed set of columns and
+the revision the binary was built from, so runs from different commits can be compared directly.
+
+Usage: ./vm_bench [output.csv] [repeats]
+
+Author: Zane Francis
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include "Virtual_Machine.h"
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#define BENCH_HAVE_PERF 1
+#endif
+
+#ifndef VM_BENCH_REVISION
+#define VM_BENCH_REVISION "unknown"
+#endif
+
+#define CSV_HEADER "revision,program,engine,guest_instructions,seconds,instructions_per_sec,ns_per_instruction," \
+                   "host_cycles,host_instructions,ipc,branch_misses\n"
+
+// Loop counter registers (r0..r2 for the loops, r7 holds the constant 1)
+#define REG_ONE 7
+#define LOOP_LEVELS 3
+#define LOOP_COUNT 150
+
+// Emits the body of the innermost loop at address base and returns its length
+typedef size_t (*BodyFn)(uint8_t *out, uint16_t base);
+
+// Benchmark program
+typedef struct {
+    const char *name;
+    BodyFn body;
+} BenchProgram;
+
+// Execution engine under test
+typedef struct {
+    const char *name;
+    VmEngine engine;
+    int fusion;
+} BenchEngine;
+
+// Hardware counter values for one run
+typedef struct {
+    int valid;
+    uint64_t cycles;
+    uint64_t instructions;
+    uint64_t branch_misses;
+} BenchCounters;
+
+// Inner loop bodies (only r3..r6 are free to use)
+static size_t body_countdown(uint8_t *out, uint16_t base) {
+    (void) out;
+    (void) base;
+    return 0;
+}
+
+static size_t body_nested_jz(uint8_t *out, uint16_t base) {
+    // ADD r3, r7, r3 ; JZ r3, next (taken every 256 iterations, lands on the same address either way)
+    uint16_t next = (uint16_t) (base + 8);
+    uint8_t body[] = { OP_ADD, 3, REG_ONE, 3, OP_JZ, 3, (uint8_t) (next >> 8), (uint8_t) next };
+    memcpy(out, body, sizeof(body));
+    return sizeof(body);
+}
+
+static size_t body_push_pop(uint8_t *out, uint16_t base) {
+    (void) base;
+    uint8_t body[] = { OP_PUSH, 3, OP_PUSH, 4, OP_POP, 4, OP_POP, 3, OP_ADD, 3, REG_ONE, 3 };
+    memcpy(out, body, sizeof(body));
+    return sizeof(body);
+}
+
+static size_t body_mul_div(uint8_t *out, uint16_t base) {
+    (void) base;
+    uint8_t body[] = { OP_LOAD, 5, 3, OP_MUL, 3, 5, 4, OP_LOAD, 6, 7, OP_DIV, 4, 6, 3, OP_ADD, 3, REG_ONE, 3 };
+    memcpy(out, body, sizeof(body));
+    return sizeof(body);
+}
+
+static size_t body_call_pushm(uint8_t *out, uint16_t base) {
+    // CALL sub ; JMP done ; sub: PUSHM r4-r6 ; LOAD r4, 3 ; ADD r3, r4, r5 ; POPM r4-r6 ; ADD r3, r7, r3 ; RET
+    uint16_t sub = (uint16_t) (base + 6);
+    uint16_t done = (uint16_t) (base + 22);
+    uint8_t body[] = {
+        OP_CALL, (uint8_t) (sub >> 8), (uint8_t) sub,
+        OP_JMP, (uint8_t) (done >> 8), (uint8_t) done,
+        OP_PUSHM, 0x70, OP_LOAD, 4, 3, OP_ADD, 3, 4, 5, OP_POPM, 0x70, OP_ADD, 3, REG_ONE, 3, OP_RET,
+    };
+    memcpy(out, body, sizeof(body));
+    return sizeof(body);
+}
+
+static size_t body_vector(uint8_t *out, uint16_t base) {
+    // LOAD r4, 0 ; LOAD r5, 128 ; LOAD r6, 96 ; VADD r4, r5, r6 ; VMUL r5, r4, r6 ; VSUM r3, r4, r6
+    (void) base;
+    uint8_t body[] = {
+        OP_LOAD, 4, 0, OP_LOAD, 5, 128, OP_LOAD, 6, 96,
+        OP_VADD, 4, 5, 6, OP_VMUL, 5, 4, 6, OP_VSUM, 3, 4, 6,
+    };
+    memcpy(out, body, sizeof(body));
+    return sizeof(body);
+}
+
+static size_t body_native(uint8_t *out, uint16_t base) {
+    // LOAD r4, 0 ; LOAD r6, 96 ; CALLN 0 (r3 = checksum of data[r4 .. r4 + r6 - 1])
+    (void) base;
+    uint8_t body[] = { OP_LOAD, 4, 0, OP_LOAD, 6, 96, OP_CALLN, 0 };
+    memcpy(out, body, sizeof(body));
+    return sizeof(body);
+}
+
+// Host function for the native program: FNV-1a over a range of data memory
+static int native_checksum(VirtualMachine *vm, vm_word *registers, uint8_t *data, void *ctx) {
+    uint32_t hash = 2166136261u;
+    (void) vm;
+    (void) ctx;
+    if (!vm_data_address(registers[4]) || registers[6] > VM_DATA_SIZE - registers[4]) {
+        return -1;
+    }
+    for (size_t i = 0; i < registers[6]; i++) {
+        hash = (hash ^ data[registers[4] + i]) * 16777619u;
+    }
+    registers[3] = (vm_word) hash;
+    return 0;
+}
+
+static const BenchProgram programs[] = {
+    { "countdown", body_countdown },
+    { "nested_jz", body_nested_jz },
+    { "push_pop", body_push_pop },
+    { "mul_div", body_mul_div },
+    { "call_pushm", body_call_pushm },
+    { "vector", body_vector },
+    { "native", body_native },
+};
+
+static const BenchEngine engines[] = {
+    { "switch", VM_ENGINE_SWITCH, 1 },
+    { "threaded", VM_ENGINE_THREADED, 1 },
+    { "threaded_nofuse", VM_ENGINE_THREADED, 0 },
+    { "jit", VM_ENGINE_JIT, 1 },
+};
+
+/*
+Build LOOP_LEVELS nested countdown loops around a body:
+    LOAD r7, 1
+    LOAD r0, N ; LOAD r1, N ; LOAD r2, N
+    body
+    SUB r2, r7, r2 ; JZ r2, tail1 ; JMP body
+    SUB r1, r7, r1 ; JZ r1, tail0 ; JMP (LOAD r2)
+    SUB r0, r7, r0 ; JZ r0, halt  ; JMP (LOAD r1)
+    HALT
+*/
+static size_t build_program(uint8_t *out, BodyFn body) {
+    size_t len = 0;
+    uint16_t body_start = 3 + 3 * LOOP_LEVELS;
+
+    out[len++] = OP_LOAD;
+    out[len++] = REG_ONE;
+    out[len++] = 1;
+    for (int level = 0; level < LOOP_LEVELS; level++) {
+        out[len++] = OP_LOAD;
+        out[len++] = (uint8_t) level;
+        out[len++] = LOOP_COUNT;
+    }
+    len += body(&out[len], body_start);
+    for (int level = LOOP_LEVELS - 1; level >= 0; level--) {
+        uint16_t exit = (uint16_t) (len + 11);
+        uint16_t again = (uint16_t) (3 + 3 * (level + 1));
+        uint8_t tail[] = {
+            OP_SUB, (uint8_t) level, REG_ONE, (uint8_t) level,
+            OP_JZ, (uint8_t) level, (uint8_t) (exit >> 8), (uint8_t) exit,
+            OP_JMP, (uint8_t) (again >> 8), (uint8_t) again,
+        };
+        memcpy(&out[len], tail, sizeof(tail));
+        len += sizeof(tail);
+    }
+    out[len++] = OP_HALT;
+    return len;
+}
+
+#ifdef BENCH_HAVE_PERF
+// Open one counter in the group led by group_fd (-1 opens the leader)
+static int perf_open(uint64_t config, int group_fd) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.disabled = group_fd == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+#endif
+
+// Hardware counters for the calling thread
+typedef struct {
+    int fds[3];
+} BenchPerf;
+
+static void perf_start(BenchPerf *perf) {
+    perf->fds[0] = perf->fds[1] = perf->fds[2] = -1;
+#ifdef BENCH_HAVE_PERF
+    perf->fds[0] = perf_open(PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (perf->fds[0] < 0) {
+        return;
+    }
+    perf->fds[1] = perf_open(PERF_COUNT_HW_INSTRUCTIONS, perf->fds[0]);
+    perf->fds[2] = perf_open(PERF_COUNT_HW_BRANCH_MISSES, perf->fds[0]);
+    if (perf->fds[1] < 0 || perf->fds[2] < 0) {
+        return;
+    }
+    ioctl(perf->fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(perf->fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+}
+
+static void perf_stop(BenchPerf *perf, BenchCounters *counters) {
+    memset(counters, 0, sizeof(*counters));
+#ifdef BENCH_HAVE_PERF
+    if (perf->fds[0] >= 0 && perf->fds[1] >= 0 && perf->fds[2] >= 0) {
+        uint64_t values[4];
+        ioctl(perf->fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        if (read(perf->fds[0], values, sizeof(values)) == (ssize_t) sizeof(values) && values[0] == 3) {
+            counters->valid = 1;
+            counters->cycles = values[1];
+            counters->instructions = values[2];
+            counters->branch_misses = values[3];
+        }
+    }
+#endif
+    for (int i = 0; i < 3; i++) {
+        if (perf->fds[i] >= 0) {
+            close(perf->fds[i]);
+        }
+    }
+}
+
+static double now_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec + (double) now.tv_nsec / 1e9;
+}
+
+// Count the guest instructions a program executes (one vm_step per instruction)
+static uint64_t count_instructions(uint8_t *program, size_t size) {
+    VirtualMachine *vm = (VirtualMachine*) malloc(sizeof(VirtualMachine));
+    uint64_t count = 0;
+
+    vm_init(vm);
+    vm_register_native(vm, 0, native_checksum, NULL);
+    if (vm_load_program(vm, program, size) == 0) {
+        while (vm->running) {
+            vm_step(vm);
+            count++;
+        }
+    }
+    vm_unload(vm);
+    free(vm);
+    return count;
+}
+
+// Run one program on one engine, keeping the fastest of several runs
+static double run_engine(uint8_t *program, size_t size, const BenchEngine *engine, int repeats,
+                         BenchCounters *best_counters) {
+    VirtualMachine *vm = (VirtualMachine*) malloc(sizeof(VirtualMachine));
+    double best = -1.0;
+
+    memset(best_counters, 0, sizeof(*best_counters));
+    for (int i = 0; i < repeats; i++) {
+        BenchPerf perf;
+        BenchCounters counters;
+
+        vm_init(vm);
+        vm_register_native(vm, 0, native_checksum, NULL);
+        vm->fusion = (uint8_t) engine->fusion;
+        vm_load_program(vm, program, size);
+        perf_start(&perf);
+        double start = now_seconds();
+        vm_run(vm, engine->engine);
+        double elapsed = now_seconds() - start;
+        perf_stop(&perf, &counters);
+        vm_unload(vm);
+        if (best < 0 || elapsed < best) {
+            best = elapsed;
+            *best_counters = counters;
+        }
+    }
+    free(vm);
+    return best;
+}
+
+int main(int argc, char **argv) {
+    const char *csv_path = argc > 1 ? argv[1] : "bench_results.csv";
+    int repeats = argc > 2 ? atoi(argv[2]) : 3;
+    uint8_t program[MEMORY_SIZE];
+
+    if (repeats <= 0) {
+        repeats = 1;
+    }
+    // Append so results from several commits can live in one file
+    FILE *existing = fopen(csv_path, "r");
+    FILE *csv = fopen(csv_path, "a");
+    if (csv == NULL) {
+        fprintf(stderr, "Error, could not open %s\n", csv_path);
+        return 1;
+    }
+    if (existing == NULL) {
+        fputs(CSV_HEADER, csv);
+    } else {
+        fclose(existing);
+    }
+
+    printf("%-10s %-16s %12s %10s %14s %8s %8s %14s\n",
+        "program", "engine", "guest_instr", "seconds", "instr/sec", "ns/instr", "ipc", "branch_misses");
+    for (size_t p = 0; p < sizeof(programs) / sizeof(programs[0]); p++) {
+        size_t size = build_program(program, programs[p].body);
+        uint64_t guest_instructions = count_instructions(program, size);
+
+        for (size_t e = 0; e < sizeof(engines) / sizeof(engines[0]); e++) {
+            BenchCounters counters;
+            double seconds = run_engine(program, size, &engines[e], repeats, &counters);
+            double per_sec = seconds > 0 ? (double) guest_instructions / seconds : 0.0;
+            double ns_per = guest_instructions > 0 ? seconds * 1e9 / (double) guest_instructions : 0.0;
+            double ipc = counters.valid && counters.cycles > 0 ?
+                (double) counters.instructions / (double) counters.cycles : 0.0;
+
+            printf("%-10s %-16s %12llu %10.4f %14.0f %8.3f ", programs[p].name, engines[e].name,
+                (unsigned long long) guest_instructions, seconds, per_sec, ns_per);
+            fprintf(csv, "%s,%s,%s,%llu,%.6f,%.0f,%.4f,", VM_BENCH_REVISION, programs[p].name,
+                engines[e].name, (unsigned long long) guest_instructions, seconds, per_sec, ns_per);
+            if (counters.valid) {
+                printf("%8.2f %14llu\n", ipc, (unsigned long long) counters.branch_misses);
+                fprintf(csv, "%llu,%llu,%.4f,%llu\n", (unsigned long long) counters.cycles,
+                    (unsigned long long) counters.instructions, ipc, (unsigned long long) counters.branch_misses);
+            } else {
+                printf("%8s %14s\n", "-", "-");
+                fprintf(csv, ",,,\n");
+            }
+        }
+    }
+    fclose(csv);
+    printf("\nResults appended to %s\n", csv_path);
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+This file implements shared code images and execution snapshots for the virtual machine.
+
+A VmImage holds everything about a program that never changes while it runs: the memory bytes, the
+pre-decoded instruction stream and the verifier results. vm_image_create builds one (decoding and
+verifying once), and any number of VMs can run it through vm_attach_image, so starting another
+instance of a program costs a pointer and a reference count instead of copying and decoding ~4 KB.
+Images are reference counted (atomically, so VMs on different threads can share one) and freed when
+the last VM or snapshot lets go of them, together with the native code vm_execute_jit compiled for
+them.
+
+vm_snapshot checkpoints the registers, pc, stack, call stack, data memory and flags of a VM and
+vm_restore puts them back (only the call stack entries in use are copied).
+The stack and data memory are big but mostly untouched, so both only copy what was ever written.
+Every VM tracks stack_low, the lowest the stack pointer has been since vm_init (updated on POP, the
+only point where the stack pointer turns back up), and no slot below it has ever been written. It
+also marks each 64-byte page of data memory on its first store (data_written), and a page that is not
+marked is all zero. A snapshot copies the stack above its mark and the marked pages, and a restore
+rewrites the stack above the lower of the two marks and the pages either side marked, which for most
+programs is a handful of bytes.
+
+Author: Zane Francis
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "Virtual_Machine.h"
+
+// All-zero image every VM starts on (never freed, refs stays 0)
+VmImage vm_empty_image;
+
+// Build a decoded and verified image of a program (returns NULL if it is rejected)
+VmImage *vm_image_create(const uint8_t *program, size_t size, int fusion) {
+    if (size > MEMORY_SIZE) {
+        fprintf(stderr, "Error, Program size (%zu bytes) exceeds the memory siz (%d bytes)\n",
+            size, MEMORY_SIZE);
+        return NULL;
+    }
+    VmImage *image = (VmImage*) calloc(1, sizeof(VmImage));
+    if (image == NULL) {
+        fprintf(stderr, "Error, image allocation failed\n");
+        return NULL;
+    }
+    if (size > 0) {
+        memcpy(image->memory, program, size);
+    }
+    image->size = size;
+    image->fusion = fusion ? 1 : 0;
+    image->refs = 1;
+    // Decode once for the threaded engine, verify once so the engines can skip the per-instruction checks
+    vm_decode_program(image);
+    if (vm_verify_program(image) != 0) {
+        free(image);
+        return NULL;
+    }
+    return image;
+}
+
+void vm_image_retain(VmImage *image) {
+    if (image->refs != 0) {
+        __atomic_add_fetch(&image->refs, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Drop one reference, freeing the image with the last one
+void vm_image_release(VmImage *image) {
+    if (image == NULL || image == &vm_empty_image) {
+        return;
+    }
+    if (__atomic_sub_fetch(&image->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        vm_jit_free(image->jit);
+        free(image);
+    }
+}
+
+// Run a shared image on a VM (registers, pc and stack are left as they are, like vm_load_program)
+void vm_attach_image(VirtualMachine *vm, VmImage *image) {
+    vm_image_retain(image);
+    vm_image_release(vm->image);
+    vm->image = image;
+    vm->memory = image->memory;
+    vm->running = 1;
+    vm->halted = 0;
+}
+
+// Let go of the loaded program (the VM goes back to the empty image)
+void vm_unload(VirtualMachine *vm) {
+    vm_image_release(vm->image);
+    vm->image = &vm_empty_image;
+    vm->memory = vm_empty_image.memory;
+    vm->running = 0;
+}
+
+// Lowest stack pointer a VM has reached, nothing below it has been written
+static uint16_t stack_mark(uint16_t sp, uint16_t stack_low) {
+    return sp < stack_low ? sp : stack_low;
+}
+
+// Bytes of data memory in a page (the last one can be short)
+static size_t data_page_size(int page) {
+    size_t start = (size_t) page << VM_DATA_PAGE_SHIFT;
+    size_t end = start + ((size_t) 1 << VM_DATA_PAGE_SHIFT);
+    return (end < VM_DATA_SIZE ? end : VM_DATA_SIZE) - start;
+}
+
+// Checkpoint a VM's execution state (holds a reference to its image until vm_snapshot_free)
+// Only the stack slots and data pages that were ever written are copied, the rest is known to be zero
+void vm_snapshot(const VirtualMachine *vm, VmSnapshot *snap) {
+    uint16_t low = stack_mark(vm->sp, vm->stack_low);
+
+    snap->image = vm->image;
+    vm_image_retain(snap->image);
+    memcpy(snap->registers, vm->registers, sizeof(vm->registers));
+    snap->pc = vm->pc;
+    snap->sp = vm->sp;
+    snap->stack_low = low;
+    snap->call_depth = vm->call_depth;
+    memcpy(snap->call_stack, vm->call_stack, sizeof(uint16_t) * vm->call_depth);
+    snap->running = vm->running;
+    snap->halted = vm->halted;
+    if (low + 1 < MEMORY_SIZE) {
+        memcpy(&snap->stack[low + 1], &vm->stack[low + 1], sizeof(vm_word) * (MEMORY_SIZE - 1 - low));
+    }
+    memcpy(snap->data_written, vm->data_written, sizeof(vm->data_written));
+    for (int page = 0; page < VM_DATA_PAGES; page++) {
+        if (vm->data_written[page]) {
+            size_t start = (size_t) page << VM_DATA_PAGE_SHIFT;
+            memcpy(&snap->data[start], &vm->data[start], data_page_size(page));
+        }
+    }
+}
+
+// Put a VM back into a snapshot's state (the sink and profile stay attached)
+void vm_restore(VirtualMachine *vm, const VmSnapshot *snap) {
+    uint16_t low = stack_mark(vm->sp, vm->stack_low);
+
+    if (vm->image != snap->image) {
+        vm_image_retain(snap->image);
+        vm_image_release(vm->image);
+        vm->image = snap->image;
+        vm->memory = snap->image->memory;
+    }
+    memcpy(vm->registers, snap->registers, sizeof(vm->registers));
+    // Below low neither stack was ever written, so only the part above it can differ. The snapshot
+    // holds the slots above its own mark, the ones between the two marks were zero when it was taken
+    if (snap->stack_low < low) {
+        low = snap->stack_low;
+    }
+    if (low < snap->stack_low) {
+        memset(&vm->stack[low + 1], 0, sizeof(vm_word) * (size_t) (snap->stack_low - low));
+    }
+    if (snap->stack_low + 1 < MEMORY_SIZE) {
+        memcpy(&vm->stack[snap->stack_low + 1], &snap->stack[snap->stack_low + 1],
+            sizeof(vm_word) * (MEMORY_SIZE - 1 - snap->stack_low));
+    }
+    vm->pc = snap->pc;
+    vm->sp = snap->sp;
+    vm->stack_low = low;
+    vm->call_depth = snap->call_depth;
+    memcpy(vm->call_stack, snap->call_stack, sizeof(uint16_t) * snap->call_depth);
+    // Pages neither side wrote are zero in both
+    for (int page = 0; page < VM_DATA_PAGES; page++) {
+        size_t start = (size_t) page << VM_DATA_PAGE_SHIFT;
+        if (snap->data_written[page]) {
+            memcpy(&vm->data[start], &snap->data[start], data_page_size(page));
+        } else if (vm->data_written[page]) {
+            memset(&vm->data[start], 0, data_page_size(page));
+        }
+    }
+    memcpy(vm->data_written, snap->data_written, sizeof(vm->data_written));
+    vm->running = snap->running;
+    vm->halted = snap->halted;
+}
+
+void vm_snapshot_free(VmSnapshot *snap) {
+    vm_image_release(snap->image);
+    snap->image = NULL;
+}
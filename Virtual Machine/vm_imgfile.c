@@ -0,0 +1,304 @@
+/*
+This file implements the binary program image format (.vmi files) written by the assembler.
+
+A .vmi file holds the program bytes together with the results of the load-time analysis, so loading
+one skips the verifier's control-flow walk. Everything is little-endian:
+
+    offset  size  field
+    0       4     magic "ZVMI"
+    4       2     format version (VM_IMAGE_FILE_VERSION)
+    6       2     memory size the program was built for
+    8       2     code size in bytes
+    10      2     number of basic blocks
+    12      2     number of jump table entries
+    14      2     max stack depth
+    16      1     flags (bit 0: stack depth is known at every instruction)
+    17      3     reserved, zero
+    20      4     FNV-1a checksum of everything after the header
+    24      8     reserved, zero
+    32            code bytes
+                  basic blocks: 2-byte start address, 2-byte stack depth on entry
+                  jump table: 2-byte branch address, 2-byte target address
+
+vm_image_load maps the file, checks the header and checksum, rebuilds the per-address verifier flags
+and depths by walking each basic block, and then runs vm_verify_metadata, a single linear pass that
+confirms the loaded results are self-consistent (so a damaged or hand-edited file can never reach the
+unchecked fast paths). Only the instruction starts it confirmed are decoded for the threaded engine.
+The bytecode and the analysis do not depend on the register width, so one file runs on every
+VM_WORD_BITS variant built for its memory size.
+
+Author: Zane Francis
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Virtual_Machine.h"
+
+#define IMAGE_HEADER_SIZE 32
+#define IMAGE_FLAG_STACK_CHECKED 0x01
+// Largest possible file: full memory, a block at every address and a jump table entry for every one
+#define IMAGE_MAX_FILE_SIZE (IMAGE_HEADER_SIZE + MEMORY_SIZE * 9)
+
+// Little-endian field access
+static void put_u16(uint8_t *out, uint16_t value) {
+    out[0] = (uint8_t) value;
+    out[1] = (uint8_t) (value >> 8);
+}
+
+static void put_u32(uint8_t *out, uint32_t value) {
+    put_u16(out, (uint16_t) value);
+    put_u16(out + 2, (uint16_t) (value >> 16));
+}
+
+static uint16_t get_u16(const uint8_t *in) {
+    return (uint16_t) (in[0] | (in[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+    return (uint32_t) get_u16(in) | ((uint32_t) get_u16(in + 2) << 16);
+}
+
+static uint32_t image_checksum(const uint8_t *data, size_t size) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Instructions that end a basic block
+static int ends_block(uint8_t opcode) {
+    return opcode == OP_HALT || opcode == OP_JMP || opcode == OP_JZ || opcode == OP_CALL || opcode == OP_RET;
+}
+
+// Instructions with a target address (the jump table), returns the operand offset of the address or 0
+static int branch_operand(uint8_t opcode) {
+    return opcode == OP_JMP || opcode == OP_CALL ? 1 : opcode == OP_JZ ? 2 : 0;
+}
+
+// Write a verified image to a .vmi file (returns 0 on success, -1 on failure)
+int vm_image_save(const VmImage *image, const char *path) {
+    const VmVerifyInfo *info = &image->verify;
+    uint8_t leader[MEMORY_SIZE];
+    size_t blocks = 0;
+    size_t jumps = 0;
+
+    if (!info->verified) {
+        fprintf(stderr, "Error, only verified images can be saved\n");
+        return -1;
+    }
+    // Block leaders: address 0, jump targets, and whatever follows a branch
+    memset(leader, 0, sizeof(leader));
+    leader[0] = 1;
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (!(info->flags[addr] & VM_ADDR_START)) {
+            continue;
+        }
+        uint8_t opcode = image->memory[addr];
+        int next = addr + vm_instruction_length(opcode);
+        if (info->flags[addr] & VM_ADDR_TARGET) {
+            leader[addr] = 1;
+        }
+        if (branch_operand(opcode)) {
+            jumps++;
+        }
+        if (ends_block(opcode) && next < MEMORY_SIZE && (info->flags[next] & VM_ADDR_START)) {
+            leader[next] = 1;
+        }
+    }
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        blocks += leader[addr] && (info->flags[addr] & VM_ADDR_START);
+    }
+
+    size_t body_size = image->size + blocks * 4 + jumps * 4;
+    uint8_t *file_data = (uint8_t*) calloc(1, IMAGE_HEADER_SIZE + body_size);
+    if (file_data == NULL) {
+        fprintf(stderr, "Error, image file allocation failed\n");
+        return -1;
+    }
+    uint8_t *body = file_data + IMAGE_HEADER_SIZE;
+    uint8_t *block_out = body + image->size;
+    uint8_t *jump_out = block_out + blocks * 4;
+
+    memcpy(body, image->memory, image->size);
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (!(info->flags[addr] & VM_ADDR_START)) {
+            continue;
+        }
+        if (leader[addr]) {
+            put_u16(block_out, (uint16_t) addr);
+            put_u16(block_out + 2, info->stack_checked ? info->depth[addr] : 0);
+            block_out += 4;
+        }
+        int at = branch_operand(image->memory[addr]);
+        if (at) {
+            const uint8_t *operand = &image->memory[addr + at];
+            put_u16(jump_out, (uint16_t) addr);
+            put_u16(jump_out + 2, (uint16_t) ((operand[0] << 8) | operand[1]));
+            jump_out += 4;
+        }
+    }
+
+    memcpy(file_data, "ZVMI", 4);
+    put_u16(file_data + 4, VM_IMAGE_FILE_VERSION);
+    put_u16(file_data + 6, MEMORY_SIZE);
+    put_u16(file_data + 8, (uint16_t) image->size);
+    put_u16(file_data + 10, (uint16_t) blocks);
+    put_u16(file_data + 12, (uint16_t) jumps);
+    put_u16(file_data + 14, info->max_stack_depth);
+    file_data[16] = info->stack_checked ? IMAGE_FLAG_STACK_CHECKED : 0;
+    put_u32(file_data + 20, image_checksum(body, body_size));
+
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error, could not open %s\n", path);
+        free(file_data);
+        return -1;
+    }
+    int result = 0;
+    if (fwrite(file_data, 1, IMAGE_HEADER_SIZE + body_size, file) != IMAGE_HEADER_SIZE + body_size) {
+        fprintf(stderr, "Error, could not write %s\n", path);
+        result = -1;
+    }
+    if (fclose(file) != 0) {
+        result = -1;
+    }
+    free(file_data);
+    return result;
+}
+
+// Build an image from the bytes of a .vmi file (returns NULL if they are not a valid image)
+static VmImage *image_parse(const uint8_t *data, size_t size, int fusion, const char *path) {
+    if (size < IMAGE_HEADER_SIZE || memcmp(data, "ZVMI", 4) != 0) {
+        fprintf(stderr, "Error, %s is not a program image\n", path);
+        return NULL;
+    }
+    if (get_u16(data + 4) != VM_IMAGE_FILE_VERSION || get_u16(data + 6) != MEMORY_SIZE) {
+        fprintf(stderr, "Error, %s was built for version %d with %d bytes of memory\n", path,
+            get_u16(data + 4), get_u16(data + 6));
+        return NULL;
+    }
+    size_t code_size = get_u16(data + 8);
+    size_t blocks = get_u16(data + 10);
+    size_t jumps = get_u16(data + 12);
+    const uint8_t *body = data + IMAGE_HEADER_SIZE;
+    size_t body_size = code_size + blocks * 4 + jumps * 4;
+    if (code_size > MEMORY_SIZE || size != IMAGE_HEADER_SIZE + body_size ||
+            image_checksum(body, body_size) != get_u32(data + 20)) {
+        fprintf(stderr, "Error, %s is damaged\n", path);
+        return NULL;
+    }
+
+    VmImage *image = (VmImage*) calloc(1, sizeof(VmImage));
+    if (image == NULL) {
+        fprintf(stderr, "Error, image allocation failed\n");
+        return NULL;
+    }
+    memcpy(image->memory, body, code_size);
+    image->size = code_size;
+    image->fusion = fusion ? 1 : 0;
+    image->refs = 1;
+
+    // Rebuild the verifier results from the blocks and jump table instead of walking the program
+    VmVerifyInfo *info = &image->verify;
+    const uint8_t *block_in = body + code_size;
+    const uint8_t *jump_in = block_in + blocks * 4;
+    uint8_t leader[MEMORY_SIZE];
+
+    info->stack_checked = (data[16] & IMAGE_FLAG_STACK_CHECKED) ? 1 : 0;
+    info->max_stack_depth = get_u16(data + 14);
+    memset(leader, 0, sizeof(leader));
+    for (size_t i = 0; i < blocks; i++) {
+        uint16_t start = get_u16(block_in + i * 4);
+        if (start < MEMORY_SIZE) {
+            leader[start] = 1;
+        }
+    }
+    for (size_t i = 0; i < blocks; i++) {
+        int addr = get_u16(block_in + i * 4);
+        int depth = get_u16(block_in + i * 4 + 2);
+        // Walk the block: one instruction after another until a branch or the next leader
+        while (addr < MEMORY_SIZE) {
+            uint8_t opcode = image->memory[addr];
+            int length = vm_instruction_length(opcode);
+            info->flags[addr] |= VM_ADDR_START;
+            info->depth[addr] = (uint16_t) depth;
+            // Bad instructions are left for vm_verify_metadata to reject
+            if (length == 0 || addr + length > MEMORY_SIZE) {
+                break;
+            }
+            for (int j = addr + 1; j < addr + length; j++) {
+                info->flags[j] |= VM_ADDR_OPERAND;
+            }
+            if (info->stack_checked) {
+                depth += opcode == OP_PUSH ? 1 : opcode == OP_POP ? -1 : 0;
+                depth += opcode == OP_PUSHM ? vm_mask_count(image->memory[addr + 1]) : 0;
+                depth -= opcode == OP_POPM ? vm_mask_count(image->memory[addr + 1]) : 0;
+            }
+            addr += length;
+            if (ends_block(opcode) || (addr < MEMORY_SIZE && leader[addr]) || depth < 0) {
+                break;
+            }
+        }
+    }
+    // Each jump table entry has to describe the branch that is really there
+    int bad_jump = 0;
+    for (size_t i = 0; i < jumps; i++) {
+        uint16_t from = get_u16(jump_in + i * 4);
+        uint16_t target = get_u16(jump_in + i * 4 + 2);
+        uint8_t opcode = from < MEMORY_SIZE ? image->memory[from] : OP_HALT;
+        if (!branch_operand(opcode) || from + vm_instruction_length(opcode) > MEMORY_SIZE ||
+                target >= MEMORY_SIZE || !(info->flags[from] & VM_ADDR_START)) {
+            bad_jump = 1;
+            break;
+        }
+        const uint8_t *operand = &image->memory[from + branch_operand(opcode)];
+        if (((operand[0] << 8) | operand[1]) != target) {
+            bad_jump = 1;
+            break;
+        }
+        info->flags[target] |= VM_ADDR_TARGET;
+    }
+    if (bad_jump || vm_verify_metadata(image) != 0) {
+        fprintf(stderr, "Error, %s failed verification\n", path);
+        free(image);
+        return NULL;
+    }
+    // The checked starts say where every instruction is, so only those are decoded
+    vm_decode_verified(image);
+    return image;
+}
+
+// Load a .vmi file into a new image (returns NULL on failure, release it with vm_image_release)
+VmImage *vm_image_load(const char *path, int fusion) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error, could not open %s\n", path);
+        return NULL;
+    }
+    // The file is mapped and parsed in place, nothing but the code bytes is copied
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size < IMAGE_HEADER_SIZE || info.st_size > IMAGE_MAX_FILE_SIZE) {
+        fprintf(stderr, "Error, %s is not a program image\n", path);
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t) info.st_size;
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        fprintf(stderr, "Error, could not map %s\n", path);
+        return NULL;
+    }
+    VmImage *image = image_parse((const uint8_t*) data, size, fusion, path);
+    munmap(data, size);
+    return image;
+}
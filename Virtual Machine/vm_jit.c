@@ -0,0 +1,758 @@
+/*
+This file implements an optional x86-64 JIT compiler for the virtual machine.
+
+vm_jit_compile translates every reachable instruction of a verified program into native code in an
+mmap'd buffer. While native code runs, rbx holds the VirtualMachine pointer (the guest registers and
+stack are addressed straight off it, with loads and stores sized for vm_word) and r12 holds the
+stack pointer. Jumps between guest instructions become native jumps, so tight OP_JMP/OP_JZ loops
+never leave native code. OP_CALL pushes the guest return address and jumps natively, and OP_RET goes
+through a shared stub that looks the return address up in the entry table. OP_PUSHM/OP_POPM copy
+each run of consecutive registers with the widest moves that fit (one 8-byte move when the mask
+names every 8-bit register). OP_LDB/OP_STB index data memory with the register value directly
+(checked against VM_DATA_SIZE only in builds where a register can hold a larger value), and the bulk
+instructions call vm_data_bulk, so they run on the same SIMD kernels as the interpreters. OP_CALLN
+stores pc and sp and calls vm_call_native straight from native code.
+
+Native code only exits back to C for instructions it does not handle itself: OP_PRINT, OP_HALT and
+anything that would raise an error (division by zero, stack or call stack under/overflow, data
+ranges out of bounds). On exit vm->pc points at that instruction and vm_jit_execute runs it through
+vm_step, so output, error messages and the final register/stack state are identical to vm_execute.
+A failed OP_CALLN is the exception: the VM is already stopped when native code returns.
+
+On hosts that are not x86-64 Unix, vm_jit_compile returns NULL and vm_execute_jit falls back to the
+threaded engine.
+
+Author: Zane Francis
+*/
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "Virtual_Machine.h"
+
+#if defined(__x86_64__) && defined(__unix__)
+#define VM_JIT_SUPPORTED 1
+#include <sys/mman.h>
+#endif
+
+// Signature of the compiled code: run from the native address of vm->pc
+typedef void (*VmJitEntry)(VirtualMachine *vm, const uint8_t *target);
+
+// Compiled program
+struct VmJit {
+    uint8_t *code;                  // Executable buffer
+    size_t size;                    // Size of the mapping
+    int32_t entry[MEMORY_SIZE];     // Native offset of each guest instruction, -1 if none
+    uint8_t stack_checked;          // Push/pop checks were emitted
+};
+
+#ifdef VM_JIT_SUPPORTED
+
+// Worst case native bytes per byte of guest code (OP_POPM of every 64-bit register), plus room for the stubs
+#define JIT_MAX_INSTR_BYTES 96
+#define JIT_BUFFER_SIZE (MEMORY_SIZE * JIT_MAX_INSTR_BYTES + 512)
+
+// Offsets of the VirtualMachine fields used by the generated code
+#define OFF_REG(r) ((int32_t) (offsetof(VirtualMachine, registers) + (r) * sizeof(vm_word)))
+#define OFF_STACK ((int32_t) offsetof(VirtualMachine, stack))
+#define OFF_PC ((int32_t) offsetof(VirtualMachine, pc))
+#define OFF_SP ((int32_t) offsetof(VirtualMachine, sp))
+#define OFF_STACK_LOW ((int32_t) offsetof(VirtualMachine, stack_low))
+#define OFF_CALL_STACK ((int32_t) offsetof(VirtualMachine, call_stack))
+#define OFF_CALL_DEPTH ((int32_t) offsetof(VirtualMachine, call_depth))
+#define OFF_DATA ((int32_t) offsetof(VirtualMachine, data))
+#define OFF_DATA_WRITTEN ((int32_t) offsetof(VirtualMachine, data_written))
+
+// Pending rel32 jump that needs the native address of a guest instruction
+typedef struct {
+    size_t at;          // Offset of the rel32 field
+    uint16_t target;    // Guest address
+} JitFixup;
+
+// Code emission state
+typedef struct {
+    uint8_t *buf;
+    size_t len;
+    size_t exit_offset;             // Shared epilogue
+    size_t ret_offset;              // Shared OP_RET stub
+    JitFixup fixups[MEMORY_SIZE * 2];
+    int num_fixups;
+} JitBuilder;
+
+static void emit_byte(JitBuilder *b, uint8_t byte) {
+    b->buf[b->len++] = byte;
+}
+
+static void emit_bytes(JitBuilder *b, const uint8_t *bytes, size_t count) {
+    memcpy(&b->buf[b->len], bytes, count);
+    b->len += count;
+}
+
+static void emit_u32(JitBuilder *b, uint32_t value) {
+    memcpy(&b->buf[b->len], &value, 4);
+    b->len += 4;
+}
+
+// Emit a two-byte opcode followed by a [rbx + disp32] memory operand
+static void emit_rbx_op(JitBuilder *b, uint8_t op1, uint8_t op2, uint8_t modrm, int32_t disp) {
+    if (op1 != 0) {
+        emit_byte(b, op1);
+    }
+    emit_byte(b, op2);
+    emit_byte(b, modrm);
+    emit_u32(b, (uint32_t) disp);
+}
+
+// movzx eax, byte [rbx + disp]
+static void emit_load_eax(JitBuilder *b, int32_t disp) {
+    emit_rbx_op(b, 0x0F, 0xB6, 0x83, disp);
+}
+
+// mov byte [rbx + disp], al
+static void emit_store_al(JitBuilder *b, int32_t disp) {
+    emit_rbx_op(b, 0, 0x88, 0x83, disp);
+}
+
+/*
+Guest registers and stack slots are vm_word sized. Word accesses use the 8-bit encodings for 8-bit
+registers, the operand-size prefix for 16-bit ones, the plain 32-bit forms, or REX.W for 64-bit
+ones. Loads always zero-extend into the full 32-bit register, so the arithmetic below can work on
+32-bit registers for every width up to 32 and only the stores need to be word sized.
+*/
+#define JIT_WORD_SHIFT (VM_WORD_BITS == 8 ? 0 : VM_WORD_BITS == 16 ? 1 : VM_WORD_BITS == 32 ? 2 : 3)
+
+// Prefixes of a word-sized instruction (opsize: it takes 0x66 for 16-bit words, rex: its REX.R/X/B bits)
+static void emit_word_prefix(JitBuilder *b, int opsize, uint8_t rex) {
+    if (opsize && VM_WORD_BITS == 16) {
+        emit_byte(b, 0x66);
+    }
+    if (VM_WORD_BITS == 64) {
+        rex |= 0x08;
+    }
+    if (rex != 0) {
+        emit_byte(b, (uint8_t) (0x40 | rex));
+    }
+}
+
+// Opcode of a zero-extending word load: movzx r32, m8 / movzx r32, m16 / mov r32, m32 / mov r64, m64
+static void emit_word_load_opcode(JitBuilder *b) {
+    if (VM_WORD_BITS <= 16) {
+        emit_byte(b, 0x0F);
+        emit_byte(b, VM_WORD_BITS == 8 ? 0xB6 : 0xB7);
+    } else {
+        emit_byte(b, 0x8B);
+    }
+}
+
+// Load the guest register at [rbx + disp] into host register reg (0 = eax, 1 = ecx, 2 = edx, 8 = r8d)
+static void emit_load_word(JitBuilder *b, int reg, int32_t disp) {
+    emit_word_prefix(b, 0, reg >= 8 ? 0x04 : 0);
+    emit_word_load_opcode(b);
+    emit_byte(b, (uint8_t) (0x83 | ((reg & 7) << 3)));
+    emit_u32(b, (uint32_t) disp);
+}
+
+// Store al/ax/eax/rax to the guest register at [rbx + disp]
+static void emit_store_word(JitBuilder *b, int32_t disp) {
+    emit_word_prefix(b, 1, 0);
+    emit_byte(b, VM_WORD_BITS == 8 ? 0x88 : 0x89);
+    emit_byte(b, 0x83);
+    emit_u32(b, (uint32_t) disp);
+}
+
+// Load eax from, or store eax to, the stack slot at [rbx + r12 * sizeof(vm_word) + disp]
+static void emit_stack_word(JitBuilder *b, int store, int32_t disp) {
+    emit_word_prefix(b, store, 0x02);
+    if (store) {
+        emit_byte(b, VM_WORD_BITS == 8 ? 0x88 : 0x89);
+    } else {
+        emit_word_load_opcode(b);
+    }
+    emit_byte(b, 0x84);
+    emit_byte(b, (uint8_t) ((JIT_WORD_SHIFT << 6) | 0x23));
+    emit_u32(b, (uint32_t) disp);
+}
+
+// Register to register ALU operation on the 32-bit (64-bit for 64-bit words) host registers
+static void emit_word_alu(JitBuilder *b, const uint8_t *op, size_t len) {
+    emit_word_prefix(b, 0, 0);
+    emit_bytes(b, op, len);
+}
+
+// mov eax, pc ; jmp exit  (10 bytes, leaves native code at guest address pc)
+static void emit_exit(JitBuilder *b, uint16_t pc) {
+    emit_byte(b, 0xB8);
+    emit_u32(b, pc);
+    emit_byte(b, 0xE9);
+    emit_u32(b, (uint32_t) (int32_t) (b->exit_offset - (b->len + 4)));
+}
+
+// jmp rel32 (opcode bytes given) to the native code of a guest address, patched later
+static void emit_jump_to(JitBuilder *b, const uint8_t *opcode, size_t opcode_len, uint16_t target) {
+    emit_bytes(b, opcode, opcode_len);
+    b->fixups[b->num_fixups].at = b->len;
+    b->fixups[b->num_fixups].target = target;
+    b->num_fixups++;
+    emit_u32(b, 0);
+}
+
+// Copy len bytes of consecutive registers starting at reg_disp to the stack at
+// [rbx + r12 * sizeof(vm_word) + stack_disp], or back when to_stack is 0, using 8, 4, 2 and 1 byte moves through rax
+static void emit_register_run(JitBuilder *b, int to_stack, int32_t reg_disp, int32_t stack_disp, int len) {
+    // Indexed by log2 of the width: [rbx + disp32] and [rbx + r12 + disp32] forms
+    static const uint8_t load_reg[4][3] = { { 0x0F, 0xB6, 0x83 }, { 0x0F, 0xB7, 0x83 }, { 0x8B, 0x83 }, { 0x48, 0x8B, 0x83 } };
+    static const uint8_t load_reg_len[4] = { 3, 3, 2, 3 };
+    static const uint8_t store_stack[4][5] = { { 0x42, 0x88, 0x84, 0x23 }, { 0x66, 0x42, 0x89, 0x84, 0x23 },
+                                               { 0x42, 0x89, 0x84, 0x23 }, { 0x4A, 0x89, 0x84, 0x23 } };
+    static const uint8_t store_stack_len[4] = { 4, 5, 4, 4 };
+    static const uint8_t load_stack[4][5] = { { 0x42, 0x0F, 0xB6, 0x84, 0x23 }, { 0x42, 0x0F, 0xB7, 0x84, 0x23 },
+                                              { 0x42, 0x8B, 0x84, 0x23 }, { 0x4A, 0x8B, 0x84, 0x23 } };
+    static const uint8_t load_stack_len[4] = { 5, 5, 4, 4 };
+    static const uint8_t store_reg[4][3] = { { 0x88, 0x83 }, { 0x66, 0x89, 0x83 }, { 0x89, 0x83 }, { 0x48, 0x89, 0x83 } };
+    static const uint8_t store_reg_len[4] = { 2, 3, 2, 3 };
+    // The SIB byte (last in the stack forms) scales r12 by the word size
+    const uint8_t sib = (uint8_t) ((JIT_WORD_SHIFT << 6) | 0x23);
+
+    while (len > 0) {
+        int size = len >= 8 ? 3 : len >= 4 ? 2 : len >= 2 ? 1 : 0;
+        int width = 1 << size;
+        if (to_stack) {
+            emit_bytes(b, load_reg[size], load_reg_len[size]);
+            emit_u32(b, (uint32_t) reg_disp);
+            emit_bytes(b, store_stack[size], store_stack_len[size] - 1u);
+            emit_byte(b, sib);
+            emit_u32(b, (uint32_t) stack_disp);
+        } else {
+            emit_bytes(b, load_stack[size], load_stack_len[size] - 1u);
+            emit_byte(b, sib);
+            emit_u32(b, (uint32_t) stack_disp);
+            emit_bytes(b, store_reg[size], store_reg_len[size]);
+            emit_u32(b, (uint32_t) reg_disp);
+        }
+        reg_disp += width;
+        stack_disp += width;
+        len -= width;
+    }
+}
+
+// Copy the registers in mask to or from the stack slots starting at [rbx + r12 * sizeof(vm_word) + stack_disp],
+// one run at a time
+static void emit_register_mask(JitBuilder *b, int to_stack, uint8_t mask, int32_t stack_disp) {
+    int r = 0;
+    while (r < NUM_REGISTERS) {
+        if (!(mask & (1u << r))) {
+            r++;
+            continue;
+        }
+        int len = 0;
+        while (r + len < NUM_REGISTERS && (mask & (1u << (r + len)))) {
+            len++;
+        }
+        emit_register_run(b, to_stack, OFF_REG(r), stack_disp, len * (int) sizeof(vm_word));
+        stack_disp += len * (int32_t) sizeof(vm_word);
+        r += len;
+    }
+}
+
+// Exit to the interpreter at addr when the address in rax is past the end of data memory (emits nothing
+// when every register value is a data address)
+static void emit_data_check(JitBuilder *b, uint16_t addr) {
+    static const uint8_t cmp_eax_imm32[] = { 0x3D };
+    static const uint8_t jb_skip[] = { 0x72, 0x0A };
+    if (!VM_DATA_CHECKED) {
+        return;
+    }
+    emit_word_alu(b, cmp_eax_imm32, sizeof(cmp_eax_imm32));
+    emit_u32(b, VM_DATA_SIZE);
+    emit_bytes(b, jb_skip, sizeof(jb_skip));
+    emit_exit(b, addr);
+}
+
+// Emit native code for the instruction at addr (returns 1 if execution can fall through)
+static int jit_emit_instruction(JitBuilder *b, const VirtualMachine *vm, uint16_t addr, int check_stack) {
+    static const uint8_t jmp_rel32[] = { 0xE9 };
+    static const uint8_t je_rel32[] = { 0x0F, 0x84 };
+    const uint8_t *operand = &vm->memory[addr + 1];
+
+    switch (vm->memory[addr]) {
+        case OP_LOAD:
+            // mov [rbx + reg], imm (8, 16 or 32 bits, sign-extended to 64, the value is at most 255)
+            emit_word_prefix(b, 1, 0);
+            emit_byte(b, VM_WORD_BITS == 8 ? 0xC6 : 0xC7);
+            emit_byte(b, 0x83);
+            emit_u32(b, (uint32_t) OFF_REG(operand[0]));
+            emit_byte(b, operand[1]);
+            for (int i = 1; i < (VM_WORD_BITS >= 32 ? 4 : VM_WORD_BITS / 8); i++) {
+                emit_byte(b, 0);
+            }
+            return 1;
+
+        case OP_ADD:
+        case OP_SUB:
+            emit_load_word(b, 0, OFF_REG(operand[0]));
+            // add/sub al, ax, eax or rax, [rbx + b]
+            emit_word_prefix(b, 1, 0);
+            emit_byte(b, (uint8_t) ((vm->memory[addr] == OP_ADD ? 0x02 : 0x2A) + (VM_WORD_BITS == 8 ? 0 : 1)));
+            emit_byte(b, 0x83);
+            emit_u32(b, (uint32_t) OFF_REG(operand[1]));
+            emit_store_word(b, OFF_REG(operand[2]));
+            return 1;
+
+        case OP_MUL: {
+            static const uint8_t imul_eax_ecx[] = { 0x0F, 0xAF, 0xC1 };
+            emit_load_word(b, 0, OFF_REG(operand[0]));
+            emit_load_word(b, 1, OFF_REG(operand[1]));
+            emit_word_alu(b, imul_eax_ecx, sizeof(imul_eax_ecx));
+            emit_store_word(b, OFF_REG(operand[2]));
+            return 1;
+        }
+
+        case OP_DIV: {
+            static const uint8_t test_ecx[] = { 0x85, 0xC9 };
+            static const uint8_t jnz_skip[] = { 0x75, 0x0A };
+            static const uint8_t xor_edx[] = { 0x31, 0xD2 };
+            static const uint8_t div_ecx[] = { 0xF7, 0xF1 };
+            emit_load_word(b, 1, OFF_REG(operand[1]));
+            // Let the interpreter report division by zero
+            emit_word_alu(b, test_ecx, sizeof(test_ecx));
+            emit_bytes(b, jnz_skip, sizeof(jnz_skip));
+            emit_exit(b, addr);
+            emit_load_word(b, 0, OFF_REG(operand[0]));
+            emit_bytes(b, xor_edx, sizeof(xor_edx));
+            emit_word_alu(b, div_ecx, sizeof(div_ecx));
+            emit_store_word(b, OFF_REG(operand[2]));
+            return 1;
+        }
+
+        case OP_JMP:
+            emit_jump_to(b, jmp_rel32, sizeof(jmp_rel32), (uint16_t) ((operand[0] << 8) | operand[1]));
+            return 0;
+
+        case OP_JZ:
+            // cmp [rbx + reg], 0 (word sized) ; je target
+            emit_word_prefix(b, 1, 0);
+            emit_byte(b, VM_WORD_BITS == 8 ? 0x80 : 0x83);
+            emit_byte(b, 0xBB);
+            emit_u32(b, (uint32_t) OFF_REG(operand[0]));
+            emit_byte(b, 0x00);
+            emit_jump_to(b, je_rel32, sizeof(je_rel32), (uint16_t) ((operand[1] << 8) | operand[2]));
+            return 1;
+
+        case OP_PUSH: {
+            static const uint8_t test_r12d_jnz[] = { 0x45, 0x85, 0xE4, 0x75, 0x0A };
+            static const uint8_t dec_r12d[] = { 0x41, 0xFF, 0xCC };
+            if (check_stack) {
+                emit_bytes(b, test_r12d_jnz, sizeof(test_r12d_jnz));
+                emit_exit(b, addr);
+            }
+            emit_load_word(b, 0, OFF_REG(operand[0]));
+            emit_stack_word(b, 1, OFF_STACK);
+            emit_bytes(b, dec_r12d, sizeof(dec_r12d));
+            return 1;
+        }
+
+        case OP_POP: {
+            static const uint8_t cmp_r12d[] = { 0x41, 0x81, 0xFC };
+            static const uint8_t jb_skip[] = { 0x72, 0x0A };
+            static const uint8_t inc_r12d[] = { 0x41, 0xFF, 0xC4 };
+            static const uint8_t cmp_low_r12w[] = { 0x66, 0x44, 0x39, 0xA3 };       // cmp [rbx + disp], r12w
+            static const uint8_t jbe_skip_low[] = { 0x76, 0x08 };
+            static const uint8_t store_low_r12w[] = { 0x66, 0x44, 0x89, 0xA3 };     // mov [rbx + disp], r12w
+            if (check_stack) {
+                emit_bytes(b, cmp_r12d, sizeof(cmp_r12d));
+                emit_u32(b, MEMORY_SIZE - 1);
+                emit_bytes(b, jb_skip, sizeof(jb_skip));
+                emit_exit(b, addr);
+            }
+            // vm->stack_low = min(vm->stack_low, sp) before the stack shrinks
+            emit_bytes(b, cmp_low_r12w, sizeof(cmp_low_r12w));
+            emit_u32(b, (uint32_t) OFF_STACK_LOW);
+            emit_bytes(b, jbe_skip_low, sizeof(jbe_skip_low));
+            emit_bytes(b, store_low_r12w, sizeof(store_low_r12w));
+            emit_u32(b, (uint32_t) OFF_STACK_LOW);
+            emit_bytes(b, inc_r12d, sizeof(inc_r12d));
+            emit_stack_word(b, 0, OFF_STACK);
+            emit_store_word(b, OFF_REG(operand[0]));
+            return 1;
+        }
+
+        case OP_CALL: {
+            static const uint8_t cmp_eax[] = { 0x3D };
+            static const uint8_t jb_skip[] = { 0x72, 0x0A };
+            static const uint8_t store_return[] = { 0x66, 0xC7, 0x84, 0x43 };   // mov word [rbx + rax*2 + disp], imm16
+            static const uint8_t inc_eax[] = { 0xFF, 0xC0 };
+            uint16_t next = (uint16_t) (addr + 3);
+            // Let the interpreter report call stack overflow
+            emit_load_eax(b, OFF_CALL_DEPTH);
+            emit_bytes(b, cmp_eax, sizeof(cmp_eax));
+            emit_u32(b, VM_CALL_DEPTH);
+            emit_bytes(b, jb_skip, sizeof(jb_skip));
+            emit_exit(b, addr);
+            emit_bytes(b, store_return, sizeof(store_return));
+            emit_u32(b, (uint32_t) OFF_CALL_STACK);
+            emit_byte(b, (uint8_t) next);
+            emit_byte(b, (uint8_t) (next >> 8));
+            emit_bytes(b, inc_eax, sizeof(inc_eax));
+            emit_store_al(b, OFF_CALL_DEPTH);
+            emit_jump_to(b, jmp_rel32, sizeof(jmp_rel32), (uint16_t) ((operand[0] << 8) | operand[1]));
+            return 0;
+        }
+
+        case OP_RET: {
+            static const uint8_t test_eax_jnz[] = { 0x85, 0xC0, 0x75, 0x0A };
+            // Let the interpreter report a return with an empty call stack, the stub does the rest
+            emit_load_eax(b, OFF_CALL_DEPTH);
+            emit_bytes(b, test_eax_jnz, sizeof(test_eax_jnz));
+            emit_exit(b, addr);
+            emit_byte(b, 0xE9);
+            emit_u32(b, (uint32_t) (int32_t) (b->ret_offset - (b->len + 4)));
+            return 0;
+        }
+
+        case OP_PUSHM: {
+            static const uint8_t cmp_r12d[] = { 0x41, 0x81, 0xFC };
+            static const uint8_t jae_skip[] = { 0x73, 0x0A };
+            static const uint8_t sub_r12d[] = { 0x41, 0x83, 0xEC };
+            int count = vm_mask_count(operand[0]);
+            if (check_stack) {
+                emit_bytes(b, cmp_r12d, sizeof(cmp_r12d));
+                emit_u32(b, (uint32_t) count);
+                emit_bytes(b, jae_skip, sizeof(jae_skip));
+                emit_exit(b, addr);
+            }
+            // The registers land in ascending order at stack[sp - count + 1 .. sp]
+            emit_register_mask(b, 1, operand[0], OFF_STACK - (count - 1) * (int32_t) sizeof(vm_word));
+            emit_bytes(b, sub_r12d, sizeof(sub_r12d));
+            emit_byte(b, (uint8_t) count);
+            return 1;
+        }
+
+        case OP_POPM: {
+            static const uint8_t cmp_r12d[] = { 0x41, 0x81, 0xFC };
+            static const uint8_t jbe_skip[] = { 0x76, 0x0A };
+            static const uint8_t cmp_low_r12w[] = { 0x66, 0x44, 0x39, 0xA3 };       // cmp [rbx + disp], r12w
+            static const uint8_t jbe_skip_low[] = { 0x76, 0x08 };
+            static const uint8_t store_low_r12w[] = { 0x66, 0x44, 0x89, 0xA3 };     // mov [rbx + disp], r12w
+            static const uint8_t add_r12d[] = { 0x41, 0x83, 0xC4 };
+            int count = vm_mask_count(operand[0]);
+            if (check_stack) {
+                emit_bytes(b, cmp_r12d, sizeof(cmp_r12d));
+                emit_u32(b, (uint32_t) (MEMORY_SIZE - 1 - count));
+                emit_bytes(b, jbe_skip, sizeof(jbe_skip));
+                emit_exit(b, addr);
+            }
+            // vm->stack_low = min(vm->stack_low, sp) before the stack shrinks
+            emit_bytes(b, cmp_low_r12w, sizeof(cmp_low_r12w));
+            emit_u32(b, (uint32_t) OFF_STACK_LOW);
+            emit_bytes(b, jbe_skip_low, sizeof(jbe_skip_low));
+            emit_bytes(b, store_low_r12w, sizeof(store_low_r12w));
+            emit_u32(b, (uint32_t) OFF_STACK_LOW);
+            emit_register_mask(b, 0, operand[0], OFF_STACK + (int32_t) sizeof(vm_word));
+            emit_bytes(b, add_r12d, sizeof(add_r12d));
+            emit_byte(b, (uint8_t) count);
+            return 1;
+        }
+
+        case OP_LDB: {
+            static const uint8_t load_data[] = { 0x0F, 0xB6, 0x84, 0x03 };     // movzx eax, byte [rbx + rax + disp]
+            emit_load_word(b, 0, OFF_REG(operand[1]));
+            emit_data_check(b, addr);
+            emit_bytes(b, load_data, sizeof(load_data));
+            emit_u32(b, (uint32_t) OFF_DATA);
+            emit_store_word(b, OFF_REG(operand[0]));
+            return 1;
+        }
+
+        case OP_STB: {
+            static const uint8_t store_data[] = { 0x88, 0x8C, 0x03 };         // mov [rbx + rax + disp], cl
+            static const uint8_t page_shift[] = { 0xC1, 0xE8, VM_DATA_PAGE_SHIFT };    // shr eax, shift
+            static const uint8_t mark_page[] = { 0xC6, 0x84, 0x03 };          // mov byte [rbx + rax + disp], 1
+            emit_load_word(b, 0, OFF_REG(operand[0]));
+            emit_data_check(b, addr);
+            emit_load_word(b, 1, OFF_REG(operand[1]));
+            emit_bytes(b, store_data, sizeof(store_data));
+            emit_u32(b, (uint32_t) OFF_DATA);
+            // vm_data_mark: the address is below VM_DATA_SIZE, so it fits in eax
+            emit_bytes(b, page_shift, sizeof(page_shift));
+            emit_bytes(b, mark_page, sizeof(mark_page));
+            emit_u32(b, (uint32_t) OFF_DATA_WRITTEN);
+            emit_byte(b, 1);
+            return 1;
+        }
+
+        case OP_VADD:
+        case OP_VSUB:
+        case OP_VMUL:
+        case OP_MSET:
+        case OP_MCPY:
+        case OP_VSUM:
+        case OP_VCMP: {
+            static const uint8_t mov_rdi_rbx[] = { 0x48, 0x89, 0xDF };          // mov rdi, rbx
+            static const uint8_t mov_esi_imm32[] = { 0xBE };
+            static const uint8_t mov_rax_imm64[] = { 0x48, 0xB8 };
+            // rsp is 8 off 16-byte alignment after the prologue's two pushes
+            static const uint8_t call_rax[] = { 0x48, 0x83, 0xEC, 0x08, 0xFF, 0xD0, 0x48, 0x83, 0xC4, 0x08 };
+            static const uint8_t test_eax_jns[] = { 0x85, 0xC0, 0x79, 0x0A };
+            VmBulkOperands reg = vm_bulk_operands(vm->memory[addr], operand);
+            uint64_t function = (uint64_t) (uintptr_t) &vm_data_bulk;
+            // vm_data_bulk(vm, opcode, x, y, length), only rbx and r12 need to survive the call
+            emit_bytes(b, mov_rdi_rbx, sizeof(mov_rdi_rbx));
+            emit_bytes(b, mov_esi_imm32, sizeof(mov_esi_imm32));
+            emit_u32(b, vm->memory[addr]);
+            emit_load_word(b, 2, OFF_REG(reg.x));
+            emit_load_word(b, 1, OFF_REG(reg.y));
+            emit_load_word(b, 8, OFF_REG(reg.length));
+            emit_bytes(b, mov_rax_imm64, sizeof(mov_rax_imm64));
+            emit_u32(b, (uint32_t) function);
+            emit_u32(b, (uint32_t) (function >> 32));
+            emit_bytes(b, call_rax, sizeof(call_rax));
+            // Let the interpreter report a range out of bounds
+            emit_bytes(b, test_eax_jns, sizeof(test_eax_jns));
+            emit_exit(b, addr);
+            if (reg.result < NUM_REGISTERS) {
+                // The result is an int, zero-extend it before a 64-bit store (mov eax, eax)
+                if (VM_WORD_BITS == 64) {
+                    emit_byte(b, 0x89);
+                    emit_byte(b, 0xC0);
+                }
+                emit_store_word(b, OFF_REG(reg.result));
+            }
+            return 1;
+        }
+
+        case OP_CALLN: {
+            static const uint8_t store_pc_imm16[] = { 0x66, 0xC7, 0x83 };       // mov word [rbx + disp], imm16
+            static const uint8_t store_sp[] = { 0x66, 0x44, 0x89, 0xA3 };       // mov [rbx + disp], r12w
+            static const uint8_t mov_rdi_rbx[] = { 0x48, 0x89, 0xDF };
+            static const uint8_t mov_esi_imm32[] = { 0xBE };
+            static const uint8_t mov_rax_imm64[] = { 0x48, 0xB8 };
+            static const uint8_t call_rax[] = { 0x48, 0x83, 0xEC, 0x08, 0xFF, 0xD0, 0x48, 0x83, 0xC4, 0x08 };
+            static const uint8_t test_eax_jz[] = { 0x85, 0xC0, 0x74, 0x0A };
+            uint64_t function = (uint64_t) (uintptr_t) &vm_call_native;
+            uint16_t next = (uint16_t) (addr + 2);
+            // The host function sees pc and sp as the interpreter would leave them
+            emit_bytes(b, store_pc_imm16, sizeof(store_pc_imm16));
+            emit_u32(b, (uint32_t) OFF_PC);
+            emit_byte(b, (uint8_t) next);
+            emit_byte(b, (uint8_t) (next >> 8));
+            emit_bytes(b, store_sp, sizeof(store_sp));
+            emit_u32(b, (uint32_t) OFF_SP);
+            // vm_call_native(vm, index), a failed call has already stopped the VM so just leave
+            emit_bytes(b, mov_rdi_rbx, sizeof(mov_rdi_rbx));
+            emit_bytes(b, mov_esi_imm32, sizeof(mov_esi_imm32));
+            emit_u32(b, operand[0]);
+            emit_bytes(b, mov_rax_imm64, sizeof(mov_rax_imm64));
+            emit_u32(b, (uint32_t) function);
+            emit_u32(b, (uint32_t) (function >> 32));
+            emit_bytes(b, call_rax, sizeof(call_rax));
+            emit_bytes(b, test_eax_jz, sizeof(test_eax_jz));
+            emit_exit(b, next);
+            return 1;
+        }
+
+        default:
+            // OP_PRINT, OP_HALT and anything else run in the interpreter
+            emit_exit(b, addr);
+            return 0;
+    }
+}
+
+// Compile a verified program (returns NULL if it cannot be compiled)
+VmJit *vm_jit_compile(const VirtualMachine *vm) {
+    if (!vm->image->verify.verified) {
+        return NULL;
+    }
+    VmJit *jit = (VmJit*) malloc(sizeof(VmJit));
+    JitBuilder *b = (JitBuilder*) malloc(sizeof(JitBuilder));
+    if (jit == NULL || b == NULL) {
+        fprintf(stderr, "Error, JIT allocation failed\n");
+        free(jit);
+        free(b);
+        return NULL;
+    }
+    jit->size = JIT_BUFFER_SIZE;
+    jit->stack_checked = vm->image->verify.stack_checked ? 0 : 1;
+    jit->code = (uint8_t*) mmap(NULL, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->code == MAP_FAILED) {
+        fprintf(stderr, "Error, JIT could not map code buffer\n");
+        free(jit);
+        free(b);
+        return NULL;
+    }
+    b->buf = jit->code;
+    b->len = 0;
+    b->num_fixups = 0;
+
+    // Prologue: push rbx ; push r12 ; mov rbx, rdi ; movzx r12d, word [rbx + sp] ; jmp rsi
+    static const uint8_t prologue[] = { 0x53, 0x41, 0x54, 0x48, 0x89, 0xFB, 0x44, 0x0F, 0xB7, 0xA3 };
+    static const uint8_t jmp_rsi[] = { 0xFF, 0xE6 };
+    emit_bytes(b, prologue, sizeof(prologue));
+    emit_u32(b, (uint32_t) OFF_SP);
+    emit_bytes(b, jmp_rsi, sizeof(jmp_rsi));
+
+    // Shared exit: mov [rbx + pc], ax ; mov [rbx + sp], r12w ; pop r12 ; pop rbx ; ret
+    static const uint8_t store_pc[] = { 0x66, 0x89, 0x83 };
+    static const uint8_t store_sp[] = { 0x66, 0x44, 0x89, 0xA3 };
+    static const uint8_t epilogue[] = { 0x41, 0x5C, 0x5B, 0xC3 };
+    b->exit_offset = b->len;
+    emit_bytes(b, store_pc, sizeof(store_pc));
+    emit_u32(b, (uint32_t) OFF_PC);
+    emit_bytes(b, store_sp, sizeof(store_sp));
+    emit_u32(b, (uint32_t) OFF_SP);
+    emit_bytes(b, epilogue, sizeof(epilogue));
+
+    /*
+    Shared OP_RET stub, entered with eax = call depth (not 0):
+        dec eax ; mov [rbx + call_depth], al ; movzx eax, word [rbx + rax*2 + call_stack]
+        mov rcx, entry ; movsxd rcx, dword [rcx + rax*4] ; test ecx, ecx ; js exit
+        mov rdx, code ; add rcx, rdx ; jmp rcx
+    A return address without native code (never the case for verified programs) exits to the
+    interpreter with eax as the pc.
+    */
+    static const uint8_t dec_eax[] = { 0xFF, 0xC8 };
+    static const uint8_t load_return[] = { 0x0F, 0xB7, 0x84, 0x43 };
+    static const uint8_t mov_rcx_imm64[] = { 0x48, 0xB9 };
+    static const uint8_t load_entry[] = { 0x48, 0x63, 0x0C, 0x81, 0x85, 0xC9, 0x0F, 0x88 };
+    static const uint8_t mov_rdx_imm64[] = { 0x48, 0xBA };
+    static const uint8_t add_jmp_rcx[] = { 0x48, 0x01, 0xD1, 0xFF, 0xE1 };
+    uint64_t entry_address = (uint64_t) (uintptr_t) jit->entry;
+    uint64_t code_address = (uint64_t) (uintptr_t) jit->code;
+    b->ret_offset = b->len;
+    emit_bytes(b, dec_eax, sizeof(dec_eax));
+    emit_store_al(b, OFF_CALL_DEPTH);
+    emit_bytes(b, load_return, sizeof(load_return));
+    emit_u32(b, (uint32_t) OFF_CALL_STACK);
+    emit_bytes(b, mov_rcx_imm64, sizeof(mov_rcx_imm64));
+    emit_u32(b, (uint32_t) entry_address);
+    emit_u32(b, (uint32_t) (entry_address >> 32));
+    emit_bytes(b, load_entry, sizeof(load_entry));
+    emit_u32(b, (uint32_t) (int32_t) (b->exit_offset - (b->len + 4)));
+    emit_bytes(b, mov_rdx_imm64, sizeof(mov_rdx_imm64));
+    emit_u32(b, (uint32_t) code_address);
+    emit_u32(b, (uint32_t) (code_address >> 32));
+    emit_bytes(b, add_jmp_rcx, sizeof(add_jmp_rcx));
+
+    // Translate every reachable instruction in address order
+    int falls_through = 0;
+    uint16_t fall_target = 0;
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        jit->entry[addr] = -1;
+        if (!(vm->image->verify.flags[addr] & VM_ADDR_START)) {
+            continue;
+        }
+        // Previous instruction continues somewhere other than here
+        if (falls_through && fall_target != addr) {
+            static const uint8_t jmp_rel32[] = { 0xE9 };
+            emit_jump_to(b, jmp_rel32, sizeof(jmp_rel32), fall_target);
+        }
+        jit->entry[addr] = (int32_t) b->len;
+        falls_through = jit_emit_instruction(b, vm, (uint16_t) addr, jit->stack_checked);
+        fall_target = (uint16_t) (addr + vm_instruction_length(vm->memory[addr]));
+    }
+    if (falls_through) {
+        static const uint8_t jmp_rel32[] = { 0xE9 };
+        emit_jump_to(b, jmp_rel32, sizeof(jmp_rel32), fall_target);
+    }
+
+    // Patch the jumps now that every instruction has an address
+    for (int i = 0; i < b->num_fixups; i++) {
+        int32_t target = jit->entry[b->fixups[i].target];
+        int32_t rel = target - (int32_t) (b->fixups[i].at + 4);
+        memcpy(&b->buf[b->fixups[i].at], &rel, 4);
+    }
+    free(b);
+
+    if (mprotect(jit->code, jit->size, PROT_READ | PROT_EXEC) != 0) {
+        fprintf(stderr, "Error, JIT could not make code executable\n");
+        vm_jit_free(jit);
+        return NULL;
+    }
+    return jit;
+}
+
+// Run a compiled program until it halts or stops with an error
+void vm_jit_execute(VmJit *jit, VirtualMachine *vm) {
+    VmJitEntry run = (VmJitEntry) (void*) jit->code;
+
+    while (vm->running) {
+        int stack_safe;
+        // Code compiled without stack checks is only safe from the proven stack depth
+        if (!jit->stack_checked && (!vm_verified_entry(vm, &stack_safe) || !stack_safe)) {
+            vm_execute(vm);
+            return;
+        }
+        if (vm->pc >= MEMORY_SIZE || jit->entry[vm->pc] < 0) {
+            vm_step(vm);
+            continue;
+        }
+        run(vm, jit->code + jit->entry[vm->pc]);
+        // A failed OP_CALLN leaves native code with the VM already stopped
+        if (!vm->running) {
+            break;
+        }
+        // Native code stopped at an instruction it leaves to the interpreter
+        vm_step(vm);
+    }
+}
+
+// Release a compiled program
+void vm_jit_free(VmJit *jit) {
+    if (jit == NULL) {
+        return;
+    }
+    munmap(jit->code, jit->size);
+    free(jit);
+}
+
+#else
+
+// JIT is not available on this host
+VmJit *vm_jit_compile(const VirtualMachine *vm) {
+    (void) vm;
+    return NULL;
+}
+
+void vm_jit_execute(VmJit *jit, VirtualMachine *vm) {
+    (void) jit;
+    vm_execute(vm);
+}
+
+void vm_jit_free(VmJit *jit) {
+    (void) jit;
+}
+
+#endif
+
+// Run the loaded program as native code, falling back to the threaded engine if it cannot be compiled
+// The code is compiled once per image and kept on it, so every later run and every VM sharing the image
+// skips straight to vm_jit_execute
+void vm_execute_jit(VirtualMachine *vm) {
+    if (!vm->running) {
+        return;
+    }
+    VmImage *image = vm->image;
+    VmJit *jit = __atomic_load_n(&image->jit, __ATOMIC_ACQUIRE);
+    if (jit == NULL) {
+        jit = vm_jit_compile(vm);
+        if (jit == NULL) {
+            vm_execute_threaded(vm);
+            return;
+        }
+        // The built-in empty image is never freed, so nothing may be kept on it
+        VmJit *none = NULL;
+        if (image->refs == 0) {
+            vm_jit_execute(jit, vm);
+            vm_jit_free(jit);
+            return;
+        }
+        // VMs on other threads may have compiled the same image at the same time, the first one is kept
+        if (!__atomic_compare_exchange_n(&image->jit, &none, jit, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            vm_jit_free(jit);
+            jit = none;
+        }
+    }
+    vm_jit_execute(jit, vm);
+}
@@ -0,0 +1,120 @@
+/*
+This file implements the built-in guest profiler for the virtual machine.
+
+When built with -DVM_PROFILE (make PROFILE=1) and a VmProfile is attached to vm->profile, vm_execute
+counts every instruction per opcode and per address, records taken/not-taken counts for each OP_JZ,
+and samples the host clock around every instruction (rdtsc on x86, clock_gettime elsewhere). When the
+program reaches OP_HALT the profile is written as JSON so it can be fed straight into other tools.
+
+Without VM_PROFILE none of this is compiled in, and vm_execute has no profiling code at all.
+
+Author: Zane Francis
+*/
+
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "Virtual_Machine.h"
+
+#ifdef VM_PROFILE
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_CLOCK "rdtsc"
+#else
+#include <time.h>
+#define PROFILE_CLOCK "ns"
+#endif
+
+// Mnemonics used in the report
+static const char *opcode_names[] = {
+    "HALT", "LOAD", "PRINT", "ADD", "SUB", "MUL", "DIV", "JMP", "JZ", "PUSH", "POP", "CALL", "RET", "PUSHM", "POPM",
+    "LDB", "STB", "VADD", "VSUB", "VMUL", "MSET", "MCPY", "VSUM", "VCMP", "CALLN",
+};
+
+// Read the host clock
+uint64_t vm_profile_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+#endif
+}
+
+// Record one executed instruction
+void vm_profile_record(VmProfile *profile, const uint8_t *memory, uint16_t pc, uint16_t next_pc, uint64_t elapsed) {
+    if (pc >= MEMORY_SIZE) {
+        return;
+    }
+    uint8_t opcode = memory[pc];
+
+    profile->instructions++;
+    profile->cycles += elapsed;
+    profile->op_count[opcode]++;
+    profile->op_cycles[opcode] += elapsed;
+    profile->pc_hits[pc]++;
+    // OP_JZ falls through to pc + 4 when the branch is not taken
+    if (opcode == OP_JZ) {
+        if (next_pc != pc + 4) {
+            profile->jz_taken[pc]++;
+        } else {
+            profile->jz_not_taken[pc]++;
+        }
+    }
+}
+
+// Write the profile as JSON
+void vm_profile_report(const VmProfile *profile, FILE *out) {
+    int first;
+
+    fprintf(out, "{\n  \"instructions\": %llu,\n  \"clock\": \"%s\",\n  \"cycles\": %llu,\n",
+        (unsigned long long) profile->instructions, PROFILE_CLOCK, (unsigned long long) profile->cycles);
+
+    // Per-opcode counts
+    fprintf(out, "  \"opcodes\": [");
+    first = 1;
+    for (int op = 0; op < 256; op++) {
+        if (profile->op_count[op] == 0) {
+            continue;
+        }
+        const char *name = op < (int) (sizeof(opcode_names) / sizeof(opcode_names[0])) ? opcode_names[op] : "INVALID";
+        fprintf(out, "%s\n    {\"opcode\": %d, \"name\": \"%s\", \"count\": %llu, \"cycles\": %llu}",
+            first ? "" : ",", op, name, (unsigned long long) profile->op_count[op],
+            (unsigned long long) profile->op_cycles[op]);
+        first = 0;
+    }
+    fprintf(out, "\n  ],\n");
+
+    // Per-address hit histogram
+    fprintf(out, "  \"pcs\": [");
+    first = 1;
+    for (int pc = 0; pc < MEMORY_SIZE; pc++) {
+        if (profile->pc_hits[pc] == 0) {
+            continue;
+        }
+        fprintf(out, "%s\n    {\"pc\": %d, \"hits\": %llu}", first ? "" : ",", pc,
+            (unsigned long long) profile->pc_hits[pc]);
+        first = 0;
+    }
+    fprintf(out, "\n  ],\n");
+
+    // Conditional branch outcomes
+    fprintf(out, "  \"branches\": [");
+    first = 1;
+    for (int pc = 0; pc < MEMORY_SIZE; pc++) {
+        if (profile->jz_taken[pc] == 0 && profile->jz_not_taken[pc] == 0) {
+            continue;
+        }
+        fprintf(out, "%s\n    {\"pc\": %d, \"taken\": %llu, \"not_taken\": %llu}", first ? "" : ",", pc,
+            (unsigned long long) profile->jz_taken[pc], (unsigned long long) profile->jz_not_taken[pc]);
+        first = 0;
+    }
+    fprintf(out, "\n  ]\n}\n");
+    fflush(out);
+}
+
+#endif
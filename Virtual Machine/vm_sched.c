@@ -0,0 +1,91 @@
+/*
+This file implements a cooperative round-robin scheduler that time-slices many virtual machines on
+the calling thread.
+
+Every VM added with vm_scheduler_add is given a turn of vm_execute_for(vm, quantum) in order. A VM
+that yields goes back to the end of the ready list, and one that halts or hits an error drops out of
+it with its final status recorded in its VmTask. Since the budget is checked on every backward
+branch, a runaway loop only ever holds the thread for about one quantum, which bounds the latency
+of every other VM without needing an OS thread per VM.
+
+Author: Zane Francis
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "Virtual_Machine.h"
+
+#define SCHED_DEFAULT_QUANTUM 10000
+
+// Set up an empty scheduler (quantum of 0 picks the default)
+int vm_scheduler_init(VmScheduler *sched, uint64_t quantum) {
+    memset(sched, 0, sizeof(*sched));
+    sched->quantum = quantum ? quantum : SCHED_DEFAULT_QUANTUM;
+    return 0;
+}
+
+// Add a loaded VM to the end of the ready list (returns its task index, -1 on failure)
+int vm_scheduler_add(VmScheduler *sched, VirtualMachine *vm, void *user) {
+    if (vm == NULL) {
+        fprintf(stderr, "Error, no virtual machine to schedule\n");
+        return -1;
+    }
+    // Grow both arrays together so the ready list always fits
+    if (sched->count >= sched->capacity) {
+        size_t new_capacity = sched->capacity ? sched->capacity * 2 : 16;
+        VmTask *tasks = (VmTask*) realloc(sched->tasks, sizeof(VmTask) * new_capacity);
+        if (tasks == NULL) {
+            fprintf(stderr, "Error, scheduler allocation failed\n");
+            return -1;
+        }
+        sched->tasks = tasks;
+        size_t *ready = (size_t*) realloc(sched->ready, sizeof(size_t) * new_capacity);
+        if (ready == NULL) {
+            fprintf(stderr, "Error, scheduler allocation failed\n");
+            return -1;
+        }
+        sched->ready = ready;
+        sched->capacity = new_capacity;
+    }
+
+    VmTask *task = &sched->tasks[sched->count];
+    task->vm = vm;
+    task->user = user;
+    if (vm->running) {
+        task->status = VM_STATUS_YIELDED;
+        sched->ready[sched->ready_count++] = sched->count;
+    } else {
+        task->status = vm->halted ? VM_STATUS_HALTED : VM_STATUS_ERROR;
+    }
+    return (int) sched->count++;
+}
+
+// Give every ready VM one quantum per round (max_rounds of 0 runs until all have stopped)
+size_t vm_scheduler_run(VmScheduler *sched, uint64_t max_rounds) {
+    for (uint64_t round = 0; sched->ready_count > 0 && (max_rounds == 0 || round < max_rounds); round++) {
+        size_t kept = 0;
+
+        // Run the ready list in order and compact it in place, keeping the VMs that yielded
+        for (size_t i = 0; i < sched->ready_count; i++) {
+            size_t index = sched->ready[i];
+            VmTask *task = &sched->tasks[index];
+
+            task->status = vm_execute_for(task->vm, sched->quantum);
+            if (task->status == VM_STATUS_YIELDED) {
+                sched->ready[kept++] = index;
+            }
+        }
+        sched->ready_count = kept;
+        sched->rounds++;
+    }
+    return sched->ready_count;
+}
+
+// Release the scheduler's arrays (the VMs themselves belong to the caller)
+void vm_scheduler_free(VmScheduler *sched) {
+    free(sched->tasks);
+    free(sched->ready);
+    memset(sched, 0, sizeof(*sched));
+}
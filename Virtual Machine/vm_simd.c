@@ -0,0 +1,397 @@
+/*
+This file implements lockstep SIMD execution of many jobs that run the same program.
+
+vm_lockstep_run packs VM_LANES jobs into a structure-of-arrays layout where register r of every lane
+sits in one row, so a single decoded OP_LOAD/OP_ADD/OP_SUB/OP_MUL updates all lanes with one AVX2
+operation per 32 bytes of the row: one for 8-bit registers, up to eight for 64-bit ones (plain loops
+are used when the CPU has no AVX2).
+
+Lanes only execute an instruction when they are at the current pc. The current pc is the lowest pc of
+any running lane, so when an OP_JZ sends lanes different ways the ones that fell behind catch up and
+the group runs as one again once they meet. Instructions that are rare or per-lane by nature (PRINT,
+DIV, PUSH, POP, CALL, RET, PUSHM, POPM, the data memory instructions, HALT and errors) are run one
+lane at a time through vm_step on that lane's own VirtualMachine, which also keeps each lane's stack,
+call stack, data memory and output separate.
+
+Author: Zane Francis
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "Virtual_Machine.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define VM_SIMD_AVX2 1
+#include <immintrin.h>
+#endif
+
+// Every register row holds one word per lane (sizeof(vm_word) 32-byte vectors)
+typedef struct {
+    vm_word regs[NUM_REGISTERS][VM_LANES] __attribute__((aligned(32)));
+    uint16_t pc[VM_LANES];
+} VmLanes;
+
+// Vector operations on register rows (mask selects the lanes that are written)
+typedef struct {
+    void (*load)(vm_word *dst, vm_word value, uint32_t mask);
+    void (*add)(vm_word *dst, const vm_word *a, const vm_word *b, uint32_t mask);
+    void (*sub)(vm_word *dst, const vm_word *a, const vm_word *b, uint32_t mask);
+    void (*mul)(vm_word *dst, const vm_word *a, const vm_word *b, uint32_t mask);
+    uint32_t (*zero)(const vm_word *a);
+} VmLaneOps;
+
+// Scalar lane operations (used when AVX2 is not available)
+static void scalar_load(vm_word *dst, vm_word value, uint32_t mask) {
+    for (int i = 0; i < VM_LANES; i++) {
+        if (mask & (1u << i)) {
+            dst[i] = value;
+        }
+    }
+}
+
+static void scalar_add(vm_word *dst, const vm_word *a, const vm_word *b, uint32_t mask) {
+    for (int i = 0; i < VM_LANES; i++) {
+        if (mask & (1u << i)) {
+            dst[i] = (vm_word) (a[i] + b[i]);
+        }
+    }
+}
+
+static void scalar_sub(vm_word *dst, const vm_word *a, const vm_word *b, uint32_t mask) {
+    for (int i = 0; i < VM_LANES; i++) {
+        if (mask & (1u << i)) {
+            dst[i] = (vm_word) (a[i] - b[i]);
+        }
+    }
+}
+
+static void scalar_mul(vm_word *dst, const vm_word *a, const vm_word *b, uint32_t mask) {
+    for (int i = 0; i < VM_LANES; i++) {
+        if (mask & (1u << i)) {
+            dst[i] = vm_word_mul(a[i], b[i]);
+        }
+    }
+}
+
+static uint32_t scalar_zero(const vm_word *a) {
+    uint32_t mask = 0;
+    for (int i = 0; i < VM_LANES; i++) {
+        if (a[i] == 0) {
+            mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+static const VmLaneOps scalar_ops = { scalar_load, scalar_add, scalar_sub, scalar_mul, scalar_zero };
+
+#ifdef VM_SIMD_AVX2
+
+// A register row is LANE_VECTORS vectors of LANES_PER_VECTOR lanes each
+#define LANE_VECTORS ((int) sizeof(vm_word))
+#define LANES_PER_VECTOR (VM_LANES / LANE_VECTORS)
+
+// Lane-width versions of the AVX2 operations
+#if VM_WORD_BITS == 8
+#define LANE_SET1(value) _mm256_set1_epi8((char) (value))
+#define LANE_ADD _mm256_add_epi8
+#define LANE_SUB _mm256_sub_epi8
+#define LANE_CMPEQ _mm256_cmpeq_epi8
+#elif VM_WORD_BITS == 16
+#define LANE_SET1(value) _mm256_set1_epi16((short) (value))
+#define LANE_ADD _mm256_add_epi16
+#define LANE_SUB _mm256_sub_epi16
+#define LANE_CMPEQ _mm256_cmpeq_epi16
+#define LANE_BITS _mm256_setr_epi16(1, 2, 4, 8, 16, 32, 64, 128, 256, 512, 1024, 2048, 4096, 8192, 16384, \
+                                    (short) 0x8000)
+#elif VM_WORD_BITS == 32
+#define LANE_SET1(value) _mm256_set1_epi32((int) (value))
+#define LANE_ADD _mm256_add_epi32
+#define LANE_SUB _mm256_sub_epi32
+#define LANE_CMPEQ _mm256_cmpeq_epi32
+#define LANE_BITS _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128)
+#else
+#define LANE_SET1(value) _mm256_set1_epi64x((long long) (value))
+#define LANE_ADD _mm256_add_epi64
+#define LANE_SUB _mm256_sub_epi64
+#define LANE_CMPEQ _mm256_cmpeq_epi64
+#define LANE_BITS _mm256_setr_epi64x(1, 2, 4, 8)
+#endif
+
+// Bits of mask that belong to vector v of a row
+static inline uint32_t lane_bits(uint32_t mask, int v) {
+    return (uint32_t) ((uint64_t) mask >> (v * LANES_PER_VECTOR));
+}
+
+// Expand the lane bits of one vector into all-ones/all-zeros lanes
+__attribute__((target("avx2")))
+static inline __m256i avx2_mask(uint32_t bits) {
+#if VM_WORD_BITS == 8
+    // A byte cannot hold a 32-bit lane mask, so spread each mask byte over 8 lanes and test one bit each
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i bits_set = _mm256_set1_epi64x((long long) 0x8040201008040201ULL);
+    __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32((int) bits), spread);
+    return _mm256_cmpeq_epi8(_mm256_and_si256(bytes, bits_set), bits_set);
+#else
+    const __m256i lane = LANE_BITS;
+    return LANE_CMPEQ(_mm256_and_si256(LANE_SET1(bits), lane), lane);
+#endif
+}
+
+// One bit per lane that is all ones
+__attribute__((target("avx2")))
+static inline uint32_t avx2_lane_movemask(__m256i lanes) {
+#if VM_WORD_BITS == 8
+    return (uint32_t) _mm256_movemask_epi8(lanes);
+#elif VM_WORD_BITS == 16
+    // Pack the words to bytes (packs works per 128-bit half, the permute puts the halves together)
+    __m256i bytes = _mm256_permute4x64_epi64(_mm256_packs_epi16(lanes, lanes), 0xD8);
+    return (uint32_t) _mm256_movemask_epi8(bytes) & 0xFFFFu;
+#elif VM_WORD_BITS == 32
+    return (uint32_t) _mm256_movemask_ps(_mm256_castsi256_ps(lanes));
+#else
+    return (uint32_t) _mm256_movemask_pd(_mm256_castsi256_pd(lanes));
+#endif
+}
+
+// Low word-width half of each product
+__attribute__((target("avx2")))
+static inline __m256i avx2_mul_lanes(__m256i a, __m256i b) {
+#if VM_WORD_BITS == 8
+    // There is no 8-bit multiply, so multiply even and odd bytes as 16-bit words and recombine
+    __m256i even = _mm256_mullo_epi16(a, b);
+    __m256i odd = _mm256_mullo_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+    __m256i low_bytes = _mm256_set1_epi16(0x00FF);
+    return _mm256_or_si256(_mm256_and_si256(even, low_bytes), _mm256_slli_epi16(odd, 8));
+#elif VM_WORD_BITS == 16
+    return _mm256_mullo_epi16(a, b);
+#elif VM_WORD_BITS == 32
+    return _mm256_mullo_epi32(a, b);
+#else
+    // No 64-bit multiply either: low * low plus the two cross products shifted up
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                     _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(_mm256_mul_epu32(a, b), _mm256_slli_epi64(cross, 32));
+#endif
+}
+
+// Write result into the lanes of vector v selected by mask
+__attribute__((target("avx2")))
+static inline void avx2_store(vm_word *dst, int v, __m256i result, uint32_t mask) {
+    __m256i *out = (__m256i*) dst + v;
+    __m256i old = _mm256_load_si256(out);
+    _mm256_store_si256(out, _mm256_blendv_epi8(old, result, avx2_mask(lane_bits(mask, v))));
+}
+
+__attribute__((target("avx2")))
+static void avx2_load(vm_word *dst, vm_word value, uint32_t mask) {
+    for (int v = 0; v < LANE_VECTORS; v++) {
+        avx2_store(dst, v, LANE_SET1(value), mask);
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_add(vm_word *dst, const vm_word *a, const vm_word *b, uint32_t mask) {
+    for (int v = 0; v < LANE_VECTORS; v++) {
+        __m256i va = _mm256_load_si256((const __m256i*) a + v);
+        __m256i vb = _mm256_load_si256((const __m256i*) b + v);
+        avx2_store(dst, v, LANE_ADD(va, vb), mask);
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_sub(vm_word *dst, const vm_word *a, const vm_word *b, uint32_t mask) {
+    for (int v = 0; v < LANE_VECTORS; v++) {
+        __m256i va = _mm256_load_si256((const __m256i*) a + v);
+        __m256i vb = _mm256_load_si256((const __m256i*) b + v);
+        avx2_store(dst, v, LANE_SUB(va, vb), mask);
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_mul(vm_word *dst, const vm_word *a, const vm_word *b, uint32_t mask) {
+    for (int v = 0; v < LANE_VECTORS; v++) {
+        __m256i va = _mm256_load_si256((const __m256i*) a + v);
+        __m256i vb = _mm256_load_si256((const __m256i*) b + v);
+        avx2_store(dst, v, avx2_mul_lanes(va, vb), mask);
+    }
+}
+
+__attribute__((target("avx2")))
+static uint32_t avx2_zero(const vm_word *a) {
+    uint32_t mask = 0;
+    for (int v = 0; v < LANE_VECTORS; v++) {
+        __m256i va = _mm256_load_si256((const __m256i*) a + v);
+        mask |= avx2_lane_movemask(LANE_CMPEQ(va, _mm256_setzero_si256())) << (v * LANES_PER_VECTOR);
+    }
+    return mask;
+}
+
+static const VmLaneOps avx2_ops = { avx2_load, avx2_add, avx2_sub, avx2_mul, avx2_zero };
+
+#endif
+
+// Pick the widest lane operations the CPU supports
+static const VmLaneOps *lane_ops(void) {
+#ifdef VM_SIMD_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        return &avx2_ops;
+    }
+#endif
+    return &scalar_ops;
+}
+
+// Run one instruction on a single lane through its own VirtualMachine
+static void lane_step(VmLanes *lanes, VirtualMachine *vm, int lane, uint16_t pc) {
+    for (int r = 0; r < NUM_REGISTERS; r++) {
+        vm->registers[r] = lanes->regs[r][lane];
+    }
+    vm->pc = pc;
+    vm_step(vm);
+    for (int r = 0; r < NUM_REGISTERS; r++) {
+        lanes->regs[r][lane] = vm->registers[r];
+    }
+    lanes->pc[lane] = vm->pc;
+}
+
+// Run up to VM_LANES jobs in lockstep (template holds the loaded program)
+static void lockstep_group(const VmLaneOps *ops, const VirtualMachine *template, VirtualMachine *lane_vms,
+                           VmSink *lane_sinks, VmJob *jobs, int count) {
+    VmLanes lanes;
+    const VmInstr *code = template->image->decoded;
+    uint32_t active = count == VM_LANES ? 0xFFFFFFFFu : (1u << count) - 1;
+    int converged = 1;
+    uint16_t pc = 0;
+
+    memset(&lanes, 0, sizeof(lanes));
+    for (int i = 0; i < count; i++) {
+        lane_vms[i] = *template;
+        vm_sink_init_callback(&lane_sinks[i], vm_job_capture_print, &jobs[i]);
+        vm_set_sink(&lane_vms[i], &lane_sinks[i]);
+        jobs[i].output_count = 0;
+        for (int r = 0; r < NUM_REGISTERS; r++) {
+            lanes.regs[r][i] = jobs[i].registers[r];
+        }
+    }
+
+    while (active) {
+        uint32_t mask = active;
+
+        // After a divergent branch, run the lanes that are furthest behind first
+        if (!converged) {
+            pc = 0xFFFF;
+            for (int i = 0; i < count; i++) {
+                if ((active & (1u << i)) && lanes.pc[i] < pc) {
+                    pc = lanes.pc[i];
+                }
+            }
+            mask = 0;
+            for (int i = 0; i < count; i++) {
+                if ((active & (1u << i)) && lanes.pc[i] == pc) {
+                    mask |= 1u << i;
+                }
+            }
+            converged = mask == active;
+        }
+
+        const VmInstr *instr = &code[pc];
+        uint16_t next = instr->next;
+        uint32_t taken = 0;
+        switch (instr->op) {
+            case OP_LOAD:
+                ops->load(lanes.regs[instr->a], instr->b, mask);
+                break;
+            case OP_ADD:
+                ops->add(lanes.regs[instr->c], lanes.regs[instr->a], lanes.regs[instr->b], mask);
+                break;
+            case OP_SUB:
+                ops->sub(lanes.regs[instr->c], lanes.regs[instr->a], lanes.regs[instr->b], mask);
+                break;
+            case OP_MUL:
+                ops->mul(lanes.regs[instr->c], lanes.regs[instr->a], lanes.regs[instr->b], mask);
+                break;
+            case OP_JMP:
+                next = instr->target;
+                break;
+            case OP_JZ:
+                taken = ops->zero(lanes.regs[instr->a]) & mask;
+                break;
+            default:
+                // Everything else runs one lane at a time
+                for (int i = 0; i < count; i++) {
+                    if (!(mask & (1u << i))) {
+                        continue;
+                    }
+                    lane_step(&lanes, &lane_vms[i], i, pc);
+                    if (!lane_vms[i].running) {
+                        active &= ~(1u << i);
+                    }
+                }
+                converged = 0;
+                continue;
+        }
+
+        // Move the lanes that ran to their next instruction
+        if (converged && (taken == 0 || taken == mask)) {
+            pc = taken ? instr->target : next;
+            continue;
+        }
+        for (int i = 0; i < count; i++) {
+            if (mask & (1u << i)) {
+                lanes.pc[i] = (taken & (1u << i)) ? instr->target : next;
+            }
+        }
+        converged = 0;
+    }
+
+    // Copy the final state back to the jobs
+    for (int i = 0; i < count; i++) {
+        for (int r = 0; r < NUM_REGISTERS; r++) {
+            jobs[i].registers[r] = lanes.regs[r][i];
+        }
+        jobs[i].status = lane_vms[i].halted ? VM_JOB_HALTED : VM_JOB_ERROR;
+    }
+}
+
+// Run the same program for every job, VM_LANES jobs at a time (natives is a VM_MAX_NATIVES table or NULL)
+int vm_lockstep_run(const uint8_t *program, size_t size, const VmNative *natives, VmJob *jobs, size_t count) {
+    if (jobs == NULL) {
+        fprintf(stderr, "Error, no jobs\n");
+        return -1;
+    }
+    VirtualMachine *template = (VirtualMachine*) malloc(sizeof(VirtualMachine) * (VM_LANES + 1));
+    if (template == NULL) {
+        fprintf(stderr, "Error, lane allocation failed\n");
+        return -1;
+    }
+    VirtualMachine *lane_vms = template + 1;
+    VmSink lane_sinks[VM_LANES];
+
+    // Superinstructions are not vectorized, so decode the plain instruction set
+    vm_init(template);
+    template->fusion = 0;
+    // Every lane is copied from the template, so it carries the caller's host functions for OP_CALLN
+    if (natives != NULL) {
+        memcpy(template->natives, natives, sizeof(template->natives));
+    }
+    if (vm_load_program(template, (uint8_t*) program, size) != 0) {
+        for (size_t i = 0; i < count; i++) {
+            jobs[i].status = VM_JOB_REJECTED;
+        }
+        free(template);
+        return -1;
+    }
+
+    const VmLaneOps *ops = lane_ops();
+    for (size_t start = 0; start < count; start += VM_LANES) {
+        int group = count - start < VM_LANES ? (int) (count - start) : VM_LANES;
+        lockstep_group(ops, template, lane_vms, lane_sinks, &jobs[start], group);
+    }
+    // The lanes only borrowed the template's image
+    vm_unload(template);
+    free(template);
+    return 0;
+}
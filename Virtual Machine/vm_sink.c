@@ -0,0 +1,190 @@
+/*
+This file implements the output sinks that OP_PRINT writes to.
+
+Without a sink every PRINT is an fprintf to stderr, and stderr is unbuffered, so a PRINT inside a
+guest loop costs one write syscall per iteration. Attaching a VmSink with vm_set_sink sends the
+values somewhere cheaper instead:
+- discard: only counts the values
+- ring: keeps the most recent values in memory (read them back with vm_sink_ring_read)
+- text: formats "Register value: N" lines into a buffer and writes it to a FILE in large batches
+- binary: the raw values (VM_WORD_BITS / 8 little-endian bytes each), buffered the same way
+- callback: hands every value to a VmPrintFn (the batch executor uses this for per-job output)
+
+The file sinks only write when their buffer fills, so call vm_sink_flush (or vm_sink_free) once the
+program has stopped. A sink is not locked, so VMs on different threads need sinks of their own.
+
+Author: Zane Francis
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "Virtual_Machine.h"
+
+#define SINK_DEFAULT_BUFFER 65536
+#define SINK_TEXT_PREFIX "Register value: "
+#define SINK_TEXT_DIGITS 20                                  // Digits of the largest 64-bit value
+#define SINK_TEXT_MAX (sizeof(SINK_TEXT_PREFIX) - 1 + SINK_TEXT_DIGITS + 1)   // Prefix, digits and a newline
+
+// Attach a sink to a virtual machine (NULL goes back to printing on stderr)
+void vm_set_sink(VirtualMachine *vm, VmSink *sink) {
+    vm->sink = sink;
+}
+
+// Zero a sink and set its kind
+static void sink_reset(VmSink *sink, VmSinkKind kind) {
+    memset(sink, 0, sizeof(*sink));
+    sink->kind = kind;
+}
+
+// Allocate the batch buffer for a file sink (returns -1 on failure)
+static int sink_init_file(VmSink *sink, VmSinkKind kind, FILE *file, size_t buffer_size) {
+    sink_reset(sink, kind);
+    if (file == NULL) {
+        fprintf(stderr, "Error, sink has no file\n");
+        return -1;
+    }
+    if (buffer_size < SINK_TEXT_MAX) {
+        buffer_size = SINK_DEFAULT_BUFFER;
+    }
+    sink->buffer = (uint8_t*) malloc(buffer_size);
+    if (sink->buffer == NULL) {
+        fprintf(stderr, "Error, sink buffer allocation failed\n");
+        return -1;
+    }
+    sink->capacity = buffer_size;
+    sink->owns_buffer = 1;
+    sink->file = file;
+    return 0;
+}
+
+void vm_sink_init_stderr(VmSink *sink) {
+    sink_reset(sink, VM_SINK_STDERR);
+}
+
+void vm_sink_init_discard(VmSink *sink) {
+    sink_reset(sink, VM_SINK_DISCARD);
+}
+
+// The ring keeps the last capacity values in buffer (owned by the caller)
+void vm_sink_init_ring(VmSink *sink, vm_word *buffer, size_t capacity) {
+    sink_reset(sink, VM_SINK_RING);
+    sink->ring = buffer;
+    sink->capacity = buffer != NULL ? capacity : 0;
+}
+
+// buffer_size of 0 picks a 64 KiB buffer
+int vm_sink_init_text(VmSink *sink, FILE *file, size_t buffer_size) {
+    return sink_init_file(sink, VM_SINK_TEXT, file, buffer_size);
+}
+
+int vm_sink_init_binary(VmSink *sink, FILE *file, size_t buffer_size) {
+    return sink_init_file(sink, VM_SINK_BINARY, file, buffer_size);
+}
+
+void vm_sink_init_callback(VmSink *sink, VmPrintFn fn, void *ctx) {
+    sink_reset(sink, VM_SINK_CALLBACK);
+    sink->fn = fn;
+    sink->ctx = ctx;
+}
+
+// Write the pending bytes of a file sink
+void vm_sink_flush(VmSink *sink) {
+    if ((sink->kind == VM_SINK_TEXT || sink->kind == VM_SINK_BINARY) && sink->count > 0) {
+        if (fwrite(sink->buffer, 1, sink->count, sink->file) != sink->count) {
+            fprintf(stderr, "Error, sink write failed\n");
+        }
+        sink->count = 0;
+        fflush(sink->file);
+    }
+}
+
+// Format one text line without going through printf
+static size_t sink_format_text(uint8_t *out, vm_word value) {
+    size_t len = sizeof(SINK_TEXT_PREFIX) - 1;
+    uint8_t digits[SINK_TEXT_DIGITS];
+    int count = 0;
+
+    memcpy(out, SINK_TEXT_PREFIX, len);
+    // Digits come out lowest first
+    do {
+        digits[count++] = (uint8_t) ('0' + value % 10);
+        value /= 10;
+    } while (value != 0);
+    while (count > 0) {
+        out[len++] = digits[--count];
+    }
+    out[len++] = '\n';
+    return len;
+}
+
+// Send one PRINT value to the sink
+void vm_sink_write(VmSink *sink, vm_word value) {
+    sink->total++;
+    switch (sink->kind) {
+        case VM_SINK_DISCARD:
+            break;
+        case VM_SINK_RING:
+            if (sink->capacity == 0) {
+                break;
+            }
+            sink->ring[sink->head] = value;
+            sink->head = sink->head + 1 == sink->capacity ? 0 : sink->head + 1;
+            if (sink->count < sink->capacity) {
+                sink->count++;
+            }
+            break;
+        case VM_SINK_TEXT:
+            if (sink->capacity - sink->count < SINK_TEXT_MAX) {
+                vm_sink_flush(sink);
+            }
+            sink->count += sink_format_text(&sink->buffer[sink->count], value);
+            break;
+        case VM_SINK_BINARY:
+            if (sink->capacity - sink->count < sizeof(vm_word)) {
+                vm_sink_flush(sink);
+            }
+            for (size_t i = 0; i < sizeof(vm_word); i++) {
+                sink->buffer[sink->count++] = (uint8_t) (value >> (8 * i));
+            }
+            break;
+        case VM_SINK_CALLBACK:
+            if (sink->fn != NULL) {
+                sink->fn(sink->ctx, value);
+            }
+            break;
+        case VM_SINK_STDERR:
+        default:
+            fprintf(stderr, "Register value: %" PRIu64 "\n", (uint64_t) value);
+            break;
+    }
+}
+
+// Copy the values held by a ring sink, oldest first (returns how many were copied)
+size_t vm_sink_ring_read(const VmSink *sink, vm_word *out, size_t max) {
+    if (sink->kind != VM_SINK_RING || sink->count == 0) {
+        return 0;
+    }
+    size_t count = sink->count < max ? sink->count : max;
+    // The oldest value sits count slots behind head, skip the ones that do not fit in out
+    size_t start = (sink->head + sink->capacity - count) % sink->capacity;
+
+    for (size_t i = 0; i < count; i++) {
+        out[i] = sink->ring[(start + i) % sink->capacity];
+    }
+    return count;
+}
+
+// Flush a sink and release any buffer it allocated
+void vm_sink_free(VmSink *sink) {
+    vm_sink_flush(sink);
+    if (sink->owns_buffer) {
+        free(sink->buffer);
+    }
+    sink->buffer = NULL;
+    sink->ring = NULL;
+    sink->capacity = 0;
+    sink->count = 0;
+    sink->owns_buffer = 0;
+}
@@ -0,0 +1,675 @@
+/*
+This file implements the threaded execution engine for the virtual machine.
+
+Instead of fetching and decoding one byte at a time like vm_execute, the program is decoded once
+when it is loaded into an array of fixed-width VmInstr records (one per memory address, so jumps can
+land on any byte exactly like they do in the switch interpreter). The engine then jumps straight from
+one handler to the next using computed goto when the compiler supports it, which gives every handler
+its own indirect branch instead of sharing the single branch at the top of a switch.
+
+Anything the decoder cannot prove valid (bad register, bad jump address, unknown opcode) becomes a
+VM_OP_TRAP record. The engine hands those back to vm_step so the error messages stay identical.
+
+When fusion is enabled (the default, see vm_set_fusion) a second pass rewrites common instruction
+pairs into superinstructions listed in fusion_rules, so each pair costs one dispatch instead of two.
+Only the record of the first instruction is replaced, so a jump to the second one still lands on
+its own unfused record.
+
+vm_execute_for runs the same engine with an instruction budget. Straight-line code can run at most
+MEMORY_SIZE instructions before it halts or branches backwards, so the budget is only charged when a
+backward branch is taken: each such record carries the number of instructions from its target up to
+the branch, and the engine yields once the budget cannot cover the next trip round the loop. OP_CALL
+counts as a branch to its target, and every OP_RET is charged one instruction since it may go back.
+
+Author: Zane Francis
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "Virtual_Machine.h"
+
+// Use computed goto on GCC/Clang, otherwise fall back to a switch
+#if defined(__GNUC__)
+#define VM_COMPUTED_GOTO 1
+#endif
+
+// Number of bytes an instruction occupies (opcode included), 0 for unknown opcodes
+int vm_instruction_length(uint8_t opcode) {
+    switch (opcode) {
+        case OP_HALT:
+        case OP_RET:
+            return 1;
+        case OP_PRINT:
+        case OP_PUSH:
+        case OP_POP:
+        case OP_PUSHM:
+        case OP_POPM:
+        case OP_CALLN:
+            return 2;
+        case OP_LOAD:
+        case OP_JMP:
+        case OP_CALL:
+        case OP_LDB:
+        case OP_STB:
+            return 3;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_JZ:
+        case OP_VADD:
+        case OP_VSUB:
+        case OP_VMUL:
+        case OP_MSET:
+        case OP_MCPY:
+        case OP_VSUM:
+            return 4;
+        case OP_VCMP:
+            return 5;
+        default:
+            return 0;
+    }
+}
+
+// Decode the instruction starting at addr into a record
+static void vm_decode_at(const uint8_t *memory, int addr, VmInstr *instr) {
+    uint8_t opcode = memory[addr];
+    int length = vm_instruction_length(opcode);
+
+    // Default to a trap so vm_step reports the problem
+    memset(instr, 0, sizeof(*instr));
+    instr->op = VM_OP_TRAP;
+    instr->next = (uint16_t) (addr + 1);
+    // Unknown opcode or instruction cut off by the end of memory
+    if (length == 0 || addr + length > MEMORY_SIZE) {
+        return;
+    }
+    const uint8_t *operand = &memory[addr + 1];
+    switch (opcode) {
+        case OP_HALT:
+        case OP_RET:
+            break;
+        case OP_LOAD:
+            if (operand[0] >= NUM_REGISTERS) {
+                return;
+            }
+            instr->a = operand[0];
+            instr->b = operand[1];
+            break;
+        case OP_PRINT:
+        case OP_PUSH:
+        case OP_POP:
+            if (operand[0] >= NUM_REGISTERS) {
+                return;
+            }
+            instr->a = operand[0];
+            break;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+            if (operand[0] >= NUM_REGISTERS || operand[1] >= NUM_REGISTERS || operand[2] >= NUM_REGISTERS) {
+                return;
+            }
+            instr->a = operand[0];
+            instr->b = operand[1];
+            instr->c = operand[2];
+            break;
+        case OP_JMP:
+        case OP_CALL:
+            instr->target = (uint16_t) ((operand[0] << 8) | operand[1]);
+            if (instr->target >= MEMORY_SIZE) {
+                return;
+            }
+            break;
+        case OP_PUSHM:
+        case OP_POPM:
+            // a holds the register mask and b how many registers it names
+            if (operand[0] >> NUM_REGISTERS) {
+                return;
+            }
+            instr->a = operand[0];
+            instr->b = (uint8_t) vm_mask_count(operand[0]);
+            break;
+        case OP_JZ:
+            instr->a = operand[0];
+            instr->target = (uint16_t) ((operand[1] << 8) | operand[2]);
+            if (operand[0] >= NUM_REGISTERS || instr->target >= MEMORY_SIZE) {
+                return;
+            }
+            break;
+        case OP_LDB:
+        case OP_STB:
+            if (operand[0] >= NUM_REGISTERS || operand[1] >= NUM_REGISTERS) {
+                return;
+            }
+            instr->a = operand[0];
+            instr->b = operand[1];
+            break;
+        case OP_VADD:
+        case OP_VSUB:
+        case OP_VMUL:
+        case OP_MSET:
+        case OP_MCPY:
+        case OP_VSUM:
+        case OP_VCMP: {
+            for (int i = 0; i < length - 1; i++) {
+                if (operand[i] >= NUM_REGISTERS) {
+                    return;
+                }
+            }
+            // a, b and c hold the x, y and length registers, x the result register
+            VmBulkOperands reg = vm_bulk_operands(opcode, operand);
+            instr->a = reg.x;
+            instr->b = reg.y;
+            instr->c = reg.length;
+            instr->x = reg.result;
+            break;
+        }
+        case OP_CALLN:
+            if (operand[0] >= VM_MAX_NATIVES) {
+                return;
+            }
+            instr->a = operand[0];
+            break;
+    }
+    instr->op = opcode;
+    instr->next = (uint16_t) (addr + length);
+}
+
+// Instruction pairs that are rewritten into a single superinstruction
+typedef struct {
+    uint8_t first;
+    uint8_t second;
+    uint8_t fused;
+} VmFusionRule;
+
+static const VmFusionRule fusion_rules[] = {
+    { OP_LOAD, OP_ADD, VM_OP_LOAD_ADD },    // Load a constant then add
+    { OP_LOAD, OP_SUB, VM_OP_LOAD_SUB },    // Load a constant then subtract
+    { OP_SUB, OP_JZ, VM_OP_SUB_JZ },        // Decrement-then-test loop tail
+    { OP_PUSH, OP_POP, VM_OP_PUSH_POP },    // Register move through the stack
+};
+
+// Rewrite instruction pairs that match a fusion rule
+static void vm_fuse_program(VmImage *image) {
+    // Ascending order means the second record is always still unfused when it is read
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        VmInstr *first = &image->decoded[addr];
+        if (first->op == VM_OP_TRAP || first->next >= MEMORY_SIZE) {
+            continue;
+        }
+        const VmInstr *second = &image->decoded[first->next];
+        for (size_t i = 0; i < sizeof(fusion_rules) / sizeof(fusion_rules[0]); i++) {
+            if (first->op == fusion_rules[i].first && second->op == fusion_rules[i].second) {
+                first->op = fusion_rules[i].fused;
+                first->x = second->a;
+                first->y = second->b;
+                first->z = second->c;
+                first->target = second->target;
+                first->next = second->next;
+                break;
+            }
+        }
+    }
+}
+
+// Give every backward branch the number of instructions between its target and itself
+static void vm_cost_program(VmImage *image) {
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        VmInstr *instr = &image->decoded[addr];
+        // Where a return lands is only known at runtime, so every OP_RET is charged as one instruction
+        if (instr->op == OP_RET) {
+            instr->cost = 1;
+            continue;
+        }
+        if ((instr->op != OP_JMP && instr->op != OP_JZ && instr->op != VM_OP_SUB_JZ && instr->op != OP_CALL) ||
+                instr->target > addr) {
+            continue;
+        }
+        // Walk the raw instructions of the loop body, the branch itself included
+        // (fewer than MEMORY_SIZE of them, so the count always fits)
+        int cost = 0;
+        int pc = instr->target;
+        while (pc < instr->next) {
+            int length = vm_instruction_length(image->memory[pc]);
+            pc += length ? length : 1;
+            cost++;
+        }
+        instr->cost = (uint16_t) cost;
+    }
+}
+
+// Add the end-of-memory sentinel, superinstructions and branch costs to a decoded stream
+static void vm_finish_decode(VmImage *image) {
+    // Sentinel for instructions that end exactly at the end of memory
+    memset(&image->decoded[MEMORY_SIZE], 0, sizeof(VmInstr));
+    image->decoded[MEMORY_SIZE].op = VM_OP_FALLOFF;
+    if (image->fusion) {
+        vm_fuse_program(image);
+    }
+    vm_cost_program(image);
+}
+
+// Decode the whole memory image into image->decoded
+void vm_decode_program(VmImage *image) {
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        vm_decode_at(image->memory, addr, &image->decoded[addr]);
+    }
+    vm_finish_decode(image);
+}
+
+// Decode only the instructions the verifier results mark as starts, for an image whose analysis was
+// loaded with it. A verified program never reaches any other address, they are left as traps that
+// hand back to vm_step.
+void vm_decode_verified(VmImage *image) {
+    const uint8_t *flags = image->verify.flags;
+
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        VmInstr *instr = &image->decoded[addr];
+        if (flags[addr] & VM_ADDR_START) {
+            vm_decode_at(image->memory, addr, instr);
+        } else {
+            memset(instr, 0, sizeof(*instr));
+            instr->op = VM_OP_TRAP;
+            instr->next = (uint16_t) (addr + 1);
+        }
+    }
+    vm_finish_decode(image);
+}
+
+// Turn superinstruction fusion on or off (images are shared, so the loaded program gets a new one)
+void vm_set_fusion(VirtualMachine *vm, int enabled) {
+    vm->fusion = enabled ? 1 : 0;
+    if (vm->image == &vm_empty_image || vm->image->fusion == vm->fusion) {
+        return;
+    }
+    VmImage *image = vm_image_create(vm->image->memory, vm->image->size, vm->fusion);
+    if (image == NULL) {
+        return;
+    }
+    // Keep the execution state, only the code image changes
+    uint8_t running = vm->running;
+    uint8_t halted = vm->halted;
+    vm_attach_image(vm, image);
+    vm_image_release(image);
+    vm->running = running;
+    vm->halted = halted;
+}
+
+// Threaded engine shared by vm_execute_threaded and vm_execute_for (budget is charged on backward branches)
+static VmStatus vm_threaded_run(VirtualMachine *vm, uint64_t budget) {
+    const VmInstr *code = vm->image->decoded;
+    vm_word *regs = vm->registers;
+    uint16_t sp = vm->sp;
+    const VmInstr *ip;
+    int stack_safe = 0;
+
+    if (!vm->running) {
+        return vm->halted ? VM_STATUS_HALTED : VM_STATUS_ERROR;
+    }
+    // Verified programs whose stack depth is known everywhere can skip the stack checks
+    vm_verified_entry(vm, &stack_safe);
+    const int check_stack = !stack_safe;
+    ip = &code[vm->pc];
+
+#ifdef VM_COMPUTED_GOTO
+    // The decoder only ever produces the opcodes listed here
+    static const void *dispatch_table[256] = {
+        [OP_HALT] = &&op_halt,
+        [OP_LOAD] = &&op_load,
+        [OP_PRINT] = &&op_print,
+        [OP_ADD] = &&op_add,
+        [OP_SUB] = &&op_sub,
+        [OP_MUL] = &&op_mul,
+        [OP_DIV] = &&op_div,
+        [OP_JMP] = &&op_jmp,
+        [OP_JZ] = &&op_jz,
+        [OP_PUSH] = &&op_push,
+        [OP_POP] = &&op_pop,
+        [OP_CALL] = &&op_call,
+        [OP_RET] = &&op_ret,
+        [OP_PUSHM] = &&op_pushm,
+        [OP_POPM] = &&op_popm,
+        [OP_LDB] = &&op_ldb,
+        [OP_STB] = &&op_stb,
+        [OP_VADD] = &&op_bulk,
+        [OP_VSUB] = &&op_bulk,
+        [OP_VMUL] = &&op_bulk,
+        [OP_MSET] = &&op_bulk,
+        [OP_MCPY] = &&op_bulk,
+        [OP_VSUM] = &&op_bulk,
+        [OP_VCMP] = &&op_bulk,
+        [OP_CALLN] = &&op_calln,
+        [VM_OP_LOAD_ADD] = &&op_load_add,
+        [VM_OP_LOAD_SUB] = &&op_load_sub,
+        [VM_OP_SUB_JZ] = &&op_sub_jz,
+        [VM_OP_PUSH_POP] = &&op_push_pop,
+        [VM_OP_TRAP] = &&op_trap,
+        [VM_OP_FALLOFF] = &&op_falloff,
+    };
+#define TARGET(label, opcode) label:
+#define DISPATCH() goto *dispatch_table[ip->op]
+// Take a branch (ip is the branch record), yielding at the target once the budget runs out
+#define BRANCH(taken_ip) do { \
+        uint16_t cost = ip->cost; \
+        ip = (taken_ip); \
+        if (cost != 0) { \
+            if (budget <= cost) goto yield; \
+            budget -= cost; \
+        } \
+    } while (0)
+    DISPATCH();
+    {
+#else
+#define TARGET(label, opcode) case opcode:
+#define DISPATCH() goto dispatch
+#define BRANCH(taken_ip) do { \
+        uint16_t cost = ip->cost; \
+        ip = (taken_ip); \
+        if (cost != 0) { \
+            if (budget <= cost) goto yield; \
+            budget -= cost; \
+        } \
+    } while (0)
+dispatch:
+    switch (ip->op) {
+#endif
+        // Case for ending the virtual machine
+        TARGET(op_halt, OP_HALT) {
+            vm->pc = ip->next;
+            vm->sp = sp;
+            vm->running = 0;
+            vm->halted = 1;
+            return VM_STATUS_HALTED;
+        }
+
+        // Case for loading the registers and values
+        TARGET(op_load, OP_LOAD) {
+            regs[ip->a] = ip->b;
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Case for printing
+        TARGET(op_print, OP_PRINT) {
+            vm_print_value(vm, regs[ip->a]);
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Case for addition
+        TARGET(op_add, OP_ADD) {
+            regs[ip->c] = regs[ip->a] + regs[ip->b];
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Case for subtraction
+        TARGET(op_sub, OP_SUB) {
+            regs[ip->c] = regs[ip->a] - regs[ip->b];
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Case for multiplication
+        TARGET(op_mul, OP_MUL) {
+            regs[ip->c] = vm_word_mul(regs[ip->a], regs[ip->b]);
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Case for division
+        TARGET(op_div, OP_DIV) {
+            if (regs[ip->b] == 0) {
+                fprintf(stderr, "Error, can not divide when register %d is 0.\n", ip->b);
+                vm->pc = ip->next;
+                vm->sp = sp;
+                vm->running = 0;
+                return VM_STATUS_ERROR;
+            }
+            regs[ip->c] = regs[ip->a] / regs[ip->b];
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Case for jumping to an address
+        TARGET(op_jmp, OP_JMP) {
+            BRANCH(&code[ip->target]);
+            DISPATCH();
+        }
+
+        // Case for jumping if a register is zero
+        TARGET(op_jz, OP_JZ) {
+            if (regs[ip->a] == 0) {
+                BRANCH(&code[ip->target]);
+            } else {
+                ip = &code[ip->next];
+            }
+            DISPATCH();
+        }
+
+        // Case for pushing onto the stack
+        TARGET(op_push, OP_PUSH) {
+            if (check_stack && sp <= 0) {
+                fprintf(stderr, "Error, stack underflow\n");
+                vm->pc = ip->next;
+                vm->sp = sp;
+                vm->running = 0;
+                return VM_STATUS_ERROR;
+            }
+            vm->stack[sp] = regs[ip->a];
+            sp--;
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Case for popping off the stack
+        TARGET(op_pop, OP_POP) {
+            if (check_stack && sp >= MEMORY_SIZE - 1) {
+                fprintf(stderr, "Error, stack overflow\n");
+                vm->pc = ip->next;
+                vm->sp = sp;
+                vm->running = 0;
+                return VM_STATUS_ERROR;
+            }
+            // Remember how deep the stack got before it shrinks (see vm_restore)
+            if (sp < vm->stack_low) {
+                vm->stack_low = sp;
+            }
+            sp++;
+            regs[ip->a] = vm->stack[sp];
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Case for calling a subroutine (overflow is reported by vm_step)
+        TARGET(op_call, OP_CALL) {
+            if (vm->call_depth >= VM_CALL_DEPTH) {
+                goto fallback;
+            }
+            vm->call_stack[vm->call_depth++] = ip->next;
+            BRANCH(&code[ip->target]);
+            DISPATCH();
+        }
+
+        // Case for returning from a subroutine
+        TARGET(op_ret, OP_RET) {
+            if (vm->call_depth == 0) {
+                goto fallback;
+            }
+            BRANCH(&code[vm->call_stack[--vm->call_depth]]);
+            DISPATCH();
+        }
+
+        // Case for pushing a set of registers
+        TARGET(op_pushm, OP_PUSHM) {
+            if (check_stack && sp < ip->b) {
+                goto fallback;
+            }
+            sp = vm_push_mask(vm->stack, sp, regs, ip->a);
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Case for popping a set of registers
+        TARGET(op_popm, OP_POPM) {
+            if (check_stack && sp + ip->b > MEMORY_SIZE - 1) {
+                goto fallback;
+            }
+            if (sp < vm->stack_low) {
+                vm->stack_low = sp;
+            }
+            sp = vm_pop_mask(vm->stack, sp, regs, ip->a);
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Case for loading a byte of data memory (a bad address is reported by vm_step)
+        TARGET(op_ldb, OP_LDB) {
+            if (!vm_data_address(regs[ip->b])) {
+                goto fallback;
+            }
+            regs[ip->a] = vm->data[regs[ip->b]];
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Case for storing a byte of data memory
+        TARGET(op_stb, OP_STB) {
+            if (!vm_data_address(regs[ip->a])) {
+                goto fallback;
+            }
+            vm->data[regs[ip->a]] = (uint8_t) regs[ip->b];
+            vm_data_mark(vm, regs[ip->a]);
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Case for the bulk operations (a range out of bounds is reported by vm_step)
+#ifdef VM_COMPUTED_GOTO
+        op_bulk:
+#else
+        case OP_VADD:
+        case OP_VSUB:
+        case OP_VMUL:
+        case OP_MSET:
+        case OP_MCPY:
+        case OP_VSUM:
+        case OP_VCMP:
+#endif
+        {
+            int result = vm_data_bulk(vm, ip->op, regs[ip->a], regs[ip->b], regs[ip->c]);
+            if (result < 0) {
+                goto fallback;
+            }
+            if (ip->x < NUM_REGISTERS) {
+                regs[ip->x] = (vm_word) result;
+            }
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Case for calling a host function (it sees the VM as vm_step would leave it)
+        TARGET(op_calln, OP_CALLN) {
+            vm->pc = ip->next;
+            vm->sp = sp;
+            if (vm_call_native(vm, ip->a) != 0) {
+                return VM_STATUS_ERROR;
+            }
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Superinstruction: OP_LOAD then OP_ADD
+        TARGET(op_load_add, VM_OP_LOAD_ADD) {
+            regs[ip->a] = ip->b;
+            regs[ip->z] = regs[ip->x] + regs[ip->y];
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Superinstruction: OP_LOAD then OP_SUB
+        TARGET(op_load_sub, VM_OP_LOAD_SUB) {
+            regs[ip->a] = ip->b;
+            regs[ip->z] = regs[ip->x] - regs[ip->y];
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Superinstruction: OP_SUB then OP_JZ
+        TARGET(op_sub_jz, VM_OP_SUB_JZ) {
+            regs[ip->c] = regs[ip->a] - regs[ip->b];
+            if (regs[ip->x] == 0) {
+                BRANCH(&code[ip->target]);
+            } else {
+                ip = &code[ip->next];
+            }
+            DISPATCH();
+        }
+
+        // Superinstruction: OP_PUSH then OP_POP (sp ends up where it started)
+        TARGET(op_push_pop, VM_OP_PUSH_POP) {
+            if (check_stack && sp <= 0) {
+                goto fallback;
+            }
+            vm->stack[sp] = regs[ip->a];
+            regs[ip->x] = vm->stack[sp];
+            if (sp - 1 < vm->stack_low) {
+                vm->stack_low = (uint16_t) (sp - 1);
+            }
+            ip = &code[ip->next];
+            DISPATCH();
+        }
+
+        // Case for running off the end of memory
+        TARGET(op_falloff, VM_OP_FALLOFF) {
+            fprintf(stderr, "Error, program counter out of bounds\n");
+            vm->pc = MEMORY_SIZE;
+            vm->sp = sp;
+            vm->running = 0;
+            return VM_STATUS_ERROR;
+        }
+
+#ifndef VM_COMPUTED_GOTO
+        default:
+#endif
+        // Let the switch interpreter handle anything the decoder rejected
+        TARGET(op_trap, VM_OP_TRAP)
+        fallback: {
+            vm->pc = (uint16_t) (ip - code);
+            vm->sp = sp;
+            vm_step(vm);
+            if (!vm->running) {
+                return vm->halted ? VM_STATUS_HALTED : VM_STATUS_ERROR;
+            }
+            sp = vm->sp;
+            ip = &code[vm->pc < MEMORY_SIZE ? vm->pc : MEMORY_SIZE];
+            DISPATCH();
+        }
+    }
+
+    // Budget used up: stop at the branch target, still running
+yield:
+    vm->pc = (uint16_t) (ip - code);
+    vm->sp = sp;
+    return VM_STATUS_YIELDED;
+#undef TARGET
+#undef DISPATCH
+#undef BRANCH
+}
+
+// Threaded execution function for the virtual machine
+void vm_execute_threaded(VirtualMachine *vm) {
+    vm_threaded_run(vm, UINT64_MAX);
+}
+
+// Run for roughly max_instructions (checked on backward branches) and report why it stopped
+VmStatus vm_execute_for(VirtualMachine *vm, uint64_t max_instructions) {
+    if (vm->running && max_instructions == 0) {
+        return VM_STATUS_YIELDED;
+    }
+    return vm_threaded_run(vm, max_instructions);
+}
@@ -0,0 +1,339 @@
+/*
+This file implements the bulk data-memory instructions (OP_VADD, OP_VSUB, OP_VMUL, OP_MSET, OP_MCPY,
+OP_VSUM and OP_VCMP) and the SIMD kernels they run on.
+
+Every VM has VM_DATA_SIZE bytes of data memory next to its stack. A bulk instruction takes its
+addresses and length from registers and processes the whole range in one dispatch, so the kernels
+below do the per-byte work 16 (SSE2) or 32 (AVX2) bytes at a time. The widest set the CPU supports is
+picked the first time a kernel runs, with plain loops on hosts that have neither. Fills and copies go
+straight to memset/memmove, which the C library already vectorizes.
+
+vm_data_bulk is the single entry point the engines share: it range-checks the operands, makes
+overlapping vector operations behave as if the whole source were read first, and returns the result
+for OP_VSUM/OP_VCMP (or -1 without touching memory when a range runs past the end).
+
+Author: Zane Francis
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "Virtual_Machine.h"
+
+#define VM_BULK_CHUNK 256    // Source bytes buffered at a time when an overlapping range runs backwards
+
+#if defined(__SSE2__)
+#define VM_VECTOR_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(VM_VECTOR_SSE2) && defined(__GNUC__) && defined(__x86_64__)
+#define VM_VECTOR_AVX2 1
+#include <immintrin.h>
+#endif
+
+// Kernels over byte ranges (they run forwards, so dst may overlap src only from below, vm_data_bulk sees to that)
+typedef struct {
+    void (*add)(uint8_t *dst, const uint8_t *src, size_t count);
+    void (*sub)(uint8_t *dst, const uint8_t *src, size_t count);
+    void (*mul)(uint8_t *dst, const uint8_t *src, size_t count);
+    uint32_t (*sum)(const uint8_t *src, size_t count);
+    size_t (*mismatch)(const uint8_t *a, const uint8_t *b, size_t count);
+} VmVectorOps;
+
+// Scalar kernels (used when there is no SSE2, and for the tails of the vector ones)
+static void scalar_add(uint8_t *dst, const uint8_t *src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = (uint8_t) (dst[i] + src[i]);
+    }
+}
+
+static void scalar_sub(uint8_t *dst, const uint8_t *src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = (uint8_t) (dst[i] - src[i]);
+    }
+}
+
+static void scalar_mul(uint8_t *dst, const uint8_t *src, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        dst[i] = (uint8_t) (dst[i] * src[i]);
+    }
+}
+
+static uint32_t scalar_sum(const uint8_t *src, size_t count) {
+    uint32_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        total += src[i];
+    }
+    return total;
+}
+
+static size_t scalar_mismatch(const uint8_t *a, const uint8_t *b, size_t count) {
+    size_t i = 0;
+    while (i < count && a[i] == b[i]) {
+        i++;
+    }
+    return i;
+}
+
+static const VmVectorOps scalar_ops = { scalar_add, scalar_sub, scalar_mul, scalar_sum, scalar_mismatch };
+
+#ifdef VM_VECTOR_SSE2
+
+static void sse2_add(uint8_t *dst, const uint8_t *src, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i*) (dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i*) (src + i));
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_add_epi8(d, s));
+    }
+    scalar_add(dst + i, src + i, count - i);
+}
+
+static void sse2_sub(uint8_t *dst, const uint8_t *src, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i*) (dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i*) (src + i));
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_sub_epi8(d, s));
+    }
+    scalar_sub(dst + i, src + i, count - i);
+}
+
+// There is no 8-bit multiply, so multiply even and odd bytes as 16-bit words and recombine
+static void sse2_mul(uint8_t *dst, const uint8_t *src, size_t count) {
+    const __m128i low_bytes = _mm_set1_epi16(0x00FF);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i*) (dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i*) (src + i));
+        __m128i even = _mm_mullo_epi16(d, s);
+        __m128i odd = _mm_mullo_epi16(_mm_srli_epi16(d, 8), _mm_srli_epi16(s, 8));
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_or_si128(_mm_and_si128(even, low_bytes), _mm_slli_epi16(odd, 8)));
+    }
+    scalar_mul(dst + i, src + i, count - i);
+}
+
+// psadbw against zero adds up each group of 8 bytes into a 64-bit lane
+static uint32_t sse2_sum(const uint8_t *src, size_t count) {
+    __m128i total = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i*) (src + i));
+        total = _mm_add_epi64(total, _mm_sad_epu8(s, _mm_setzero_si128()));
+    }
+    total = _mm_add_epi64(total, _mm_unpackhi_epi64(total, total));
+    return (uint32_t) _mm_cvtsi128_si32(total) + scalar_sum(src + i, count - i);
+}
+
+static size_t sse2_mismatch(const uint8_t *a, const uint8_t *b, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i va = _mm_loadu_si128((const __m128i*) (a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i*) (b + i));
+        unsigned equal = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+        if (equal != 0xFFFF) {
+            return i + (size_t) __builtin_ctz(~equal);
+        }
+    }
+    return i + scalar_mismatch(a + i, b + i, count - i);
+}
+
+static const VmVectorOps sse2_ops = { sse2_add, sse2_sub, sse2_mul, sse2_sum, sse2_mismatch };
+
+#endif
+
+#ifdef VM_VECTOR_AVX2
+
+// The tails go to the SSE2 kernels, which are legacy-encoded: clear the upper YMM halves before the
+// call or every SSE instruction in them pays the AVX/SSE transition penalty
+__attribute__((target("avx2")))
+static void avx2_add(uint8_t *dst, const uint8_t *src, size_t count) {
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i d = _mm256_loadu_si256((const __m256i*) (dst + i));
+        __m256i s = _mm256_loadu_si256((const __m256i*) (src + i));
+        _mm256_storeu_si256((__m256i*) (dst + i), _mm256_add_epi8(d, s));
+    }
+    _mm256_zeroupper();
+    sse2_add(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_sub(uint8_t *dst, const uint8_t *src, size_t count) {
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i d = _mm256_loadu_si256((const __m256i*) (dst + i));
+        __m256i s = _mm256_loadu_si256((const __m256i*) (src + i));
+        _mm256_storeu_si256((__m256i*) (dst + i), _mm256_sub_epi8(d, s));
+    }
+    _mm256_zeroupper();
+    sse2_sub(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void avx2_mul(uint8_t *dst, const uint8_t *src, size_t count) {
+    const __m256i low_bytes = _mm256_set1_epi16(0x00FF);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i d = _mm256_loadu_si256((const __m256i*) (dst + i));
+        __m256i s = _mm256_loadu_si256((const __m256i*) (src + i));
+        __m256i even = _mm256_mullo_epi16(d, s);
+        __m256i odd = _mm256_mullo_epi16(_mm256_srli_epi16(d, 8), _mm256_srli_epi16(s, 8));
+        _mm256_storeu_si256((__m256i*) (dst + i),
+            _mm256_or_si256(_mm256_and_si256(even, low_bytes), _mm256_slli_epi16(odd, 8)));
+    }
+    _mm256_zeroupper();
+    sse2_mul(dst + i, src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static uint32_t avx2_sum(const uint8_t *src, size_t count) {
+    __m256i total = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i*) (src + i));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(s, _mm256_setzero_si256()));
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+    half = _mm_add_epi64(half, _mm_unpackhi_epi64(half, half));
+    uint32_t sum = (uint32_t) _mm_cvtsi128_si32(half);
+    _mm256_zeroupper();
+    return sum + sse2_sum(src + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_mismatch(const uint8_t *a, const uint8_t *b, size_t count) {
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i va = _mm256_loadu_si256((const __m256i*) (a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i*) (b + i));
+        uint32_t equal = (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+        if (equal != 0xFFFFFFFFu) {
+            return i + (size_t) __builtin_ctz(~equal);
+        }
+    }
+    _mm256_zeroupper();
+    return i + sse2_mismatch(a + i, b + i, count - i);
+}
+
+static const VmVectorOps avx2_ops = { avx2_add, avx2_sub, avx2_mul, avx2_sum, avx2_mismatch };
+
+#endif
+
+// Widest kernels the CPU supports, picked once (every thread picks the same ones, so the race is harmless)
+static const VmVectorOps *vector_ops(void) {
+    static const VmVectorOps *selected;
+    const VmVectorOps *ops = __atomic_load_n(&selected, __ATOMIC_RELAXED);
+
+    if (ops != NULL) {
+        return ops;
+    }
+    ops = &scalar_ops;
+#ifdef VM_VECTOR_SSE2
+    ops = &sse2_ops;
+#endif
+#ifdef VM_VECTOR_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        ops = &avx2_ops;
+    }
+#endif
+    __atomic_store_n(&selected, ops, __ATOMIC_RELAXED);
+    return ops;
+}
+
+void vm_vec_add(uint8_t *dst, const uint8_t *src, size_t count) {
+    vector_ops()->add(dst, src, count);
+}
+
+void vm_vec_sub(uint8_t *dst, const uint8_t *src, size_t count) {
+    vector_ops()->sub(dst, src, count);
+}
+
+void vm_vec_mul(uint8_t *dst, const uint8_t *src, size_t count) {
+    vector_ops()->mul(dst, src, count);
+}
+
+// Sum of count bytes (data memory is at most 64 KiB, so it never overflows)
+uint32_t vm_vec_sum(const uint8_t *src, size_t count) {
+    return vector_ops()->sum(src, count);
+}
+
+// Index of the first byte where a and b differ (count if they are equal)
+size_t vm_vec_mismatch(const uint8_t *a, const uint8_t *b, size_t count) {
+    return vector_ops()->mismatch(a, b, count);
+}
+
+// Whether count bytes from start fit in data memory (compared in 64 bits so wide registers cannot wrap)
+static int data_range(uint64_t start, uint64_t count) {
+    return start <= VM_DATA_SIZE && count <= VM_DATA_SIZE - start;
+}
+
+/*
+Apply a vector kernel to count bytes at x with the source at y, seeing the source as it was before the
+instruction even where the ranges overlap. The direction is picked like memmove's: with the
+destination below the source the kernels can run forwards, since every source byte is read before
+anything is written over it. With the destination above, the range is done from the end in chunks,
+each copied out to a small buffer first; the chunks below it have not been written yet.
+*/
+static void vector_overlapping(void (*kernel)(uint8_t*, const uint8_t*, size_t), uint8_t *data,
+        size_t x, size_t y, size_t count) {
+    uint8_t chunk[VM_BULK_CHUNK];
+
+    if (x <= y || x >= y + count) {
+        kernel(&data[x], &data[y], count);
+        return;
+    }
+    while (count > 0) {
+        size_t length = count < VM_BULK_CHUNK ? count : VM_BULK_CHUNK;
+        count -= length;
+        memcpy(chunk, &data[y + count], length);
+        kernel(&data[x + count], chunk, length);
+    }
+}
+
+/*
+Run a bulk instruction on register values: x is the destination (or only) address, y the source
+address, the second address of OP_VCMP or the fill value of OP_MSET (its low byte). Returns what the
+instruction produces (0 for the ones that only write memory, the full sum for OP_VSUM, which the
+caller truncates to its register width), or -1 if a range runs past the end of data memory.
+*/
+int vm_data_bulk(VirtualMachine *vm, uint8_t opcode, vm_word x, vm_word y, vm_word count) {
+    uint8_t *data = vm->data;
+    int y_is_address = opcode != OP_MSET && opcode != OP_VSUM;
+
+    if (!data_range(x, count) || (y_is_address && !data_range(y, count))) {
+        return -1;
+    }
+    // Every instruction but the two that only read writes the destination range
+    if (opcode != OP_VSUM && opcode != OP_VCMP && count > 0) {
+        memset(&vm->data_written[x >> VM_DATA_PAGE_SHIFT], 1,
+            (size_t) (((x + count - 1) >> VM_DATA_PAGE_SHIFT) - (x >> VM_DATA_PAGE_SHIFT) + 1));
+    }
+    const uint8_t *src = y_is_address ? &data[y] : NULL;
+    switch (opcode) {
+        case OP_VADD:
+            vector_overlapping(vm_vec_add, data, x, y, count);
+            return 0;
+        case OP_VSUB:
+            vector_overlapping(vm_vec_sub, data, x, y, count);
+            return 0;
+        case OP_VMUL:
+            vector_overlapping(vm_vec_mul, data, x, y, count);
+            return 0;
+        case OP_MSET:
+            memset(&data[x], (uint8_t) y, count);
+            return 0;
+        case OP_MCPY:
+            memmove(&data[x], src, count);
+            return 0;
+        case OP_VSUM:
+            return (int) vm_vec_sum(&data[x], count);
+        case OP_VCMP: {
+            size_t at = vm_vec_mismatch(&data[x], src, count);
+            return at == count ? 0 : (int) at + 1;
+        }
+        default:
+            return -1;
+    }
+}
@@ -0,0 +1,417 @@
+/*
+This file implements the load-time bytecode verifier for the virtual machine.
+
+vm_verify_program walks the control-flow graph of the loaded program once, starting at address 0,
+and rejects anything that would fail at runtime no matter what values end up in the registers:
+- Invalid opcodes, register indices and native function slots
+- Instructions cut off by the end of memory, or execution falling off the end
+- Jump targets outside of memory or in the middle of another instruction
+- Provable stack imbalance (POP on an empty stack, PUSH on a full one)
+Data memory ranges of the bulk instructions come from registers, so they are checked at runtime.
+
+While walking it also tracks the stack depth at every instruction. If every path reaches an
+instruction with the same depth, the stack can never under/overflow, so the engines are allowed to
+skip the stack checks as well. The results are kept in the code image for the engines to use.
+
+OP_CALL has two successors, its target and the instruction after it (where OP_RET comes back to),
+and OP_RET has none of its own. A subroutine may leave values on the stack, so the depth after a
+call is unknown and programs that call subroutines keep their stack checks. The call stack itself
+has no static bound (recursion) and is always checked at runtime.
+
+Author: Zane Francis
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "Virtual_Machine.h"
+
+// Depth markers used while walking the program
+#define DEPTH_UNSEEN -1
+#define DEPTH_UNKNOWN -2
+
+// Maximum number of values the stack can hold (sp runs from MEMORY_SIZE - 1 down to 1)
+#define STACK_CAPACITY (MEMORY_SIZE - 1)
+
+// Record a successor address, merging the stack depth it is reached with
+static int verify_edge(int *depth, int *worklist, int *pending, int from, int to, int new_depth) {
+    if (to >= MEMORY_SIZE) {
+        fprintf(stderr, "Error, verifier: execution runs past the end of memory after address %d\n", from);
+        return -1;
+    }
+    if (depth[to] == DEPTH_UNSEEN) {
+        depth[to] = new_depth;
+        worklist[(*pending)++] = to;
+    } else if (depth[to] != new_depth && depth[to] != DEPTH_UNKNOWN) {
+        // Reached with two different depths, so the depth is no longer known statically
+        depth[to] = DEPTH_UNKNOWN;
+        worklist[(*pending)++] = to;
+    }
+    return 0;
+}
+
+// Walk the program with depth (MEMORY_SIZE entries) and worklist (MEMORY_SIZE * 2 entries) as scratch
+static int verify_walk(VmImage *image, int *depth, int *worklist) {
+    VmVerifyInfo *info = &image->verify;
+    int pending = 0;
+
+    memset(info, 0, sizeof(*info));
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        depth[i] = DEPTH_UNSEEN;
+    }
+    depth[0] = 0;
+    worklist[pending++] = 0;
+
+    while (pending > 0) {
+        int addr = worklist[--pending];
+        int cur_depth = depth[addr];
+        uint8_t opcode = image->memory[addr];
+        int length = vm_instruction_length(opcode);
+
+        // Safety check for opcode and length
+        if (length == 0) {
+            fprintf(stderr, "Error, verifier: invalid opcode %d at address %d\n", opcode, addr);
+            return -1;
+        }
+        if (addr + length > MEMORY_SIZE) {
+            fprintf(stderr, "Error, verifier: truncated instruction at address %d\n", addr);
+            return -1;
+        }
+        // Mark the instruction start and its operand bytes, rejecting overlaps
+        if (info->flags[addr] & VM_ADDR_OPERAND) {
+            fprintf(stderr, "Error, verifier: jump into the middle of an instruction at address %d\n", addr);
+            return -1;
+        }
+        info->flags[addr] |= VM_ADDR_START;
+        for (int i = addr + 1; i < addr + length; i++) {
+            if (info->flags[i] & VM_ADDR_START) {
+                fprintf(stderr, "Error, verifier: jump into the middle of an instruction at address %d\n", i);
+                return -1;
+            }
+            info->flags[i] |= VM_ADDR_OPERAND;
+        }
+
+        const uint8_t *operand = &image->memory[addr + 1];
+        int next = addr + length;
+        int next_depth = cur_depth;
+        switch (opcode) {
+            case OP_HALT:
+                continue;
+
+            case OP_LOAD:
+            case OP_PRINT:
+                if (operand[0] >= NUM_REGISTERS) {
+                    fprintf(stderr, "Error, verifier: invalid register %d at address %d\n", operand[0], addr);
+                    return -1;
+                }
+                break;
+
+            // Every operand byte of these is a register
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_LDB:
+            case OP_STB:
+            case OP_VADD:
+            case OP_VSUB:
+            case OP_VMUL:
+            case OP_MSET:
+            case OP_MCPY:
+            case OP_VSUM:
+            case OP_VCMP:
+                for (int i = 0; i < length - 1; i++) {
+                    if (operand[i] >= NUM_REGISTERS) {
+                        fprintf(stderr, "Error, verifier: invalid register %d at address %d\n", operand[i], addr);
+                        return -1;
+                    }
+                }
+                break;
+
+            case OP_JMP: {
+                int target = (operand[0] << 8) | operand[1];
+                if (target >= MEMORY_SIZE) {
+                    fprintf(stderr, "Error, verifier: invalid jump address %d at address %d\n", target, addr);
+                    return -1;
+                }
+                info->flags[target] |= VM_ADDR_TARGET;
+                if (verify_edge(depth, worklist, &pending, addr, target, cur_depth) != 0) {
+                    return -1;
+                }
+                continue;
+            }
+
+            case OP_JZ: {
+                int target = (operand[1] << 8) | operand[2];
+                if (operand[0] >= NUM_REGISTERS) {
+                    fprintf(stderr, "Error, verifier: invalid register %d at address %d\n", operand[0], addr);
+                    return -1;
+                }
+                if (target >= MEMORY_SIZE) {
+                    fprintf(stderr, "Error, verifier: invalid jump address %d at address %d\n", target, addr);
+                    return -1;
+                }
+                info->flags[target] |= VM_ADDR_TARGET;
+                if (verify_edge(depth, worklist, &pending, addr, target, cur_depth) != 0) {
+                    return -1;
+                }
+                break;
+            }
+
+            case OP_PUSH:
+            case OP_POP:
+            case OP_PUSHM:
+            case OP_POPM: {
+                int count = 1;
+                if (opcode == OP_PUSHM || opcode == OP_POPM) {
+                    if (operand[0] >> NUM_REGISTERS) {
+                        fprintf(stderr, "Error, verifier: invalid register mask %d at address %d\n", operand[0], addr);
+                        return -1;
+                    }
+                    count = vm_mask_count(operand[0]);
+                } else if (operand[0] >= NUM_REGISTERS) {
+                    fprintf(stderr, "Error, verifier: invalid register %d at address %d\n", operand[0], addr);
+                    return -1;
+                }
+                if (cur_depth == DEPTH_UNKNOWN) {
+                    break;
+                }
+                if (opcode == OP_PUSH || opcode == OP_PUSHM) {
+                    if (cur_depth + count > STACK_CAPACITY) {
+                        fprintf(stderr, "Error, verifier: stack overflow at address %d\n", addr);
+                        return -1;
+                    }
+                    next_depth = cur_depth + count;
+                } else {
+                    if (cur_depth < count) {
+                        fprintf(stderr, "Error, verifier: pop from an empty stack at address %d\n", addr);
+                        return -1;
+                    }
+                    next_depth = cur_depth - count;
+                }
+                break;
+            }
+
+            case OP_CALL: {
+                int target = (operand[0] << 8) | operand[1];
+                if (target >= MEMORY_SIZE) {
+                    fprintf(stderr, "Error, verifier: invalid jump address %d at address %d\n", target, addr);
+                    return -1;
+                }
+                info->flags[target] |= VM_ADDR_TARGET;
+                if (verify_edge(depth, worklist, &pending, addr, target, cur_depth) != 0) {
+                    return -1;
+                }
+                // The subroutine decides the depth it returns with
+                next_depth = DEPTH_UNKNOWN;
+                break;
+            }
+
+            case OP_RET:
+                continue;
+
+            // The slot has to exist, whether it holds a function is only known at runtime
+            case OP_CALLN:
+                if (operand[0] >= VM_MAX_NATIVES) {
+                    fprintf(stderr, "Error, verifier: invalid native function %d at address %d\n", operand[0], addr);
+                    return -1;
+                }
+                break;
+        }
+        // Fall through to the next instruction
+        if (verify_edge(depth, worklist, &pending, addr, next, next_depth) != 0) {
+            return -1;
+        }
+    }
+
+    // Stack checks can only be dropped if every instruction has a single known depth
+    info->stack_checked = 1;
+    for (int i = 0; i < MEMORY_SIZE; i++) {
+        if (depth[i] == DEPTH_UNKNOWN) {
+            info->stack_checked = 0;
+        } else if (depth[i] >= 0) {
+            info->depth[i] = (uint16_t) depth[i];
+            if (depth[i] > info->max_stack_depth) {
+                info->max_stack_depth = (uint16_t) depth[i];
+            }
+        }
+    }
+    info->verified = 1;
+    return 0;
+}
+
+// Walk the program and fill in image->verify (returns 0 if the program is valid, -1 otherwise)
+int vm_verify_program(VmImage *image) {
+    // The scratch arrays take 12 bytes per address, too much for a worker thread's stack at a large
+    // MEMORY_SIZE. Each address is queued at most twice (first visit, then once more when it turns unknown)
+    int *depth = (int*) malloc(sizeof(int) * MEMORY_SIZE * 3);
+    if (depth == NULL) {
+        fprintf(stderr, "Error, verifier allocation failed\n");
+        return -1;
+    }
+    int result = verify_walk(image, depth, depth + MEMORY_SIZE);
+    free(depth);
+    return result;
+}
+
+// Check whether execution can use the verified fast path from the current state
+int vm_verified_entry(const VirtualMachine *vm, int *stack_safe) {
+    const VmVerifyInfo *info = &vm->image->verify;
+
+    *stack_safe = 0;
+    if (!info->verified || vm->pc >= MEMORY_SIZE || !(info->flags[vm->pc] & VM_ADDR_START)) {
+        return 0;
+    }
+    // The stack checks may only be skipped if the current depth is the one the verifier proved
+    if (info->stack_checked && vm->sp <= MEMORY_SIZE - 1 &&
+        MEMORY_SIZE - 1 - vm->sp == info->depth[vm->pc]) {
+        *stack_safe = 1;
+    }
+    return 1;
+}
+
+// Check verifier results that were loaded rather than computed (returns 0 if they hold, -1 otherwise)
+int vm_verify_metadata(VmImage *image) {
+    VmVerifyInfo *info = &image->verify;
+    uint16_t max_depth = 0;
+
+    /*
+    Every instruction marked as a start is checked on its own: its operands, that everything it can
+    go to next is also a start, and (when the stack checks are to be skipped) that the recorded depths
+    agree across each edge. That makes the loaded results an inductive proof of the same things
+    vm_verify_program establishes, but it takes a single pass over memory.
+    */
+    info->verified = 0;
+    if (!(info->flags[0] & VM_ADDR_START) || (info->stack_checked && info->depth[0] != 0)) {
+        fprintf(stderr, "Error, verifier: image does not start with an instruction at address 0\n");
+        return -1;
+    }
+    for (int addr = 0; addr < MEMORY_SIZE; addr++) {
+        if (!(info->flags[addr] & VM_ADDR_START)) {
+            continue;
+        }
+        uint8_t opcode = image->memory[addr];
+        int length = vm_instruction_length(opcode);
+        if (length == 0 || addr + length > MEMORY_SIZE || (info->flags[addr] & VM_ADDR_OPERAND)) {
+            fprintf(stderr, "Error, verifier: bad instruction in image at address %d\n", addr);
+            return -1;
+        }
+        for (int i = addr + 1; i < addr + length; i++) {
+            if ((info->flags[i] & VM_ADDR_START) || !(info->flags[i] & VM_ADDR_OPERAND)) {
+                fprintf(stderr, "Error, verifier: overlapping instructions in image at address %d\n", i);
+                return -1;
+            }
+        }
+
+        const uint8_t *operand = &image->memory[addr + 1];
+        int depth = info->depth[addr];
+        int next_depth = depth;
+        int next = addr + length;
+        int target = -1;
+        int falls_through = 1;
+        int regs = 0;
+        switch (opcode) {
+            case OP_HALT:
+            case OP_RET:
+                falls_through = 0;
+                break;
+            case OP_LOAD:
+            case OP_PRINT:
+                regs = 1;
+                break;
+            case OP_ADD:
+            case OP_SUB:
+            case OP_MUL:
+            case OP_DIV:
+            case OP_LDB:
+            case OP_STB:
+            case OP_VADD:
+            case OP_VSUB:
+            case OP_VMUL:
+            case OP_MSET:
+            case OP_MCPY:
+            case OP_VSUM:
+            case OP_VCMP:
+                regs = length - 1;
+                break;
+            case OP_JMP:
+                target = (operand[0] << 8) | operand[1];
+                falls_through = 0;
+                break;
+            case OP_CALL:
+                // vm_verify_program never proves depths for a program that calls subroutines
+                if (info->stack_checked) {
+                    fprintf(stderr, "Error, verifier: image records stack depths across a call at address %d\n", addr);
+                    return -1;
+                }
+                target = (operand[0] << 8) | operand[1];
+                break;
+            case OP_JZ:
+                regs = 1;
+                target = (operand[1] << 8) | operand[2];
+                break;
+            case OP_PUSH:
+            case OP_POP:
+                regs = 1;
+                if (opcode == OP_PUSH) {
+                    next_depth = depth + 1;
+                } else {
+                    next_depth = depth - 1;
+                }
+                if (info->stack_checked && (next_depth < 0 || next_depth > STACK_CAPACITY)) {
+                    fprintf(stderr, "Error, verifier: stack depth out of range in image at address %d\n", addr);
+                    return -1;
+                }
+                break;
+            case OP_PUSHM:
+            case OP_POPM:
+                if (operand[0] >> NUM_REGISTERS) {
+                    fprintf(stderr, "Error, verifier: invalid register mask %d at address %d\n", operand[0], addr);
+                    return -1;
+                }
+                if (opcode == OP_PUSHM) {
+                    next_depth = depth + vm_mask_count(operand[0]);
+                } else {
+                    next_depth = depth - vm_mask_count(operand[0]);
+                }
+                if (info->stack_checked && (next_depth < 0 || next_depth > STACK_CAPACITY)) {
+                    fprintf(stderr, "Error, verifier: stack depth out of range in image at address %d\n", addr);
+                    return -1;
+                }
+                break;
+            case OP_CALLN:
+                if (operand[0] >= VM_MAX_NATIVES) {
+                    fprintf(stderr, "Error, verifier: invalid native function %d at address %d\n", operand[0], addr);
+                    return -1;
+                }
+                break;
+        }
+        for (int i = 0; i < regs; i++) {
+            if (operand[i] >= NUM_REGISTERS) {
+                fprintf(stderr, "Error, verifier: invalid register %d at address %d\n", operand[i], addr);
+                return -1;
+            }
+        }
+        // Branch targets and the fall-through address must be instructions reached with a matching depth
+        if (target >= 0 && (target >= MEMORY_SIZE || !(info->flags[target] & VM_ADDR_START) ||
+                (info->stack_checked && info->depth[target] != depth))) {
+            fprintf(stderr, "Error, verifier: invalid jump address %d at address %d\n", target, addr);
+            return -1;
+        }
+        if (falls_through && (next >= MEMORY_SIZE || !(info->flags[next] & VM_ADDR_START) ||
+                (info->stack_checked && info->depth[next] != next_depth))) {
+            fprintf(stderr, "Error, verifier: execution does not continue to an instruction after address %d\n", addr);
+            return -1;
+        }
+        if (depth > max_depth) {
+            max_depth = (uint16_t) depth;
+        }
+    }
+    if (info->stack_checked && max_depth != info->max_stack_depth) {
+        fprintf(stderr, "Error, verifier: image records the wrong max stack depth\n");
+        return -1;
+    }
+    info->verified = 1;
+    return 0;
+}